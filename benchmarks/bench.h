@@ -0,0 +1,234 @@
+#pragma once
+
+#include "../include/vsqlite_serialize.h"
+
+#include <stdint.h>
+#include <memory>
+#include <string>
+#include <vector>
+
+namespace serialbench {
+
+  typedef vsqlite::StringMap Row;
+
+  /*
+   * Source of row sets fed to a serializer, one snapshot per iteration.
+   * Rows returned by next() are owned by the workload and stay valid
+   * until the following call to next() or reset().
+   */
+  struct Workload {
+    virtual ~Workload() {}
+
+    /**
+     * Parameters of this workload, as a JSON object string.
+     */
+    virtual std::string describe() = 0;
+
+    virtual std::vector<SPFieldDef> &columns() = 0;
+
+    /**
+     * Rewind to the first snapshot so every serializer sees the same sequence.
+     */
+    virtual void reset() = 0;
+
+    /**
+     * @returns rows of the next snapshot.
+     */
+    virtual std::vector<DynMap> &next() = 0;
+  };
+
+  typedef std::shared_ptr<Workload> SPWorkload;
+
+  /*
+   * Parameters of a synthetic workload.
+   *
+   * shape      : "generic" - numCols columns cycling string, int64, int32.
+   *              "processes" - processes-like table (numCols ignored) with
+   *              repeated paths and names, long cmdlines and ticking counters.
+   * churnDist  : "uniform" - changed rows picked uniformly.
+   *              "hotset" - 80% of changes land in 10% of the rows.
+   *              "volatile" - changed rows keep identity, only int columns tick.
+   * strings    : "ascii", "path" (values repeat from a small vocabulary),
+   *              "unicode" (multi-byte UTF-8), "binary" (any byte, including 0).
+   */
+  struct WorkloadSpec {
+    std::string shape { "generic" };
+    int numRows { 1000 };
+    int numCols { 25 };
+    int strLen { 32 };
+    double churnRate { 0.0 };
+    std::string churnDist { "uniform" };
+    std::string strings { "ascii" };
+    int cmdlineLen { 256 };
+    uint32_t seed { 1 };
+  };
+
+  /**
+   * Synthetic table where churnRate fraction of the rows changes
+   * between snapshots, as described by spec.
+   * @returns nullptr if spec has an unknown shape, churnDist or strings.
+   */
+  SPWorkload SyntheticWorkloadNew(const WorkloadSpec &spec);
+
+  /**
+   * Replays recorded result sets. Each file holds one snapshot per line,
+   * as a JSON array of row objects (osquery results format), or a single
+   * JSON array. Columns whose values are all integers become TINT64,
+   * the rest TSTRING. Snapshots repeat from the first once exhausted.
+   * @returns nullptr if no snapshot could be loaded.
+   */
+  SPWorkload ReplayWorkloadNew(const std::vector<std::string> &paths);
+
+  /**
+   * Renders rows to StringMap form for the StringMap serializers.
+   */
+  void ToStringMapRows(std::vector<SPFieldDef> &cols, std::vector<DynMap> &rows, std::vector<Row> &dest);
+
+  struct BenchConfig {
+    std::string mode { "phases" };
+    std::vector<std::string> serializers { "crow", "json", "columnar", "adaptive", "stringmapjson", "stringmapbin", "osquery" };
+    std::vector<int> rowCounts { 100, 1000 };
+    std::vector<int> colCounts { 25 };
+    std::vector<int> strLens { 32 };
+    std::vector<double> churnRates { 0.0, 0.01, 0.1 };
+    std::vector<std::string> shapes { "generic" };
+    std::vector<std::string> churnDists { "uniform" };
+    std::vector<std::string> stringKinds { "ascii" };
+    int cmdlineLen { 256 };
+    std::vector<std::string> replayPaths;
+    std::vector<int> threadCounts;
+    int instancesPerThread { 1 };
+    int iterations { 50 };
+    int warmup { 5 };
+    uint32_t seed { 1 };
+    std::string outPath;
+    std::string tracePath;
+  };
+
+  /**
+   * Workloads for every point of the config sweep, or the single replay
+   * workload when replayPaths is set.
+   * @returns true on error
+   */
+  bool BuildWorkloads(BenchConfig &config, std::vector<SPWorkload> &dest);
+
+  /*
+   * Summary of per-iteration samples.
+   */
+  struct Stats {
+    size_t count { 0 };
+    double mean { 0 };
+    double stddev { 0 };
+    double min { 0 };
+    double median { 0 };
+    double max { 0 };
+  };
+
+  Stats ComputeStats(std::vector<double> samples);
+
+  /**
+   * @returns str as a quoted and escaped JSON string.
+   */
+  std::string JsonQuote(const std::string &str);
+
+  /*
+   * Minimal streaming JSON writer for result files.
+   */
+  class JsonOut {
+  public:
+    explicit JsonOut(std::string &dest) : _dest(dest) {}
+
+    void beginObject();
+    void endObject();
+    void beginArray(const char *name = nullptr);
+    void endArray();
+    void key(const char *name);
+    void value(const std::string &str);
+    void value(double val);
+    void value(int64_t val);
+    void raw(const char *name, const std::string &json);
+    void field(const char *name, const std::string &str) { key(name); value(str); }
+    void field(const char *name, double val) { key(name); value(val); }
+    void field(const char *name, int64_t val) { key(name); value(val); }
+    /**
+     * @param unit suffix of the keys, as in "mean_ns". Empty for plain counts.
+     */
+    void stats(const char *name, const Stats &s, const std::string &unit = "ns");
+
+  private:
+    void _separate();
+
+    std::string &_dest;
+    std::vector<bool> _needComma;
+    bool _afterKey { false };
+  };
+
+  enum Phase { PHASE_BEGIN_DATA, PHASE_ADD_NEW_RESULT, PHASE_END_DATA, PHASE_SERIALIZE, NUM_PHASES };
+
+  extern const char *PhaseNames[NUM_PHASES];
+
+  /*
+   * Called around each serializer phase by RunSerializer().
+   * PHASE_ADD_NEW_RESULT spans all addNewResult() calls of an iteration.
+   */
+  struct PhaseProbe {
+    virtual ~PhaseProbe() {}
+
+    /**
+     * @param record false for warmup iterations.
+     */
+    virtual void beginIteration(bool record) {}
+    virtual void start(Phase phase) = 0;
+    virtual void stop(Phase phase) = 0;
+
+    /**
+     * @param snapshot serialized output of the iteration.
+     */
+    virtual void endIteration(std::string &snapshot) {}
+  };
+
+  /**
+   * Runs warmup + iterations snapshots of workload through a new
+   * serializer of the given name, reporting phases to probe.
+   * @returns true if name is not a known serializer.
+   */
+  bool RunSerializer(const std::string &name, Workload &workload, int warmup, int iterations, PhaseProbe &probe);
+
+  /**
+   * Measures beginData, addNewResult, endData and serialize separately
+   * for every serializer over every point of the config sweep.
+   * Results are appended to dest as a JSON document.
+   * @returns true if the workloads could not be built.
+   */
+  bool RunPhaseSuite(BenchConfig &config, std::string &dest);
+
+  /**
+   * Reports allocation count, bytes allocated and peak live bytes per phase,
+   * bytes retained by the serializer between iterations, and process RSS,
+   * for every serializer over every point of the config sweep.
+   * @returns true if the workloads could not be built.
+   */
+  bool RunMemorySuite(BenchConfig &config, std::string &dest);
+
+  /**
+   * Runs instancesPerThread serializers on each of T threads over shared
+   * schema objects, for each T in threadCounts (default powers of two up
+   * to the number of cores), and reports throughput scaling.
+   * @returns true if the workloads could not be built.
+   */
+  bool RunThreadsSuite(BenchConfig &config, std::string &dest);
+
+  /**
+   * Original end-to-end loop : wall time for all iterations of one serializer.
+   */
+  void RunLegacy(int totalRows, int iterations, std::string serializerName);
+
+  // implemented in benchmain.cpp
+
+  std::shared_ptr<vsqlite::ResultsSerializer<DynMap> > DynMapSerializerNew(const std::string &name);
+  std::shared_ptr<vsqlite::ResultsSerializer<Row> > StringMapSerializerNew(const std::string &name);
+
+  std::shared_ptr<vsqlite::DiffResultsListener<DynMap> > DynMapListenerNew(std::vector<SPFieldDef> &cols);
+  std::shared_ptr<vsqlite::DiffResultsListener<Row> > StringMapListenerNew();
+
+} // namespace serialbench
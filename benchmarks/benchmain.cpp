@@ -1,4 +1,8 @@
-#include "../include/vsqlite_serialize.h"
+#include "bench.h"
+
+#include <fstream>
+#include <sstream>
+#include <stdio.h>
 
 static const SPFieldDef COL_PATH = FieldDef::alloc(TSTRING, "path");
 static const SPFieldDef COL_NAME = FieldDef::alloc(TSTRING, "name");
@@ -264,41 +268,257 @@ void test_stringmap(int totalRows, int iterations, std::shared_ptr<vsqlite::Resu
   }
 }
 
+namespace serialbench {
+
+  std::shared_ptr<vsqlite::ResultsSerializer<DynMap> > DynMapSerializerNew(const std::string &name) {
+    if (name == "crow") {
+      return vsqlite::CrowResultsSerializerNew();
+    } else if (name == "json") {
+      return vsqlite::JsonResultsSerializerNew();
+    } else if (name == "columnar") {
+      return vsqlite::ColumnarResultsSerializerNew();
+    } else if (name == "adaptive") {
+      return vsqlite::AdaptiveResultsSerializerNew();
+    }
+    return nullptr;
+  }
+
+  std::shared_ptr<vsqlite::ResultsSerializer<Row> > StringMapSerializerNew(const std::string &name) {
+    if (name == "osquery") {
+      return vsqlite::OsqueryJsonResultsSerializerNew();
+    } else if (name == "stringmapjson") {
+      return vsqlite::JsonStringMapResultsSerializerNew();
+    } else if (name == "stringmapbin") {
+      return vsqlite::BinaryStringMapResultsSerializerNew();
+    }
+    return nullptr;
+  }
+
+  /*
+   * Same work as MyDiffResultsListener, over an arbitrary schema.
+   */
+  struct SchemaDiffResultsListener: public vsqlite::DiffResultsListener<DynMap> {
+    SchemaDiffResultsListener(std::vector<SPFieldDef> &cols) : _cols(cols) {}
+    virtual ~SchemaDiffResultsListener() {}
+
+    void onAdded(DynMap &row) override {
+      _render(row);
+    }
+
+    void onRemoved(DynMap &row) override {
+      _render(row);
+    }
+
+    void _render(DynMap &row) {
+      std::string s;
+      for (auto &colId : _cols) {
+        DynVal &val = row[colId];
+        if (!val.valid()) {
+          continue;
+        }
+        if (!s.empty()) { s += ", "; }
+        s += colId->name + ":" + val.as_s();
+      }
+    }
+
+    std::vector<SPFieldDef> _cols;
+  };
+
+  std::shared_ptr<vsqlite::DiffResultsListener<DynMap> > DynMapListenerNew(std::vector<SPFieldDef> &cols) {
+    return std::make_shared<SchemaDiffResultsListener>(cols);
+  }
+
+  std::shared_ptr<vsqlite::DiffResultsListener<Row> > StringMapListenerNew() {
+    return std::make_shared<StringMapDiffResultsListener>();
+  }
+
+  void RunLegacy(int totalRows, int numIterations, std::string serializerName) {
+    if (serializerName == "json") {
+
+      fprintf(stderr, "Start total:%d iterations:%d serializer:%s\n", totalRows, numIterations, serializerName.c_str());
+      auto spSerializer = vsqlite::JsonResultsSerializerNew();
+      test_dynmap(totalRows, numIterations, spSerializer);
+
+    } else if (serializerName == "osquery") {
+
+      fprintf(stderr, "Start total:%d iterations:%d serializer:%s\n", totalRows, numIterations, serializerName.c_str());
+      auto spSerializer = vsqlite::OsqueryJsonResultsSerializerNew();
+      test_stringmap(totalRows, numIterations, spSerializer);
+
+    } else if (serializerName == "stringmapjson") {
+
+      fprintf(stderr, "Start total:%d iterations:%d serializer:%s\n", totalRows, numIterations, serializerName.c_str());
+      auto spSerializer = vsqlite::JsonStringMapResultsSerializerNew();
+      test_stringmap(totalRows, numIterations, spSerializer);
+
+    } else {
+      fprintf(stderr, "Start total:%d iterations:%d serializer:crow\n", totalRows, numIterations);
+      auto spSerializer = vsqlite::CrowResultsSerializerNew();
+      test_dynmap(totalRows, numIterations, spSerializer);
+    }
+  }
+
+} // namespace serialbench
+
+static std::vector<std::string> splitList(const std::string &s) {
+  std::vector<std::string> items;
+  std::stringstream ss(s);
+  std::string item;
+  while (std::getline(ss, item, ',')) {
+    if (!item.empty()) { items.push_back(item); }
+  }
+  return items;
+}
+
+static std::vector<int> splitIntList(const std::string &s) {
+  std::vector<int> items;
+  for (auto &item : splitList(s)) { items.push_back(atoi(item.c_str())); }
+  return items;
+}
+
+static std::vector<double> splitDoubleList(const std::string &s) {
+  std::vector<double> items;
+  for (auto &item : splitList(s)) { items.push_back(atof(item.c_str())); }
+  return items;
+}
+
+static void usage() {
+  fprintf(stderr, "usage: serialbench <total_rows> <iterations> <serializer>\n"
+                  "       serialbench [options]\n"
+                  "  --mode=phases          phases : time per phase, memory : allocations, live bytes and RSS (serialbench-memory),\n"
+                  "                         threads : throughput scaling over thread counts\n"
+                  "  --serializers=crow,json,columnar,adaptive,stringmapjson,stringmapbin,osquery (default all)\n"
+                  "  --rows=100,1000        row counts to sweep\n"
+                  "  --cols=25              column counts to sweep\n"
+                  "  --strlen=32            string value lengths to sweep\n"
+                  "  --churn=0,0.01,0.1     fraction of rows changed per iteration\n"
+                  "  --shape=generic        generic,processes\n"
+                  "  --churn-dist=uniform   uniform,hotset,volatile\n"
+                  "  --strings=ascii        ascii,path,unicode,binary\n"
+                  "  --cmdline=256          cmdline length for processes shape\n"
+                  "  --replay=FILE,...      replay recorded snapshots instead of synthetic data\n"
+                  "  --iterations=N         measured iterations per point\n"
+                  "  --warmup=N             unmeasured iterations per point\n"
+                  "  --threads=1,2,4        thread counts for threads mode (default powers of two up to cores)\n"
+                  "  --instances=N          serializer instances per thread for threads mode\n"
+                  "  --seed=N\n"
+                  "  --out=FILE             write JSON results to FILE instead of stdout\n"
+                  "  --trace=FILE           write Chrome trace of serializer phases to FILE (VSQLITE_TRACE builds)\n");
+}
+
+/*
+ * Parses --name=value options into config.
+ * @returns true on error
+ */
+static bool parseOptions(int argc, char *argv[], serialbench::BenchConfig &config) {
+  for (int i=1; i < argc; i++) {
+    std::string arg = argv[i];
+    size_t eq = arg.find('=');
+    if (arg.compare(0, 2, "--") != 0 || eq == std::string::npos) {
+      fprintf(stderr, "invalid argument '%s'\n", arg.c_str());
+      return true;
+    }
+    std::string name = arg.substr(2, eq - 2);
+    std::string value = arg.substr(eq + 1);
+
+    if (name == "mode") {
+      config.mode = value;
+    } else if (name == "serializers") {
+      config.serializers = splitList(value);
+    } else if (name == "rows") {
+      config.rowCounts = splitIntList(value);
+    } else if (name == "cols") {
+      config.colCounts = splitIntList(value);
+    } else if (name == "strlen") {
+      config.strLens = splitIntList(value);
+    } else if (name == "churn") {
+      config.churnRates = splitDoubleList(value);
+    } else if (name == "shape") {
+      config.shapes = splitList(value);
+    } else if (name == "churn-dist") {
+      config.churnDists = splitList(value);
+    } else if (name == "strings") {
+      config.stringKinds = splitList(value);
+    } else if (name == "cmdline") {
+      config.cmdlineLen = atoi(value.c_str());
+    } else if (name == "replay") {
+      config.replayPaths = splitList(value);
+    } else if (name == "iterations") {
+      config.iterations = atoi(value.c_str());
+    } else if (name == "warmup") {
+      config.warmup = atoi(value.c_str());
+    } else if (name == "threads") {
+      config.threadCounts = splitIntList(value);
+    } else if (name == "instances") {
+      config.instancesPerThread = atoi(value.c_str());
+    } else if (name == "seed") {
+      config.seed = (uint32_t)strtoul(value.c_str(), nullptr, 10);
+    } else if (name == "out") {
+      config.outPath = value;
+    } else if (name == "trace") {
+      config.tracePath = value;
+    } else {
+      fprintf(stderr, "unknown option '%s'\n", name.c_str());
+      return true;
+    }
+  }
+  if (config.iterations < 1 || config.warmup < 0) {
+    fprintf(stderr, "--iterations must be at least 1 and --warmup at least 0\n");
+    return true;
+  }
+  return false;
+}
+
 int main(int argc, char *argv[])
 {
-  int totalRows = 1000;
-  int numIterations = 500;
-  std::string serializerName;
-  if (argc == 4) {
+  // original positional form : <total_rows> <iterations> <serializer>
+
+  if (argc == 4 && argv[1][0] != '-') {
+    int totalRows = 1000;
+    int numIterations = 500;
     int total = atoi(argv[1]);
     int count = atoi(argv[2]);
-    serializerName = argv[3];
     if (total > 0) totalRows = total;
     if (count > 0) numIterations = count;
+    serialbench::RunLegacy(totalRows, numIterations, argv[3]);
+    return 0;
   }
 
-  if (serializerName == "json") {
-
-    fprintf(stderr, "Start total:%d iterations:%d serializer:%s\n", totalRows, numIterations, serializerName.c_str());
-    auto spSerializer = vsqlite::JsonResultsSerializerNew();
-    test_dynmap(totalRows, numIterations, spSerializer);
-
-  } else if (serializerName == "osquery") {
+  serialbench::BenchConfig config;
+  if (parseOptions(argc, argv, config)) {
+    usage();
+    return 1;
+  }
 
-    fprintf(stderr, "Start total:%d iterations:%d serializer:%s\n", totalRows, numIterations, serializerName.c_str());
-    auto spSerializer = vsqlite::OsqueryJsonResultsSerializerNew();
-    test_stringmap(totalRows, numIterations, spSerializer);
+  std::string results;
+  bool failed = false;
+  if (config.mode == "phases") {
+    failed = serialbench::RunPhaseSuite(config, results);
+  } else if (config.mode == "memory") {
+    failed = serialbench::RunMemorySuite(config, results);
+  } else if (config.mode == "threads") {
+    failed = serialbench::RunThreadsSuite(config, results);
+  } else {
+    fprintf(stderr, "unknown mode '%s'\n", config.mode.c_str());
+    usage();
+    return 1;
+  }
+  if (failed) {
+    return 1;
+  }
 
-  } else if (serializerName == "stringmapjson") {
-    
-    fprintf(stderr, "Start total:%d iterations:%d serializer:%s\n", totalRows, numIterations, serializerName.c_str());
-    auto spSerializer = vsqlite::JsonStringMapResultsSerializerNew();
-    test_stringmap(totalRows, numIterations, spSerializer);
-    
+  if (config.outPath.empty()) {
+    fwrite(results.data(), 1, results.size(), stdout);
   } else {
-    fprintf(stderr, "Start total:%d iterations:%d serializer:crow\n", totalRows, numIterations);
-    auto spSerializer = vsqlite::CrowResultsSerializerNew();
-    test_dynmap(totalRows, numIterations, spSerializer);
+    std::ofstream f(config.outPath.c_str(), std::ios::out | std::ios::binary);
+    f << results;
+  }
+
+  if (!config.tracePath.empty()) {
+    std::string trace;
+    vsqlite::TraceWriteChromeJson(trace);
+    std::ofstream f(config.tracePath.c_str(), std::ios::out | std::ios::binary);
+    f << trace;
   }
 
   return 0;
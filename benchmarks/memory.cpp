@@ -0,0 +1,146 @@
+#include "bench.h"
+#include "memtrack.h"
+
+#include <stdio.h>
+
+namespace serialbench {
+
+  /*
+   * Allocation counters per phase, and live bytes held between iterations.
+   * Retained bytes exclude the serialized snapshot, which the caller owns.
+   */
+  class MemoryProbe : public PhaseProbe {
+  public:
+    virtual ~MemoryProbe() {}
+
+    void beginIteration(bool record) override {
+      _record = record;
+      if (!_haveBaseline) {
+        MemCounters counters;
+        MemTrackGet(counters);
+        _baselineLive = counters.liveBytes;
+        _haveBaseline = true;
+      }
+    }
+
+    void start(Phase phase) override {
+      MemTrackGet(_before);
+      MemTrackResetPeak();
+    }
+
+    void stop(Phase phase) override {
+      MemCounters after;
+      MemTrackGet(after);
+      if (!_record) {
+        return;
+      }
+      allocs[phase].push_back((double)(after.allocCount - _before.allocCount));
+      bytes[phase].push_back((double)(after.bytesAllocated - _before.bytesAllocated));
+      peakLive[phase].push_back((double)(after.peakLiveBytes - _before.liveBytes));
+    }
+
+    void endIteration(std::string &snapshot) override {
+      MemCounters counters;
+      MemTrackGet(counters);
+      if (!_record) {
+        return;
+      }
+      retained.push_back((double)(counters.liveBytes - _baselineLive - (int64_t)snapshot.capacity()));
+      size_t rss = CurrentRSS();
+      if (rss > maxRSS) { maxRSS = rss; }
+    }
+
+    std::vector<double> allocs[NUM_PHASES];
+    std::vector<double> bytes[NUM_PHASES];
+    std::vector<double> peakLive[NUM_PHASES];
+    std::vector<double> retained;
+    size_t maxRSS { 0 };
+
+  private:
+    bool _record { false };
+    bool _haveBaseline { false };
+    int64_t _baselineLive { 0 };
+    MemCounters _before;
+  };
+
+  bool RunMemorySuite(BenchConfig &config, std::string &dest) {
+    if (!MemTrackAvailable()) {
+      fprintf(stderr, "memory mode needs the serialbench-memory build\n");
+      return true;
+    }
+
+    std::vector<SPWorkload> workloads;
+    if (BuildWorkloads(config, workloads)) {
+      return true;
+    }
+
+    JsonOut out(dest);
+    out.beginObject();
+    out.field("suite", std::string("memory"));
+    out.field("iterations", (int64_t)config.iterations);
+    out.field("warmup", (int64_t)config.warmup);
+    out.field("seed", (int64_t)config.seed);
+    out.beginArray("results");
+
+    for (auto &spWorkload : workloads) {
+      for (auto &name : config.serializers) {
+        fprintf(stderr, "%s %s\n", name.c_str(), spWorkload->describe().c_str());
+
+        MemoryProbe probe;
+        size_t rssStart = CurrentRSS();
+
+        MemTrackEnable(true);
+        bool failed = RunSerializer(name, *spWorkload, config.warmup, config.iterations, probe);
+        MemTrackEnable(false);
+
+        if (failed) {
+          continue;
+        }
+
+        out.beginObject();
+        out.field("serializer", name);
+        out.raw("workload", spWorkload->describe());
+        out.key("phases");
+        out.beginObject();
+        for (int phase=0; phase < NUM_PHASES; phase++) {
+          out.key(PhaseNames[phase]);
+          out.beginObject();
+          out.stats("allocs", ComputeStats(probe.allocs[phase]), "");
+          out.stats("bytes_allocated", ComputeStats(probe.bytes[phase]), "");
+          out.stats("peak_live_bytes", ComputeStats(probe.peakLive[phase]), "");
+          out.endObject();
+        }
+        out.endObject();
+
+        // growth of retained bytes over the measured iterations
+        // points at state that is never released (e.g. allocator pools)
+
+        Stats retained = ComputeStats(probe.retained);
+        out.key("retained_bytes");
+        out.beginObject();
+        out.field("first", probe.retained.empty() ? 0.0 : probe.retained.front());
+        out.field("last", probe.retained.empty() ? 0.0 : probe.retained.back());
+        out.field("max", retained.max);
+        out.field("growth_per_iteration", probe.retained.size() < 2 ? 0.0 :
+                  (probe.retained.back() - probe.retained.front()) / (probe.retained.size() - 1));
+        out.endObject();
+
+        out.key("rss_bytes");
+        out.beginObject();
+        out.field("start", (int64_t)rssStart);
+        out.field("end", (int64_t)CurrentRSS());
+        out.field("max_sampled", (int64_t)probe.maxRSS);
+        out.field("process_peak", (int64_t)PeakRSS());
+        out.endObject();
+
+        out.endObject();
+      }
+    }
+
+    out.endArray();
+    out.endObject();
+    dest += "\n";
+    return false;
+  }
+
+} // namespace serialbench
@@ -0,0 +1,163 @@
+#include "memtrack.h"
+
+#include <atomic>
+#include <new>
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/resource.h>
+#include <unistd.h>
+
+#if defined(__APPLE__)
+#include <mach/mach.h>
+#endif
+
+namespace serialbench {
+
+  static std::atomic<bool> gEnabled(false);
+  static std::atomic<uint64_t> gAllocCount(0);
+  static std::atomic<uint64_t> gBytesAllocated(0);
+  static std::atomic<int64_t> gLiveBytes(0);
+  static std::atomic<int64_t> gPeakLiveBytes(0);
+
+  /*
+   * Prepended to every block. Keeps blocks aligned for any type.
+   */
+  struct alignas(16) AllocHeader {
+    size_t size;
+    bool tracked;
+  };
+
+  static void *trackedAlloc(size_t size) {
+    AllocHeader *hdr = (AllocHeader *)malloc(sizeof(AllocHeader) + size);
+    if (hdr == nullptr) {
+      return nullptr;
+    }
+    hdr->size = size;
+    hdr->tracked = gEnabled.load(std::memory_order_relaxed);
+    if (hdr->tracked) {
+      gAllocCount.fetch_add(1, std::memory_order_relaxed);
+      gBytesAllocated.fetch_add(size, std::memory_order_relaxed);
+      int64_t live = gLiveBytes.fetch_add((int64_t)size, std::memory_order_relaxed) + (int64_t)size;
+      int64_t peak = gPeakLiveBytes.load(std::memory_order_relaxed);
+      while (live > peak && !gPeakLiveBytes.compare_exchange_weak(peak, live, std::memory_order_relaxed)) {
+      }
+    }
+    return hdr + 1;
+  }
+
+  static void trackedFree(void *p) {
+    if (p == nullptr) {
+      return;
+    }
+    AllocHeader *hdr = ((AllocHeader *)p) - 1;
+    if (hdr->tracked) {
+      gLiveBytes.fetch_sub((int64_t)hdr->size, std::memory_order_relaxed);
+    }
+    free(hdr);
+  }
+
+  bool MemTrackAvailable() {
+#if SERIALBENCH_MEMTRACK
+    return true;
+#else
+    return false;
+#endif
+  }
+
+  void MemTrackEnable(bool enabled) {
+    gEnabled.store(enabled);
+  }
+
+  void MemTrackGet(MemCounters &dest) {
+    dest.allocCount = gAllocCount.load();
+    dest.bytesAllocated = gBytesAllocated.load();
+    dest.liveBytes = gLiveBytes.load();
+    dest.peakLiveBytes = gPeakLiveBytes.load();
+  }
+
+  void MemTrackResetPeak() {
+    gPeakLiveBytes.store(gLiveBytes.load());
+  }
+
+  size_t CurrentRSS() {
+#if defined(__linux__)
+    long pages = 0;
+    long residentPages = 0;
+    FILE *fp = fopen("/proc/self/statm", "r");
+    if (fp == nullptr) {
+      return 0;
+    }
+    if (fscanf(fp, "%ld %ld", &pages, &residentPages) != 2) {
+      residentPages = 0;
+    }
+    fclose(fp);
+    return (size_t)residentPages * (size_t)sysconf(_SC_PAGESIZE);
+#elif defined(__APPLE__)
+    mach_task_basic_info info;
+    mach_msg_type_number_t count = MACH_TASK_BASIC_INFO_COUNT;
+    if (task_info(mach_task_self(), MACH_TASK_BASIC_INFO, (task_info_t)&info, &count) != KERN_SUCCESS) {
+      return 0;
+    }
+    return (size_t)info.resident_size;
+#else
+    return 0;
+#endif
+  }
+
+  size_t PeakRSS() {
+    struct rusage usage;
+    if (getrusage(RUSAGE_SELF, &usage) != 0) {
+      return 0;
+    }
+#if defined(__APPLE__)
+    return (size_t)usage.ru_maxrss;
+#else
+    return (size_t)usage.ru_maxrss * 1024;
+#endif
+  }
+
+} // namespace serialbench
+
+#if SERIALBENCH_MEMTRACK
+
+void *operator new(size_t size) {
+  void *p = serialbench::trackedAlloc(size);
+  if (p == nullptr) {
+    throw std::bad_alloc();
+  }
+  return p;
+}
+
+void *operator new[](size_t size) {
+  void *p = serialbench::trackedAlloc(size);
+  if (p == nullptr) {
+    throw std::bad_alloc();
+  }
+  return p;
+}
+
+void *operator new(size_t size, const std::nothrow_t &) noexcept {
+  return serialbench::trackedAlloc(size);
+}
+
+void *operator new[](size_t size, const std::nothrow_t &) noexcept {
+  return serialbench::trackedAlloc(size);
+}
+
+void operator delete(void *p) noexcept {
+  serialbench::trackedFree(p);
+}
+
+void operator delete[](void *p) noexcept {
+  serialbench::trackedFree(p);
+}
+
+void operator delete(void *p, const std::nothrow_t &) noexcept {
+  serialbench::trackedFree(p);
+}
+
+void operator delete[](void *p, const std::nothrow_t &) noexcept {
+  serialbench::trackedFree(p);
+}
+
+#endif // SERIALBENCH_MEMTRACK
@@ -0,0 +1,46 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * Global operator new/delete counters for serialbench.
+ * Every allocation carries a small header so frees can be attributed,
+ * but counters are only updated while tracking is enabled.
+ * The replacement operators are only built into serialbench-memory
+ * (SERIALBENCH_MEMTRACK), so the other modes time the default allocator.
+ */
+namespace serialbench {
+
+  struct MemCounters {
+    uint64_t allocCount { 0 };
+    uint64_t bytesAllocated { 0 };
+    int64_t liveBytes { 0 };
+    int64_t peakLiveBytes { 0 };
+  };
+
+  /**
+   * @returns true if built with the counting operator new.
+   */
+  bool MemTrackAvailable();
+
+  void MemTrackEnable(bool enabled);
+
+  void MemTrackGet(MemCounters &dest);
+
+  /**
+   * Restart peak tracking from the current live bytes.
+   */
+  void MemTrackResetPeak();
+
+  /**
+   * @returns resident set size of the process in bytes, 0 if unavailable.
+   */
+  size_t CurrentRSS();
+
+  /**
+   * @returns peak resident set size of the process in bytes, 0 if unavailable.
+   */
+  size_t PeakRSS();
+
+} // namespace serialbench
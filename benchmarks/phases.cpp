@@ -0,0 +1,282 @@
+#include "bench.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <stdio.h>
+
+namespace serialbench {
+
+  typedef std::chrono::steady_clock Clock;
+
+  static inline double elapsedNanos(Clock::time_point start) {
+    return (double)std::chrono::duration_cast<std::chrono::nanoseconds>(Clock::now() - start).count();
+  }
+
+  Stats ComputeStats(std::vector<double> samples) {
+    Stats s;
+    s.count = samples.size();
+    if (samples.empty()) {
+      return s;
+    }
+    std::sort(samples.begin(), samples.end());
+    double sum = 0;
+    for (auto val : samples) { sum += val; }
+    s.mean = sum / samples.size();
+    double sqsum = 0;
+    for (auto val : samples) { sqsum += (val - s.mean) * (val - s.mean); }
+    s.stddev = samples.size() > 1 ? sqrt(sqsum / (samples.size() - 1)) : 0;
+    s.min = samples.front();
+    s.max = samples.back();
+    s.median = samples[samples.size() / 2];
+    return s;
+  }
+
+  //------------------------------------------------------------
+  // JsonOut
+
+  void JsonOut::_separate() {
+    if (_afterKey) {
+      _afterKey = false;
+      return;
+    }
+    if (!_needComma.empty()) {
+      if (_needComma.back()) { _dest += ","; }
+      _needComma.back() = true;
+    }
+  }
+
+  void JsonOut::beginObject() {
+    _separate();
+    _dest += "{";
+    _needComma.push_back(false);
+  }
+
+  void JsonOut::endObject() {
+    _needComma.pop_back();
+    _dest += "}";
+  }
+
+  void JsonOut::beginArray(const char *name) {
+    if (name != nullptr) { key(name); }
+    _separate();
+    _dest += "[";
+    _needComma.push_back(false);
+  }
+
+  void JsonOut::endArray() {
+    _needComma.pop_back();
+    _dest += "]";
+  }
+
+  void JsonOut::key(const char *name) {
+    _separate();
+    _dest += "\"";
+    _dest += name;
+    _dest += "\":";
+    _afterKey = true;
+  }
+
+  std::string JsonQuote(const std::string &str) {
+    std::string quoted = "\"";
+    for (char c : str) {
+      if (c == '"' || c == '\\') {
+        quoted += '\\';
+        quoted += c;
+      } else if ((uint8_t)c < 0x20) {
+        char tmp[8];
+        snprintf(tmp, sizeof(tmp), "\\u%04x", (int)c);
+        quoted += tmp;
+      } else {
+        quoted += c;
+      }
+    }
+    quoted += "\"";
+    return quoted;
+  }
+
+  void JsonOut::value(const std::string &str) {
+    _separate();
+    _dest += JsonQuote(str);
+  }
+
+  void JsonOut::value(double val) {
+    _separate();
+    char tmp[32];
+    snprintf(tmp, sizeof(tmp), "%.1f", val);
+    _dest += tmp;
+  }
+
+  void JsonOut::value(int64_t val) {
+    _separate();
+    _dest += std::to_string(val);
+  }
+
+  void JsonOut::raw(const char *name, const std::string &json) {
+    key(name);
+    _separate();
+    _dest += json;
+  }
+
+  void JsonOut::stats(const char *name, const Stats &s, const std::string &unit) {
+    std::string suffix = unit.empty() ? "" : "_" + unit;
+    key(name);
+    beginObject();
+    field("count", (int64_t)s.count);
+    field(("mean" + suffix).c_str(), s.mean);
+    field(("stddev" + suffix).c_str(), s.stddev);
+    field(("min" + suffix).c_str(), s.min);
+    field(("median" + suffix).c_str(), s.median);
+    field(("max" + suffix).c_str(), s.max);
+    endObject();
+  }
+
+  //------------------------------------------------------------
+  // serializer runner
+
+  const char *PhaseNames[NUM_PHASES] = { "beginData", "addNewResult", "endData", "serialize" };
+
+  template <class T>
+  static void RunPhases(std::shared_ptr<vsqlite::ResultsSerializer<T> > spSerializer,
+                        std::shared_ptr<vsqlite::DiffResultsListener<T> > spListener,
+                        Workload &workload,
+                        void (*prepareRows)(Workload &, std::vector<DynMap> &, std::vector<T> &),
+                        int warmup, int iterations, PhaseProbe &probe) {
+    std::string historicalData;
+    std::vector<T> rows;
+
+    workload.reset();
+
+    for (int i=0; i < warmup + iterations; i++) {
+      prepareRows(workload, workload.next(), rows);
+      probe.beginIteration(i >= warmup);
+
+      probe.start(PHASE_BEGIN_DATA);
+      spSerializer->beginData(historicalData, spListener, workload.columns());
+      probe.stop(PHASE_BEGIN_DATA);
+
+      probe.start(PHASE_ADD_NEW_RESULT);
+      for (auto &row : rows) {
+        spSerializer->addNewResult(row);
+      }
+      probe.stop(PHASE_ADD_NEW_RESULT);
+
+      probe.start(PHASE_END_DATA);
+      spSerializer->endData();
+      probe.stop(PHASE_END_DATA);
+
+      historicalData.clear();
+      probe.start(PHASE_SERIALIZE);
+      spSerializer->serialize(historicalData);
+      probe.stop(PHASE_SERIALIZE);
+
+      probe.endIteration(historicalData);
+    }
+  }
+
+  static void prepareDynMapRows(Workload &workload, std::vector<DynMap> &src, std::vector<DynMap> &dest) {
+    dest = src;
+  }
+
+  static void prepareStringMapRows(Workload &workload, std::vector<DynMap> &src, std::vector<Row> &dest) {
+    ToStringMapRows(workload.columns(), src, dest);
+  }
+
+  bool RunSerializer(const std::string &name, Workload &workload, int warmup, int iterations, PhaseProbe &probe) {
+    auto spDynMapSerializer = DynMapSerializerNew(name);
+    if (spDynMapSerializer) {
+      RunPhases<DynMap>(spDynMapSerializer, DynMapListenerNew(workload.columns()), workload,
+                        prepareDynMapRows, warmup, iterations, probe);
+      return false;
+    }
+    auto spStringMapSerializer = StringMapSerializerNew(name);
+    if (spStringMapSerializer) {
+      RunPhases<Row>(spStringMapSerializer, StringMapListenerNew(), workload,
+                     prepareStringMapRows, warmup, iterations, probe);
+      return false;
+    }
+    fprintf(stderr, "unknown serializer '%s'\n", name.c_str());
+    return true;
+  }
+
+  //------------------------------------------------------------
+  // phase suite
+
+  /*
+   * Per-iteration wall time of each phase, and snapshot size.
+   */
+  class TimingProbe : public PhaseProbe {
+  public:
+    virtual ~TimingProbe() {}
+
+    void beginIteration(bool record) override { _record = record; }
+
+    void start(Phase phase) override {
+      _start = Clock::now();
+    }
+
+    void stop(Phase phase) override {
+      double elapsed = elapsedNanos(_start);
+      if (_record) {
+        samples[phase].push_back(elapsed);
+      }
+    }
+
+    void endIteration(std::string &snapshot) override {
+      if (_record) {
+        snapshotBytes.push_back((double)snapshot.size());
+      }
+    }
+
+    std::vector<double> samples[NUM_PHASES];
+    std::vector<double> snapshotBytes;
+
+  private:
+    bool _record { false };
+    Clock::time_point _start;
+  };
+
+  bool RunPhaseSuite(BenchConfig &config, std::string &dest) {
+    std::vector<SPWorkload> workloads;
+    if (BuildWorkloads(config, workloads)) {
+      return true;
+    }
+
+    JsonOut out(dest);
+    out.beginObject();
+    out.field("suite", std::string("phases"));
+    out.field("iterations", (int64_t)config.iterations);
+    out.field("warmup", (int64_t)config.warmup);
+    out.field("seed", (int64_t)config.seed);
+    out.beginArray("results");
+
+    for (auto &spWorkload : workloads) {
+      for (auto &name : config.serializers) {
+        fprintf(stderr, "%s %s\n", name.c_str(), spWorkload->describe().c_str());
+
+        TimingProbe probe;
+        if (RunSerializer(name, *spWorkload, config.warmup, config.iterations, probe)) {
+          continue;
+        }
+
+        out.beginObject();
+        out.field("serializer", name);
+        out.raw("workload", spWorkload->describe());
+        out.key("phases");
+        out.beginObject();
+        for (int phase=0; phase < NUM_PHASES; phase++) {
+          out.stats(PhaseNames[phase], ComputeStats(probe.samples[phase]));
+        }
+        out.endObject();
+        out.field("snapshot_bytes", ComputeStats(probe.snapshotBytes).mean);
+        out.endObject();
+      }
+    }
+
+    out.endArray();
+    out.endObject();
+    dest += "\n";
+    return false;
+  }
+
+} // namespace serialbench
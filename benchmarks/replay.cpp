@@ -0,0 +1,183 @@
+#include "bench.h"
+
+#include <rapidjson/document.h>
+#include <fstream>
+#include <sstream>
+#include <stdio.h>
+
+namespace rj = rapidjson;
+
+namespace serialbench {
+
+  typedef std::vector<std::vector<std::pair<std::string, std::string> > > RawSnapshot;
+
+  static bool isInteger(const std::string &s) {
+    if (s.empty()) { return false; }
+    size_t i = (s[0] == '-') ? 1 : 0;
+    if (i == s.size() || s.size() - i > 18) { return false; }
+    for (; i < s.size(); i++) {
+      if (s[i] < '0' || s[i] > '9') { return false; }
+    }
+    return true;
+  }
+
+  /*
+   * return true on error, false on success
+   */
+  static bool parseSnapshot(const std::string &json, RawSnapshot &dest) {
+    rj::Document doc;
+    if (doc.Parse(json.c_str()).HasParseError() || !doc.IsArray()) {
+      return true;
+    }
+    for (const auto &obj : doc.GetArray()) {
+      if (!obj.IsObject()) {
+        return true;
+      }
+      std::vector<std::pair<std::string, std::string> > row;
+      for (const auto &i : obj.GetObject()) {
+        if (!i.value.IsString()) { continue; }
+        row.push_back(std::make_pair(std::string(i.name.GetString(), i.name.GetStringLength()),
+                                     std::string(i.value.GetString(), i.value.GetStringLength())));
+      }
+      dest.push_back(row);
+    }
+    return false;
+  }
+
+  /*
+   * Cycles through snapshots loaded from recorded result files.
+   */
+  class ReplayWorkload : public Workload {
+  public:
+    ReplayWorkload(std::vector<std::string> paths) : Workload(), _paths(paths) {}
+
+    virtual ~ReplayWorkload() {}
+
+    /*
+     * return true on error, false on success
+     */
+    bool load() {
+      std::vector<RawSnapshot> raw;
+      for (auto &path : _paths) {
+        std::ifstream f(path.c_str(), std::ios::in | std::ios::binary);
+        if (!f.is_open()) {
+          fprintf(stderr, "unable to open '%s'\n", path.c_str());
+          return true;
+        }
+        std::stringstream content;
+        content << f.rdbuf();
+
+        // whole file as one array, otherwise one array per line
+
+        RawSnapshot snapshot;
+        if (!parseSnapshot(content.str(), snapshot)) {
+          raw.push_back(snapshot);
+          continue;
+        }
+        content.seekg(0);
+        std::string line;
+        while (std::getline(content, line)) {
+          if (line.empty()) { continue; }
+          RawSnapshot lineSnapshot;
+          if (parseSnapshot(line, lineSnapshot)) {
+            fprintf(stderr, "skipping unparsable snapshot in '%s'\n", path.c_str());
+            continue;
+          }
+          raw.push_back(lineSnapshot);
+        }
+      }
+      if (raw.empty()) {
+        return true;
+      }
+      _buildColumns(raw);
+      _buildSnapshots(raw);
+      return false;
+    }
+
+    std::string describe() override {
+      std::stringstream ss;
+      ss << "{\"type\":\"replay\",\"snapshots\":" << _snapshots.size() << ",\"cols\":" << _cols.size()
+         << ",\"rows\":" << (_snapshots.empty() ? 0 : _snapshots[0].size()) << ",\"files\":[";
+      for (size_t i=0; i < _paths.size(); i++) {
+        if (i > 0) { ss << ","; }
+        ss << JsonQuote(_paths[i]);
+      }
+      ss << "]}";
+      return ss.str();
+    }
+
+    std::vector<SPFieldDef> &columns() override { return _cols; }
+
+    void reset() override {
+      _next = 0;
+    }
+
+    std::vector<DynMap> &next() override {
+      _current = _snapshots[_next];
+      _next = (_next + 1) % _snapshots.size();
+      return _current;
+    }
+
+  protected:
+
+    /*
+     * Columns in order of first appearance, typed TINT64 only
+     * if every value seen is an integer.
+     */
+    void _buildColumns(std::vector<RawSnapshot> &raw) {
+      std::vector<std::string> names;
+      std::map<std::string, bool> allInts;
+      for (auto &snapshot : raw) {
+        for (auto &row : snapshot) {
+          for (auto &kv : row) {
+            auto fit = allInts.find(kv.first);
+            if (fit == allInts.end()) {
+              names.push_back(kv.first);
+              allInts[kv.first] = isInteger(kv.second);
+            } else if (fit->second && !isInteger(kv.second)) {
+              fit->second = false;
+            }
+          }
+        }
+      }
+      for (auto &name : names) {
+        SPFieldDef col = FieldDef::alloc(allInts[name] ? TINT64 : TSTRING, name);
+        _cols.push_back(col);
+        _colsByName[name] = col;
+      }
+    }
+
+    void _buildSnapshots(std::vector<RawSnapshot> &raw) {
+      for (auto &snapshot : raw) {
+        std::vector<DynMap> rows(snapshot.size());
+        for (size_t i=0; i < snapshot.size(); i++) {
+          for (auto &kv : snapshot[i]) {
+            SPFieldDef col = _colsByName[kv.first];
+            if (col->typeId == TINT64) {
+              rows[i][col] = (int64_t)strtoll(kv.second.c_str(), nullptr, 10);
+            } else {
+              rows[i][col] = kv.second;
+            }
+          }
+        }
+        _snapshots.push_back(rows);
+      }
+    }
+
+    std::vector<std::string> _paths;
+    std::vector<SPFieldDef> _cols;
+    std::map<std::string, SPFieldDef> _colsByName;
+    std::vector<std::vector<DynMap> > _snapshots;
+    std::vector<DynMap> _current;
+    size_t _next { 0 };
+  };
+
+  SPWorkload ReplayWorkloadNew(const std::vector<std::string> &paths) {
+    auto spWorkload = std::make_shared<ReplayWorkload>(paths);
+    if (spWorkload->load()) {
+      return nullptr;
+    }
+    return spWorkload;
+  }
+
+} // namespace serialbench
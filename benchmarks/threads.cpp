@@ -0,0 +1,252 @@
+#include "bench.h"
+
+#include <atomic>
+#include <chrono>
+#include <stdio.h>
+#include <thread>
+
+namespace serialbench {
+
+  typedef std::chrono::steady_clock Clock;
+
+  // distinct snapshots each thread cycles through
+  static const int MAX_SNAPSHOTS = 4;
+
+  /*
+   * One serializer instance and the snapshot it diffs against.
+   */
+  template <class T>
+  struct Instance {
+    std::shared_ptr<vsqlite::ResultsSerializer<T> > spSerializer;
+    std::shared_ptr<vsqlite::DiffResultsListener<T> > spListener;
+    std::string historicalData;
+  };
+
+  /*
+   * Every thread holds its own copy of the rows, so the only state
+   * shared between threads is the schema (SPFieldDef) and the allocator.
+   */
+  template <class T>
+  struct ThreadState {
+    std::vector<Instance<T> > instances;
+    std::vector<std::vector<T> > snapshots;
+    Clock::time_point end;
+  };
+
+  static void makeSnapshot(Workload &workload, std::vector<DynMap> &src, std::vector<DynMap> &dest) {
+    dest = src;
+  }
+
+  static void makeSnapshot(Workload &workload, std::vector<DynMap> &src, std::vector<Row> &dest) {
+    ToStringMapRows(workload.columns(), src, dest);
+  }
+
+  static std::shared_ptr<vsqlite::ResultsSerializer<DynMap> > serializerNew(const std::string &name, DynMap *) {
+    return DynMapSerializerNew(name);
+  }
+
+  static std::shared_ptr<vsqlite::ResultsSerializer<Row> > serializerNew(const std::string &name, Row *) {
+    return StringMapSerializerNew(name);
+  }
+
+  static std::shared_ptr<vsqlite::DiffResultsListener<DynMap> > listenerNew(Workload &workload, DynMap *) {
+    return DynMapListenerNew(workload.columns());
+  }
+
+  static std::shared_ptr<vsqlite::DiffResultsListener<Row> > listenerNew(Workload &workload, Row *) {
+    return StringMapListenerNew();
+  }
+
+  template <class T>
+  static void runThread(ThreadState<T> &state, std::vector<SPFieldDef> &cols, int iterations, std::atomic<bool> &go) {
+    while (!go.load()) {
+      std::this_thread::yield();
+    }
+    for (int i=0; i < iterations && !state.snapshots.empty(); i++) {
+      std::vector<T> &rows = state.snapshots[i % state.snapshots.size()];
+      for (auto &instance : state.instances) {
+        instance.spSerializer->beginData(instance.historicalData, instance.spListener, cols);
+        for (auto &row : rows) {
+          instance.spSerializer->addNewResult(row);
+        }
+        instance.spSerializer->endData();
+        instance.historicalData.clear();
+        instance.spSerializer->serialize(instance.historicalData);
+      }
+    }
+    state.end = Clock::now();
+  }
+
+  /*
+   * @returns wall time in nanoseconds for all threads to complete
+   * warmup + iterations, or 0 if name is not a serializer of row type T.
+   */
+  template <class T>
+  static double runScaling(const std::string &name, Workload &workload, int numThreads, int instancesPerThread,
+                           int warmup, int iterations, size_t &rowsProcessed) {
+    if (!serializerNew(name, (T *)nullptr)) {
+      return 0;
+    }
+
+    // snapshots are generated once, then copied into each thread
+
+    std::vector<std::vector<T> > snapshots;
+    workload.reset();
+    for (int i=0; i < MAX_SNAPSHOTS && i < warmup + iterations; i++) {
+      snapshots.push_back(std::vector<T>());
+      makeSnapshot(workload, workload.next(), snapshots.back());
+    }
+
+    std::vector<ThreadState<T> > states(numThreads);
+    for (auto &state : states) {
+      state.snapshots = snapshots;
+      for (int k=0; k < instancesPerThread; k++) {
+        Instance<T> instance;
+        instance.spSerializer = serializerNew(name, (T *)nullptr);
+        instance.spListener = listenerNew(workload, (T *)nullptr);
+        state.instances.push_back(instance);
+      }
+    }
+
+    // warmup single-threaded so every instance starts with history
+
+    for (auto &state : states) {
+      std::atomic<bool> go(true);
+      runThread<T>(state, workload.columns(), warmup, go);
+    }
+
+    std::atomic<bool> go(false);
+    std::vector<std::thread> threads;
+    for (auto &state : states) {
+      threads.push_back(std::thread(runThread<T>, std::ref(state), std::ref(workload.columns()), iterations, std::ref(go)));
+    }
+
+    auto start = Clock::now();
+    go.store(true);
+    Clock::time_point end = start;
+    for (size_t t=0; t < threads.size(); t++) {
+      threads[t].join();
+      if (states[t].end > end) { end = states[t].end; }
+    }
+
+    rowsProcessed = 0;
+    for (int i=0; i < iterations && !snapshots.empty(); i++) {
+      rowsProcessed += snapshots[i % snapshots.size()].size();
+    }
+    rowsProcessed *= numThreads * instancesPerThread;
+
+    return (double)std::chrono::duration_cast<std::chrono::nanoseconds>(end - start).count();
+  }
+
+  struct ScalingPoint {
+    int numThreads { 0 };
+    double wall { 0 };
+    double rate { 0 };
+  };
+
+  /**
+   * Fills wall time and rows per second of point.numThreads threads.
+   * @returns true if name is not a known serializer.
+   */
+  static bool measureScaling(const std::string &name, Workload &workload, BenchConfig &config, ScalingPoint &point) {
+    fprintf(stderr, "%s threads:%d %s\n", name.c_str(), point.numThreads, workload.describe().c_str());
+
+    size_t rowsProcessed = 0;
+    double wall = runScaling<DynMap>(name, workload, point.numThreads, config.instancesPerThread,
+                                     config.warmup, config.iterations, rowsProcessed);
+    if (wall == 0) {
+      wall = runScaling<Row>(name, workload, point.numThreads, config.instancesPerThread,
+                             config.warmup, config.iterations, rowsProcessed);
+    }
+    if (wall == 0) {
+      fprintf(stderr, "unknown serializer '%s'\n", name.c_str());
+      return true;
+    }
+    point.wall = wall;
+    point.rate = rowsProcessed / (wall / 1e9);
+    return false;
+  }
+
+  static std::vector<int> defaultThreadCounts() {
+    int numCores = (int)std::thread::hardware_concurrency();
+    if (numCores < 1) { numCores = 1; }
+    std::vector<int> counts;
+    for (int t=1; t < numCores; t *= 2) {
+      counts.push_back(t);
+    }
+    counts.push_back(numCores);
+    return counts;
+  }
+
+  bool RunThreadsSuite(BenchConfig &config, std::string &dest) {
+    std::vector<SPWorkload> workloads;
+    if (BuildWorkloads(config, workloads)) {
+      return true;
+    }
+
+    std::vector<int> threadCounts = config.threadCounts.empty() ? defaultThreadCounts() : config.threadCounts;
+
+    JsonOut out(dest);
+    out.beginObject();
+    out.field("suite", std::string("threads"));
+    out.field("iterations", (int64_t)config.iterations);
+    out.field("warmup", (int64_t)config.warmup);
+    out.field("instances_per_thread", (int64_t)config.instancesPerThread);
+    out.field("hardware_concurrency", (int64_t)std::thread::hardware_concurrency());
+    out.beginArray("results");
+
+    for (auto &spWorkload : workloads) {
+      for (auto &name : config.serializers) {
+        std::vector<ScalingPoint> points;
+        for (int numThreads : threadCounts) {
+          if (numThreads < 1) { continue; }
+          ScalingPoint point;
+          point.numThreads = numThreads;
+          if (measureScaling(name, *spWorkload, config, point)) {
+            break;
+          }
+          points.push_back(point);
+        }
+        if (points.empty()) {
+          continue;
+        }
+
+        // speedup is relative to one thread, measured separately
+        // when the thread counts do not include 1
+
+        ScalingPoint single;
+        single.numThreads = 1;
+        for (auto &point : points) {
+          if (point.numThreads == 1) { single = point; }
+        }
+        if (single.rate == 0 && measureScaling(name, *spWorkload, config, single)) {
+          continue;
+        }
+
+        out.beginObject();
+        out.field("serializer", name);
+        out.raw("workload", spWorkload->describe());
+        out.field("single_thread_rows_per_sec", single.rate);
+        out.beginArray("curve");
+        for (auto &point : points) {
+          out.beginObject();
+          out.field("threads", (int64_t)point.numThreads);
+          out.field("instances", (int64_t)(point.numThreads * config.instancesPerThread));
+          out.field("wall_ns", point.wall);
+          out.field("rows_per_sec", point.rate);
+          out.field("speedup", single.rate > 0 ? point.rate / single.rate : 0.0);
+          out.field("efficiency", single.rate > 0 ? point.rate / (single.rate * point.numThreads) : 0.0);
+          out.endObject();
+        }
+        out.endArray();
+        out.endObject();
+      }
+    }
+
+    out.endArray();
+    out.endObject();
+    dest += "\n";
+    return false;
+  }
+
+} // namespace serialbench
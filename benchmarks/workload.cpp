@@ -0,0 +1,299 @@
+#include "bench.h"
+
+#include <random>
+#include <sstream>
+#include <stdio.h>
+
+namespace serialbench {
+
+  static const decltype(TSTRING) gColumnTypeCycle[] = { TSTRING, TINT64, TINT64, TINT64, TINT32 };
+
+  static const char *gPathVocabulary[] = {
+    "/usr/sbin/sshd", "/usr/lib/systemd/systemd-journald", "/usr/bin/dbus-daemon",
+    "/usr/sbin/cron", "/usr/lib/postgresql/12/bin/postgres", "/usr/bin/python3.8",
+    "/usr/sbin/nginx", "/usr/bin/containerd", "/usr/bin/dockerd", "/bin/bash",
+    "C:\\Windows\\System32\\svchost.exe", "C:\\Windows\\explorer.exe",
+    "C:\\Program Files\\Some Application\\Contents\\app.exe",
+    "/Applications/Safari.app/Contents/MacOS/Safari", "/sbin/launchd", ""
+  };
+  static const size_t gPathVocabularySize = sizeof(gPathVocabulary) / sizeof(gPathVocabulary[0]);
+
+  static const char *gStateVocabulary[] = { "R", "S", "S", "S", "I", "D", "Z" };
+
+  // 2,3 and 4 byte UTF-8 sequences
+  static const char *gUnicodeChars[] = { "\xc3\xa9", "\xd0\x96", "\xe4\xb8\xad", "\xe2\x82\xac", "\xf0\x9f\x9a\x94", "\xf0\x9f\x8c\xb4" };
+
+  /*
+   * Generated table where a fraction of the rows changes on each snapshot.
+   */
+  class SyntheticWorkload : public Workload {
+  public:
+    SyntheticWorkload(const WorkloadSpec &spec) : Workload(), _spec(spec) {
+      if (_spec.shape == "processes") {
+        _initProcessesColumns();
+      } else {
+        for (int i=0; i < _spec.numCols; i++) {
+          auto typeId = gColumnTypeCycle[i % (sizeof(gColumnTypeCycle) / sizeof(gColumnTypeCycle[0]))];
+          _cols.push_back(FieldDef::alloc(typeId, "c" + std::to_string(i)));
+        }
+      }
+      reset();
+    }
+
+    virtual ~SyntheticWorkload() {}
+
+    std::string describe() override {
+      std::stringstream ss;
+      ss << "{\"type\":\"synthetic\",\"shape\":" << JsonQuote(_spec.shape) << ",\"rows\":" << _spec.numRows
+         << ",\"cols\":" << _cols.size() << ",\"strlen\":" << _spec.strLen
+         << ",\"churn\":" << _spec.churnRate << ",\"churn_dist\":" << JsonQuote(_spec.churnDist)
+         << ",\"strings\":" << JsonQuote(_spec.strings);
+      if (_spec.shape == "processes") {
+        ss << ",\"cmdline_len\":" << _spec.cmdlineLen;
+      }
+      ss << "}";
+      return ss.str();
+    }
+
+    std::vector<SPFieldDef> &columns() override { return _cols; }
+
+    void reset() override {
+      _rng.seed(_spec.seed);
+      _iteration = 0;
+      _nextPid = 100;
+      _rows.clear();
+      _rows.resize(_spec.numRows);
+      for (auto &row : _rows) {
+        _fillRow(row);
+      }
+    }
+
+    std::vector<DynMap> &next() override {
+      if (_iteration++ > 0 && !_rows.empty()) {
+        size_t numChanged = (size_t)(_spec.churnRate * _rows.size() + 0.5);
+        for (size_t i=0; i < numChanged; i++) {
+          DynMap &row = _rows[_pickRow()];
+          if (_spec.churnDist == "volatile") {
+            _tickRow(row);
+          } else {
+            row = DynMap();
+            _fillRow(row);
+          }
+        }
+      }
+      return _rows;
+    }
+
+  protected:
+
+    void _initProcessesColumns() {
+      static const char *strCols[] = { "path", "name", "state", "cmdline", "cwd", "root" };
+      static const char *i64Cols[] = { "pid", "uid", "gid", "euid", "egid", "suid", "sgid",
+        "wired_size", "resident_size", "total_size", "user_time", "system_time",
+        "start_time", "parent", "pgroup", "elapsed_time", "handle_count" };
+      static const char *i32Cols[] = { "on_disk", "threads", "is_elevated_token" };
+      for (auto name : strCols) { _cols.push_back(FieldDef::alloc(TSTRING, name)); }
+      for (auto name : i64Cols) { _cols.push_back(FieldDef::alloc(TINT64, name)); }
+      for (auto name : i32Cols) { _cols.push_back(FieldDef::alloc(TINT32, name)); }
+    }
+
+    size_t _pickRow() {
+      if (_spec.churnDist == "hotset" && _rows.size() >= 10 && (_rng() % 10) < 8) {
+        return _rng() % (_rows.size() / 10);
+      }
+      return _rng() % _rows.size();
+    }
+
+    std::string _makeString(int len) {
+      std::string s;
+      if (_spec.strings == "path") {
+        return gPathVocabulary[_rng() % gPathVocabularySize];
+      } else if (_spec.strings == "unicode") {
+        while ((int)s.size() < len) {
+          if (_rng() % 4 == 0) {
+            s += gUnicodeChars[_rng() % (sizeof(gUnicodeChars) / sizeof(gUnicodeChars[0]))];
+          } else {
+            s += (char)('a' + _rng() % 26);
+          }
+        }
+      } else if (_spec.strings == "binary") {
+        s.resize(len);
+        for (int i=0; i < len; i++) {
+          s[i] = (char)(_rng() & 0xFF);
+        }
+      } else {
+        s.resize(len);
+        for (int i=0; i < len; i++) {
+          s[i] = (char)('a' + _rng() % 26);
+        }
+      }
+      return s;
+    }
+
+    void _fillRow(DynMap &row) {
+      if (_spec.shape == "processes") {
+        _fillProcessRow(row);
+        return;
+      }
+      for (auto &col : _cols) {
+        switch(col->typeId) {
+          case TINT64:
+            row[col] = (int64_t)(_rng() % 0x0FFFFFFL);
+            break;
+          case TINT32:
+            row[col] = (int32_t)(_rng() % 0x0FFFFL);
+            break;
+          case TSTRING:
+          default:
+            row[col] = _makeString(_spec.strLen);
+            break;
+        }
+      }
+    }
+
+    /*
+     * Paths, names and users repeat across rows; counters are distinct.
+     */
+    void _fillProcessRow(DynMap &row) {
+      std::string path = gPathVocabulary[_rng() % gPathVocabularySize];
+      std::string name = path.substr(path.find_last_of("/\\") + 1);
+      int64_t uid = (_rng() % 4 == 0) ? 0 : 500 + (int64_t)(_rng() % 4);
+
+      std::string cmdline = path;
+      while ((int)cmdline.size() < _spec.cmdlineLen) {
+        cmdline += " --opt" + std::to_string(_rng() % 100) + "=" + _makeString(12);
+      }
+
+      for (auto &col : _cols) {
+        const std::string &cname = col->name;
+        if (cname == "path") {
+          row[col] = path;
+        } else if (cname == "name") {
+          row[col] = name;
+        } else if (cname == "state") {
+          row[col] = gStateVocabulary[_rng() % (sizeof(gStateVocabulary) / sizeof(gStateVocabulary[0]))];
+        } else if (cname == "cmdline") {
+          row[col] = cmdline;
+        } else if (cname == "cwd" || cname == "root") {
+          row[col] = (_rng() % 2) ? "/" : _makeString(_spec.strLen);
+        } else if (cname == "pid" || cname == "pgroup") {
+          row[col] = (int64_t)_nextPid;
+        } else if (cname == "parent") {
+          row[col] = (int64_t)(_rng() % 100);
+        } else if (cname == "uid" || cname == "euid" || cname == "suid" ||
+                   cname == "gid" || cname == "egid" || cname == "sgid") {
+          row[col] = uid;
+        } else if (cname == "start_time") {
+          row[col] = (int64_t)1500000000 + _nextPid;
+        } else if (cname == "on_disk") {
+          row[col] = (int32_t)1;
+        } else if (cname == "is_elevated_token") {
+          row[col] = (int32_t)(uid == 0 ? 1 : 0);
+        } else if (col->typeId == TINT32) {
+          row[col] = (int32_t)(1 + _rng() % 64);
+        } else {
+          row[col] = (int64_t)(_rng() % 0x0FFFFFFL);
+        }
+      }
+      _nextPid++;
+    }
+
+    /*
+     * Same row identity, new values for a few counters.
+     */
+    void _tickRow(DynMap &row) {
+      int numTicked = 0;
+      for (auto &col : _cols) {
+        if (_spec.shape == "processes") {
+          const std::string &cname = col->name;
+          if (cname != "resident_size" && cname != "user_time" && cname != "system_time" && cname != "elapsed_time") {
+            continue;
+          }
+        } else if (col->typeId != TINT64 || (_rng() % 4) != 0) {
+          continue;
+        }
+        row[col] = (int64_t)(_rng() % 0x0FFFFFFL);
+        numTicked++;
+      }
+      if (numTicked == 0) {
+        _fillRow(row);
+      }
+    }
+
+    WorkloadSpec _spec;
+    int _iteration { 0 };
+    int64_t _nextPid { 100 };
+    std::mt19937 _rng;
+    std::vector<SPFieldDef> _cols;
+    std::vector<DynMap> _rows;
+  };
+
+  SPWorkload SyntheticWorkloadNew(const WorkloadSpec &spec) {
+    if (spec.shape != "generic" && spec.shape != "processes") { return nullptr; }
+    if (spec.churnDist != "uniform" && spec.churnDist != "hotset" && spec.churnDist != "volatile") { return nullptr; }
+    if (spec.strings != "ascii" && spec.strings != "path" && spec.strings != "unicode" && spec.strings != "binary") { return nullptr; }
+    return std::make_shared<SyntheticWorkload>(spec);
+  }
+
+  bool BuildWorkloads(BenchConfig &config, std::vector<SPWorkload> &dest) {
+    if (!config.replayPaths.empty()) {
+      auto spWorkload = ReplayWorkloadNew(config.replayPaths);
+      if (!spWorkload) {
+        fprintf(stderr, "no snapshots loaded from replay files\n");
+        return true;
+      }
+      dest.push_back(spWorkload);
+      return false;
+    }
+
+    WorkloadSpec spec;
+    spec.cmdlineLen = config.cmdlineLen;
+    spec.seed = config.seed;
+
+    for (auto &shape : config.shapes) {
+      spec.shape = shape;
+      for (int numRows : config.rowCounts) {
+        spec.numRows = numRows;
+        for (int numCols : config.colCounts) {
+          spec.numCols = numCols;
+          for (int strLen : config.strLens) {
+            spec.strLen = strLen;
+            for (auto &strings : config.stringKinds) {
+              spec.strings = strings;
+              for (double churn : config.churnRates) {
+                spec.churnRate = churn;
+                for (auto &churnDist : config.churnDists) {
+                  spec.churnDist = churnDist;
+                  auto spWorkload = SyntheticWorkloadNew(spec);
+                  if (!spWorkload) {
+                    fprintf(stderr, "invalid workload shape:%s churn_dist:%s strings:%s\n",
+                            shape.c_str(), churnDist.c_str(), strings.c_str());
+                    return true;
+                  }
+                  dest.push_back(spWorkload);
+                }
+              }
+            }
+          }
+        }
+      }
+    }
+    return false;
+  }
+
+  void ToStringMapRows(std::vector<SPFieldDef> &cols, std::vector<DynMap> &rows, std::vector<Row> &dest) {
+    dest.resize(rows.size());
+    for (size_t i=0; i < rows.size(); i++) {
+      Row &dst = dest[i];
+      dst.clear();
+      for (auto &col : cols) {
+        DynVal &val = rows[i][col];
+        if (!val.valid()) {
+          continue;
+        }
+        dst[col->name] = val.as_s();
+      }
+    }
+  }
+
+} // namespace serialbench
@@ -1,24 +1,220 @@
 #pragma once
 
+#include <map>
 #include <memory>
 #include <string>
+#include <vector>
 #include <dynobj.hpp>
 
 namespace vsqlite {
 
+  typedef std::map<std::string,std::string> StringMap;
+
+  /*
+   * Row decoded from historical data without building a row object,
+   * see DiffResultsListener::onRemovedView(). String and bytes values
+   * point into buffers of the serializer, and are only valid until the
+   * callback returns.
+   */
+  struct RowView {
+    struct Field {
+      SPFieldDef id;
+      DynVal value;                 // numeric values
+      const char *data { nullptr }; // string and bytes values, not null terminated
+      size_t size { 0 };
+    };
+
+    std::vector<Field> fields;
+
+    /**
+     * @returns the field of column id, or nullptr if not set.
+     */
+    const Field *find(const SPFieldDef &id) const {
+      for (auto &field : fields) {
+        if (field.id == id) { return &field; }
+      }
+      return nullptr;
+    }
+
+    /**
+     * Copies the values into row, for listeners that keep it.
+     */
+    void copyTo(DynMap &row) const {
+      for (auto &field : fields) {
+        if (field.data == nullptr) {
+          row[field.id] = field.value;
+        } else if (field.id->typeId == TBYTES) {
+          row[field.id] = DynVal(std::vector<uint8_t>(field.data, field.data + field.size));
+        } else {
+          row[field.id] = DynVal(std::string(field.data, field.size));
+        }
+      }
+    }
+
+    void copyTo(StringMap &row) const {
+      for (auto &field : fields) {
+        row[field.id->name] = (field.data == nullptr ? field.value.as_s() : std::string(field.data, field.size));
+      }
+    }
+  };
+
   template <class T>
   struct DiffResultsListener {
 
     virtual void onAdded(T &row) = 0;
 
     virtual void onRemoved(T &row) = 0;
+
+    /**
+     * Called instead of onRemoved() by the crow serializer, which
+     * decodes removed rows into a reused RowView rather than a new row
+     * per removed row. Override it to read the values in place, and
+     * copy only those to keep. The default copies the view into a row
+     * and calls onRemoved().
+     */
+    virtual void onRemovedView(const RowView &view) {
+      T row;
+      view.copyTo(row);
+      onRemoved(row);
+    }
+
+    /**
+     * Called instead of onRemoved() + onAdded() when key columns are set
+     * (see DiffOptions) and a new row has the key of a historical row,
+     * but other column values differ.
+     * @param changedColumns columns whose values differ between oldRow and newRow.
+     */
+    virtual void onChanged(T &oldRow, T &newRow, const std::vector<SPFieldDef> &changedColumns) {
+      onRemoved(oldRow);
+      onAdded(newRow);
+    }
   };
 
   typedef std::shared_ptr<DiffResultsListener<DynMap> > SPDiffResultsListener;
 
-  typedef std::map<std::string,std::string> StringMap;
+  /*
+   * Pull-based access to diff results, as an alternative to
+   * DiffResultsListener callbacks.
+   */
+  template <class T>
+  struct RowCursor {
+    virtual ~RowCursor() {}
+
+    /**
+     * Fills row with the next row. row is cleared first.
+     * @returns false when there are no more rows.
+     */
+    virtual bool next(T &row) = 0;
+  };
+
   typedef std::shared_ptr<DiffResultsListener<StringMap> > SPDiffResultsListenerStringMap;
 
+  /*
+   * Optional diff behavior for ResultsSerializer::beginData().
+   */
+  struct DiffOptions {
+    /**
+     * If not empty, historical rows are also matched on these columns.
+     * A new row that is not identical to any historical row, but has the
+     * same key column values as one, is reported via onChanged().
+     * Key values are expected to be unique within a result set.
+     * For DynMap rows, requires knownColumnIds in beginData(), which
+     * returns true otherwise.
+     */
+    std::vector<SPFieldDef> keyColumnIds;
+
+    /**
+     * Columns left out of row identity. They are still stored in the
+     * snapshot, but a row that differs from a historical row only in
+     * these columns is treated as unchanged : no listener call, and it
+     * does not make endData() return true.
+     * For DynMap rows, requires knownColumnIds in beginData().
+     */
+    std::vector<SPFieldDef> volatileColumnIds;
+
+    /**
+     * If true, only the result of endData() is computed, by comparing an
+     * order-independent digest of the rows with one derived from the
+     * snapshot. Historical rows are not indexed, the listener is not
+     * called, and addNewResult() returns false. The snapshot is still
+     * written in full. Ignored when volatileColumnIds is set, by the
+     * osquery json serializer, and for json lines snapshots without a
+     * fingerprint line (see storeFingerprints).
+     */
+    bool digestOnly { false };
+
+    /**
+     * If true, the json lines serializers end the snapshot with a line
+     * holding a fingerprint of each row, so that the next data set reuses
+     * unchanged lines without encoding them, and can use digestOnly.
+     * Off by default, since earlier versions would read the line as a row.
+     */
+    bool storeFingerprints { false };
+
+    /**
+     * If not 0, string values at least this many bytes long are stored
+     * once per snapshot in a blob section, keyed by content hash, and
+     * rows reference them. Supported by the json lines and crow
+     * serializers. Changing it makes rows with long values compare as
+     * changed once.
+     */
+    size_t blobMinSize { 0 };
+
+    /**
+     * If true, the columns of the data set are recorded in the snapshot,
+     * a section before the crow data or a first json line, so that the
+     * next data set can be compared on shared columns when
+     * knownColumnIds changes. Supported by the crow and json lines
+     * serializers. Off by default, since earlier versions can not read
+     * such snapshots.
+     */
+    bool storeSchema { false };
+
+    /**
+     * Name of the query or table, attached to trace spans of this data
+     * set. Only used when built with VSQLITE_TRACE.
+     */
+    std::string traceLabel;
+
+    /**
+     * If more than 1, rows may be added from up to this many threads at
+     * once with addNewResult(row, producer), each thread using its own
+     * producer index in [0, numProducers).
+     */
+    size_t numProducers { 1 };
+  };
+
+  /*
+   * Approximate heap bytes held by a serializer, see
+   * ResultsSerializer::memoryUsage().
+   */
+  struct MemoryUsage {
+    size_t historical { 0 }; // historical rows and their indexes
+    size_t current { 0 };    // encoding of the current data set
+    size_t other { 0 };      // scratch buffers, state kept across data sets
+
+    size_t total() const { return historical + current + other; }
+  };
+
+  /*
+   * When a serializer frees the capacity its containers grew to.
+   * Containers are cleared, not freed, between data sets, so after one
+   * large data set they keep their peak size until released.
+   */
+  struct TrimPolicy {
+    /**
+     * Release memory at beginData() once this many data sets in a row
+     * had less than half the rows of the largest one since the last
+     * release. 0 never releases.
+     */
+    uint32_t afterSmallDataSets { 0 };
+
+    /**
+     * Data sets smaller than this many rows are not worth releasing for.
+     */
+    size_t minRows { 1024 };
+  };
+
   template <class T>
   struct ResultsSerializer {
 
@@ -26,7 +222,16 @@ namespace vsqlite {
      * Initialize with historical data and optional listener.
      * @returns true if unable to parse historical_data.
      */
-    virtual bool beginData(std::string &historical_data, std::shared_ptr<DiffResultsListener<T> > listener, std::vector<SPFieldDef> &knownColumnIds) = 0;
+    virtual bool beginData(std::string &historical_data, std::shared_ptr<DiffResultsListener<T> > listener, std::vector<SPFieldDef> &knownColumnIds) {
+      DiffOptions options;
+      return beginData(historical_data, listener, knownColumnIds, options);
+    }
+
+    /**
+     * Same as above, with diff options.
+     * @returns true if unable to parse historical_data.
+     */
+    virtual bool beginData(std::string &historical_data, std::shared_ptr<DiffResultsListener<T> > listener, std::vector<SPFieldDef> &knownColumnIds, const DiffOptions &options) = 0;
 
     /**
      * If row is not in historical_data, then listener.onAdded()
@@ -35,6 +240,34 @@ namespace vsqlite {
      */
     virtual bool addNewResult(T &row) = 0;
 
+    /**
+     * Same as above, for rows the caller tracks across data sets.
+     * rowId is stable for a row, and version must change whenever one
+     * of its values does. If rowId was passed with the same version
+     * during the previous data set, its encoding is reused and row is
+     * not encoded again. Supported by the json lines serializers when
+     * blobMinSize is 0, others encode row as usual.
+     * @returns true if row was not in historical_data.
+     */
+    virtual bool addNewResult(T &row, uint64_t rowId, uint64_t version) {
+      return addNewResult(row);
+    }
+
+    /**
+     * Same as addNewResult(row), for rows produced by several threads
+     * (DiffOptions::numProducers). Calls with different producer values
+     * may run concurrently, and the listener is called from those
+     * threads. The json lines serializers encode each producer's rows
+     * into its own buffer and append the buffers in producer order at
+     * endData(), so the snapshot does not depend on thread scheduling.
+     * This requires knownColumnIds for DynMap rows, and no key columns,
+     * volatile columns or blobs. Otherwise, and in the other
+     * serializers, calls are serialized through a mutex. producer must
+     * be less than numProducers : other rows are dropped.
+     * @returns true if row was not in historical_data.
+     */
+    virtual bool addNewResult(T &row, size_t producer) = 0;
+
     /**
      * Indicates that all addNewResult() calls have been made for
      * current data set.
@@ -47,10 +280,65 @@ namespace vsqlite {
      * Serializes the current data snapshot into dest.
      */
     virtual void serialize(std::string &dest) = 0;
+
+    /**
+     * Historical rows not found in the current data set, for use after
+     * endData() when no listener is attached. Rows are decoded from the
+     * historical data as the cursor advances, so the consumer can stop
+     * early and the removed set is never held in memory at once (except
+     * for the columnar serializer, which decodes by column).
+     * The cursor is empty if a listener was attached, since endData()
+     * already reported the rows, and is invalid after the next beginData().
+     * It holds a reference to the serializer, so it may outlive the
+     * caller's own.
+     */
+    virtual std::shared_ptr<RowCursor<T> > removedRows() = 0;
+
+    /**
+     * Appends the rows removedRows() would return to dest as JSON lines,
+     * one {"column":"value",...} object per line, values as strings.
+     * Rows are rendered from their encoded form where the format allows
+     * (copied for json lines, transcoded for crow and binary StringMap),
+     * without building row objects. Does not consume the removed rows,
+     * and has the same lifetime as removedRows().
+     * @returns number of rows appended.
+     */
+    virtual size_t appendRemovedRowsJson(std::string &dest) = 0;
+
+    /**
+     * @returns approximate heap bytes held, by container capacity.
+     * Walks the containers, so meant for periodic reporting rather than
+     * every data set.
+     */
+    virtual MemoryUsage memoryUsage() = 0;
+
+    /**
+     * Sets when containers are freed. The default policy never frees
+     * them, which suits instances with a steady number of rows.
+     */
+    virtual void setTrimPolicy(const TrimPolicy &policy) = 0;
   };
 
+  /**
+   * Appends the spans recorded by all threads (beginData, addNewResult
+   * batches, endData, removed row decoding, serialize) as Chrome
+   * trace-event JSON, for chrome://tracing or Perfetto. Each thread keeps
+   * its most recent spans in a fixed-size ring buffer.
+   * Spans are only recorded when built with VSQLITE_TRACE, otherwise
+   * the trace is empty.
+   */
+  void TraceWriteChromeJson(std::string &dest);
+
+  /**
+   * Drops the spans recorded so far.
+   */
+  void TraceClear();
+
   std::shared_ptr<ResultsSerializer<DynMap> > CrowResultsSerializerNew();
   std::shared_ptr<ResultsSerializer<DynMap> > JsonResultsSerializerNew();
+  std::shared_ptr<ResultsSerializer<DynMap> > ColumnarResultsSerializerNew();
+  std::shared_ptr<ResultsSerializer<DynMap> > AdaptiveResultsSerializerNew();
   std::shared_ptr<ResultsSerializer<StringMap> > OsqueryJsonResultsSerializerNew();
   std::shared_ptr<ResultsSerializer<StringMap> > JsonStringMapResultsSerializerNew();
+  std::shared_ptr<ResultsSerializer<StringMap> > BinaryStringMapResultsSerializerNew();
 }
@@ -0,0 +1,410 @@
+#include "../include/vsqlite_serialize.h"
+
+#include <algorithm>
+#include <atomic>
+#include <string.h>
+
+#include "varint.h"
+
+/*
+ * Wraps a crow, json lines or columnar serializer, picked per instance
+ * from the options and statistics of past data sets :
+ *
+ *  - json lines when rows are versioned or come from several producers,
+ *    the only format that reuses row encodings and encodes producers
+ *    in parallel.
+ *  - columnar for large tables that barely change. beginData() reads
+ *    only the row hashes rather than indexing every row, and columns
+ *    are decoded for removed rows only.
+ *  - crow otherwise, the fastest for full diffs.
+ *
+ * Snapshot format:
+ *
+ *   "VSA1"
+ *   byte format (ADAPTIVE_FORMAT_*)
+ *   varint numDataSets, varint avgRows, varint lastRows,
+ *   varint churnPermille, byte flags, byte pendingFormat,
+ *   varint pendingDataSets
+ *   snapshot of the wrapped serializer
+ *
+ * The format only changes at beginData(). The historical data is then
+ * diffed by a serializer of its own format, while the rows are also
+ * encoded, with no history, by one of the new format, which writes
+ * the snapshot, and endData() returns true so that it is stored.
+ * Historical data without the tag is read as json lines if it starts
+ * with '{', otherwise as crow.
+ */
+
+using namespace vsqlite_utils;
+
+namespace vsqlite {
+
+  static const char ADAPTIVE_MAGIC[] = { 'V', 'S', 'A', '1' };
+
+  enum AdaptiveFormat {
+    ADAPTIVE_FORMAT_NONE = 0,
+    ADAPTIVE_FORMAT_CROW = 1,
+    ADAPTIVE_FORMAT_JSON = 2,
+    ADAPTIVE_FORMAT_COLUMNAR = 3,
+    ADAPTIVE_NUM_FORMATS = 4
+  };
+
+  enum AdaptiveStatsFlags {
+    STATS_LISTENER = 1,       // last data set had a listener
+    STATS_VERSIONED_ROWS = 2, // last data set used addNewResult(row, rowId, version)
+    STATS_CHURN_MEASURED = 4  // churnPermille has at least one sample
+  };
+
+  // columnar is picked for tables of at least this many rows on average ...
+  static const uint64_t COLUMNAR_MIN_ROWS = 2000;
+
+  // ... where at most this many rows per 1000 are added or removed.
+  // With a listener, removed rows are decoded at every endData(), and
+  // columnar decodes whole columns for them.
+  static const uint32_t COLUMNAR_MAX_CHURN_PERMILLE = 50;
+  static const uint32_t COLUMNAR_MAX_CHURN_PERMILLE_LISTENER = 20;
+
+  // a format picked from statistics must be picked this many data sets
+  // in a row before switching, so that a burst of changes does not
+  // switch back and forth
+  static const uint32_t SWITCH_AFTER_DATA_SETS = 3;
+
+  /*
+   * Per-query statistics, kept in the snapshot so that they survive
+   * the serializer instance.
+   */
+  struct AdaptiveStats {
+    uint64_t numDataSets { 0 };
+    uint64_t avgRows { 0 };
+    uint64_t lastRows { 0 };
+    uint32_t churnPermille { 0 };
+    uint8_t flags { 0 };
+    uint8_t pendingFormat { ADAPTIVE_FORMAT_NONE };
+    uint32_t pendingDataSets { 0 };
+
+    void append(std::string &dest) const {
+      PutVarint(dest, numDataSets);
+      PutVarint(dest, avgRows);
+      PutVarint(dest, lastRows);
+      PutVarint(dest, churnPermille);
+      dest.push_back((char)flags);
+      dest.push_back((char)pendingFormat);
+      PutVarint(dest, pendingDataSets);
+    }
+
+    /**
+     * return true on error, false on success
+     */
+    bool read(ByteReader &r) {
+      numDataSets = r.varint();
+      avgRows = r.varint();
+      lastRows = r.varint();
+      churnPermille = (uint32_t)r.varint();
+      flags = r.byte();
+      pendingFormat = r.byte();
+      pendingDataSets = (uint32_t)r.varint();
+      return r.error || pendingFormat >= ADAPTIVE_NUM_FORMATS;
+    }
+
+    /**
+     * Adds a data set of numRows rows, numAdded of which were not in
+     * the historical data. Rows removed are estimated from the size of
+     * the previous data set. Averages weigh the last data set by half.
+     * @param measured false if numAdded is unknown, e.g. no history.
+     */
+    void addDataSet(uint64_t numRows, uint64_t numAdded, bool measured, uint8_t dataSetFlags) {
+      if (measured) {
+        uint64_t matched = (numAdded < numRows ? numRows - numAdded : 0);
+        uint64_t numRemoved = (lastRows > matched ? lastRows - matched : 0);
+        uint64_t base = std::max(numRows, lastRows);
+        uint32_t churn = (base == 0 ? 0 : (uint32_t)((numAdded + numRemoved) * 1000 / base));
+        churnPermille = ((flags & STATS_CHURN_MEASURED) ? (churnPermille + churn) / 2 : churn);
+        dataSetFlags |= STATS_CHURN_MEASURED;
+      } else {
+        dataSetFlags |= (flags & STATS_CHURN_MEASURED);
+      }
+      avgRows = (numDataSets == 0 ? numRows : (avgRows + numRows) / 2);
+      lastRows = numRows;
+      flags = dataSetFlags;
+      numDataSets++;
+    }
+  };
+
+  /**
+   * @returns the format suited to options and stats. now is set when
+   * the current format cannot be kept, rather than just being slower.
+   */
+  static int ChooseFormat(const AdaptiveStats &stats, int current, const DiffOptions &options, const std::vector<SPFieldDef> &knownColumnIds, bool &now) {
+    // columnar ignores key and volatile columns and long values
+    bool columnarSupported = !knownColumnIds.empty() && options.keyColumnIds.empty() &&
+        options.volatileColumnIds.empty() && options.blobMinSize == 0;
+    now = (current == ADAPTIVE_FORMAT_COLUMNAR && !columnarSupported);
+
+    if (options.numProducers > 1) {
+      now = true;
+      return ADAPTIVE_FORMAT_JSON;
+    }
+    if (stats.flags & STATS_VERSIONED_ROWS) {
+      return ADAPTIVE_FORMAT_JSON;
+    }
+    uint32_t maxChurn = ((stats.flags & STATS_LISTENER) ? COLUMNAR_MAX_CHURN_PERMILLE_LISTENER : COLUMNAR_MAX_CHURN_PERMILLE);
+    if (columnarSupported && (stats.flags & STATS_CHURN_MEASURED) &&
+        stats.avgRows >= COLUMNAR_MIN_ROWS && stats.churnPermille <= maxChurn) {
+      return ADAPTIVE_FORMAT_COLUMNAR;
+    }
+    return ADAPTIVE_FORMAT_CROW;
+  }
+
+class AdaptiveResultsSerializer : public ResultsSerializer<DynMap> {
+public:
+  AdaptiveResultsSerializer() {}
+
+  virtual bool beginData(std::string &historical_data, SPDiffResultsListener listener, std::vector<SPFieldDef> &knownColumnIds, const DiffOptions &options) override {
+    bool parseError = false;
+    int histFormat = ADAPTIVE_FORMAT_NONE;
+    AdaptiveStats histStats;
+    size_t offset = 0;
+    if (!historical_data.empty() && _readTag(historical_data, histFormat, histStats, offset)) {
+      parseError = true;
+      histFormat = ADAPTIVE_FORMAT_NONE;
+      offset = historical_data.size();
+    }
+
+    // a new instance continues from the statistics in the snapshot
+    if (_stats.numDataSets == 0 && histFormat != ADAPTIVE_FORMAT_NONE) {
+      _stats = histStats;
+    }
+
+    _format = _nextFormat(histFormat, offset < historical_data.size(), options, knownColumnIds);
+    int readFormat = (histFormat == ADAPTIVE_FORMAT_NONE ? _format : histFormat);
+
+    // drop serializers of formats no longer used
+
+    for (int i=ADAPTIVE_FORMAT_CROW; i < ADAPTIVE_NUM_FORMATS; i++) {
+      if (i != readFormat && i != _format) {
+        _serializers[i].reset();
+      }
+    }
+
+    _hasHistory = (offset < historical_data.size());
+    _digestOnly = options.digestOnly;
+    _versionedRows = false;
+    _listenerFlag = (listener ? STATS_LISTENER : 0);
+    _numRows = 0;
+    _numAdded = 0;
+
+    _reader = _serializerFor(readFormat);
+    _writer.reset();
+    if (_format != readFormat) {
+      _writer = _serializerFor(_format);
+      _emptyHistory.clear();
+      _writer->beginData(_emptyHistory, nullptr, knownColumnIds, options);
+    }
+
+    if (offset == 0) {
+      return _reader->beginData(historical_data, listener, knownColumnIds, options) || parseError;
+    }
+    _histPayload.assign(historical_data, offset, std::string::npos);
+    bool status = _reader->beginData(_histPayload, listener, knownColumnIds, options);
+    _histPayload.clear();
+    return status || parseError;
+  }
+
+  /**
+   * If row is not in historical_data, then listener.onAdded()
+   * will be called.
+   * @returns true if row was not in historical_data.
+   */
+  virtual bool addNewResult(DynMap &row) override {
+    if (_writer) {
+      _writer->addNewResult(row);
+    }
+    return _countRow(_reader->addNewResult(row));
+  }
+
+  virtual bool addNewResult(DynMap &row, uint64_t rowId, uint64_t version) override {
+    _versionedRows = true;
+    if (_writer) {
+      _writer->addNewResult(row, rowId, version);
+    }
+    return _countRow(_reader->addNewResult(row, rowId, version));
+  }
+
+  virtual bool addNewResult(DynMap &row, size_t producer) override {
+    if (_writer) {
+      _writer->addNewResult(row, producer);
+    }
+    return _countRow(_reader->addNewResult(row, producer));
+  }
+
+  /**
+   * Indicates that all addNewResult() calls have been made for
+   * current data set.
+   * @return true if new results are different from historical_data,
+   * false if unchanged.
+   */
+  virtual bool endData() override {
+    if (_writer) {
+      _writer->endData();
+    }
+    bool hasChanged = _reader->endData();
+
+    // digest only counts no added rows, but an unchanged data set has none
+    bool measured = _hasHistory && (!_digestOnly || !hasChanged);
+    uint8_t flags = (uint8_t)(_listenerFlag | (_versionedRows ? STATS_VERSIONED_ROWS : 0));
+    _stats.addDataSet(_numRows.load(), _numAdded.load(), measured, flags);
+
+    // a new format is only written if the snapshot is stored
+    return hasChanged || _writer != nullptr;
+  }
+
+  /**
+   * Serializes the current data snapshot into dest.
+   */
+  virtual void serialize(std::string &dest) override {
+    dest.append(ADAPTIVE_MAGIC, sizeof(ADAPTIVE_MAGIC));
+    dest.push_back((char)_format);
+    _stats.append(dest);
+    (_writer ? _writer : _reader)->serialize(dest);
+  }
+
+  virtual std::shared_ptr<RowCursor<DynMap> > removedRows() override {
+    return _reader->removedRows();
+  }
+
+  virtual size_t appendRemovedRowsJson(std::string &dest) override {
+    return _reader->appendRemovedRowsJson(dest);
+  }
+
+  virtual MemoryUsage memoryUsage() override {
+    MemoryUsage usage;
+    for (auto &spSerializer : _serializers) {
+      if (!spSerializer) {
+        continue;
+      }
+      MemoryUsage part = spSerializer->memoryUsage();
+      usage.historical += part.historical;
+      usage.current += part.current;
+      usage.other += part.other;
+    }
+    return usage;
+  }
+
+  virtual void setTrimPolicy(const TrimPolicy &policy) override {
+    _trimPolicy = policy;
+    for (auto &spSerializer : _serializers) {
+      if (spSerializer) {
+        spSerializer->setTrimPolicy(policy);
+      }
+    }
+  }
+
+protected:
+
+  bool _countRow(bool wasAdded) {
+    _numRows++;
+    if (wasAdded) {
+      _numAdded++;
+    }
+    return wasAdded;
+  }
+
+  /**
+   * Picks the format of the next snapshot. Without history, switching
+   * costs nothing, so the format suited to the last data sets is used
+   * right away.
+   */
+  int _nextFormat(int histFormat, bool hasHistory, const DiffOptions &options, const std::vector<SPFieldDef> &knownColumnIds) {
+    int current = (histFormat != ADAPTIVE_FORMAT_NONE ? histFormat : ADAPTIVE_FORMAT_CROW);
+    bool now = false;
+    int wanted = ChooseFormat(_stats, current, options, knownColumnIds, now);
+    if (wanted == current) {
+      _stats.pendingFormat = ADAPTIVE_FORMAT_NONE;
+      _stats.pendingDataSets = 0;
+      return current;
+    }
+    if (!now && hasHistory) {
+      if (_stats.pendingFormat != wanted) {
+        _stats.pendingFormat = (uint8_t)wanted;
+        _stats.pendingDataSets = 0;
+      }
+      if (++_stats.pendingDataSets < SWITCH_AFTER_DATA_SETS) {
+        return current;
+      }
+    }
+    _stats.pendingFormat = ADAPTIVE_FORMAT_NONE;
+    _stats.pendingDataSets = 0;
+    return wanted;
+  }
+
+  std::shared_ptr<ResultsSerializer<DynMap> > &_serializerFor(int format) {
+    auto &spSerializer = _serializers[format];
+    if (!spSerializer) {
+      switch (format) {
+        case ADAPTIVE_FORMAT_JSON:
+          spSerializer = JsonResultsSerializerNew();
+          break;
+        case ADAPTIVE_FORMAT_COLUMNAR:
+          spSerializer = ColumnarResultsSerializerNew();
+          break;
+        default:
+          spSerializer = CrowResultsSerializerNew();
+          break;
+      }
+      spSerializer->setTrimPolicy(_trimPolicy);
+    }
+    return spSerializer;
+  }
+
+  /**
+   * Reads the tag at the start of data. Data without a tag is guessed
+   * as json lines or crow, and offset is left at 0.
+   * return true on error, false on success
+   */
+  bool _readTag(const std::string &data, int &format, AdaptiveStats &stats, size_t &offset) {
+    offset = 0;
+    if (data.size() < sizeof(ADAPTIVE_MAGIC) || 0 != memcmp(data.data(), ADAPTIVE_MAGIC, sizeof(ADAPTIVE_MAGIC))) {
+      format = (data[0] == '{' ? ADAPTIVE_FORMAT_JSON : ADAPTIVE_FORMAT_CROW);
+      return false;
+    }
+    const uint8_t *start = (const uint8_t *)data.data();
+    ByteReader r(start + sizeof(ADAPTIVE_MAGIC), data.size() - sizeof(ADAPTIVE_MAGIC));
+    format = r.byte();
+    if (format <= ADAPTIVE_FORMAT_NONE || format >= ADAPTIVE_NUM_FORMATS || stats.read(r)) {
+      return true;
+    }
+    offset = (size_t)(r.p - start);
+    return false;
+  }
+
+  // indexed by AdaptiveFormat, created when first needed
+  std::shared_ptr<ResultsSerializer<DynMap> > _serializers[ADAPTIVE_NUM_FORMATS];
+
+  // diffs against the historical data, in its format
+  std::shared_ptr<ResultsSerializer<DynMap> > _reader;
+
+  // when switching format, encodes the rows in the new one
+  std::shared_ptr<ResultsSerializer<DynMap> > _writer;
+
+  int _format { ADAPTIVE_FORMAT_NONE };
+  AdaptiveStats _stats;
+  TrimPolicy _trimPolicy;
+
+  // historical data past the tag, and the history of _writer
+  std::string _histPayload;
+  std::string _emptyHistory;
+
+  // current data set
+  bool _hasHistory { false };
+  bool _digestOnly { false };
+  bool _versionedRows { false };
+  uint8_t _listenerFlag { 0 };
+  std::atomic<uint64_t> _numRows { 0 };
+  std::atomic<uint64_t> _numAdded { 0 };
+};
+
+  std::shared_ptr<ResultsSerializer<DynMap> > AdaptiveResultsSerializerNew() {
+    return std::make_shared<AdaptiveResultsSerializer>();
+  }
+
+} // namespace vsqlite
@@ -0,0 +1,480 @@
+#include "../include/vsqlite_serialize.h"
+
+#include <assert.h>
+#include <mutex>
+#include <string.h>
+#include <unordered_map>
+
+#include "encoded_row_counts.h"
+#include "fingerprint.h"
+#include "kernels.h"
+#include "memory_usage.h"
+#include "row_keys.h"
+#include "trace.h"
+#include "varint.h"
+
+/*
+ * Binary snapshot format for StringMap rows:
+ *
+ *   "VSM1"
+ *   varint numKeys, numKeys x (varint len, bytes)
+ *   rows until end of data : varint rowLen, row
+ *
+ * Row:
+ *   varint numFields, numFields x (varint key index, varint len, value bytes)
+ *
+ * The key dictionary of the historical snapshot is kept as the prefix
+ * of the current one, so an unchanged row encodes to the same bytes,
+ * and rows are compared by their encoding, like the crow serializer.
+ */
+
+using namespace vsqlite_utils;
+
+namespace vsqlite {
+
+  static const char STRINGMAP_MAGIC[] = { 'V', 'S', 'M', '1' };
+
+class BinaryStringMapResultsSerializer : public ResultsSerializer<StringMap>, public std::enable_shared_from_this<BinaryStringMapResultsSerializer> {
+public:
+  virtual ~BinaryStringMapResultsSerializer() {}
+
+  using ResultsSerializer<StringMap>::beginData;
+
+  /**
+   * Initialize with historical data and optional listener.
+   */
+  virtual bool beginData(std::string &historical_data, SPDiffResultsListenerStringMap listener, std::vector<SPFieldDef> &knownColumnIds, const DiffOptions &options) override {
+    VSQLITE_TRACE_LABEL(_trace, options.traceLabel);
+    VSQLITE_TRACE_SPAN(_trace, "beginData");
+    if (_trimTracker.beginDataSet(_numRows)) {
+      _releaseMemory();
+    }
+    _numRows = 0;
+    _addCount = 0;
+    _removeCount = 0;
+    _changeCount = 0;
+    _listener = listener;
+    _numProducers = options.numProducers;
+    _histEncodedRows.clear();
+    _keys.clear();
+    _keyIndex.clear();
+    _body.clear();
+    _keyColIds = options.keyColumnIds;
+    _volatileColIds = options.volatileColumnIds;
+    _histKeyIndex.clear();
+    _histIdentityIndex.clear();
+    _digestOnly = options.digestOnly && _volatileColIds.empty();
+    _digest.clear();
+    _histDigest.clear();
+
+    // only used to name changed columns
+    _colIds = knownColumnIds;
+
+    if (!historical_data.empty()) {
+      if (_extractEncodedRows(historical_data)) {
+        _histEncodedRows.clear();
+        _histDigest.clear();
+        _keys.clear();
+        _keyIndex.clear();
+        return true;
+      }
+
+      if (!_digestOnly && (!_keyColIds.empty() || !_volatileColIds.empty())) {
+        _indexHistoricalRows();
+      }
+    }
+
+    return false;
+  }
+
+  /**
+   * If row is not in historical_data, then listener.onAdded()
+   * will be called.
+   * @returns true if row was not in historical_data.
+   */
+  virtual bool addNewResult(StringMap &row) override {
+    VSQLITE_TRACE_ROW(_trace);
+    _numRows++;
+    bool wasFoundInHistoricalResults = false;
+
+    _encodeRow(row, _rowBuf);
+
+    // append to running encoding
+    PutVarint(_body, _rowBuf.size());
+    _body.append(_rowBuf);
+
+    if (_digestOnly) {
+      _digest.add(FingerprintBytes(_rowBuf));
+      return false;
+    }
+
+    // lookup, by identity if some columns are volatile
+
+    if (_volatileColIds.empty()) {
+      wasFoundInHistoricalResults = _histEncodedRows.consume(_rowBuf);
+    } else {
+      wasFoundInHistoricalResults = _lookupIdentity(row);
+    }
+
+    // key columns : same key as a historical row means changed, not added
+
+    if (!_histKeyIndex.empty()) {
+      if (wasFoundInHistoricalResults) {
+        _forgetKey(row, _rowBuf);
+      } else if (_lookupChangedRow(row)) {
+        return true;
+      }
+    }
+
+    if (!wasFoundInHistoricalResults) {
+      _addCount++;
+      if (_listener) {
+        _listener->onAdded(row);
+      }
+    }
+    return !wasFoundInHistoricalResults;
+  }
+
+  /**
+   * Rows from several producers are added one at a time.
+   */
+  virtual bool addNewResult(StringMap &row, size_t producer) override {
+    if (producer >= _numProducers) {
+      assert(false);
+      return false;
+    }
+    std::lock_guard<std::mutex> lock(_producerMutex);
+    return addNewResult(row);
+  }
+
+  /**
+   * Indicates that all addNewResult() calls have been made for
+   * current data set.
+   * @return true if new results are different from historical_data,
+   * false if unchanged.
+   */
+  virtual bool endData() override {
+    VSQLITE_TRACE_END_ROWS(_trace);
+    VSQLITE_TRACE_SPAN(_trace, "endData");
+    if (_digestOnly) {
+      return _digest != _histDigest;
+    }
+
+    // without a listener, removed rows are left for removedRows()
+    bool hasRemovedRows = !_histEncodedRows.empty();
+
+    if (_listener && hasRemovedRows) {
+      for (auto &it : _histEncodedRows) {
+        StringMap row;
+        if (_decodeRow(it.first, row)) {
+          // fail
+        } else {
+          for (uint32_t i=0; i < it.second; i++) {
+            _listener->onRemoved(row);
+            _removeCount++;
+          }
+        }
+      }
+      _histEncodedRows.clear();
+    }
+    return !(_addCount == 0 && _removeCount == 0 && _changeCount == 0 && !hasRemovedRows);
+  }
+
+  /**
+   * Serializes the current data snapshot into dest.
+   */
+  virtual void serialize(std::string &dest) override {
+    VSQLITE_TRACE_SPAN(_trace, "serialize");
+    dest.append(STRINGMAP_MAGIC, sizeof(STRINGMAP_MAGIC));
+    PutVarint(dest, _keys.size());
+    for (auto &key : _keys) {
+      PutBytes(dest, key);
+    }
+    dest.append(_body);
+  }
+
+  virtual std::shared_ptr<RowCursor<StringMap> > removedRows() override {
+    // the cursor holds the serializer, whose rows it walks
+    auto self = shared_from_this();
+    return std::make_shared<EncodedRowsCursor<StringMap> >(_histEncodedRows, [self](const std::string &encRow, StringMap &row) {
+      return self->_decodeRow(encRow, row);
+    });
+  }
+
+  /*
+   * Frees containers sized by the largest data set, called by the trim
+   * policy before they are filled again.
+   */
+  void _releaseMemory() {
+    ReleaseMemory(_histEncodedRows);
+    ReleaseMemory(_histKeyIndex);
+    ReleaseMemory(_histIdentityIndex);
+    ReleaseMemory(_keys);
+    ReleaseMemory(_keyIndex);
+    ReleaseMemory(_body);
+  }
+
+  /**
+   * Transcodes the removed rows to JSON lines from their encoding,
+   * without building StringMap rows.
+   */
+  virtual size_t appendRemovedRowsJson(std::string &dest) override {
+    size_t count = 0;
+    std::string line;
+    for (auto &it : _histEncodedRows) {
+      if (_transcodeRow(it.first, line)) {
+        continue;
+      }
+      for (uint32_t i=0; i < it.second; i++) {
+        dest.append(line);
+        dest += '\n';
+        count++;
+      }
+    }
+    return count;
+  }
+
+  virtual MemoryUsage memoryUsage() override {
+    MemoryUsage usage;
+    usage.historical = _histEncodedRows.memoryBytes() + MemBytes(_histKeyIndex) + MemBytes(_histIdentityIndex);
+    usage.current = MemBytes(_body) + MemBytes(_keys) + MemBytes(_keyIndex);
+    usage.other = MemBytes(_rowBuf);
+    return usage;
+  }
+
+  virtual void setTrimPolicy(const TrimPolicy &policy) override {
+    _trimTracker.setPolicy(policy);
+  }
+
+protected:
+
+  uint32_t _getKeyIndex(const std::string &key) {
+    auto fit = _keyIndex.find(key);
+    if (fit != _keyIndex.end()) {
+      return fit->second;
+    }
+    uint32_t index = (uint32_t)_keys.size();
+    _keys.push_back(key);
+    _keyIndex[key] = index;
+    return index;
+  }
+
+  void _encodeRow(StringMap &row, std::string &dest) {
+    dest.clear();
+    PutVarint(dest, row.size());
+    for (auto &it : row) {
+      PutVarint(dest, _getKeyIndex(it.first));
+      PutBytes(dest, it.second);
+    }
+  }
+
+  /*
+   * return true on error, false on success
+   */
+  bool _decodeRow(const std::string &encRow, StringMap &row) {
+    ByteReader r((const uint8_t *)encRow.data(), encRow.size());
+    size_t numFields = (size_t)r.varint();
+    std::string value;
+    for (size_t i=0; i < numFields && !r.error; i++) {
+      uint64_t keyIndex = r.varint();
+      if (!r.bytes(value) || keyIndex >= _keys.size()) {
+        return true;
+      }
+      row[_keys[(size_t)keyIndex]] = value;
+    }
+    return r.error;
+  }
+
+  /*
+   * Renders encRow as a JSON object. Fields were encoded in StringMap
+   * order, so the output matches the json lines StringMap encoding.
+   * return true on error, false on success
+   */
+  bool _transcodeRow(const std::string &encRow, std::string &dest) {
+    ByteReader r((const uint8_t *)encRow.data(), encRow.size());
+    size_t numFields = (size_t)r.varint();
+    dest = "{";
+    for (size_t i=0; i < numFields && !r.error; i++) {
+      uint64_t keyIndex = r.varint();
+      size_t len = (size_t)r.varint();
+      const uint8_t *p = r.skip(len);
+      if (p == nullptr || keyIndex >= _keys.size()) {
+        return true;
+      }
+      if (i > 0) { dest += ','; }
+      AppendJsonString(dest, _keys[(size_t)keyIndex]);
+      dest += ':';
+      AppendJsonString(dest, (const char *)p, len);
+    }
+    dest += '}';
+    return r.error;
+  }
+
+  /*
+   * Reads the key dictionary and splits rows into _histEncodedRows,
+   * or only hashes them into _histDigest in digest only mode.
+   * return true on error, false on success
+   */
+  bool _extractEncodedRows(const std::string &historical_data) {
+    ByteReader r((const uint8_t *)historical_data.data(), historical_data.size());
+    const uint8_t *magic = r.skip(sizeof(STRINGMAP_MAGIC));
+    if (magic == nullptr || 0 != memcmp(magic, STRINGMAP_MAGIC, sizeof(STRINGMAP_MAGIC))) {
+      return true;
+    }
+
+    size_t numKeys = (size_t)r.varint();
+    std::string key;
+    for (size_t i=0; i < numKeys && !r.error; i++) {
+      if (!r.bytes(key)) { break; }
+      _getKeyIndex(key);
+    }
+
+    while (!r.error && !r.atEnd()) {
+      size_t rowLen = (size_t)r.varint();
+      const uint8_t *p = r.skip(rowLen);
+      if (p == nullptr) { break; }
+      if (_digestOnly) {
+        _histDigest.add(FingerprintBytes((const char *)p, rowLen));
+      } else {
+        _histEncodedRows.insert((const char *)p, rowLen);
+      }
+    }
+    return r.error;
+  }
+
+  /*
+   * Decodes all historical rows and indexes them by key columns
+   * and/or identity.
+   */
+  void _indexHistoricalRows() {
+    std::string key;
+    for (auto &it : _histEncodedRows) {
+      const std::string &encRow = it.first;
+      StringMap row;
+      if (_decodeRow(encRow, row)) {
+        continue;
+      }
+      if (!_keyColIds.empty()) {
+        MakeRowKey(row, _keyColIds, key);
+        _histKeyIndex[key] = encRow;
+      }
+      if (!_volatileColIds.empty()) {
+        MakeRowIdentity(row, _volatileColIds, key);
+        for (uint32_t i=0; i < it.second; i++) {
+          _histIdentityIndex.insert(std::make_pair(key, encRow));
+        }
+      }
+    }
+  }
+
+  /*
+   * Finds a remaining historical row with the same identity as row,
+   * ignoring volatile columns, and consumes it.
+   * @returns true if found.
+   */
+  bool _lookupIdentity(StringMap &row) {
+    if (_histIdentityIndex.empty()) { return false; }
+
+    std::string identity;
+    MakeRowIdentity(row, _volatileColIds, identity);
+    auto range = _histIdentityIndex.equal_range(identity);
+    for (auto it = range.first; it != range.second; ) {
+      bool consumed = _histEncodedRows.consume(it->second);
+      it = _histIdentityIndex.erase(it);
+      if (consumed) {
+        return true;
+      }
+    }
+    return false;
+  }
+
+  /*
+   * row matched a historical row exactly, so once no copies of it
+   * remain, its key is no longer available for change detection.
+   */
+  void _forgetKey(StringMap &row, const std::string &encRow) {
+    std::string key;
+    MakeRowKey(row, _keyColIds, key);
+    auto fit = _histKeyIndex.find(key);
+    if (fit != _histKeyIndex.end() && fit->second == encRow && !_histEncodedRows.contains(encRow)) {
+      _histKeyIndex.erase(fit);
+    }
+  }
+
+  /*
+   * If a remaining historical row has the same key as row, notify
+   * listener of the change and consume the historical row.
+   * @returns true if row was reported as changed.
+   */
+  bool _lookupChangedRow(StringMap &row) {
+    std::string key;
+    MakeRowKey(row, _keyColIds, key);
+    auto fit = _histKeyIndex.find(key);
+    if (fit == _histKeyIndex.end()) {
+      return false;
+    }
+    std::string encRow = fit->second;
+    bool consumed = _histEncodedRows.consume(encRow);
+    if (!_histEncodedRows.contains(encRow)) {
+      _histKeyIndex.erase(fit);
+    }
+    if (!consumed) {
+      return false;
+    }
+
+    _changeCount++;
+    if (_listener) {
+      StringMap oldRow;
+      _decodeRow(encRow, oldRow);
+      std::vector<SPFieldDef> changedColumns;
+      ChangedColumns(oldRow, row, _colIds, changedColumns);
+      _listener->onChanged(oldRow, row, changedColumns);
+    }
+    return true;
+  }
+
+  // members
+  uint32_t _addCount { 0 };
+  uint32_t _removeCount { 0 };
+  uint32_t _changeCount { 0 };
+  SPDiffResultsListenerStringMap _listener;
+  std::vector<SPFieldDef> _colIds;
+
+  // key dictionary, historical keys first
+  std::vector<std::string> _keys;
+  std::unordered_map<std::string, uint32_t> _keyIndex;
+
+  // encoded rows of current data set, and scratch for one row
+  std::string _body;
+  std::string _rowBuf;
+
+  // rows of the current data set, and sizes of past ones for the trim policy
+  size_t _numRows { 0 };
+  TrimTracker _trimTracker;
+
+  EncodedRowCounts _histEncodedRows;
+
+  // key column and volatile column modes : key or identity -> historical row
+  std::vector<SPFieldDef> _keyColIds;
+  std::vector<SPFieldDef> _volatileColIds;
+  std::unordered_map<std::string, std::string> _histKeyIndex;
+  std::unordered_multimap<std::string, std::string> _histIdentityIndex;
+
+  // digest only mode : hashes of encoded rows
+  bool _digestOnly { false };
+  RowSetDigest _digest;
+  RowSetDigest _histDigest;
+
+  // serializes addNewResult(row, producer) calls
+  size_t _numProducers { 1 };
+  std::mutex _producerMutex;
+
+  // phase spans, only built with VSQLITE_TRACE
+  VSQLITE_TRACE_CONTEXT(_trace, "binary_stringmap");
+};
+
+  std::shared_ptr<ResultsSerializer<StringMap> > BinaryStringMapResultsSerializerNew() {
+    return std::make_shared<BinaryStringMapResultsSerializer>();
+  }
+
+} // namespace vsqlite
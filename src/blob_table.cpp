@@ -0,0 +1,184 @@
+#include "blob_table.h"
+
+#include <algorithm>
+#include <rapidjson/document.h>
+#include <string.h>
+
+#include "fingerprint.h"
+#include "kernels.h"
+#include "varint.h"
+
+namespace rj = rapidjson;
+
+using namespace vsqlite_utils;
+
+namespace vsqlite {
+
+  static const char BLOB_MAGIC[] = { 'V', 'S', 'B', '1' };
+  static const char BLOB_LINE_PREFIX[] = "{\"#blobs\":{";
+
+  static void appendHexId(std::string &dest, uint64_t id) {
+    uint8_t bytes[8];
+    for (int i=0; i < 8; i++) {
+      bytes[i] = (uint8_t)(id >> (8 * i));
+    }
+    size_t pos = dest.size();
+    dest.resize(pos + 16);
+    HexEncode(bytes, sizeof(bytes), &dest[pos]);
+  }
+
+  /*
+   * return true on error, false on success
+   */
+  static bool parseHexId(const char *p, size_t len, uint64_t &id) {
+    uint8_t bytes[8];
+    if (len != 16 || HexDecode(p, len, bytes)) {
+      return true;
+    }
+    id = 0;
+    for (int i=0; i < 8; i++) {
+      id |= (uint64_t)bytes[i] << (8 * i);
+    }
+    return false;
+  }
+
+  const size_t BlobTable::REF_SIZE;
+
+  bool BlobTable::encode(const char *p, size_t len, std::string &dest) {
+    if (_minSize == 0) {
+      return false;
+    }
+    if (len < _minSize) {
+      if (len == 0 || p[0] != '\0') {
+        return false;
+      }
+      dest.assign(1, '\0');
+      dest.append(p, len);
+      return true;
+    }
+
+    // on a hash collision, probe the next ids until the same content
+    // or a free id. Readers only look ids up, they never probe.
+
+    uint64_t id = FingerprintBytes(p, len);
+    while (true) {
+      auto fit = _blobs.find(id);
+      if (fit == _blobs.end()) {
+        _blobs[id].assign(p, len);
+        break;
+      }
+      if (fit->second.size() == len && 0 == memcmp(fit->second.data(), p, len)) {
+        break;
+      }
+      id++;
+    }
+    dest.assign(1, '\0');
+    appendHexId(dest, id);
+    return true;
+  }
+
+  bool BlobTable::resolve(const char *&p, size_t &len) const {
+    if (!active() || len < 2 || p[0] != '\0') {
+      return false;
+    }
+    if (p[1] == '\0') {
+      p++;
+      len--;
+      return false;
+    }
+    uint64_t id;
+    if (len != REF_SIZE || parseHexId(p + 1, len - 1, id)) {
+      return false;
+    }
+    auto fit = _blobs.find(id);
+    if (fit == _blobs.end()) {
+      return false;
+    }
+    p = fit->second.data();
+    len = fit->second.size();
+    return true;
+  }
+
+  std::vector<uint64_t> BlobTable::sortedIds() const {
+    std::vector<uint64_t> ids;
+    ids.reserve(_blobs.size());
+    for (auto &it : _blobs) {
+      ids.push_back(it.first);
+    }
+    std::sort(ids.begin(), ids.end());
+    return ids;
+  }
+
+  void BlobTable::appendJsonLine(std::string &dest) const {
+    dest.append(BLOB_LINE_PREFIX);
+    bool first = true;
+    std::string key;
+    for (uint64_t id : sortedIds()) {
+      if (!first) { dest += ','; }
+      first = false;
+      key.clear();
+      appendHexId(key, id);
+      AppendJsonString(dest, key);
+      dest += ':';
+      AppendJsonString(dest, _blobs.find(id)->second);
+    }
+    dest.append("}}\n");
+  }
+
+  bool BlobTable::IsJsonLine(const char *p, size_t len) {
+    const size_t prefixLen = sizeof(BLOB_LINE_PREFIX) - 1;
+    return len >= prefixLen && 0 == memcmp(p, BLOB_LINE_PREFIX, prefixLen);
+  }
+
+  bool BlobTable::parseJsonLine(const std::string &line) {
+    rj::Document doc;
+    if (doc.Parse(line.c_str()).HasParseError() || !doc.IsObject()) {
+      return true;
+    }
+    for (const auto& section : doc.GetObject()) {
+      if (!section.value.IsObject()) {
+        return true;
+      }
+      for (const auto& i : section.value.GetObject()) {
+        uint64_t id;
+        if (!i.value.IsString() || parseHexId(i.name.GetString(), i.name.GetStringLength(), id)) {
+          return true;
+        }
+        _blobs[id].assign(i.value.GetString(), i.value.GetStringLength());
+      }
+    }
+    _hasSection = true;
+    return false;
+  }
+
+  void BlobTable::appendBinary(std::string &dest) const {
+    dest.append(BLOB_MAGIC, sizeof(BLOB_MAGIC));
+    PutVarint(dest, _blobs.size());
+    for (uint64_t id : sortedIds()) {
+      PutFixed64(dest, id);
+      PutBytes(dest, _blobs.find(id)->second);
+    }
+  }
+
+  bool BlobTable::readBinary(const std::string &data, size_t &offset) {
+    if (data.size() < offset + sizeof(BLOB_MAGIC) || 0 != memcmp(data.data() + offset, BLOB_MAGIC, sizeof(BLOB_MAGIC))) {
+      return false;
+    }
+
+    ByteReader r((const uint8_t *)data.data() + offset + sizeof(BLOB_MAGIC), data.size() - offset - sizeof(BLOB_MAGIC));
+    size_t count = (size_t)r.varint();
+    std::string value;
+    for (size_t i=0; i < count && !r.error; i++) {
+      uint64_t id = r.fixed64();
+      if (!r.bytes(value)) { break; }
+      _blobs[id].swap(value);
+    }
+    if (r.error) {
+      return true;
+    }
+    offset = (size_t)(r.p - (const uint8_t *)data.data());
+    _hasSection = true;
+    return false;
+  }
+
+} // namespace vsqlite
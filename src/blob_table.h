@@ -0,0 +1,110 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include "memory_usage.h"
+
+/*
+ * Out-of-line storage for long values (DiffOptions::blobMinSize).
+ * A value at least minSize bytes long is stored once per snapshot,
+ * keyed by the hash of its content, and rows hold a reference in its
+ * place : a NUL byte followed by the 16 hex digits of the id. Values
+ * with the same hash but other content take the next free id, in the
+ * order they are stored, so which one keeps the hash as id depends on
+ * row order. Such rows then compare as changed once when the order
+ * changes. Sections list the blobs sorted by id.
+ * While blobs are active, a value starting with a NUL byte that is not
+ * stored is escaped with one more NUL, so it never reads as a reference.
+ */
+namespace vsqlite {
+
+  class BlobTable {
+  public:
+    static const size_t REF_SIZE = 17;
+
+    /**
+     * 0 disables storing values, blobs read from a snapshot still resolve.
+     */
+    void setMinSize(size_t minSize) { _minSize = minSize; }
+    size_t minSize() const { return _minSize; }
+
+    /**
+     * @returns true if values are encoded : minSize is set, or a
+     * section was read. A section is written whenever minSize is set,
+     * even without blobs, so readers know values are escaped.
+     */
+    bool active() const { return _minSize != 0 || _hasSection; }
+
+    /**
+     * If value is at least minSize bytes long, stores it and sets dest
+     * to its reference. If it starts with a NUL byte, sets dest to it
+     * escaped. Does nothing while minSize is 0.
+     * @returns true if dest replaces value, false if value is kept.
+     */
+    bool encode(const char *p, size_t len, std::string &dest);
+    bool encode(const std::string &value, std::string &dest) { return encode(value.data(), value.size(), dest); }
+
+    /**
+     * Reverses encode() on a value read along with this table : a
+     * reference is replaced by its blob, and an escaped value loses
+     * its escape. Values are kept as is while the table is not active.
+     * @returns true if p now points to a blob of this table.
+     */
+    bool resolve(const char *&p, size_t &len) const;
+
+    void clear() { _blobs.clear(); _hasSection = false; }
+    bool empty() const { return _blobs.empty(); }
+    size_t size() const { return _blobs.size(); }
+
+    size_t memoryBytes() const { return MemBytes(_blobs); }
+
+    /**
+     * Same as clear(), also freeing the hash table.
+     */
+    void release() { ReleaseMemory(_blobs); _hasSection = false; }
+
+    /**
+     * Appends the JSON lines section : {"#blobs":{"<hash>":"<value>",...}}
+     */
+    void appendJsonLine(std::string &dest) const;
+
+    /**
+     * @returns true if line is a JSON lines blob section.
+     */
+    static bool IsJsonLine(const char *p, size_t len);
+
+    /**
+     * Adds the blobs of a JSON lines section.
+     * return true on error, false on success
+     */
+    bool parseJsonLine(const std::string &line);
+
+    /**
+     * Appends the binary section : "VSB1", varint count, count x (fixed64 hash, varint len, bytes)
+     */
+    void appendBinary(std::string &dest) const;
+
+    /**
+     * If data has a binary section at offset, adds its blobs and moves
+     * offset to the first byte after it.
+     * return true on error, false on success
+     */
+    bool readBinary(const std::string &data, size_t &offset);
+
+  private:
+    /*
+     * @returns ids of the blobs in increasing order, so that sections do
+     * not depend on the hash table layout.
+     */
+    std::vector<uint64_t> sortedIds() const;
+
+    size_t _minSize { 0 };
+    bool _hasSection { false };
+    std::unordered_map<uint64_t, std::string> _blobs;
+  };
+
+} // namespace vsqlite
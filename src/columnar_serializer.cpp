@@ -0,0 +1,892 @@
+#include "../include/vsqlite_serialize.h"
+
+#include <assert.h>
+#include <errno.h>
+#include <mutex>
+#include <stdlib.h>
+#include <string.h>
+#include <unordered_map>
+
+#include "fingerprint.h"
+#include "kernels.h"
+#include "memory_usage.h"
+#include "trace.h"
+#include "varint.h"
+
+/*
+ * Column-oriented snapshot format:
+ *
+ *   "VSC1"
+ *   varint numCols, then per column : varint nameLen, name, varint typeId
+ *   varint numRows
+ *   numRows x fixed64 row hash
+ *   per column : varint blockLen, block
+ *
+ * Column block:
+ *   varint numRuns, then run lengths alternating valid / not set,
+ *     starting with a (possibly empty) run of valid values
+ *   byte kind
+ *   kind INT    : varint numRuns, then per run : varint count, zigzag varint delta
+ *                 (each value is the previous valid value + delta)
+ *   kind STRING : varint dictSize, dictSize x (varint len, bytes)
+ *                 varint numRuns, then per run : varint count, varint dict index
+ *
+ * Only the row hashes are read in beginData(). Columns are streamed in
+ * endData(), to compare rows matched by hash value by value, and to
+ * decode removed rows.
+ */
+
+using namespace vsqlite_utils;
+
+namespace vsqlite {
+
+  static const char COLUMNAR_MAGIC[] = { 'V', 'S', 'C', '1' };
+
+  enum ColumnKind { COLUMN_KIND_INT = 0, COLUMN_KIND_STRING = 1 };
+
+  static bool isIntType(int typeId) {
+    return typeId == TINT8 || typeId == TUINT8 || typeId == TINT32 || typeId == TUINT32 ||
+        typeId == TINT64 || typeId == TUINT64;
+  }
+
+  /*
+   * Values of int columns are decoded with the type of their column.
+   */
+  static DynVal intValueOfType(int typeId, int64_t value) {
+    switch (typeId) {
+      case TINT8: return DynVal((int8_t)value);
+      case TUINT8: return DynVal((uint8_t)value);
+      case TINT32: return DynVal((int32_t)value);
+      case TUINT32: return DynVal((uint32_t)value);
+      case TUINT64: return DynVal((uint64_t)value);
+      default: return DynVal((int64_t)value);
+    }
+  }
+
+  /*
+   * 64-bit FNV-1a with a final avalanche, over the values of a row
+   * in column order.
+   */
+  struct RowHasher {
+    void add(const char *p, size_t len) {
+      for (size_t i=0; i < len; i++) {
+        _h ^= (uint8_t)p[i];
+        _h *= 0x100000001b3ULL;
+      }
+    }
+
+    void addNull() {
+      const char marker = 0;
+      add(&marker, 1);
+    }
+
+    void addValue(const std::string &value) {
+      char prefix[11];
+      size_t n = 0;
+      prefix[n++] = 1;
+      uint64_t len = value.size();
+      while (len >= 0x80) { prefix[n++] = (char)((len & 0x7F) | 0x80); len >>= 7; }
+      prefix[n++] = (char)len;
+      add(prefix, n);
+      add(value.data(), value.size());
+    }
+
+    uint64_t finish() const {
+      uint64_t h = _h;
+      h ^= h >> 33;
+      h *= 0xff51afd7ed558ccdULL;
+      h ^= h >> 33;
+      h *= 0xc4ceb9fe1a85ec53ULL;
+      h ^= h >> 33;
+      return h;
+    }
+
+    uint64_t _h { 0xcbf29ce484222325ULL };
+  };
+
+  /*
+   * Values of one column for the current data set.
+   */
+  struct ColumnBuilder {
+    SPFieldDef id;
+    int kind { COLUMN_KIND_STRING };
+    std::vector<uint8_t> valid;
+    std::vector<int64_t> ints;
+    std::unordered_map<std::string, uint32_t> dict;
+    std::vector<const std::string *> dictEntries; // keys of dict, in index order
+    std::vector<uint32_t> codes;
+
+    size_t memoryBytes() const {
+      return MemBytes(valid) + MemBytes(ints) + MemBytes(dict) + MemBytes(dictEntries) + MemBytes(codes);
+    }
+
+    void addString(const std::string &value) {
+      auto fit = dict.find(value);
+      if (fit == dict.end()) {
+        fit = dict.insert(std::make_pair(value, (uint32_t)dictEntries.size())).first;
+        dictEntries.push_back(&fit->first);
+      }
+      codes.push_back(fit->second);
+    }
+
+    /*
+     * A value of an int column did not parse as an integer.
+     * Store the whole column as strings instead.
+     */
+    void demoteToString() {
+      kind = COLUMN_KIND_STRING;
+      for (auto value : ints) {
+        addString(std::to_string(value));
+      }
+      ints.clear();
+    }
+  };
+
+  /*
+   * @returns true if value is the canonical decimal form of an int64 :
+   * digits with an optional '-', no leading zeros, whitespace or '+',
+   * so that std::to_string(dest) gives value back.
+   */
+  static bool parseInt(const std::string &value, int64_t &dest) {
+    size_t start = (!value.empty() && value[0] == '-') ? 1 : 0;
+    size_t numDigits = value.size() - start;
+    if (numDigits == 0 || numDigits > 19) { return false; }
+    if (value[start] == '0' && (numDigits > 1 || start == 1)) { return false; }
+    for (size_t i=start; i < value.size(); i++) {
+      if (value[i] < '0' || value[i] > '9') { return false; }
+    }
+    errno = 0;
+    dest = (int64_t)strtoll(value.c_str(), nullptr, 10);
+    return errno == 0;
+  }
+
+  /*
+   * Streams one column's values for consecutive rows.
+   */
+  class ColumnReader {
+  public:
+    ColumnReader(const uint8_t *data, size_t len) : _r(data, len) {
+      size_t numValidityRuns = (size_t)_r.varint();
+      for (size_t i=0; i < numValidityRuns && !_r.error; i++) {
+        _validityRuns.push_back(_r.varint());
+      }
+      _kind = _r.byte();
+      if (_kind == COLUMN_KIND_STRING) {
+        size_t dictSize = (size_t)_r.varint();
+        for (size_t i=0; i < dictSize && !_r.error; i++) {
+          _dict.push_back(std::string());
+          _r.bytes(_dict.back());
+        }
+      }
+      _numValueRuns = (size_t)_r.varint();
+    }
+
+    bool error() const { return _r.error; }
+
+    int kind() const { return _kind; }
+
+    /**
+     * Advances to the next row.
+     * @returns false if the row's value is not set.
+     */
+    bool next() {
+      while (_validityLeft == 0) {
+        if (_validityIdx >= _validityRuns.size()) {
+          _r.error = true;
+          return false;
+        }
+        _validityLeft = _validityRuns[_validityIdx];
+        _isValidRun = (_validityIdx % 2) == 0;
+        _validityIdx++;
+      }
+      _validityLeft--;
+      if (!_isValidRun) {
+        return false;
+      }
+
+      if (_valueLeft == 0) {
+        if (_valueRunsRead >= _numValueRuns) {
+          _r.error = true;
+          return false;
+        }
+        _valueLeft = _r.varint();
+        _valueArg = _r.varint();
+        _valueRunsRead++;
+      }
+      _valueLeft--;
+      if (_kind == COLUMN_KIND_INT) {
+        _int = (int64_t)((uint64_t)_int + (uint64_t)ZigZagDecode(_valueArg));
+      }
+      return true;
+    }
+
+    int64_t intValue() const { return _int; }
+
+    const std::string &stringValue() {
+      static const std::string empty;
+      if (_valueArg >= _dict.size()) {
+        _r.error = true;
+        return empty;
+      }
+      return _dict[(size_t)_valueArg];
+    }
+
+  private:
+    ByteReader _r;
+    int _kind { COLUMN_KIND_STRING };
+    std::vector<uint64_t> _validityRuns;
+    size_t _validityIdx { 0 };
+    uint64_t _validityLeft { 0 };
+    bool _isValidRun { true };
+    std::vector<std::string> _dict;
+    size_t _numValueRuns { 0 };
+    size_t _valueRunsRead { 0 };
+    uint64_t _valueLeft { 0 };
+    uint64_t _valueArg { 0 };
+    int64_t _int { 0 };
+  };
+
+class ColumnarResultsSerializer : public ResultsSerializer<DynMap> {
+public:
+  virtual ~ColumnarResultsSerializer() {}
+
+  using ResultsSerializer<DynMap>::beginData;
+
+  /**
+   * Initialize with historical data and optional listener.
+   * Of the DiffOptions, only digestOnly is supported.
+   */
+  virtual bool beginData(std::string &historical_data, SPDiffResultsListener listener, std::vector<SPFieldDef> &knownColumnIds, const DiffOptions &options) override {
+    VSQLITE_TRACE_LABEL(_trace, options.traceLabel);
+    VSQLITE_TRACE_SPAN(_trace, "beginData");
+    if (_trimTracker.beginDataSet(_rowHashes.size())) {
+      _releaseMemory();
+    }
+    _addCount = 0;
+    _removeCount = 0;
+    _listener = listener;
+    _numProducers = options.numProducers;
+    _histData.clear();
+    _histHashes.clear();
+    _histColumns.clear();
+    _histNumRows = 0;
+    _histMatches.clear();
+    _rowHashes.clear();
+    _columns.clear();
+    _colIds.clear();
+    _digestOnly = options.digestOnly;
+    _digest.clear();
+    _histDigest.clear();
+
+    // add known columns
+    if (!knownColumnIds.empty()) {
+      for (auto &id : knownColumnIds) { _colIds.push_back(id); }
+      _initColumns();
+    }
+
+    if (historical_data.empty()) {
+      return false;
+    }
+
+    if (_digestOnly) {
+      if (_readHistoricalDigest(historical_data)) {
+        _histDigest.clear();
+        return true;
+      }
+      return false;
+    }
+
+    _histData = historical_data;
+    if (_parseHistoricalHeader()) {
+      _histData.clear();
+      _histHashes.clear();
+      _histColumns.clear();
+      return true;
+    }
+    return false;
+  }
+
+  /**
+   * If row is not in historical_data, then listener.onAdded()
+   * will be called.
+   * @returns true if row was not in historical_data.
+   */
+  virtual bool addNewResult(DynMap &row) override {
+    VSQLITE_TRACE_ROW(_trace);
+    bool wasFoundInHistoricalResults = false;
+
+    // get column ids if not set
+
+    if (_colIds.empty()) {
+      for (auto &it : row) {
+        _colIds.push_back(it.first);
+      }
+      _initColumns();
+    }
+
+    // append each value to its column, and hash row
+
+    RowHasher hasher;
+    for (auto &col : _columns) {
+      DynVal &val = row[col.id];
+      if (!val.valid()) {
+        col.valid.push_back(0);
+        hasher.addNull();
+        continue;
+      }
+      col.valid.push_back(1);
+      std::string value = val.as_s();
+      hasher.addValue(value);
+
+      if (col.kind == COLUMN_KIND_INT) {
+        int64_t intValue = 0;
+        if (parseInt(value, intValue)) {
+          col.ints.push_back(intValue);
+          continue;
+        }
+        col.demoteToString();
+      }
+      col.addString(value);
+    }
+    uint64_t rowHash = hasher.finish();
+    _rowHashes.push_back(rowHash);
+
+    if (_digestOnly) {
+      _digest.add(rowHash);
+      return false;
+    }
+
+    // lookup row hash in historical data
+
+    auto fit = _histHashes.find(rowHash);
+    if (fit != _histHashes.end()) {
+      _histMatches.push_back(std::make_pair(fit->second, (uint32_t)(_rowHashes.size() - 1)));
+      _histHashes.erase(fit);
+      wasFoundInHistoricalResults = true;
+    }
+
+    // notify listener
+
+    if (!wasFoundInHistoricalResults) {
+      _addCount++;
+      if (_listener) {
+        _listener->onAdded(row);
+      }
+    }
+    return !wasFoundInHistoricalResults;
+  }
+
+  /**
+   * Rows from several producers are added one at a time.
+   */
+  virtual bool addNewResult(DynMap &row, size_t producer) override {
+    if (producer >= _numProducers) {
+      assert(false);
+      return false;
+    }
+    std::lock_guard<std::mutex> lock(_producerMutex);
+    return addNewResult(row);
+  }
+
+  /**
+   * Indicates that all addNewResult() calls have been made for
+   * current data set.
+   * @return true if new results are different from historical_data,
+   * false if unchanged.
+   */
+  virtual bool endData() override {
+    VSQLITE_TRACE_END_ROWS(_trace);
+    VSQLITE_TRACE_SPAN(_trace, "endData");
+    if (_digestOnly) {
+      return _digest != _histDigest;
+    }
+
+    _verifyMatchedRows();
+
+    // without a listener, removed rows are left for removedRows()
+    bool hasRemovedRows = !_histHashes.empty();
+
+    if (_listener != nullptr && hasRemovedRows) {
+      _decodeAndNotifyRemovedRows();
+      _histHashes.clear();
+    }
+
+    return !(_addCount == 0 && _removeCount == 0 && !hasRemovedRows);
+  }
+
+  /**
+   * Serializes the current data snapshot into dest.
+   */
+  virtual void serialize(std::string &dest) override {
+    VSQLITE_TRACE_SPAN(_trace, "serialize");
+    dest.append(COLUMNAR_MAGIC, sizeof(COLUMNAR_MAGIC));
+    PutVarint(dest, _columns.size());
+    for (auto &col : _columns) {
+      PutBytes(dest, col.id->name);
+      PutVarint(dest, (uint64_t)col.id->typeId);
+    }
+    PutVarint(dest, _rowHashes.size());
+    for (auto rowHash : _rowHashes) {
+      PutFixed64(dest, rowHash);
+    }
+
+    std::string block;
+    for (auto &col : _columns) {
+      block.clear();
+      _encodeColumn(col, block);
+      PutVarint(dest, block.size());
+      dest.append(block);
+    }
+  }
+
+  /**
+   * Columns are decoded whole, so the removed rows are decoded when
+   * the cursor is created, and handed out from memory.
+   */
+  virtual std::shared_ptr<RowCursor<DynMap> > removedRows() override {
+    auto cursor = std::make_shared<DecodedRowsCursor>();
+    _decodeRemovedRows(cursor->rows);
+    return cursor;
+  }
+
+  /**
+   * Renders the removed rows column by column into one JSON object per
+   * row, without building DynMap rows.
+   */
+  virtual size_t appendRemovedRowsJson(std::string &dest) override {
+    static const size_t NOT_REMOVED = (size_t)-1;
+
+    std::vector<size_t> slots(_histNumRows, NOT_REMOVED);
+    std::vector<std::string> lines(_histHashes.size(), "{");
+    size_t numRemoved = 0;
+    for (auto &it : _histHashes) {
+      slots[it.second] = numRemoved++;
+    }
+
+    std::string prefix;
+    for (auto &hcol : _histColumns) {
+      if (nullptr == _getAppField(hcol.name)) {
+        continue;
+      }
+      prefix.clear();
+      vsqlite_utils::AppendJsonString(prefix, hcol.name);
+      prefix += ':';
+      ColumnReader reader(hcol.data, hcol.len);
+      for (size_t i=0; i < _histNumRows && !reader.error(); i++) {
+        bool isSet = reader.next();
+        if (!isSet || slots[i] == NOT_REMOVED) {
+          continue;
+        }
+        std::string &line = lines[slots[i]];
+        if (line.size() > 1) { line += ','; }
+        line += prefix;
+        if (reader.kind() != COLUMN_KIND_INT) {
+          vsqlite_utils::AppendJsonString(line, reader.stringValue());
+        } else {
+          vsqlite_utils::AppendJsonString(line, std::to_string(reader.intValue()));
+        }
+      }
+    }
+
+    for (auto &line : lines) {
+      dest.append(line);
+      dest.append("}\n");
+    }
+    return lines.size();
+  }
+
+  virtual MemoryUsage memoryUsage() override {
+    MemoryUsage usage;
+    usage.historical = MemBytes(_histData) + MemBytes(_histHashes) + MemBytes(_histMatches) + _histColumns.capacity() * sizeof(HistColumn);
+    usage.current = MemBytes(_rowHashes) + _columns.capacity() * sizeof(ColumnBuilder);
+    for (auto &col : _columns) {
+      usage.current += col.memoryBytes();
+    }
+    return usage;
+  }
+
+  virtual void setTrimPolicy(const TrimPolicy &policy) override {
+    _trimTracker.setPolicy(policy);
+  }
+
+protected:
+
+  struct DecodedRowsCursor : public RowCursor<DynMap> {
+    bool next(DynMap &row) override {
+      if (pos >= rows.size()) {
+        return false;
+      }
+      row = std::move(rows[pos++]);
+      return true;
+    }
+
+    std::vector<DynMap> rows;
+    size_t pos { 0 };
+  };
+
+  struct HistColumn {
+    std::string name;
+    int typeId;
+    const uint8_t *data;
+    size_t len;
+  };
+
+  void _initColumns() {
+    _columns.resize(_colIds.size());
+    for (size_t i=0; i < _colIds.size(); i++) {
+      _columns[i].id = _colIds[i];
+      _columns[i].kind = isIntType(_colIds[i]->typeId) ? COLUMN_KIND_INT : COLUMN_KIND_STRING;
+    }
+  }
+
+  /*
+   * Adds the row hashes of historical_data to _histDigest,
+   * without copying or indexing anything.
+   * return true on error, false on success
+   */
+  bool _readHistoricalDigest(const std::string &historical_data) {
+    ByteReader r((const uint8_t *)historical_data.data(), historical_data.size());
+    const uint8_t *magic = r.skip(sizeof(COLUMNAR_MAGIC));
+    if (magic == nullptr || 0 != memcmp(magic, COLUMNAR_MAGIC, sizeof(COLUMNAR_MAGIC))) {
+      return true;
+    }
+
+    size_t numCols = (size_t)r.varint();
+    std::string name;
+    for (size_t i=0; i < numCols && !r.error; i++) {
+      r.bytes(name);
+      r.varint();
+    }
+
+    size_t numRows = (size_t)r.varint();
+    if (r.error || numRows > (size_t)(r.end - r.p) / 8) {
+      return true;
+    }
+    for (size_t i=0; i < numRows; i++) {
+      _histDigest.add(r.fixed64());
+    }
+    return r.error;
+  }
+
+  /*
+   * Reads column names, row hashes and column block locations.
+   * return true on error, false on success
+   */
+  bool _parseHistoricalHeader() {
+    ByteReader r((const uint8_t *)_histData.data(), _histData.size());
+    const uint8_t *magic = r.skip(sizeof(COLUMNAR_MAGIC));
+    if (magic == nullptr || 0 != memcmp(magic, COLUMNAR_MAGIC, sizeof(COLUMNAR_MAGIC))) {
+      return true;
+    }
+
+    size_t numCols = (size_t)r.varint();
+    for (size_t i=0; i < numCols && !r.error; i++) {
+      HistColumn col;
+      r.bytes(col.name);
+      col.typeId = (int)r.varint();
+      _histColumns.push_back(col);
+    }
+
+    _histNumRows = (size_t)r.varint();
+    if (r.error || _histNumRows > (size_t)(r.end - r.p) / 8) {
+      return true;
+    }
+    _histHashes.reserve(_histNumRows);
+    for (size_t i=0; i < _histNumRows; i++) {
+      _histHashes.insert(std::make_pair(r.fixed64(), (uint32_t)i));
+    }
+
+    for (auto &col : _histColumns) {
+      col.len = (size_t)r.varint();
+      col.data = r.skip(col.len);
+    }
+    return r.error;
+  }
+
+  /*
+   * Frees containers sized by the largest data set, called by the trim
+   * policy before they are filled again.
+   */
+  void _releaseMemory() {
+    ReleaseMemory(_histData);
+    ReleaseMemory(_histHashes);
+    ReleaseMemory(_histMatches);
+    ReleaseMemory(_rowHashes);
+  }
+
+  /*
+   * Decodes the rows left in _histHashes, column by column.
+   */
+  void _decodeAndNotifyRemovedRows() {
+    VSQLITE_TRACE_SPAN(_trace, "decodeRemovedRows");
+    std::vector<DynMap> rows;
+    _decodeRemovedRows(rows);
+
+    for (auto &row : rows) {
+      _listener->onRemoved(row);
+      _removeCount++;
+    }
+  }
+
+  void _decodeRemovedRows(std::vector<DynMap> &rows) {
+    static const size_t NOT_REMOVED = (size_t)-1;
+
+    std::vector<size_t> slots(_histNumRows, NOT_REMOVED);
+    rows.resize(_histHashes.size());
+    size_t numRemoved = 0;
+    for (auto &it : _histHashes) {
+      slots[it.second] = numRemoved++;
+    }
+
+    for (auto &hcol : _histColumns) {
+      SPFieldDef colId = _getAppField(hcol.name);
+      if (nullptr == colId) {
+        continue;
+      }
+      ColumnReader reader(hcol.data, hcol.len);
+      for (size_t i=0; i < _histNumRows && !reader.error(); i++) {
+        bool isSet = reader.next();
+        if (!isSet || slots[i] == NOT_REMOVED) {
+          continue;
+        }
+        DynMap &row = rows[slots[i]];
+        if (reader.kind() != COLUMN_KIND_INT) {
+          row[colId] = DynVal(reader.stringValue());
+        } else {
+          row[colId] = intValueOfType(hcol.typeId, reader.intValue());
+        }
+      }
+    }
+  }
+
+  /*
+   * Row hashes are only 64 bits, so rows matched by hash are compared
+   * value by value, streaming each historical column once. On a
+   * mismatch the historical row is removed after all, and the new row
+   * is reported as added.
+   */
+  void _verifyMatchedRows() {
+    static const uint32_t NOT_MATCHED = (uint32_t)-1;
+    if (_histMatches.empty()) {
+      return;
+    }
+    VSQLITE_TRACE_SPAN(_trace, "verifyMatchedRows");
+
+    std::vector<uint32_t> newRows(_histNumRows, NOT_MATCHED);
+    for (auto &match : _histMatches) {
+      newRows[match.first] = match.second;
+    }
+    std::vector<uint8_t> differs(_histNumRows, 0);
+    std::vector<uint8_t> histColumnSeen(_histColumns.size(), 0);
+    std::vector<uint32_t> valueIndexes;
+
+    for (auto &col : _columns) {
+      // index of each row's value in ints or codes
+      valueIndexes.resize(col.valid.size());
+      uint32_t numValues = 0;
+      for (size_t j=0; j < col.valid.size(); j++) {
+        valueIndexes[j] = numValues;
+        numValues += col.valid[j];
+      }
+
+      const HistColumn *hcol = nullptr;
+      for (size_t c=0; c < _histColumns.size(); c++) {
+        if (_histColumns[c].name == col.id->name) {
+          hcol = &_histColumns[c];
+          histColumnSeen[c] = 1;
+          break;
+        }
+      }
+      if (nullptr == hcol) {
+        for (auto &match : _histMatches) {
+          differs[match.first] |= col.valid[match.second];
+        }
+        continue;
+      }
+
+      ColumnReader reader(hcol->data, hcol->len);
+      for (size_t i=0; i < _histNumRows && !reader.error(); i++) {
+        bool isSet = reader.next();
+        uint32_t j = newRows[i];
+        if (j == NOT_MATCHED) {
+          continue;
+        }
+        if (!isSet || !col.valid[j]) {
+          differs[i] |= (isSet != (col.valid[j] != 0));
+        } else if (col.kind == COLUMN_KIND_INT && reader.kind() == COLUMN_KIND_INT) {
+          differs[i] |= (col.ints[valueIndexes[j]] != reader.intValue());
+        } else {
+          differs[i] |= (_stringValue(col, valueIndexes[j]) != (reader.kind() == COLUMN_KIND_INT ?
+              std::to_string(reader.intValue()) : reader.stringValue()));
+        }
+      }
+    }
+
+    // columns only the snapshot has must be unset
+
+    for (size_t c=0; c < _histColumns.size(); c++) {
+      if (histColumnSeen[c]) {
+        continue;
+      }
+      ColumnReader reader(_histColumns[c].data, _histColumns[c].len);
+      for (size_t i=0; i < _histNumRows && !reader.error(); i++) {
+        bool isSet = reader.next();
+        if (isSet && newRows[i] != NOT_MATCHED) {
+          differs[i] = 1;
+        }
+      }
+    }
+
+    for (auto &match : _histMatches) {
+      if (!differs[match.first]) {
+        continue;
+      }
+      _histHashes.insert(std::make_pair(_rowHashes[match.second], match.first));
+      _addCount++;
+      if (_listener) {
+        DynMap row;
+        _currentRow(match.second, row);
+        _listener->onAdded(row);
+      }
+    }
+    _histMatches.clear();
+  }
+
+  std::string _stringValue(const ColumnBuilder &col, uint32_t valueIndex) {
+    if (col.kind == COLUMN_KIND_INT) {
+      return std::to_string(col.ints[valueIndex]);
+    }
+    return *col.dictEntries[col.codes[valueIndex]];
+  }
+
+  /*
+   * Rebuilds row j of the current data set from the columns.
+   */
+  void _currentRow(size_t j, DynMap &row) {
+    for (auto &col : _columns) {
+      if (!col.valid[j]) {
+        continue;
+      }
+      uint32_t valueIndex = 0;
+      for (size_t k=0; k < j; k++) {
+        valueIndex += col.valid[k];
+      }
+      if (col.kind == COLUMN_KIND_INT) {
+        row[col.id] = intValueOfType(col.id->typeId, col.ints[valueIndex]);
+      } else {
+        row[col.id] = DynVal(_stringValue(col, valueIndex));
+      }
+    }
+  }
+
+  /*
+   * Historical columns are matched to application columns by name,
+   * so that comparisons work.
+   */
+  SPFieldDef _getAppField(const std::string &name) {
+    for (SPFieldDef colId : _colIds) {
+      if (colId->name == name) {
+        return colId;
+      }
+    }
+    return nullptr;
+  }
+
+  void _encodeColumn(ColumnBuilder &col, std::string &block) {
+
+    // validity runs, starting with valid
+
+    std::vector<uint64_t> runs;
+    uint8_t current = 1;
+    uint64_t count = 0;
+    for (auto v : col.valid) {
+      if (v == current) {
+        count++;
+      } else {
+        runs.push_back(count);
+        current = v;
+        count = 1;
+      }
+    }
+    runs.push_back(count);
+    PutVarint(block, runs.size());
+    for (auto run : runs) {
+      PutVarint(block, run);
+    }
+
+    block.push_back((char)col.kind);
+
+    // value runs
+
+    std::vector<std::pair<uint64_t, uint64_t> > valueRuns;
+    if (col.kind == COLUMN_KIND_INT) {
+      int64_t prev = 0;
+      for (auto value : col.ints) {
+        uint64_t delta = ZigZagEncode((int64_t)((uint64_t)value - (uint64_t)prev));
+        prev = value;
+        if (!valueRuns.empty() && valueRuns.back().second == delta) {
+          valueRuns.back().first++;
+        } else {
+          valueRuns.push_back(std::make_pair((uint64_t)1, delta));
+        }
+      }
+    } else {
+      PutVarint(block, col.dictEntries.size());
+      for (auto entry : col.dictEntries) {
+        PutBytes(block, *entry);
+      }
+      for (auto code : col.codes) {
+        if (!valueRuns.empty() && valueRuns.back().second == code) {
+          valueRuns.back().first++;
+        } else {
+          valueRuns.push_back(std::make_pair((uint64_t)1, (uint64_t)code));
+        }
+      }
+    }
+    PutVarint(block, valueRuns.size());
+    for (auto &run : valueRuns) {
+      PutVarint(block, run.first);
+      PutVarint(block, run.second);
+    }
+  }
+
+  // members
+  uint32_t _addCount { 0 };
+  uint32_t _removeCount { 0 };
+  SPDiffResultsListener _listener;
+  std::vector<SPFieldDef> _colIds;
+
+  // current data set
+  std::vector<ColumnBuilder> _columns;
+  std::vector<uint64_t> _rowHashes;
+
+  // historical data : row hash -> row index, for rows not yet matched
+  std::string _histData;
+  std::vector<HistColumn> _histColumns;
+  std::unordered_multimap<uint64_t, uint32_t> _histHashes;
+  size_t _histNumRows { 0 };
+
+  // rows matched by hash, as (historical row, new row), until verified
+  std::vector<std::pair<uint32_t, uint32_t> > _histMatches;
+
+  // sizes of past data sets, for the trim policy
+  TrimTracker _trimTracker;
+
+  // digest only mode
+  bool _digestOnly { false };
+  vsqlite_utils::RowSetDigest _digest;
+  vsqlite_utils::RowSetDigest _histDigest;
+
+  // serializes addNewResult(row, producer) calls
+  size_t _numProducers { 1 };
+  std::mutex _producerMutex;
+
+  // phase spans, only built with VSQLITE_TRACE
+  VSQLITE_TRACE_CONTEXT(_trace, "columnar");
+};
+
+  std::shared_ptr<ResultsSerializer<DynMap> > ColumnarResultsSerializerNew() {
+    return std::make_shared<ColumnarResultsSerializer>();
+  }
+
+} // namespace vsqlite
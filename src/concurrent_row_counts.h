@@ -0,0 +1,80 @@
+#pragma once
+
+#include "../include/vsqlite_serialize.h"
+
+#include <atomic>
+#include <memory>
+#include <stdint.h>
+#include <string>
+
+#include "encoded_row_counts.h"
+
+namespace vsqlite {
+
+  /*
+   * Historical rows shared by concurrent addNewResult() calls
+   * (DiffOptions::numProducers). The table is built before the calls
+   * and not modified during them : consuming a row decrements its count
+   * with compare-and-swap, and rows that reach 0 copies stay in the table
+   * until moveTo() drops them.
+   */
+  class ConcurrentRowCounts {
+  public:
+
+    /**
+     * Takes the rows of src, leaving it empty. Not thread-safe.
+     */
+    void assign(EncodedRowCounts &src) {
+      _index = src.take();
+      _counts.reset(new std::atomic<uint32_t>[_index.size()]);
+      uint32_t i = 0;
+      for (auto &it : _index) {
+        _counts[i].store(it.second, std::memory_order_relaxed);
+        it.second = i++;
+      }
+    }
+
+    /**
+     * Removes one copy of encodedRow. Thread-safe.
+     * @returns true if a copy was present.
+     */
+    bool consume(const std::string &encodedRow) {
+      auto fit = _index.find(encodedRow);
+      if (fit == _index.end()) {
+        return false;
+      }
+      std::atomic<uint32_t> &count = _counts[fit->second];
+      uint32_t n = count.load(std::memory_order_relaxed);
+      while (n > 0) {
+        if (count.compare_exchange_weak(n, n - 1, std::memory_order_relaxed)) {
+          return true;
+        }
+      }
+      return false;
+    }
+
+    /**
+     * Moves the rows with copies left to dest, leaving this empty.
+     * Not thread-safe : call once the concurrent calls are done.
+     */
+    void moveTo(EncodedRowCounts &dest) {
+      for (auto it = _index.begin(); it != _index.end(); ) {
+        uint32_t n = _counts[it->second].load(std::memory_order_relaxed);
+        if (n == 0) {
+          it = _index.erase(it);
+        } else {
+          it->second = n;
+          ++it;
+        }
+      }
+      dest.assign(std::move(_index));
+      _index = EncodedRowCounts::Map();
+      _counts.reset();
+    }
+
+  private:
+    EncodedRowCounts::Map _index; // encoded row -> index in _counts
+    std::unique_ptr<std::atomic<uint32_t>[]> _counts;
+  };
+
+} // namespace vsqlite
@@ -1,21 +1,36 @@
 #include "../include/vsqlite_serialize.h"
 
+#include <assert.h>
 #include <crow.hpp>
 #include <crow/crow_decode.hpp>
-#include <unordered_set>
-
+#include <mutex>
+#include <unordered_map>
+
+#include "blob_table.h"
+#include "encoded_row_counts.h"
+#include "fingerprint.h"
+#include "kernels.h"
+#include "memory_usage.h"
+#include "trace.h"
 #include "utils.h"
+#include "row_keys.h"
+#include "schema.h"
+#include "string_pool.h"
 
 
 #define CHECK_COL(colId) if (nullptr == colId) { assert(false); return ; }
 
 static const SPFieldDef COLISFOUND = FieldDef::alloc(TUINT8, "__isfound");
 
+// removed rows decoded at a time by a removedRows() cursor
+static const size_t CURSOR_BATCH_ROWS = 256;
+
 namespace vsqlite {
 
   /*
    * This decoder listener just extracts encoded rows, not the decoded rows.
-   * It's the first pass.
+   * It's the first pass. In digest only mode, rows are hashed into
+   * pDigest instead of being kept.
    */
   class RawRowsDecoderListener : public crow::DecoderListener {
   public:
@@ -23,10 +38,15 @@ namespace vsqlite {
     virtual ~RawRowsDecoderListener() {
     }
     
-    RawRowsDecoderListener(std::unordered_set<std::string> &encodedRows, std::string &encodedHeaderRow) : crow::DecoderListener(), _rownum(0), _encodedRows(encodedRows), _encodedHeaderRow(encodedHeaderRow) {
+    RawRowsDecoderListener(EncodedRowCounts &encodedRows, std::string &encodedHeaderRow, vsqlite_utils::RowSetDigest *pDigest = nullptr) : crow::DecoderListener(), _rownum(0), _encodedRows(encodedRows), _encodedHeaderRow(encodedHeaderRow), _pDigest(pDigest) {
     }
 
     void onRowEnd(bool isHeaderRow, const uint8_t* pEncodedRowStart, size_t length) override {
+      if (!isHeaderRow && _pDigest != nullptr) {
+        _pDigest->add(vsqlite_utils::FingerprintBytes((const char *)pEncodedRowStart, length));
+        _rownum++;
+        return;
+      }
       std::string encodedRow;
       encodedRow.append((const char *)pEncodedRowStart, length);
       if (isHeaderRow) {
@@ -38,8 +58,9 @@ namespace vsqlite {
     }
 
     size_t _rownum;
-    std::unordered_set<std::string> &_encodedRows;
+    EncodedRowCounts &_encodedRows;
     std::string &_encodedHeaderRow;
+    vsqlite_utils::RowSetDigest *_pDigest;
   };
 
   /*
@@ -53,7 +74,7 @@ namespace vsqlite {
     virtual ~MyRowDecoderListener() {
     }
     
-    MyRowDecoderListener(std::vector<SPFieldDef> &colIds) : crow::DecoderListener(), _rownum(0), _rows(), _colIds(colIds)  {
+    MyRowDecoderListener(const ColumnNames &columns, const BlobTable &blobs) : crow::DecoderListener(), _rownum(0), _rows(), _columns(columns), _blobs(blobs)  {
     }
     
     virtual void onField(crow::SPCFieldInfo fieldDef, int8_t value, uint8_t flags) override {
@@ -95,7 +116,10 @@ namespace vsqlite {
     void onField(crow::SPCFieldInfo fieldDef, const std::string &value, uint8_t flags) override {
       SPFieldDef colId = getAppField(fieldDef);
       CHECK_COL(colId);
-      getRow()[colId] = DynVal(value);
+      const char *p = value.data();
+      size_t len = value.size();
+      _blobs.resolve(p, len);
+      getRow()[colId] = DynVal(std::string(p, len));
     }
     void onField(crow::SPCFieldInfo fieldDef, const std::vector<uint8_t> value, uint8_t flags) override {
       SPFieldDef colId = getAppField(fieldDef);
@@ -117,40 +141,326 @@ namespace vsqlite {
      * This maps them to application field so that comparisons work.
      */
     SPFieldDef getAppField(crow::SPCFieldInfo fieldInfo) {
-      for (SPFieldDef colId : _colIds) {
-        if (colId->name == fieldInfo->name) {
-          return colId;
-        }
-      }
-      return nullptr;
+      return _columns.find(fieldInfo->name);
     }
     
     void onRowEnd(bool isHeaderRow, const uint8_t* pEncodedRowStart, size_t length) override {
       if (!isHeaderRow) {
+        getRow(); // one row per encoded row, even without known fields
         _rownum++;
       }
     }
     
     size_t _rownum;
     std::vector<DynMap > _rows;
-    std::vector<SPFieldDef> &_colIds;
+    const ColumnNames &_columns;
+    const BlobTable &_blobs;
   };
 
-  
-class CrowResultsSerializer : public ResultsSerializer<DynMap> {
+  /*
+   * Hashes the key and identity columns of every historical row from
+   * its decoded fields, without assembling rows, and keeps the encoded
+   * bytes of each row. Used to index historical rows by key columns.
+   */
+  class RowKeysDecoderListener : public crow::DecoderListener {
+  public:
+
+    virtual ~RowKeysDecoderListener() {
+    }
+
+    RowKeysDecoderListener(const BlobTable &blobs, RowKeyBuilder &keys, RowKeyBuilder &identity, std::vector<std::string> &encodedRows) : crow::DecoderListener(), _blobs(blobs), _keys(keys), _identity(identity), _encodedRows(encodedRows) {
+    }
+
+    virtual void onField(crow::SPCFieldInfo fieldDef, int8_t value, uint8_t flags) override {
+      if (isKeyField(fieldDef)) { setValue(fieldDef, DynVal(value).as_s()); }
+    }
+    virtual void onField(crow::SPCFieldInfo fieldDef, uint8_t value, uint8_t flags) override {
+      if (isKeyField(fieldDef)) { setValue(fieldDef, DynVal(value).as_s()); }
+    }
+    void onField(crow::SPCFieldInfo fieldDef, int32_t value, uint8_t flags) override {
+      if (isKeyField(fieldDef)) { setValue(fieldDef, DynVal(value).as_s()); }
+    }
+    void onField(crow::SPCFieldInfo fieldDef, uint32_t value, uint8_t flags) override {
+      if (isKeyField(fieldDef)) { setValue(fieldDef, DynVal(value).as_s()); }
+    }
+    void onField(crow::SPCFieldInfo fieldDef, int64_t value, uint8_t flags) override {
+      if (isKeyField(fieldDef)) { setValue(fieldDef, DynVal(value).as_s()); }
+    }
+    void onField(crow::SPCFieldInfo fieldDef, uint64_t value, uint8_t flags) override {
+      if (isKeyField(fieldDef)) { setValue(fieldDef, DynVal(value).as_s()); }
+    }
+    void onField(crow::SPCFieldInfo fieldDef, double value, uint8_t flags) override {
+      if (isKeyField(fieldDef)) { setValue(fieldDef, DynVal(value).as_s()); }
+    }
+    void onField(crow::SPCFieldInfo fieldDef, const std::string &value, uint8_t flags) override {
+      if (isKeyField(fieldDef)) {
+        const char *p = value.data();
+        size_t len = value.size();
+        _blobs.resolve(p, len);
+        setValue(fieldDef, p, len);
+      }
+    }
+    void onField(crow::SPCFieldInfo fieldDef, const std::vector<uint8_t> value, uint8_t flags) override {
+      if (isKeyField(fieldDef)) { setValue(fieldDef, DynVal(value).as_s()); }
+    }
+
+    bool isKeyField(const crow::SPCFieldInfo &fieldDef) {
+      return _keys.contains(fieldDef->name) || _identity.contains(fieldDef->name);
+    }
+
+    void setValue(const crow::SPCFieldInfo &fieldDef, const std::string &value) {
+      setValue(fieldDef, value.data(), value.size());
+    }
+
+    void setValue(const crow::SPCFieldInfo &fieldDef, const char *value, size_t size) {
+      _keys.set(fieldDef->name.data(), fieldDef->name.size(), value, size);
+      _identity.set(fieldDef->name.data(), fieldDef->name.size(), value, size);
+    }
+
+    void onRowEnd(bool isHeaderRow, const uint8_t* pEncodedRowStart, size_t length) override {
+      if (isHeaderRow) {
+        return;
+      }
+      size_t idx = _encodedRows.size();
+      _encodedRows.push_back(std::string((const char *)pEncodedRowStart, length));
+      if (!_keys.empty()) {
+        _keys.build(_key);
+        _keyIndex[_key] = idx;
+      }
+      if (!_identity.empty()) {
+        _identity.build(_key);
+        _identityIndex.insert(std::make_pair(_key, idx));
+      }
+    }
+
+    const BlobTable &_blobs;
+    RowKeyBuilder &_keys;
+    RowKeyBuilder &_identity;
+    std::vector<std::string> &_encodedRows;
+    std::unordered_map<std::string, size_t> _keyIndex;
+    std::unordered_multimap<std::string, size_t> _identityIndex;
+    std::string _key;
+  };
+
+  static const size_t NO_VIEW_OFFSET = (size_t)-1;
+
+  /*
+   * Decodes each row into a RowView and passes it to the listener at
+   * the row end. Used for removed rows. The view and the buffer holding
+   * its string values are reused from row to row, so decoding allocates
+   * only while they grow. Long values point into the blob table.
+   */
+  class RowViewDecoderListener : public crow::DecoderListener {
+  public:
+
+    virtual ~RowViewDecoderListener() {
+    }
+
+    RowViewDecoderListener(const ColumnNames &columns, const BlobTable &blobs, DiffResultsListener<DynMap> &listener) : crow::DecoderListener(), _rownum(0), _columns(columns), _blobs(blobs), _listener(listener) {
+    }
+
+    virtual void onField(crow::SPCFieldInfo fieldDef, int8_t value, uint8_t flags) override {
+      addValue(fieldDef, DynVal(value));
+    }
+    virtual void onField(crow::SPCFieldInfo fieldDef, uint8_t value, uint8_t flags) override {
+      addValue(fieldDef, DynVal(value));
+    }
+    void onField(crow::SPCFieldInfo fieldDef, int32_t value, uint8_t flags) override {
+      addValue(fieldDef, DynVal(value));
+    }
+    void onField(crow::SPCFieldInfo fieldDef, uint32_t value, uint8_t flags) override {
+      addValue(fieldDef, DynVal(value));
+    }
+    void onField(crow::SPCFieldInfo fieldDef, int64_t value, uint8_t flags) override {
+      addValue(fieldDef, DynVal(value));
+    }
+    void onField(crow::SPCFieldInfo fieldDef, uint64_t value, uint8_t flags) override {
+      addValue(fieldDef, DynVal(value));
+    }
+    void onField(crow::SPCFieldInfo fieldDef, double value, uint8_t flags) override {
+      addValue(fieldDef, DynVal(value));
+    }
+    void onField(crow::SPCFieldInfo fieldDef, const std::string &value, uint8_t flags) override {
+      const char *p = value.data();
+      size_t len = value.size();
+      bool isBlob = _blobs.resolve(p, len);
+      addBytes(fieldDef, p, len, !isBlob);
+    }
+    void onField(crow::SPCFieldInfo fieldDef, const std::vector<uint8_t> value, uint8_t flags) override {
+      addBytes(fieldDef, (const char *)value.data(), value.size(), true);
+    }
+
+    void addValue(const crow::SPCFieldInfo &fieldDef, const DynVal &value) {
+      SPFieldDef colId = _columns.find(fieldDef->name);
+      CHECK_COL(colId);
+      _view.fields.emplace_back();
+      _view.fields.back().id = colId;
+      _view.fields.back().value = value;
+      _offsets.push_back(NO_VIEW_OFFSET);
+    }
+
+    /*
+     * The decoder only lends value until it returns, so it is copied
+     * to _values, unless it outlives the row. Views into _values are
+     * set at the row end, once it no longer grows.
+     */
+    void addBytes(const crow::SPCFieldInfo &fieldDef, const char *data, size_t size, bool copy) {
+      SPFieldDef colId = _columns.find(fieldDef->name);
+      CHECK_COL(colId);
+      _view.fields.emplace_back();
+      RowView::Field &field = _view.fields.back();
+      field.id = colId;
+      field.size = size;
+      if (copy) {
+        _offsets.push_back(_values.size());
+        _values.append(data, size);
+      } else {
+        field.data = data;
+        _offsets.push_back(NO_VIEW_OFFSET);
+      }
+    }
+
+    void onRowEnd(bool isHeaderRow, const uint8_t* pEncodedRowStart, size_t length) override {
+      if (isHeaderRow) {
+        return;
+      }
+      for (size_t i=0; i < _view.fields.size(); i++) {
+        if (_offsets[i] != NO_VIEW_OFFSET) {
+          _view.fields[i].data = _values.data() + _offsets[i];
+        }
+      }
+      _listener.onRemovedView(_view);
+      _view.fields.clear();
+      _offsets.clear();
+      _values.clear();
+      _rownum++;
+    }
+
+    size_t _rownum;
+    const ColumnNames &_columns;
+    const BlobTable &_blobs;
+    DiffResultsListener<DynMap> &_listener;
+    RowView _view;
+    std::vector<size_t> _offsets; // per field, start in _values
+    std::string _values;
+  };
+
+  /*
+   * Transcodes rows straight to JSON lines, one {"name":"value",...}
+   * object per row, without building DynMap rows. Values are rendered
+   * the same way as the JSON serializer renders them.
+   */
+  class JsonLinesDecoderListener : public crow::DecoderListener {
+  public:
+
+    virtual ~JsonLinesDecoderListener() {
+    }
+
+    JsonLinesDecoderListener(std::string &dest, const BlobTable &blobs) : crow::DecoderListener(), _rownum(0), _dest(dest), _blobs(blobs) {
+    }
+
+    virtual void onField(crow::SPCFieldInfo fieldDef, int8_t value, uint8_t flags) override {
+      appendValue(fieldDef, DynVal(value).as_s());
+    }
+    virtual void onField(crow::SPCFieldInfo fieldDef, uint8_t value, uint8_t flags) override {
+      appendValue(fieldDef, DynVal(value).as_s());
+    }
+    void onField(crow::SPCFieldInfo fieldDef, int32_t value, uint8_t flags) override {
+      appendValue(fieldDef, DynVal(value).as_s());
+    }
+    void onField(crow::SPCFieldInfo fieldDef, uint32_t value, uint8_t flags) override {
+      appendValue(fieldDef, DynVal(value).as_s());
+    }
+    void onField(crow::SPCFieldInfo fieldDef, int64_t value, uint8_t flags) override {
+      appendValue(fieldDef, DynVal(value).as_s());
+    }
+    void onField(crow::SPCFieldInfo fieldDef, uint64_t value, uint8_t flags) override {
+      appendValue(fieldDef, DynVal(value).as_s());
+    }
+    void onField(crow::SPCFieldInfo fieldDef, double value, uint8_t flags) override {
+      appendValue(fieldDef, DynVal(value).as_s());
+    }
+    void onField(crow::SPCFieldInfo fieldDef, const std::string &value, uint8_t flags) override {
+      const char *p = value.data();
+      size_t len = value.size();
+      _blobs.resolve(p, len);
+      appendValue(fieldDef, p, len);
+    }
+    void onField(crow::SPCFieldInfo fieldDef, const std::vector<uint8_t> value, uint8_t flags) override {
+      appendValue(fieldDef, DynVal(value).as_s());
+    }
+
+    /*
+     * Escaped '"name":' of each field is rendered once.
+     */
+    void appendValue(const crow::SPCFieldInfo &fieldDef, const std::string &value) {
+      appendValue(fieldDef, value.data(), value.size());
+    }
+
+    void appendValue(const crow::SPCFieldInfo &fieldDef, const char *value, size_t size) {
+      _dest += (_inRow ? ',' : '{');
+      _inRow = true;
+      auto fit = _namePrefixes.find(fieldDef.get());
+      if (fit == _namePrefixes.end()) {
+        std::string prefix;
+        vsqlite_utils::AppendJsonString(prefix, fieldDef->name);
+        prefix += ':';
+        fit = _namePrefixes.insert(std::make_pair(fieldDef.get(), prefix)).first;
+      }
+      _dest += fit->second;
+      vsqlite_utils::AppendJsonString(_dest, value, size);
+    }
+
+    void onRowEnd(bool isHeaderRow, const uint8_t* pEncodedRowStart, size_t length) override {
+      if (isHeaderRow) {
+        return;
+      }
+      _dest.append(_inRow ? "}\n" : "{}\n");
+      _inRow = false;
+      _rownum++;
+    }
+
+    size_t _rownum;
+    std::string &_dest;
+    const BlobTable &_blobs;
+    bool _inRow { false };
+    std::unordered_map<const void *, std::string> _namePrefixes;
+  };
+
+class CrowResultsSerializer : public ResultsSerializer<DynMap>, public std::enable_shared_from_this<CrowResultsSerializer> {
 public:
   virtual ~CrowResultsSerializer() {
     if (nullptr != _pEnc) { delete _pEnc; }
   }
 
+  using ResultsSerializer<DynMap>::beginData;
+
   /**
    * Initialize with historical data and optional listener.
    */
-  virtual bool beginData(std::string &historical_data, SPDiffResultsListener listener, std::vector<SPFieldDef> &knownColumnIds) override {
+  virtual bool beginData(std::string &historical_data, SPDiffResultsListener listener, std::vector<SPFieldDef> &knownColumnIds, const DiffOptions &options) override {
+    VSQLITE_TRACE_LABEL(_trace, options.traceLabel);
+    VSQLITE_TRACE_SPAN(_trace, "beginData");
+    if (_trimTracker.beginDataSet(_numRows)) {
+      _releaseMemory();
+    }
+    _numRows = 0;
     _addCount = 0;
     _removeCount = 0;
+    _changeCount = 0;
     _listener = listener;
+    _numProducers = options.numProducers;
     _histEncodedRows.clear();
+    _keyColIds = options.keyColumnIds;
+    _histKeyIndex.clear();
+    _histIdentityIndex.clear();
+    _histKeyedEncodedRows.clear();
+    _digest.clear();
+    _histDigest.clear();
+    _blobs.clear();
+    _blobs.setMinSize(options.blobMinSize);
+    _histBlobs.clear();
+    _storeSchema = options.storeSchema;
     if (nullptr != _pEnc) { delete _pEnc; }
 
     _pEnc = crow::EncoderFactory::New();
@@ -161,18 +471,48 @@ public:
       for (auto &id : knownColumnIds) { _colIds.push_back(id); }
     }
 
+    // historical key values are matched by column name
+    if (!_keyColIds.empty() && _colIds.empty()) {
+      return true;
+    }
+
+    // identity is every known column except volatile ones
+    _identityColIds.clear();
+    if (!options.volatileColumnIds.empty()) {
+      _identityColIds = ExcludeColumns(_colIds, options.volatileColumnIds);
+    }
+    _digestOnly = options.digestOnly && options.volatileColumnIds.empty();
+
     // extract encoded rows data from historical_data.
     // This is kind of like doing a historical_data.split(\n)
 
+    _removedColIds.clear();
+    _schemaChanged = false;
+
     if (!historical_data.empty()) {
-      RawRowsDecoderListener decoderListener(_histEncodedRows, _histEncodedHeaderRow);
+      // optional schema and blob sections, then crow data
+      size_t offset = 0;
+      std::vector<SPFieldDef> histColIds;
+      if (ReadSchemaBinary(historical_data, offset, histColIds) || _histBlobs.readBinary(historical_data, offset)) {
+        _histBlobs.clear();
+        return true;
+      }
+      _compareSchema(histColIds, options.volatileColumnIds);
+      const uint8_t *data = (const uint8_t*)historical_data.data() + offset;
+      size_t len = historical_data.size() - offset;
+
+      RawRowsDecoderListener decoderListener(_histEncodedRows, _histEncodedHeaderRow, _digestOnly ? &_histDigest : nullptr);
 
-      crow::Decoder *_pDec = crow::DecoderFactory::New((const uint8_t*)historical_data.data(), historical_data.size());
+      crow::Decoder *_pDec = crow::DecoderFactory::New(data, len);
       _pDec->setModeFlags(DECODER_MODE_SKIP);
       _pDec->decode(decoderListener);
       _histTotalRows = decoderListener._rownum;
 
       delete _pDec;
+
+      if (!_digestOnly && (!_keyColIds.empty() || !_identityColIds.empty())) {
+        _indexHistoricalRows(data, len);
+      }
     }
 
     return false;
@@ -184,6 +524,8 @@ public:
    * @returns true if row was not in historical_data.
    */
   virtual bool addNewResult(DynMap &row) override {
+    VSQLITE_TRACE_ROW(_trace);
+    _numRows++;
     bool wasFoundInHistoricalResults = false;
 
     // get column ids if not set
@@ -197,7 +539,13 @@ public:
     // encode each field
 
     for (auto &id : _colIds) {
-      _pEnc->put(id, row[id]);
+      DynVal &val = row[id];
+      if (_blobs.minSize() != 0 && val.valid() && val.type() == TSTRING && _blobs.encode(val.as_s(), _blobRef)) {
+        DynVal ref(_blobRef);
+        _pEnc->put(id, ref);
+      } else {
+        _pEnc->put(id, val);
+      }
     }
 
     // flush : first headers only, then data
@@ -211,9 +559,29 @@ public:
     const uint8_t *p = _pEnc->data() + pos + 1; // skip row 0x05 marker
     size_t rowLen = _pEnc->size() - pos - 1;
 
-    // lookup encoded bytes in historical data
+    if (_digestOnly) {
+      _digest.add(vsqlite_utils::FingerprintBytes((const char *)p, rowLen));
+      return false;
+    }
 
-    wasFoundInHistoricalResults = _lookupEncodedRow(p, rowLen);
+    // lookup encoded bytes in historical data,
+    // or identity if some columns are volatile
+
+    if (_identityColIds.empty()) {
+      wasFoundInHistoricalResults = _lookupEncodedRow(p, rowLen);
+    } else {
+      wasFoundInHistoricalResults = _lookupIdentity(row);
+    }
+
+    // key columns : same key as a historical row means changed, not added
+
+    if (!_histKeyIndex.empty()) {
+      if (wasFoundInHistoricalResults) {
+        _forgetKey(row, p, rowLen);
+      } else if (_lookupChangedRow(row)) {
+        return true;
+      }
+    }
 
     // notify listener
 
@@ -226,6 +594,18 @@ public:
     return !wasFoundInHistoricalResults;
   }
 
+  /**
+   * Rows from several producers are added one at a time.
+   */
+  virtual bool addNewResult(DynMap &row, size_t producer) override {
+    if (producer >= _numProducers) {
+      assert(false);
+      return false;
+    }
+    std::lock_guard<std::mutex> lock(_producerMutex);
+    return addNewResult(row);
+  }
+
   /**
    * Indicates that all addNewResult() calls have been made for
    * current data set.
@@ -233,33 +613,167 @@ public:
    * false if unchanged.
    */
   virtual bool endData() override {
-    if (_listener != nullptr && !_histEncodedRows.empty()) {
+    VSQLITE_TRACE_END_ROWS(_trace);
+    VSQLITE_TRACE_SPAN(_trace, "endData");
+    if (_digestOnly) {
+      return _schemaChanged || _digest != _histDigest;
+    }
+
+    // without a listener, removed rows are left for removedRows()
+    bool hasRemovedRows = !_histEncodedRows.empty();
+
+    if (_listener != nullptr && hasRemovedRows) {
       _decodeAndNotifyRemovedRows();
+      _histEncodedRows.clear();
     }
 
-    return !(_addCount == 0 && _removeCount == 0);
+    // a schema change is reported even if all rows match on the shared
+    // columns, so that the snapshot is rewritten with the new columns
+    return !(_addCount == 0 && _removeCount == 0 && _changeCount == 0 && !hasRemovedRows && !_schemaChanged);
   }
 
   /**
    * Serializes the current data snapshot into dest.
    */
   virtual void serialize(std::string &dest) override {
+    VSQLITE_TRACE_SPAN(_trace, "serialize");
     _pEnc->flush();
+    if (_storeSchema && !_colIds.empty()) {
+      AppendSchemaBinary(dest, _colIds);
+    }
+    if (_blobs.active()) {
+      _blobs.appendBinary(dest);
+    }
     dest.append((const char *)_pEnc->data(), _pEnc->size());
   }
 
+  virtual std::shared_ptr<RowCursor<DynMap> > removedRows() override {
+    _resetColumnNames();
+    return std::make_shared<RemovedRowsCursor>(shared_from_this());
+  }
+
+  /**
+   * Transcodes the removed rows from crow to JSON lines.
+   */
+  virtual size_t appendRemovedRowsJson(std::string &dest) override {
+    if (_histEncodedRows.empty()) {
+      return 0;
+    }
+    std::vector<uint8_t> encodedData;
+    assembleOnlyRemovedRows(_histEncodedHeaderRow, _histEncodedRows, encodedData);
+
+    JsonLinesDecoderListener listener(dest, _histBlobs);
+    crow::Decoder *pDec = crow::DecoderFactory::New(encodedData.data(), encodedData.size());
+    pDec->decode(listener);
+    delete pDec;
+    return listener._rownum;
+  }
+
+  virtual MemoryUsage memoryUsage() override {
+    MemoryUsage usage;
+    usage.historical = _histEncodedRows.memoryBytes() + MemBytes(_histEncodedHeaderRow) + MemBytes(_histKeyIndex) +
+        MemBytes(_histIdentityIndex) + MemBytes(_histKeyedEncodedRows) + _histBlobs.memoryBytes();
+    usage.current = (nullptr == _pEnc ? 0 : _pEnc->size()) + _blobs.memoryBytes();
+    usage.other = _columnNames.memoryBytes();
+    return usage;
+  }
+
+  virtual void setTrimPolicy(const TrimPolicy &policy) override {
+    _trimTracker.setPolicy(policy);
+  }
+
 protected:
 
   /*
-   * Assembles header + rows[] in dest binary string
+   * Decodes removed rows a batch at a time : distinct rows of the batch
+   * are assembled behind one copy of the header row and decoded with
+   * one decoder, then handed out by their counts. Holds the serializer,
+   * so it may outlive the caller's reference.
+   */
+  class RemovedRowsCursor : public RowCursor<DynMap> {
+  public:
+    RemovedRowsCursor(std::shared_ptr<CrowResultsSerializer> owner) : _owner(owner),
+        _it(owner->_histEncodedRows.begin()), _end(owner->_histEncodedRows.end()) {}
+
+    bool next(DynMap &row) override {
+      while (_pos >= _rows.size()) {
+        if (_it == _end) {
+          return false;
+        }
+        _decodeBatch();
+      }
+      if (--_counts[_pos] == 0) {
+        row = std::move(_rows[_pos++]);
+      } else {
+        row = _rows[_pos];
+      }
+      return true;
+    }
+
+  private:
+    void _decodeBatch() {
+      const std::string &header = _owner->_histEncodedHeaderRow;
+      _encodedData.assign(header.begin(), header.end());
+      _counts.clear();
+      for (; _it != _end && _counts.size() < CURSOR_BATCH_ROWS; ++_it) {
+        _encodedData.push_back((uint8_t)TROW);
+        _encodedData.insert(_encodedData.end(), _it->first.begin(), _it->first.end());
+        _counts.push_back(_it->second);
+      }
+
+      MyRowDecoderListener listener(_owner->_columnNames, _owner->_histBlobs);
+      crow::Decoder *pDec = crow::DecoderFactory::New(_encodedData.data(), _encodedData.size());
+      pDec->decode(listener);
+      delete pDec;
+
+      _rows.swap(listener._rows);
+      _pos = 0;
+    }
+
+    std::shared_ptr<CrowResultsSerializer> _owner;
+    EncodedRowCounts::const_iterator _it;
+    EncodedRowCounts::const_iterator _end;
+    std::vector<uint8_t> _encodedData; // header row and rows of the batch
+    std::vector<DynMap> _rows;         // decoded rows of the batch
+    std::vector<uint32_t> _counts;     // copies left, per row of the batch
+    size_t _pos { 0 };
+  };
+
+  /*
+   * If the snapshot was written with other columns than _colIds, rows
+   * are compared on the columns both have, and columns only the
+   * snapshot has are still decoded for removed rows.
    */
-  void assembleOnlyRemovedRows(std::string &encodedHeaderRow, std::unordered_set<std::string> &encodedRows, std::vector<uint8_t> &dest) {
+  void _compareSchema(const std::vector<SPFieldDef> &histColIds, const std::vector<SPFieldDef> &volatileColIds) {
+    if (_colIds.empty() || histColIds.empty() || SameColumns(_colIds, histColIds)) {
+      return;
+    }
+    _schemaChanged = true;
+    _removedColIds = ExcludeColumns(histColIds, _colIds);
+    _identityColIds = ExcludeColumns(SharedColumns(_colIds, histColIds), volatileColIds);
+  }
+
+  void _resetColumnNames() {
+    if (_removedColIds.empty()) {
+      _columnNames.reset(_colIds);
+      return;
+    }
+    std::vector<SPFieldDef> ids(_colIds);
+    ids.insert(ids.end(), _removedColIds.begin(), _removedColIds.end());
+    _columnNames.reset(ids);
+  }
+
+  /*
+   * Assembles header + rows[] in dest binary string,
+   * repeating each row by its count.
+   */
+  void assembleOnlyRemovedRows(std::string &encodedHeaderRow, EncodedRowCounts &encodedRows, std::vector<uint8_t> &dest) {
 
     // first determine new size
 
     size_t len = encodedHeaderRow.size();
-    for (auto & encodedRow : encodedRows) {
-      len += encodedRow.size() + 1;
+    for (auto & it : encodedRows) {
+      len += (it.first.size() + 1) * it.second;
     }
 
     // allocate
@@ -273,60 +787,215 @@ protected:
 
     // add each removed row
 
-    for (auto & encodedRow : encodedRows) {
-      *p++ = (uint8_t)TROW;
-      memcpy(p, encodedRow.data(), encodedRow.size());
-      p += encodedRow.size();
+    for (auto & it : encodedRows) {
+      for (uint32_t i=0; i < it.second; i++) {
+        *p++ = (uint8_t)TROW;
+        memcpy(p, it.first.data(), it.first.size());
+        p += it.first.size();
+      }
+    }
+  }
+
+  /*
+   * Decodes one historical row, behind the historical header row.
+   * return true on error, false on success
+   */
+  bool _decodeHistoricalRow(const std::string &encodedRow, DynMap &row) {
+    std::vector<uint8_t> encodedData;
+    encodedData.reserve(_histEncodedHeaderRow.size() + 1 + encodedRow.size());
+    encodedData.insert(encodedData.end(), _histEncodedHeaderRow.begin(), _histEncodedHeaderRow.end());
+    encodedData.push_back((uint8_t)TROW);
+    encodedData.insert(encodedData.end(), encodedRow.begin(), encodedRow.end());
+
+    MyRowDecoderListener listener(_columnNames, _histBlobs);
+    crow::Decoder *pDec = crow::DecoderFactory::New(encodedData.data(), encodedData.size());
+    pDec->decode(listener);
+    delete pDec;
+
+    if (listener._rows.empty()) {
+      return true;
     }
+    row = std::move(listener._rows[0]);
+    return false;
+  }
+
+  /*
+   * Frees containers sized by the largest data set, called by the trim
+   * policy before they are filled again.
+   */
+  void _releaseMemory() {
+    ReleaseMemory(_histEncodedRows);
+    ReleaseMemory(_histKeyIndex);
+    ReleaseMemory(_histIdentityIndex);
+    ReleaseMemory(_histKeyedEncodedRows);
+    _blobs.release();
+    _histBlobs.release();
   }
 
   /*
    * Will reassemble parts of historical_data from beginData()
    */
   void _decodeAndNotifyRemovedRows() {
+    VSQLITE_TRACE_SPAN(_trace, "decodeRemovedRows");
     std::vector<uint8_t> encodedData;
-    MyRowDecoderListener listener(_colIds);
+    _resetColumnNames();
+    RowViewDecoderListener listener(_columnNames, _histBlobs, *_listener);
 
     assembleOnlyRemovedRows(_histEncodedHeaderRow, _histEncodedRows, encodedData);
 
     crow::Decoder *pDec = crow::DecoderFactory::New(encodedData.data(), encodedData.size());
 
     pDec->decode(listener);
+    _removeCount += listener._rownum;
+
+    delete pDec;
+  }
+  
+  /*
+   * Indexes the rows of historical_data by key columns and/or identity
+   * columns. Only the old row of a change is decoded, when reported.
+   */
+  void _indexHistoricalRows(const uint8_t *data, size_t len) {
+    _resetColumnNames();
+    _keyBuilder.reset(_keyColIds);
+    _identityBuilder.reset(_identityColIds);
+    RowKeysDecoderListener listener(_histBlobs, _keyBuilder, _identityBuilder, _histKeyedEncodedRows);
+
+    crow::Decoder *pDec = crow::DecoderFactory::New(data, len);
+    pDec->decode(listener);
+    delete pDec;
 
-    for (auto & row : listener._rows) {
+    _histKeyIndex.swap(listener._keyIndex);
+    _histIdentityIndex.swap(listener._identityIndex);
+  }
 
-        _listener->onRemoved(row);
-        _removeCount++;
+  /*
+   * Finds a remaining historical row with the same identity as row,
+   * ignoring volatile columns, and consumes it.
+   * @returns true if found.
+   */
+  bool _lookupIdentity(DynMap &row) {
+    if (_histIdentityIndex.empty()) { return false; }
+
+    std::string identity;
+    MakeRowKey(row, _identityColIds, identity);
+    auto range = _histIdentityIndex.equal_range(identity);
+    for (auto it = range.first; it != range.second; ) {
+      size_t idx = it->second;
+      it = _histIdentityIndex.erase(it);
+      if (_histEncodedRows.consume(_histKeyedEncodedRows[idx])) {
+        return true;
+      }
     }
+    return false;
+  }
 
-    delete pDec;
+  /*
+   * row matched a historical row exactly, so once no copies of it
+   * remain, its key is no longer available for change detection.
+   */
+  void _forgetKey(DynMap &row, const uint8_t* ptr, size_t len) {
+    std::string key;
+    MakeRowKey(row, _keyColIds, key);
+    auto fit = _histKeyIndex.find(key);
+    if (fit == _histKeyIndex.end()) { return; }
+    std::string &encodedRow = _histKeyedEncodedRows[fit->second];
+    if (encodedRow.size() == len && 0 == memcmp(encodedRow.data(), ptr, len) &&
+        !_histEncodedRows.contains(encodedRow)) {
+      _histKeyIndex.erase(fit);
+    }
   }
-  
-  bool _lookupEncodedRow(const uint8_t* ptr, size_t len) {
-    if (_histEncodedRows.empty()) { return false; }
 
+  /*
+   * If a remaining historical row has the same key as row, notify
+   * listener of the change and consume the historical row.
+   * @returns true if row was reported as changed.
+   */
+  bool _lookupChangedRow(DynMap &row) {
     std::string key;
-    key.append((const char *)ptr, len);
-    auto fit = _histEncodedRows.find(key);
-    if (fit != _histEncodedRows.end()) {
-      _histEncodedRows.erase(fit);
+    MakeRowKey(row, _keyColIds, key);
+    auto fit = _histKeyIndex.find(key);
+    if (fit == _histKeyIndex.end()) {
+      return false;
+    }
+    size_t idx = fit->second;
+    bool consumed = _histEncodedRows.consume(_histKeyedEncodedRows[idx]);
+    if (!_histEncodedRows.contains(_histKeyedEncodedRows[idx])) {
+      _histKeyIndex.erase(fit);
+    }
+    if (!consumed) {
+      return false;
+    }
 
-      return true;
+    _changeCount++;
+    if (_listener) {
+      DynMap oldRow;
+      _decodeHistoricalRow(_histKeyedEncodedRows[idx], oldRow);
+      std::vector<SPFieldDef> changedColumns;
+      ChangedColumns(oldRow, row, _colIds, changedColumns);
+      _listener->onChanged(oldRow, row, changedColumns);
     }
+    return true;
+  }
 
-    return false;
+  bool _lookupEncodedRow(const uint8_t* ptr, size_t len) {
+    if (_histEncodedRows.empty()) { return false; }
+
+    std::string key;
+    key.append((const char *)ptr, len);
+    return _histEncodedRows.consume(key);
   }
 
   // members
   uint32_t _addCount { 0 };
   uint32_t _removeCount { 0 };
+  uint32_t _changeCount { 0 };
   SPDiffResultsListener _listener;
   crow::Encoder *_pEnc {nullptr};
   std::vector<SPFieldDef> _colIds;
 
-  std::unordered_set<std::string> _histEncodedRows;
+  // kept across data sets
+  ColumnNames _columnNames;
+
+  EncodedRowCounts _histEncodedRows;
   std::string _histEncodedHeaderRow;
   size_t _histTotalRows;
+
+  // rows of the current data set, and sizes of past ones for the trim policy
+  size_t _numRows { 0 };
+  TrimTracker _trimTracker;
+
+  // key column and volatile column modes
+  std::vector<SPFieldDef> _keyColIds;
+  std::vector<SPFieldDef> _identityColIds;
+  std::unordered_map<std::string, size_t> _histKeyIndex;
+  std::unordered_multimap<std::string, size_t> _histIdentityIndex;
+  std::vector<std::string> _histKeyedEncodedRows;
+  RowKeyBuilder _keyBuilder;
+  RowKeyBuilder _identityBuilder;
+
+  // columns of the snapshot that _colIds no longer has, and whether
+  // serialize() records _colIds
+  bool _storeSchema { false };
+  bool _schemaChanged { false };
+  std::vector<SPFieldDef> _removedColIds;
+
+  // long values of current and historical data sets
+  BlobTable _blobs;
+  BlobTable _histBlobs;
+  std::string _blobRef;
+
+  // digest only mode : hashes of encoded rows
+  bool _digestOnly { false };
+  vsqlite_utils::RowSetDigest _digest;
+  vsqlite_utils::RowSetDigest _histDigest;
+
+  // serializes addNewResult(row, producer) calls
+  size_t _numProducers { 1 };
+  std::mutex _producerMutex;
+
+  // phase spans, only built with VSQLITE_TRACE
+  VSQLITE_TRACE_CONTEXT(_trace, "crow");
 };
 
   std::shared_ptr<ResultsSerializer<DynMap> > CrowResultsSerializerNew() {
@@ -0,0 +1,179 @@
+#pragma once
+
+#include "../include/vsqlite_serialize.h"
+
+#include <functional>
+#include <stdint.h>
+#include <string>
+#include <unordered_map>
+#include <utility>
+
+#include "memory_usage.h"
+
+namespace vsqlite {
+
+  /*
+   * Multiset of encoded rows, stored as encoded row -> number of copies.
+   * A table returning many identical rows costs one entry per distinct
+   * row, and each copy is still matched and reported separately.
+   */
+  class EncodedRowCounts {
+  public:
+    typedef std::unordered_map<std::string, uint32_t> Map;
+    typedef Map::const_iterator const_iterator;
+
+    /**
+     * Adds one copy of encodedRow.
+     * @returns the stored row, valid until its last copy is consumed,
+     * or while pinned.
+     */
+    const std::string &insert(const std::string &encodedRow) {
+      auto it = _counts.insert(std::make_pair(encodedRow, 0)).first;
+      it->second++;
+      _total++;
+      return it->first;
+    }
+
+    void insert(const char *p, size_t len) {
+      insert(std::string(p, len));
+    }
+
+    /**
+     * Removes one copy of encodedRow.
+     * @returns true if a copy was present.
+     */
+    bool consume(const std::string &encodedRow) {
+      auto fit = _counts.find(encodedRow);
+      if (fit == _counts.end() || fit->second == 0) {
+        return false;
+      }
+      if (--fit->second == 0 && !_pinned) {
+        _counts.erase(fit);
+      }
+      _total--;
+      return true;
+    }
+
+    bool contains(const std::string &encodedRow) const {
+      auto fit = _counts.find(encodedRow);
+      return fit != _counts.end() && fit->second != 0;
+    }
+
+    /**
+     * While pinned, rows whose copies are all consumed stay in the table
+     * with a count of 0, so that references returned by insert() remain
+     * valid. Unpinning erases them, and must be done before iterating.
+     */
+    void pin() { _pinned = true; }
+
+    void unpin() {
+      if (!_pinned) { return; }
+      _pinned = false;
+      for (auto it = _counts.begin(); it != _counts.end(); ) {
+        if (it->second == 0) {
+          it = _counts.erase(it);
+        } else {
+          ++it;
+        }
+      }
+    }
+
+    void clear() {
+      _counts.clear();
+      _total = 0;
+      _pinned = false;
+    }
+
+    bool empty() const { return _total == 0; }
+
+    /**
+     * @returns number of rows, counting each copy.
+     */
+    size_t total() const { return _total; }
+
+    size_t distinct() const { return _counts.size(); }
+
+    size_t memoryBytes() const { return MemBytes(_counts); }
+
+    /**
+     * Moves the table out, leaving this empty.
+     */
+    Map take() {
+      unpin();
+      Map counts;
+      counts.swap(_counts);
+      _total = 0;
+      return counts;
+    }
+
+    /**
+     * Replaces the table with counts. Entries must not be 0.
+     */
+    void assign(Map &&counts) {
+      _counts = std::move(counts);
+      _total = 0;
+      for (auto &it : _counts) {
+        _total += it.second;
+      }
+    }
+
+    const_iterator begin() const { return _counts.begin(); }
+    const_iterator end() const { return _counts.end(); }
+
+  private:
+    Map _counts;
+    size_t _total { 0 };
+    bool _pinned { false };
+  };
+
+  /*
+   * Cursor over the rows of an EncodedRowCounts, each repeated by its
+   * count. A row is decoded only when the cursor reaches it.
+   */
+  template <class T>
+  class EncodedRowsCursor : public RowCursor<T> {
+  public:
+    /*
+     * Decodes an encoded row into row.
+     * return true on error, false on success
+     */
+    typedef std::function<bool(const std::string &encodedRow, T &row)> DecodeFunc;
+
+    EncodedRowsCursor(const EncodedRowCounts &rows, DecodeFunc decode) : _it(rows.begin()), _end(rows.end()), _decode(decode) {}
+
+    bool next(T &row) override {
+      while (_it != _end) {
+        if (_copiesLeft > 0) {
+          row = _row;
+        } else {
+          row.clear();
+          if (_decode(_it->first, row)) {
+            // skip rows that fail to decode, same as endData()
+            ++_it;
+            continue;
+          }
+          if (_it->second > 1) {
+            _row = row;
+            _copiesLeft = _it->second;
+          }
+        }
+        if (_copiesLeft <= 1) {
+          _copiesLeft = 0;
+          ++_it;
+        } else {
+          _copiesLeft--;
+        }
+        return true;
+      }
+      return false;
+    }
+
+  private:
+    EncodedRowCounts::const_iterator _it;
+    EncodedRowCounts::const_iterator _end;
+    DecodeFunc _decode;
+    T _row; // decoded row while copies remain
+    uint32_t _copiesLeft { 0 };
+  };
+
+} // namespace vsqlite
@@ -0,0 +1,151 @@
+#include "fingerprint.h"
+
+#include <string.h>
+
+#include "kernels.h"
+
+namespace vsqlite_utils {
+
+  // XXH64 primes
+  static const uint64_t P1 = 0x9E3779B185EBCA87ULL;
+  static const uint64_t P2 = 0xC2B2AE3D27D4EB4FULL;
+  static const uint64_t P3 = 0x165667B19E3779F9ULL;
+  static const uint64_t P4 = 0x85EBCA77C2B2AE63ULL;
+  static const uint64_t P5 = 0x27D4EB2F165667C5ULL;
+
+  static const char FINGERPRINT_LINE_PREFIX[] = "{\"#fingerprints\":\"";
+  static const char FINGERPRINT_LINE_SUFFIX[] = "\"}\n";
+
+  static inline uint64_t rotl(uint64_t x, int r) {
+    return (x << r) | (x >> (64 - r));
+  }
+
+  static inline uint64_t read64(const char *p) {
+    uint64_t v;
+    memcpy(&v, p, sizeof(v));
+    return v;
+  }
+
+  static inline uint64_t read32(const char *p) {
+    uint32_t v;
+    memcpy(&v, p, sizeof(v));
+    return v;
+  }
+
+  /*
+   * Multiplying by an odd constant is invertible, so no input block
+   * can cancel the state built from earlier blocks.
+   */
+  static inline uint64_t xxhRound(uint64_t acc, uint64_t input) {
+    acc += input * P2;
+    return rotl(acc, 31) * P1;
+  }
+
+  static inline uint64_t xxhMergeRound(uint64_t acc, uint64_t v) {
+    acc ^= xxhRound(0, v);
+    return acc * P1 + P4;
+  }
+
+  uint64_t FingerprintBytes(const char *p, size_t len, uint64_t seed) {
+    const char *end = p + len;
+    uint64_t h;
+    if (len >= 32) {
+      uint64_t v1 = seed + P1 + P2;
+      uint64_t v2 = seed + P2;
+      uint64_t v3 = seed;
+      uint64_t v4 = seed - P1;
+      do {
+        v1 = xxhRound(v1, read64(p));
+        v2 = xxhRound(v2, read64(p + 8));
+        v3 = xxhRound(v3, read64(p + 16));
+        v4 = xxhRound(v4, read64(p + 24));
+        p += 32;
+      } while (end - p >= 32);
+      h = rotl(v1, 1) + rotl(v2, 7) + rotl(v3, 12) + rotl(v4, 18);
+      h = xxhMergeRound(h, v1);
+      h = xxhMergeRound(h, v2);
+      h = xxhMergeRound(h, v3);
+      h = xxhMergeRound(h, v4);
+    } else {
+      h = seed + P5;
+    }
+    h += (uint64_t)len;
+
+    for (; end - p >= 8; p += 8) {
+      h ^= xxhRound(0, read64(p));
+      h = rotl(h, 27) * P1 + P4;
+    }
+    if (end - p >= 4) {
+      h ^= read32(p) * P1;
+      h = rotl(h, 23) * P2 + P3;
+      p += 4;
+    }
+    for (; p < end; p++) {
+      h ^= (uint8_t)*p * P5;
+      h = rotl(h, 11) * P1;
+    }
+
+    h ^= h >> 33;
+    h *= P2;
+    h ^= h >> 29;
+    h *= P3;
+    h ^= h >> 32;
+    return h;
+  }
+
+  void AppendFingerprintLine(std::string &dest, const std::vector<uint64_t> &fingerprints) {
+    dest.append(FINGERPRINT_LINE_PREFIX);
+    size_t pos = dest.size();
+    dest.resize(pos + fingerprints.size() * 16);
+
+    // little-endian bytes of all fingerprints, then one hex pass
+    std::vector<uint8_t> bytes(fingerprints.size() * 8);
+    for (size_t i=0; i < fingerprints.size(); i++) {
+      for (int j=0; j < 8; j++) {
+        bytes[i * 8 + j] = (uint8_t)(fingerprints[i] >> (8 * j));
+      }
+    }
+    HexEncode(bytes.data(), bytes.size(), &dest[pos]);
+    dest.append(FINGERPRINT_LINE_SUFFIX);
+  }
+
+  size_t ParseFingerprintLine(const std::string &data, std::vector<uint64_t> &dest) {
+    dest.clear();
+
+    const size_t prefixLen = sizeof(FINGERPRINT_LINE_PREFIX) - 1;
+    const size_t suffixLen = sizeof(FINGERPRINT_LINE_SUFFIX) - 1;
+    if (data.size() < prefixLen + suffixLen ||
+        0 != data.compare(data.size() - suffixLen, suffixLen, FINGERPRINT_LINE_SUFFIX)) {
+      return data.size();
+    }
+
+    size_t end = data.size() - suffixLen;
+    size_t lineStart = data.rfind('\n', end - 1);
+    lineStart = (lineStart == std::string::npos ? 0 : lineStart + 1);
+    if (end - lineStart < prefixLen ||
+        0 != data.compare(lineStart, prefixLen, FINGERPRINT_LINE_PREFIX)) {
+      return data.size();
+    }
+
+    const char *hex = data.data() + lineStart + prefixLen;
+    size_t hexLen = end - lineStart - prefixLen;
+    if (hexLen % 16 != 0) {
+      return data.size();
+    }
+
+    std::vector<uint8_t> bytes(hexLen / 2);
+    if (HexDecode(hex, hexLen, bytes.data())) {
+      return data.size();
+    }
+    dest.resize(hexLen / 16);
+    for (size_t i=0; i < dest.size(); i++) {
+      uint64_t fingerprint = 0;
+      for (int j=0; j < 8; j++) {
+        fingerprint |= (uint64_t)bytes[i * 8 + j] << (8 * j);
+      }
+      dest[i] = fingerprint;
+    }
+    return lineStart;
+  }
+
+} // namespace vsqlite_utils
@@ -0,0 +1,106 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string>
+#include <vector>
+
+/*
+ * Fast 64-bit hashing of row values, without encoding the row first.
+ * The hash is fixed (not seeded per process), so fingerprints can be
+ * stored in a snapshot and compared on the next run.
+ */
+namespace vsqlite_utils {
+
+  /**
+   * @returns XXH64 of the bytes, little-endian, with seed.
+   */
+  uint64_t FingerprintBytes(const char *p, size_t len, uint64_t seed = 0);
+
+  inline uint64_t FingerprintBytes(const std::string &str, uint64_t seed = 0) {
+    return FingerprintBytes(str.data(), str.size(), seed);
+  }
+
+  /*
+   * Fingerprint of a row, built from its set fields in column order.
+   * Two rows get the same fingerprint if they have the same names and
+   * values in the same order, so it follows the JSON encoding of a row.
+   */
+  class RowFingerprint {
+  public:
+    /**
+     * nameHash is FingerprintBytes(name), which callers with a fixed
+     * schema compute once per column.
+     */
+    void addField(uint64_t nameHash, const std::string &value) {
+      _h = FingerprintBytes(value, _h ^ nameHash);
+    }
+
+    void addField(const std::string &name, const std::string &value) {
+      addField(FingerprintBytes(name), value);
+    }
+
+    uint64_t value() const { return _h; }
+
+  private:
+    uint64_t _h { 0 };
+  };
+
+  /*
+   * Order-independent digest of a multiset of row hashes. Two data sets
+   * with the same rows, in any order, have equal digests.
+   */
+  class RowSetDigest {
+  public:
+    void add(uint64_t rowHash) {
+      _count++;
+      _sum += rowHash;
+      // second lane is a non-linear function of the hash, so that
+      // different rows whose hashes add up the same still differ
+      uint64_t h = rowHash;
+      h ^= h >> 33;
+      h *= 0xff51afd7ed558ccdULL;
+      h ^= h >> 33;
+      _mixedSum += h;
+    }
+
+    /**
+     * Adds the rows of other, as if their hashes were added here.
+     */
+    void add(const RowSetDigest &other) {
+      _count += other._count;
+      _sum += other._sum;
+      _mixedSum += other._mixedSum;
+    }
+
+    void clear() {
+      _count = 0;
+      _sum = 0;
+      _mixedSum = 0;
+    }
+
+    bool operator==(const RowSetDigest &other) const {
+      return _count == other._count && _sum == other._sum && _mixedSum == other._mixedSum;
+    }
+    bool operator!=(const RowSetDigest &other) const { return !(*this == other); }
+
+  private:
+    uint64_t _count { 0 };
+    uint64_t _sum { 0 };
+    uint64_t _mixedSum { 0 };
+  };
+
+  /**
+   * Appends the fingerprints of a JSON lines snapshot as its last line,
+   * {"#fingerprints":"<16 hex digits per row>"}
+   */
+  void AppendFingerprintLine(std::string &dest, const std::vector<uint64_t> &fingerprints);
+
+  /**
+   * If data ends with a fingerprint line, fills dest with the fingerprints.
+   * @returns length of data before the fingerprint line, which is
+   * data.size() if there is none.
+   */
+  size_t ParseFingerprintLine(const std::string &data, std::vector<uint64_t> &dest);
+
+} // namespace vsqlite_utils
@@ -4,50 +4,137 @@
 //using SizeType = ::std::size_t;
 //} // namespace rapidjson
 
+#include <algorithm>
+#include <assert.h>
 #include <rapidjson/document.h>
-#include <rapidjson/stringbuffer.h>
-#include <rapidjson/writer.h>
+#include <mutex>
 #include <sstream>
-#include <unordered_set>
+#include <string.h>
+#include <unordered_map>
+
+#include "blob_table.h"
+#include "concurrent_row_counts.h"
+#include "encoded_row_counts.h"
+#include "fingerprint.h"
+#include "kernels.h"
+#include "memory_usage.h"
+#include "row_cache.h"
+#include "row_keys.h"
+#include "schema.h"
+#include "string_pool.h"
+#include "trace.h"
 
 namespace rj = rapidjson;
 
-static void SPLIT(const std::string &s, char delim, std::unordered_set<std::string> &dest) {
-  std::stringstream ss(s);
-  std::string item;
-  while (std::getline(ss, item, delim)) {
-    if (item.empty()) { continue; }
-    if (item[0] == ' ') { item.erase(0); }
-    if (item[item.size()-1] == ' ') { item.erase(item.size()-1); }
+// a parse arena reused across rows is freed once it holds this many bytes
+static const size_t PARSE_ARENA_BYTES = 1 << 20;
+
+/*
+ * Frees the memory pool of doc, reused to parse a batch of rows, once
+ * it reaches PARSE_ARENA_BYTES. Values parsed into doc are invalid after.
+ */
+static void TrimParseArena(rj::Document &doc) {
+  if (doc.GetAllocator().Size() > PARSE_ARENA_BYTES) {
+    doc.GetAllocator().Clear();
+  }
+}
+
+static void SPLIT(const char *p, size_t len, char delim, std::vector<std::string> &dest) {
+  const char *end = p + len;
+  while (p < end) {
+    const char *q = (const char *)memchr(p, delim, end - p);
+    if (q == nullptr) { q = end; }
+    std::string item(p, q - p);
+    p = q + 1;
+    if (!item.empty() && item[0] == ' ') { item.erase(0, 1); }
+    if (!item.empty() && item[item.size()-1] == ' ') { item.erase(item.size()-1); }
     if (item.empty()) { continue; }
-    dest.insert(item);
+    dest.push_back(item);
   }
 }
 
 namespace vsqlite {
 
-class JSONResultsSerializer : public ResultsSerializer<DynMap> {
+class JSONResultsSerializer : public ResultsSerializer<DynMap>, public std::enable_shared_from_this<JSONResultsSerializer> {
 public:
   virtual ~JSONResultsSerializer() {}
+
+  using ResultsSerializer<DynMap>::beginData;
+
   /**
    * Initialize with historical data and optional listener.
    */
-  virtual bool beginData(std::string &historical_data, SPDiffResultsListener listener, std::vector<SPFieldDef> &knownColumnIds) override {
+  virtual bool beginData(std::string &historical_data, SPDiffResultsListener listener, std::vector<SPFieldDef> &knownColumnIds, const DiffOptions &options) override {
+    VSQLITE_TRACE_LABEL(_trace, options.traceLabel);
+    VSQLITE_TRACE_SPAN(_trace, "beginData");
+    if (_trimTracker.beginDataSet(_fingerprints.size())) {
+      _releaseMemory();
+    }
     _addCount = 0;
     _removeCount = 0;
+    _changeCount = 0;
     _listener = listener;
+    _numProducers = options.numProducers;
     _encodedLines.clear();
+    _keyColIds = options.keyColumnIds;
+    _histKeyIndex.clear();
+    _histIdentityIndex.clear();
+    _histFingerprintIndex.clear();
+    _fingerprints.clear();
+    _blobs.clear();
+    _blobs.setMinSize(options.blobMinSize);
+    _histBlobs.clear();
+    _histBlobLine.clear();
+    _storeSchema = options.storeSchema;
+    _storeFingerprints = options.storeFingerprints;
 
     _colIds.clear();
     _ss = std::stringstream();
+    _rowCache.beginCycle();
 
     // add known columns
     if (!knownColumnIds.empty()) {
       for (auto &id : knownColumnIds) { _colIds.push_back(id); }
     }
 
-    if (!historical_data.empty()) {
-      SPLIT(historical_data, '\n', _encodedLines);
+    // historical key values are matched by column name
+    if (!_keyColIds.empty() && _colIds.empty()) {
+      return true;
+    }
+
+    // identity is every known column except volatile ones
+    _identityColIds.clear();
+    if (!options.volatileColumnIds.empty()) {
+      _identityColIds = ExcludeColumns(_colIds, options.volatileColumnIds);
+    }
+    bool digestOnly = options.digestOnly && _identityColIds.empty();
+
+    _removedColIds.clear();
+    _schemaChanged = false;
+    _compareSchema(historical_data, options.volatileColumnIds);
+    _columnsChanged();
+
+    // digest only : compare with the digest of the stored fingerprints
+
+    _digestOnly = false;
+    _digest.clear();
+    _histDigest.clear();
+    if (digestOnly && _readHistoricalDigest(historical_data)) {
+      _digestOnly = true;
+    } else if (!historical_data.empty()) {
+      _extractEncodedLines(historical_data);
+
+      if (!_keyColIds.empty() || !_identityColIds.empty()) {
+        _indexHistoricalRows();
+      }
+    }
+
+    // concurrent mode : lookups that would change shared indexes, or
+    // store blobs, go through the mutex instead
+    _producers.clear();
+    if (options.numProducers > 1 && !_colIds.empty() && _keyColIds.empty() && _identityColIds.empty() && options.blobMinSize == 0) {
+      _producers.resize(options.numProducers);
+      _sharedLines.assign(_encodedLines);
     }
 
     return false;
@@ -59,33 +146,91 @@ public:
    * @returns true if row was not in historical_data.
    */
   virtual bool addNewResult(DynMap &row) override {
-    bool wasFoundInHistoricalResults = false;
+    if (!_producers.empty()) {
+      return addNewResult(row, 0);
+    }
+    VSQLITE_TRACE_ROW(_trace);
+    _setColumns(row);
 
-    // get column ids if not set
+    uint64_t fingerprint = _prepareRow(row, _rowValues);
 
-    if (_colIds.empty()) {
-      for (auto &it : row) {
-        _colIds.push_back(it.first);
-      }
+    // an unchanged row reuses its historical line, otherwise encode it
+
+    std::string row_json;
+    bool isHistoricalLine = !_digestOnly && _identityColIds.empty() && _lookupFingerprint(_rowValues, fingerprint, row_json);
+    if (!isHistoricalLine) {
+      _serializeRow(_rowValues, row_json);
     }
+    return _addEncodedRow(row, fingerprint, row_json, isHistoricalLine);
+  }
 
+  /**
+   * Reuses the line and fingerprint row had in a previous data set if
+   * its version is unchanged. Not with blobs, since the line would
+   * reference blobs missing from this data set.
+   */
+  virtual bool addNewResult(DynMap &row, uint64_t rowId, uint64_t version) override {
+    if (_blobs.minSize() != 0 || !_producers.empty()) {
+      return addNewResult(row);
+    }
+    VSQLITE_TRACE_ROW(_trace);
+    _setColumns(row);
+
+    uint64_t fingerprint;
     std::string row_json;
-    _serializeRow(row, row_json);
+    if (!_rowCache.find(rowId, version, fingerprint, row_json)) {
+      fingerprint = _prepareRow(row, _rowValues);
+      _serializeRow(_rowValues, row_json);
+      _rowCache.put(rowId, version, fingerprint, row_json);
+    }
+    return _addEncodedRow(row, fingerprint, row_json, false);
+  }
 
-    // append to running encoding
-    _ss << row_json << "\n";
+  /**
+   * In concurrent mode, each producer encodes into its own buffer and
+   * consumes historical lines from a table shared without locks.
+   * Calls are not traced, since trace batches are per serializer.
+   */
+  virtual bool addNewResult(DynMap &row, size_t producer) override {
+    if (producer >= _numProducers) {
+      assert(false);
+      return false;
+    }
+    if (_producers.empty()) {
+      std::lock_guard<std::mutex> lock(_producerMutex);
+      return addNewResult(row);
+    }
+    Producer &p = _producers[producer];
+    uint64_t fingerprint = _prepareRow(row, p.rowValues);
+    p.fingerprints.push_back(fingerprint);
+
+    if (_digestOnly) {
+      p.digest.add(fingerprint);
+      _serializeRow(p.rowValues, p.rowJson);
+      p.lines.append(p.rowJson);
+      p.lines += '\n';
+      return false;
+    }
 
-    // lookup
+    // an unchanged row reuses its historical line, otherwise encode it
 
-    auto fit = _encodedLines.find(row_json);
-    if (fit != _encodedLines.end()) {
+    bool wasFoundInHistoricalResults = false;
+    auto fit = _histFingerprintIndex.find(fingerprint);
+    if (fit != _histFingerprintIndex.end() && _lineMatches(p.rowValues, *fit->second) && _sharedLines.consume(*fit->second)) {
+      p.lines.append(*fit->second);
       wasFoundInHistoricalResults = true;
-      _encodedLines.erase(fit);
+    } else {
+      _serializeRow(p.rowValues, p.rowJson);
+      p.lines.append(p.rowJson);
+      wasFoundInHistoricalResults = _sharedLines.consume(p.rowJson);
     }
+    p.lines += '\n';
 
-    if (!wasFoundInHistoricalResults && _listener) {
-      _addCount++;
-      _listener->onAdded(row);
+    if (!wasFoundInHistoricalResults) {
+      p.addCount++;
+      if (_listener) {
+        _listener->onAdded(row);
+      }
     }
     return !wasFoundInHistoricalResults;
   }
@@ -97,49 +242,396 @@ public:
    * false if unchanged.
    */
   virtual bool endData() override {
-    if (_listener && !_encodedLines.empty()) {
-      for (auto &encLine : _encodedLines) {
+    VSQLITE_TRACE_END_ROWS(_trace);
+    VSQLITE_TRACE_SPAN(_trace, "endData");
+    if (!_producers.empty()) {
+      _mergeProducers();
+    }
+    _histFingerprintIndex.clear();
+    _encodedLines.unpin();
+    if (_digestOnly) {
+      return _schemaChanged || _digest != _histDigest;
+    }
+
+    // without a listener, removed rows are left for removedRows()
+    bool hasRemovedRows = !_encodedLines.empty();
+
+    if (_listener && hasRemovedRows) {
+      for (auto &it : _encodedLines) {
         DynMap row;
-        if (_decodeRow(encLine, row)) {
+        bool failed = _decodeRow(it.first, row, _parseDoc);
+        TrimParseArena(_parseDoc);
+        if (failed) {
           // fail
         } else {
-          _listener->onRemoved(row);
-          _removeCount++;
+          for (uint32_t i=0; i < it.second; i++) {
+            _listener->onRemoved(row);
+            _removeCount++;
+          }
         }
       }
+      _encodedLines.clear();
     }
-    // TODO: find all removed entries
-    return !(_addCount == 0 && _removeCount == 0);
+    _parseDoc.GetAllocator().Clear();
+    // a schema change is reported even if all rows match on the shared
+    // columns, so that the snapshot is rewritten with the new columns
+    return !(_addCount == 0 && _removeCount == 0 && _changeCount == 0 && !hasRemovedRows && !_schemaChanged);
   }
 
   /**
    * Serializes the current data snapshot into dest.
    */
   virtual void serialize(std::string &dest) override {
-    dest = _ss.str();
+    VSQLITE_TRACE_SPAN(_trace, "serialize");
+    dest.clear();
+    if (_storeSchema && !_colIds.empty()) {
+      AppendSchemaJsonLine(dest, _colIds);
+    }
+    dest.append(_ss.str());
+    if (_blobs.active()) {
+      _blobs.appendJsonLine(dest);
+    }
+    if (_storeFingerprints && !_fingerprints.empty()) {
+      vsqlite_utils::AppendFingerprintLine(dest, _fingerprints);
+    }
+  }
+
+  virtual std::shared_ptr<RowCursor<DynMap> > removedRows() override {
+    // one parse arena for the cursor, cleared as it grows. The cursor
+    // holds the serializer, whose lines it walks.
+    auto self = shared_from_this();
+    auto doc = std::make_shared<rj::Document>();
+    return std::make_shared<EncodedRowsCursor<DynMap> >(_encodedLines, [self, doc](const std::string &encLine, DynMap &row) {
+      bool failed = self->_decodeRow(encLine, row, *doc);
+      TrimParseArena(*doc);
+      return failed;
+    });
+  }
+
+  /**
+   * Removed lines are copied as is, except lines with encoded values,
+   * blob references or escaped NULs, which are rendered again with the
+   * values.
+   */
+  virtual size_t appendRemovedRowsJson(std::string &dest) override {
+    size_t count = 0;
+    bool hasBlobs = !_histBlobLine.empty() || _histBlobs.active();
+    rj::Document doc;
+    std::string resolved;
+    for (auto &it : _encodedLines) {
+      const std::string *line = &it.first;
+      if (hasBlobs && line->find("\\u0000") != std::string::npos) {
+        bool failed = _resolveBlobs(*line, resolved, doc);
+        TrimParseArena(doc);
+        if (failed) {
+          continue;
+        }
+        line = &resolved;
+      }
+      for (uint32_t i=0; i < it.second; i++) {
+        dest.append(*line);
+        dest += '\n';
+        count++;
+      }
+    }
+    return count;
+  }
+
+  virtual MemoryUsage memoryUsage() override {
+    MemoryUsage usage;
+    usage.historical = _encodedLines.memoryBytes() + MemBytes(_histFingerprintIndex) + MemBytes(_histKeyIndex) +
+        MemBytes(_histIdentityIndex) + _histBlobs.memoryBytes() + MemBytes(_histBlobLine);
+    usage.current = (size_t)_ss.tellp() + MemBytes(_fingerprints) + _blobs.memoryBytes();
+    usage.other = MemBytes(_rowValues.values) + _rowValues.isSet.capacity() / 8 + MemBytes(_namePrefixes) + _columnNames.memoryBytes() +
+        _rowCache.memoryBytes() + _parseDoc.GetAllocator().Capacity();
+    return usage;
+  }
+
+  virtual void setTrimPolicy(const TrimPolicy &policy) override {
+    _trimTracker.setPolicy(policy);
   }
 
 protected:
 
   /*
-   * The decoder creates field infos as it decodes, and they
-   * won't be the exact same instances as the application uses.
-   * This maps them to application field so that comparisons work.
+   * String values of the row being added, per column of _colIds.
+   */
+  struct RowValues {
+    std::vector<std::string> values;
+    std::vector<bool> isSet;
+    std::string blobRef;
+  };
+
+  /*
+   * Output of one producer in concurrent mode, appended to the
+   * snapshot at endData().
+   */
+  struct Producer {
+    RowValues rowValues;
+    std::string rowJson;
+    std::string lines;
+    std::vector<uint64_t> fingerprints;
+    vsqlite_utils::RowSetDigest digest;
+    uint32_t addCount { 0 };
+    char padding[64]; // keeps producers written by different threads off the same cache line
+  };
+
+  /*
+   * If the snapshot starts with a schema line of other columns than
+   * _colIds, rows are compared on the columns both have, and columns
+   * only the snapshot has are still decoded for removed rows.
+   */
+  void _compareSchema(const std::string &historical_data, const std::vector<SPFieldDef> &volatileColIds) {
+    size_t len = SchemaJsonLineLength(historical_data);
+    std::vector<SPFieldDef> histColIds;
+    if (len == 0 || ParseSchemaJsonLine(historical_data.substr(0, len), histColIds)) {
+      return;
+    }
+    if (_colIds.empty() || histColIds.empty() || SameColumns(_colIds, histColIds)) {
+      return;
+    }
+    _schemaChanged = true;
+    _removedColIds = ExcludeColumns(histColIds, _colIds);
+    _identityColIds = ExcludeColumns(SharedColumns(_colIds, histColIds), volatileColIds);
+  }
+
+  /*
+   * Fills _histDigest from the fingerprint line of historical_data.
+   * @returns false if historical_data has rows but no fingerprint line.
+   */
+  bool _readHistoricalDigest(const std::string &historical_data) {
+    std::vector<uint64_t> fingerprints;
+    if (!historical_data.empty() &&
+        vsqlite_utils::ParseFingerprintLine(historical_data, fingerprints) == historical_data.size()) {
+      return false;
+    }
+    for (auto fingerprint : fingerprints) {
+      _histDigest.add(fingerprint);
+    }
+    return true;
+  }
+
+  /*
+   * Splits historical_data, after its schema line, into _encodedLines,
+   * and indexes the stored lines by the fingerprints stored with them.
+   * _encodedLines is pinned until endData(), so the index can point
+   * into it. Snapshots without fingerprints, or whose fingerprints
+   * collide, are matched by encoded line only.
    */
-  SPFieldDef GetAppColumnId(std::string fieldName) {
-    for (SPFieldDef colId : _colIds) {
-      if (colId->name == fieldName) {
-        return colId;
+  void _extractEncodedLines(const std::string &historical_data) {
+    std::vector<uint64_t> fingerprints;
+    size_t len = vsqlite_utils::ParseFingerprintLine(historical_data, fingerprints);
+    size_t start = std::min(SchemaJsonLineLength(historical_data), len);
+
+    std::vector<std::string> lines;
+    SPLIT(historical_data.data() + start, len - start, '\n', lines);
+    _takeBlobLine(lines);
+    if (fingerprints.size() != lines.size()) {
+      // last line was not a fingerprint line after all
+      lines.clear();
+      SPLIT(historical_data.data() + start, historical_data.size() - start, '\n', lines);
+      _takeBlobLine(lines);
+      fingerprints.clear();
+    }
+
+    if (!fingerprints.empty()) {
+      _encodedLines.pin();
+    }
+    for (size_t i=0; i < lines.size(); i++) {
+      const std::string &line = _encodedLines.insert(lines[i]);
+      if (fingerprints.empty()) { continue; }
+
+      auto res = _histFingerprintIndex.insert(std::make_pair(fingerprints[i], &line));
+      if (!res.second && res.first->second != &line) {
+        _histFingerprintIndex.clear();
+        fingerprints.clear();
       }
     }
-    return nullptr;
   }
 
   /*
+   * Moves the blob section, the last line before the fingerprints,
+   * out of lines. It is parsed when a row needs it.
+   */
+  void _takeBlobLine(std::vector<std::string> &lines) {
+    _histBlobLine.clear();
+    if (!lines.empty() && BlobTable::IsJsonLine(lines.back().data(), lines.back().size())) {
+      _histBlobLine.swap(lines.back());
+      lines.pop_back();
+    }
+  }
+
+  const BlobTable &_historicalBlobs() {
+    if (!_histBlobLine.empty()) {
+      _histBlobs.parseJsonLine(_histBlobLine);
+      _histBlobLine.clear();
+    }
+    return _histBlobs;
+  }
+
+  /*
+   * Gets column ids from the first row if not set.
+   */
+  void _setColumns(DynMap &row) {
+    if (!_colIds.empty()) {
+      return;
+    }
+    for (auto &it : row) {
+      _colIds.push_back(it.first);
+    }
+    _columnsChanged();
+  }
+
+  /*
+   * Appends row_json to the running encoding and looks it up in
+   * historical data, by identity if some columns are volatile.
+   * @param isHistoricalLine true if row_json was already consumed from
+   * historical data.
+   * @returns true if row was not in historical_data.
+   */
+  bool _addEncodedRow(DynMap &row, uint64_t fingerprint, const std::string &row_json, bool isHistoricalLine) {
+    _fingerprints.push_back(fingerprint);
+    _ss << row_json << "\n";
+
+    if (_digestOnly) {
+      _digest.add(fingerprint);
+      return false;
+    }
+
+    bool wasFoundInHistoricalResults = isHistoricalLine;
+    if (!wasFoundInHistoricalResults) {
+      if (_identityColIds.empty()) {
+        wasFoundInHistoricalResults = _encodedLines.consume(row_json);
+      } else {
+        wasFoundInHistoricalResults = _lookupIdentity(row);
+      }
+    }
+
+    // key columns : same key as a historical row means changed, not added
+
+    if (!_histKeyIndex.empty()) {
+      if (wasFoundInHistoricalResults) {
+        _forgetKey(row, row_json);
+      } else if (_lookupChangedRow(row)) {
+        return true;
+      }
+    }
+
+    if (!wasFoundInHistoricalResults) {
+      _addCount++;
+      if (_listener) {
+        _listener->onAdded(row);
+      }
+    }
+    return !wasFoundInHistoricalResults;
+  }
+
+  /*
+   * Fills rv with the string value of each set column, long values
+   * replaced by blob references.
+   * @returns fingerprint of the row, same as hashing the output of
+   * _serializeRow(), without rendering it.
+   */
+  uint64_t _prepareRow(DynMap &row, RowValues &rv) {
+    vsqlite_utils::RowFingerprint fingerprint;
+    rv.isSet.assign(_colIds.size(), false);
+    rv.values.resize(_colIds.size());
+    for (size_t i=0; i < _colIds.size(); i++) {
+      DynVal &val = row[_colIds[i]];
+      if (!val.valid()) {
+        continue;
+      }
+      rv.isSet[i] = true;
+      rv.values[i] = val.as_s();
+      if (_blobs.minSize() != 0 && _blobs.encode(rv.values[i], rv.blobRef)) {
+        rv.values[i].swap(rv.blobRef);
+      }
+      fingerprint.addField(_nameHashes[i], rv.values[i]);
+    }
+    return fingerprint.value();
+  }
+
+  /*
+   * If a remaining historical line has fingerprint and the values of rv,
+   * consumes it and copies it to dest. Fingerprints are only 64 bits,
+   * so the line is compared before it is reused.
+   * @returns true if found.
+   */
+  bool _lookupFingerprint(const RowValues &rv, uint64_t fingerprint, std::string &dest) {
+    auto fit = _histFingerprintIndex.find(fingerprint);
+    if (fit == _histFingerprintIndex.end() || !_lineMatches(rv, *fit->second) || !_encodedLines.consume(*fit->second)) {
+      return false;
+    }
+    dest = *fit->second;
+    return true;
+  }
+
+  /*
+   * @returns true if line is what _serializeRow() renders for rv,
+   * compared in place rather than rendered.
+   */
+  bool _lineMatches(const RowValues &rv, const std::string &line) {
+    const char *p = line.data();
+    const char *end = p + line.size();
+    if (p == end || *p++ != '{') {
+      return false;
+    }
+    bool isFirst = true;
+    for (size_t i=0; i < _colIds.size(); i++) {
+      if (!rv.isSet[i]) {
+        continue;
+      }
+      if (!isFirst && (p == end || *p++ != ',')) {
+        return false;
+      }
+      isFirst = false;
+      const std::string &prefix = _namePrefixes[i];
+      if ((size_t)(end - p) < prefix.size() || 0 != memcmp(p, prefix.data(), prefix.size())) {
+        return false;
+      }
+      p += prefix.size();
+      size_t n = vsqlite_utils::MatchJsonString(p, end - p, rv.values[i]);
+      if (n == 0) {
+        return false;
+      }
+      p += n;
+    }
+    return end - p == 1 && *p == '}';
+  }
+
+  /*
+   * Renders encLine again into dest, with blob references replaced by
+   * their values.
    * return true on error, false on success
    */
-  bool _decodeRow(const std::string &encRow, DynMap &row) {
-    rj::Document doc;
+  bool _resolveBlobs(const std::string &encLine, std::string &dest, rj::Document &doc) {
+    if (doc.Parse(encLine.c_str()).HasParseError() || !doc.IsObject()) {
+      return true;
+    }
+    dest = "{";
+    for (const auto& i : doc.GetObject()) {
+      if (!i.value.IsString()) {
+        continue;
+      }
+      if (dest.size() > 1) { dest += ','; }
+      vsqlite_utils::AppendJsonString(dest, i.name.GetString(), i.name.GetStringLength());
+      dest += ':';
+      const char *value = i.value.GetString();
+      size_t size = i.value.GetStringLength();
+      _historicalBlobs().resolve(value, size);
+      vsqlite_utils::AppendJsonString(dest, value, size);
+    }
+    dest += '}';
+    return false;
+  }
+
+  /*
+   * doc is reused for a batch of rows : its memory pool grows in large
+   * chunks until TrimParseArena() frees them. Values are copied into
+   * row, whose nodes and strings are still allocated per row.
+   * return true on error, false on success
+   */
+  bool _decodeRow(const std::string &encRow, DynMap &row, rj::Document &doc) {
     if (doc.Parse(encRow.c_str()).HasParseError()) {
       // TODO: log
       return true;
@@ -149,52 +641,263 @@ protected:
     }
 
     for (const auto& i : doc.GetObject()) {
-      std::string name(i.name.GetString());
-      if (!name.empty() && i.value.IsString()) {
-        auto id = GetAppColumnId(name);
+      if (i.name.GetStringLength() > 0 && i.value.IsString()) {
+        // map decoded names to application fields, so that comparisons work
+        auto id = _columnNames.find(i.name.GetString(), i.name.GetStringLength());
         if (id == nullptr) {
           // TODO: log
         } else {
-          row[id] = i.value.GetString();
+          const char *value = i.value.GetString();
+          size_t size = i.value.GetStringLength();
+          _historicalBlobs().resolve(value, size);
+          row[id] = DynVal(std::string(value, size));
         }
       }
     }
     return false;
   }
 
-  inline rj::Value SVAL(const std::string &str) {
-    rj::Value retval;
-    retval.SetString(str.c_str(), str.size(), doc.GetAllocator());
-    return retval;
+  /*
+   * Indexes historical lines by key columns and/or identity columns,
+   * hashing their values from the parsed line, without building rows.
+   */
+  void _indexHistoricalRows() {
+    _keyBuilder.reset(_keyColIds);
+    _identityBuilder.reset(_identityColIds);
+    std::string key;
+    for (auto &it : _encodedLines) {
+      const std::string &encLine = it.first;
+      TrimParseArena(_parseDoc);
+      if (_parseDoc.Parse(encLine.c_str()).HasParseError() || !_parseDoc.IsObject()) {
+        continue;
+      }
+      for (const auto& i : _parseDoc.GetObject()) {
+        if (!i.value.IsString()) {
+          continue;
+        }
+        const char *value = i.value.GetString();
+        size_t size = i.value.GetStringLength();
+        _historicalBlobs().resolve(value, size);
+        _keyBuilder.set(i.name.GetString(), i.name.GetStringLength(), value, size);
+        _identityBuilder.set(i.name.GetString(), i.name.GetStringLength(), value, size);
+      }
+      if (!_keyBuilder.empty()) {
+        _keyBuilder.build(key);
+        _histKeyIndex[key] = encLine;
+      }
+      if (!_identityBuilder.empty()) {
+        _identityBuilder.build(key);
+        for (uint32_t i=0; i < it.second; i++) {
+          _histIdentityIndex.insert(std::make_pair(key, encLine));
+        }
+      }
+    }
+    _parseDoc.GetAllocator().Clear();
+  }
+
+  /*
+   * Finds a remaining historical row with the same identity as row,
+   * ignoring volatile columns, and consumes it.
+   * @returns true if found.
+   */
+  bool _lookupIdentity(DynMap &row) {
+    if (_histIdentityIndex.empty()) { return false; }
+
+    std::string identity;
+    MakeRowKey(row, _identityColIds, identity);
+    auto range = _histIdentityIndex.equal_range(identity);
+    for (auto it = range.first; it != range.second; ) {
+      bool consumed = _encodedLines.consume(it->second);
+      it = _histIdentityIndex.erase(it);
+      if (consumed) {
+        return true;
+      }
+    }
+    return false;
+  }
+
+  /*
+   * row matched a historical row exactly, so once no copies of it
+   * remain, its key is no longer available for change detection.
+   */
+  void _forgetKey(DynMap &row, const std::string &row_json) {
+    std::string key;
+    MakeRowKey(row, _keyColIds, key);
+    auto fit = _histKeyIndex.find(key);
+    if (fit != _histKeyIndex.end() && fit->second == row_json && !_encodedLines.contains(row_json)) {
+      _histKeyIndex.erase(fit);
+    }
+  }
+
+  /*
+   * If a remaining historical row has the same key as row, notify
+   * listener of the change and consume the historical row.
+   * @returns true if row was reported as changed.
+   */
+  bool _lookupChangedRow(DynMap &row) {
+    std::string key;
+    MakeRowKey(row, _keyColIds, key);
+    auto fit = _histKeyIndex.find(key);
+    if (fit == _histKeyIndex.end()) {
+      return false;
+    }
+    std::string encLine = fit->second;
+    bool consumed = _encodedLines.consume(encLine);
+    if (!_encodedLines.contains(encLine)) {
+      _histKeyIndex.erase(fit);
+    }
+    if (!consumed) {
+      return false;
+    }
+
+    _changeCount++;
+    if (_listener) {
+      DynMap oldRow;
+      _decodeRow(encLine, oldRow, _parseDoc);
+      TrimParseArena(_parseDoc);
+      std::vector<SPFieldDef> changedColumns;
+      ChangedColumns(oldRow, row, _colIds, changedColumns);
+      _listener->onChanged(oldRow, row, changedColumns);
+    }
+    return true;
   }
 
-  void _serializeRow(DynMap &row, std::string &dest) {
-    rj::Value obj(rj::kObjectType);
+  /*
+   * Frees containers sized by the largest data set, called by the trim
+   * policy before they are filled again.
+   */
+  void _releaseMemory() {
+    ReleaseMemory(_encodedLines);
+    ReleaseMemory(_histFingerprintIndex);
+    ReleaseMemory(_histKeyIndex);
+    ReleaseMemory(_histIdentityIndex);
+    ReleaseMemory(_fingerprints);
+    ReleaseMemory(_histBlobLine);
+    _blobs.release();
+    _histBlobs.release();
+    ReleaseMemory(_rowCache);
+  }
 
-    for (auto &id : _colIds) {
+  /*
+   * Called when _colIds is set. Resolves decoded names, including
+   * columns only the snapshot has, and renders
+   * the escaped '"name":' prefix and name hash of each column once
+   * per schema.
+   */
+  void _columnsChanged() {
+    if (_removedColIds.empty()) {
+      _columnNames.reset(_colIds);
+    } else {
+      std::vector<SPFieldDef> ids(_colIds);
+      ids.insert(ids.end(), _removedColIds.begin(), _removedColIds.end());
+      _columnNames.reset(ids);
+    }
+    if (!_colIds.empty() && !SameColumns(_colIds, _rowCacheColIds)) {
+      // cached lines follow the column order
+      _rowCache.clear();
+      _rowCacheColIds = _colIds;
+    }
+    _namePrefixes.resize(_colIds.size());
+    _nameHashes.resize(_colIds.size());
+    for (size_t i=0; i < _colIds.size(); i++) {
+      std::string &prefix = _namePrefixes[i];
+      prefix.clear();
+      vsqlite_utils::AppendJsonString(prefix, _colIds[i]->name);
+      prefix += ':';
+      _nameHashes[i] = vsqlite_utils::FingerprintBytes(_colIds[i]->name);
+    }
+  }
 
-      if (!row[id].valid()) {
+  /*
+   * Renders the values of a _prepareRow() call as a JSON object,
+   * escaped the same way as rapidjson::Writer.
+   */
+  void _serializeRow(const RowValues &rv, std::string &dest) {
+    dest = "{";
+    for (size_t i=0; i < _colIds.size(); i++) {
+      if (!rv.isSet[i]) {
         continue;
       }
-      obj.AddMember(SVAL(id->name),SVAL(row[id].as_s()),doc.GetAllocator());
+      if (dest.size() > 1) { dest += ','; }
+      dest += _namePrefixes[i];
+      vsqlite_utils::AppendJsonString(dest, rv.values[i]);
     }
-    // render to string
-
-    rj::StringBuffer buffer;
-    rj::Writer<rj::StringBuffer> writer(buffer);
-    obj.Accept(writer);
+    dest += '}';
+  }
 
-    dest = buffer.GetString();
+  /*
+   * Appends the producer buffers in producer order, and moves the
+   * historical lines left back to _encodedLines.
+   */
+  void _mergeProducers() {
+    for (auto &p : _producers) {
+      _ss << p.lines;
+      _fingerprints.insert(_fingerprints.end(), p.fingerprints.begin(), p.fingerprints.end());
+      _digest.add(p.digest);
+      _addCount += p.addCount;
+    }
+    _producers.clear();
+    _sharedLines.moveTo(_encodedLines);
   }
 
   // members
   uint32_t _addCount { 0 };
   uint32_t _removeCount { 0 };
+  uint32_t _changeCount { 0 };
   SPDiffResultsListener _listener;
   std::vector<SPFieldDef> _colIds;
-  rj::Document doc;
+  std::vector<std::string> _namePrefixes; // per column of _colIds
+  std::vector<uint64_t> _nameHashes; // per column of _colIds
   std::stringstream _ss;
-  std::unordered_set<std::string> _encodedLines;
+  std::vector<uint64_t> _fingerprints; // per line of _ss
+  EncodedRowCounts _encodedLines;
+  std::unordered_map<uint64_t, const std::string *> _histFingerprintIndex; // into _encodedLines
+
+  // values of the row being added
+  RowValues _rowValues;
+
+  // parse arena for historical rows, freed at the end of beginData() and endData()
+  rj::Document _parseDoc;
+
+  // concurrent mode : per producer output, and historical lines shared by producers
+  std::vector<Producer> _producers;
+  ConcurrentRowCounts _sharedLines;
+  std::mutex _producerMutex;
+  size_t _numProducers { 1 };
+
+  // long values of current and historical data sets
+  BlobTable _blobs;
+  BlobTable _histBlobs;
+  std::string _histBlobLine;
+
+  // digest only mode
+  bool _digestOnly { false };
+  vsqlite_utils::RowSetDigest _digest;
+  vsqlite_utils::RowSetDigest _histDigest;
+
+  // kept across data sets
+  ColumnNames _columnNames;
+  RowEncodingCache _rowCache;
+  std::vector<SPFieldDef> _rowCacheColIds;
+  TrimTracker _trimTracker;
+
+  // key column and volatile column modes : key or identity -> historical line
+  std::vector<SPFieldDef> _keyColIds;
+  std::vector<SPFieldDef> _identityColIds;
+  std::unordered_map<std::string, std::string> _histKeyIndex;
+  std::unordered_multimap<std::string, std::string> _histIdentityIndex;
+  RowKeyBuilder _keyBuilder;
+  RowKeyBuilder _identityBuilder;
+
+  // columns of the snapshot that _colIds no longer has, and whether
+  // serialize() records _colIds
+  bool _storeSchema { false };
+  bool _storeFingerprints { false };
+  bool _schemaChanged { false };
+  std::vector<SPFieldDef> _removedColIds;
+
+  // phase spans, only built with VSQLITE_TRACE
+  VSQLITE_TRACE_CONTEXT(_trace, "json");
 };
 
   std::shared_ptr<ResultsSerializer<DynMap> > JsonResultsSerializerNew() {
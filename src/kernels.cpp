@@ -0,0 +1,348 @@
+#include "kernels.h"
+
+#include <string.h>
+
+#if (defined(__x86_64__) || defined(__i386__)) && defined(__GNUC__) && defined(__SSE2__)
+#define VSQLITE_X86_KERNELS 1
+#include <immintrin.h>
+#endif
+
+namespace vsqlite_utils {
+
+  struct Kernels {
+    KernelLevel level;
+    size_t (*findJsonEscape)(const char *p, size_t len);
+    void (*hexEncode)(const uint8_t *p, size_t len, char *dest);
+    bool (*hexDecode)(const char *p, size_t len, uint8_t *dest);
+  };
+
+  //------------------------------------------------------------
+  // scalar
+
+  static const char hexCharsLower[] = "0123456789abcdef";
+
+  static inline bool needsJsonEscape(uint8_t c) {
+    return c < 0x20 || c == '"' || c == '\\';
+  }
+
+  static size_t findJsonEscapeScalar(const char *p, size_t len) {
+    for (size_t i=0; i < len; i++) {
+      if (needsJsonEscape((uint8_t)p[i])) {
+        return i;
+      }
+    }
+    return len;
+  }
+
+  static void hexEncodeScalar(const uint8_t *p, size_t len, char *dest) {
+    for (size_t i=0; i < len; i++) {
+      *dest++ = hexCharsLower[p[i] >> 4];
+      *dest++ = hexCharsLower[p[i] & 0x0F];
+    }
+  }
+
+  /*
+   * @returns 0..15, or 0xFF if c is not a hex digit
+   */
+  static inline uint8_t hexDigitValue(char c) {
+    if (c >= '0' && c <= '9') { return (uint8_t)(c - '0'); }
+    if (c >= 'a' && c <= 'f') { return (uint8_t)(c - 'a' + 10); }
+    if (c >= 'A' && c <= 'F') { return (uint8_t)(c - 'A' + 10); }
+    return 0xFF;
+  }
+
+  static bool hexDecodeScalar(const char *p, size_t len, uint8_t *dest) {
+    for (size_t i=0; i + 1 < len; i += 2) {
+      uint8_t hi = hexDigitValue(p[i]);
+      uint8_t lo = hexDigitValue(p[i+1]);
+      if (hi > 15 || lo > 15) {
+        return true;
+      }
+      *dest++ = (uint8_t)(hi << 4 | lo);
+    }
+    return false;
+  }
+
+  static const Kernels gScalarKernels = {
+    KERNELS_SCALAR, findJsonEscapeScalar, hexEncodeScalar, hexDecodeScalar
+  };
+
+#ifdef VSQLITE_X86_KERNELS
+
+  //------------------------------------------------------------
+  // SSE2
+
+  static inline __m128i jsonEscapeMask128(__m128i v) {
+    const __m128i ctrlMax = _mm_set1_epi8(0x1F);
+    __m128i isCtrl = _mm_cmpeq_epi8(_mm_max_epu8(v, ctrlMax), ctrlMax);
+    __m128i isQuote = _mm_cmpeq_epi8(v, _mm_set1_epi8('"'));
+    __m128i isBackslash = _mm_cmpeq_epi8(v, _mm_set1_epi8('\\'));
+    return _mm_or_si128(isCtrl, _mm_or_si128(isQuote, isBackslash));
+  }
+
+  static size_t findJsonEscapeSSE2(const char *p, size_t len) {
+    size_t i = 0;
+    for (; i + 16 <= len; i += 16) {
+      __m128i v = _mm_loadu_si128((const __m128i *)(p + i));
+      int mask = _mm_movemask_epi8(jsonEscapeMask128(v));
+      if (mask != 0) {
+        return i + __builtin_ctz(mask);
+      }
+    }
+    return i + findJsonEscapeScalar(p + i, len - i);
+  }
+
+  // nibbles 0..15 to '0'..'9','a'..'f'
+  static inline __m128i nibblesToHex128(__m128i n) {
+    __m128i isAlpha = _mm_cmpgt_epi8(n, _mm_set1_epi8(9));
+    __m128i ascii = _mm_add_epi8(n, _mm_set1_epi8('0'));
+    return _mm_add_epi8(ascii, _mm_and_si128(isAlpha, _mm_set1_epi8('a' - '0' - 10)));
+  }
+
+  static void hexEncodeSSE2(const uint8_t *p, size_t len, char *dest) {
+    const __m128i lowNibble = _mm_set1_epi8(0x0F);
+    size_t i = 0;
+    for (; i + 16 <= len; i += 16) {
+      __m128i v = _mm_loadu_si128((const __m128i *)(p + i));
+      __m128i hi = nibblesToHex128(_mm_and_si128(_mm_srli_epi16(v, 4), lowNibble));
+      __m128i lo = nibblesToHex128(_mm_and_si128(v, lowNibble));
+      _mm_storeu_si128((__m128i *)(dest + 2 * i), _mm_unpacklo_epi8(hi, lo));
+      _mm_storeu_si128((__m128i *)(dest + 2 * i + 16), _mm_unpackhi_epi8(hi, lo));
+    }
+    // 8 bytes, the size of a fingerprint or blob ref
+    if (i + 8 <= len) {
+      __m128i v = _mm_loadl_epi64((const __m128i *)(p + i));
+      __m128i hi = nibblesToHex128(_mm_and_si128(_mm_srli_epi16(v, 4), lowNibble));
+      __m128i lo = nibblesToHex128(_mm_and_si128(v, lowNibble));
+      _mm_storeu_si128((__m128i *)(dest + 2 * i), _mm_unpacklo_epi8(hi, lo));
+      i += 8;
+    }
+    hexEncodeScalar(p + i, len - i, dest + 2 * i);
+  }
+
+  /*
+   * Hex digit values of 16 chars. invalid is set to 0xFF in lanes
+   * that are not hex digits.
+   */
+  static inline __m128i hexValues128(__m128i v, __m128i &invalid) {
+    // unsigned a <= b  <=>  max(a,b) == b
+    __m128i digit = _mm_sub_epi8(v, _mm_set1_epi8('0'));
+    __m128i isDigit = _mm_cmpeq_epi8(_mm_max_epu8(digit, _mm_set1_epi8(9)), _mm_set1_epi8(9));
+    __m128i alpha = _mm_sub_epi8(_mm_or_si128(v, _mm_set1_epi8(0x20)), _mm_set1_epi8('a'));
+    __m128i isAlpha = _mm_cmpeq_epi8(_mm_max_epu8(alpha, _mm_set1_epi8(5)), _mm_set1_epi8(5));
+    invalid = _mm_andnot_si128(_mm_or_si128(isDigit, isAlpha), _mm_set1_epi8((char)0xFF));
+    return _mm_or_si128(_mm_and_si128(isDigit, digit),
+                        _mm_and_si128(isAlpha, _mm_add_epi8(alpha, _mm_set1_epi8(10))));
+  }
+
+  // pairs of nibbles (high first) in 16 lanes to 8 bytes in 16-bit lanes
+  static inline __m128i combineNibbles128(__m128i values) {
+    __m128i hi = _mm_and_si128(values, _mm_set1_epi16(0x00FF));
+    __m128i lo = _mm_srli_epi16(values, 8);
+    return _mm_or_si128(_mm_slli_epi16(hi, 4), lo);
+  }
+
+  static bool hexDecodeSSE2(const char *p, size_t len, uint8_t *dest) {
+    size_t i = 0;
+    for (; i + 32 <= len; i += 32) {
+      __m128i invalidA, invalidB;
+      __m128i a = hexValues128(_mm_loadu_si128((const __m128i *)(p + i)), invalidA);
+      __m128i b = hexValues128(_mm_loadu_si128((const __m128i *)(p + i + 16)), invalidB);
+      if (_mm_movemask_epi8(_mm_or_si128(invalidA, invalidB)) != 0) {
+        return true;
+      }
+      __m128i bytes = _mm_packus_epi16(combineNibbles128(a), combineNibbles128(b));
+      _mm_storeu_si128((__m128i *)(dest + i / 2), bytes);
+    }
+    // 16 digits, the size of a fingerprint or blob ref
+    if (i + 16 <= len) {
+      __m128i invalid;
+      __m128i a = hexValues128(_mm_loadu_si128((const __m128i *)(p + i)), invalid);
+      if (_mm_movemask_epi8(invalid) != 0) {
+        return true;
+      }
+      _mm_storel_epi64((__m128i *)(dest + i / 2), _mm_packus_epi16(combineNibbles128(a), _mm_setzero_si128()));
+      i += 16;
+    }
+    return hexDecodeScalar(p + i, len - i, dest + i / 2);
+  }
+
+  static const Kernels gSSE2Kernels = {
+    KERNELS_SSE2, findJsonEscapeSSE2, hexEncodeSSE2, hexDecodeSSE2
+  };
+
+  //------------------------------------------------------------
+  // AVX2 : scanning only, hex uses SSE2
+
+  __attribute__((target("avx2")))
+  static size_t findJsonEscapeAVX2(const char *p, size_t len) {
+    const __m256i ctrlMax = _mm256_set1_epi8(0x1F);
+    const __m256i quote = _mm256_set1_epi8('"');
+    const __m256i backslash = _mm256_set1_epi8('\\');
+    size_t i = 0;
+    for (; i + 32 <= len; i += 32) {
+      __m256i v = _mm256_loadu_si256((const __m256i *)(p + i));
+      __m256i isCtrl = _mm256_cmpeq_epi8(_mm256_max_epu8(v, ctrlMax), ctrlMax);
+      __m256i special = _mm256_or_si256(isCtrl, _mm256_or_si256(_mm256_cmpeq_epi8(v, quote),
+                                                                _mm256_cmpeq_epi8(v, backslash)));
+      unsigned mask = (unsigned)_mm256_movemask_epi8(special);
+      if (mask != 0) {
+        return i + __builtin_ctz(mask);
+      }
+    }
+    return i + findJsonEscapeSSE2(p + i, len - i);
+  }
+
+  static const Kernels gAVX2Kernels = {
+    KERNELS_AVX2, findJsonEscapeAVX2, hexEncodeSSE2, hexDecodeSSE2
+  };
+
+#endif // VSQLITE_X86_KERNELS
+
+  //------------------------------------------------------------
+  // dispatch
+
+  static KernelLevel supportedLevel() {
+#ifdef VSQLITE_X86_KERNELS
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2")) {
+      return KERNELS_AVX2;
+    }
+    return KERNELS_SSE2;
+#else
+    return KERNELS_SCALAR;
+#endif
+  }
+
+  static const Kernels *selectKernels(KernelLevel level) {
+    KernelLevel supported = supportedLevel();
+    if (level > supported) {
+      level = supported;
+    }
+    switch (level) {
+#ifdef VSQLITE_X86_KERNELS
+      case KERNELS_AVX2: return &gAVX2Kernels;
+      case KERNELS_SSE2: return &gSSE2Kernels;
+#endif
+      default: return &gScalarKernels;
+    }
+  }
+
+  static const Kernels *&activeKernels() {
+    static const Kernels *kernels = selectKernels(KERNELS_AVX2);
+    return kernels;
+  }
+
+  KernelLevel GetKernelLevel() {
+    return activeKernels()->level;
+  }
+
+  KernelLevel SetKernelLevel(KernelLevel level) {
+    activeKernels() = selectKernels(level);
+    return activeKernels()->level;
+  }
+
+  const char *KernelLevelName(KernelLevel level) {
+    switch (level) {
+      case KERNELS_AVX2: return "avx2";
+      case KERNELS_SSE2: return "sse2";
+      default: return "scalar";
+    }
+  }
+
+  //------------------------------------------------------------
+  // public
+
+  size_t FindJsonEscape(const char *p, size_t len) {
+    return activeKernels()->findJsonEscape(p, len);
+  }
+
+  /*
+   * Renders the escape sequence of a byte found by findJsonEscape.
+   * @returns its length.
+   */
+  static size_t renderJsonEscape(uint8_t c, char esc[6]) {
+    static const char shortEscapes[0x20] = {
+      0, 0, 0, 0, 0, 0, 0, 0, 'b', 't', 'n', 0, 'f', 'r', 0, 0,
+      0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0
+    };
+    static const char hexCharsUpper[] = "0123456789ABCDEF";
+
+    esc[0] = '\\';
+    if (c == '"' || c == '\\') {
+      esc[1] = (char)c;
+      return 2;
+    }
+    if (shortEscapes[c] != 0) {
+      esc[1] = shortEscapes[c];
+      return 2;
+    }
+    esc[1] = 'u';
+    esc[2] = '0';
+    esc[3] = '0';
+    esc[4] = hexCharsUpper[c >> 4];
+    esc[5] = hexCharsUpper[c & 0x0F];
+    return 6;
+  }
+
+  void AppendJsonString(std::string &dest, const char *p, size_t len) {
+    auto findEscape = activeKernels()->findJsonEscape;
+    char esc[6];
+
+    dest += '"';
+    while (len > 0) {
+      size_t n = findEscape(p, len);
+      dest.append(p, n);
+      if (n == len) {
+        break;
+      }
+      dest.append(esc, renderJsonEscape((uint8_t)p[n], esc));
+      p += n + 1;
+      len -= n + 1;
+    }
+    dest += '"';
+  }
+
+  size_t MatchJsonString(const char *line, size_t lineLen, const char *p, size_t len) {
+    auto findEscape = activeKernels()->findJsonEscape;
+    char esc[6];
+
+    if (lineLen == 0 || line[0] != '"') {
+      return 0;
+    }
+    size_t pos = 1;
+    while (len > 0) {
+      size_t n = findEscape(p, len);
+      if (lineLen - pos < n || 0 != memcmp(line + pos, p, n)) {
+        return 0;
+      }
+      pos += n;
+      if (n == len) {
+        break;
+      }
+      size_t escLen = renderJsonEscape((uint8_t)p[n], esc);
+      if (lineLen - pos < escLen || 0 != memcmp(line + pos, esc, escLen)) {
+        return 0;
+      }
+      pos += escLen;
+      p += n + 1;
+      len -= n + 1;
+    }
+    if (pos >= lineLen || line[pos] != '"') {
+      return 0;
+    }
+    return pos + 1;
+  }
+
+  void HexEncode(const uint8_t *p, size_t len, char *dest) {
+    activeKernels()->hexEncode(p, len, dest);
+  }
+
+  bool HexDecode(const char *p, size_t len, uint8_t *dest) {
+    if (len % 2 != 0) {
+      return true;
+    }
+    return activeKernels()->hexDecode(p, len, dest);
+  }
+
+} // namespace vsqlite_utils
@@ -0,0 +1,69 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string>
+
+/*
+ * Byte scanning and hex kernels. On x86 the SSE2 or AVX2 version is
+ * chosen at runtime from the CPU features, other platforms use the
+ * scalar version.
+ */
+namespace vsqlite_utils {
+
+  enum KernelLevel { KERNELS_SCALAR, KERNELS_SSE2, KERNELS_AVX2 };
+
+  /**
+   * @returns level of the kernels in use.
+   */
+  KernelLevel GetKernelLevel();
+
+  /**
+   * Use kernels up to level, limited to what the CPU supports.
+   * Not thread-safe, meant for tests and benchmarks.
+   * @returns level now in use.
+   */
+  KernelLevel SetKernelLevel(KernelLevel level);
+
+  const char *KernelLevelName(KernelLevel level);
+
+  /**
+   * @returns index of the first byte that must be escaped in a JSON
+   * string (quote, backslash or control character), or len if none.
+   */
+  size_t FindJsonEscape(const char *p, size_t len);
+
+  /**
+   * Appends p as a quoted JSON string, escaped the same way as
+   * rapidjson::Writer. Other bytes, including non-ASCII, are copied as is.
+   */
+  void AppendJsonString(std::string &dest, const char *p, size_t len);
+
+  inline void AppendJsonString(std::string &dest, const std::string &str) {
+    AppendJsonString(dest, str.data(), str.size());
+  }
+
+  /**
+   * Compares the start of line with p as AppendJsonString() renders it,
+   * without rendering it.
+   * @returns length of the rendered string at the start of line, or 0
+   * if line does not start with it.
+   */
+  size_t MatchJsonString(const char *line, size_t lineLen, const char *p, size_t len);
+
+  inline size_t MatchJsonString(const char *line, size_t lineLen, const std::string &str) {
+    return MatchJsonString(line, lineLen, str.data(), str.size());
+  }
+
+  /**
+   * Writes 2 * len lowercase hex digits to dest.
+   */
+  void HexEncode(const uint8_t *p, size_t len, char *dest);
+
+  /**
+   * Decodes len hex digits (either case) into len / 2 bytes.
+   * @returns true on error (odd length or invalid digit), false on success.
+   */
+  bool HexDecode(const char *p, size_t len, uint8_t *dest);
+
+} // namespace vsqlite_utils
@@ -0,0 +1,152 @@
+#pragma once
+
+#include "../include/vsqlite_serialize.h"
+
+#include <map>
+#include <memory>
+#include <string>
+#include <type_traits>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+/*
+ * Estimates for ResultsSerializer::memoryUsage(), and the trim policy.
+ * Containers are counted by capacity : element arrays, hash buckets,
+ * nodes, and string buffers past the small string size.
+ */
+namespace vsqlite {
+
+  static const size_t MEMORY_NODE_OVERHEAD = 2 * sizeof(void *);
+
+  /*
+   * Numbers, and pointers to objects counted by their owner, hold no
+   * memory of their own. Other types need an overload, so that a new
+   * member type is not silently counted as 0.
+   */
+  template <class T>
+  typename std::enable_if<std::is_arithmetic<T>::value || std::is_enum<T>::value || std::is_pointer<T>::value, size_t>::type
+  MemBytes(const T &) { return 0; }
+  template <class T> size_t MemBytes(const std::shared_ptr<T> &) { return 0; }
+
+  inline size_t MemBytes(const std::string &s);
+  inline size_t MemBytes(const DynVal &value);
+  inline size_t MemBytes(const DynMap &row);
+  template <class A, class B> size_t MemBytes(const std::pair<A,B> &p);
+  template <class T> size_t MemBytes(const std::vector<T> &v);
+  template <class K, class V, class C> size_t MemBytes(const std::map<K,V,C> &m);
+  template <class K, class V, class H, class E> size_t MemBytes(const std::unordered_map<K,V,H,E> &m);
+  template <class K, class V, class H, class E> size_t MemBytes(const std::unordered_multimap<K,V,H,E> &m);
+
+  inline size_t MemBytes(const std::string &s) {
+    return (s.capacity() > 15 ? s.capacity() + 1 : 0);
+  }
+
+  template <class A, class B> size_t MemBytes(const std::pair<A,B> &p) {
+    return MemBytes(p.first) + MemBytes(p.second);
+  }
+
+  template <class T> size_t MemBytes(const std::vector<T> &v) {
+    size_t n = v.capacity() * sizeof(T);
+    for (auto &item : v) { n += MemBytes(item); }
+    return n;
+  }
+
+  template <class It> size_t NodeBytes(It begin, It end) {
+    size_t n = 0;
+    for (auto it = begin; it != end; ++it) {
+      n += sizeof(*it) + MEMORY_NODE_OVERHEAD + MemBytes(*it);
+    }
+    return n;
+  }
+
+  template <class K, class V, class C> size_t MemBytes(const std::map<K,V,C> &m) {
+    return NodeBytes(m.begin(), m.end());
+  }
+
+  template <class K, class V, class H, class E> size_t MemBytes(const std::unordered_map<K,V,H,E> &m) {
+    return m.bucket_count() * sizeof(void *) + NodeBytes(m.begin(), m.end());
+  }
+
+  template <class K, class V, class H, class E> size_t MemBytes(const std::unordered_multimap<K,V,H,E> &m) {
+    return m.bucket_count() * sizeof(void *) + NodeBytes(m.begin(), m.end());
+  }
+
+  /**
+   * Same as MemBytes(), for a hash table whose values are iterators
+   * into another container, which counts what they point to.
+   */
+  template <class M> size_t IndexBytes(const M &m) {
+    size_t n = m.bucket_count() * sizeof(void *);
+    for (auto &it : m) {
+      n += sizeof(it) + MEMORY_NODE_OVERHEAD + MemBytes(it.first);
+    }
+    return n;
+  }
+
+  /*
+   * String and bytes values are counted by their length, since DynVal
+   * does not expose the capacity of its buffer.
+   */
+  inline size_t MemBytes(const DynVal &value) {
+    if (!value.valid() || (value.type() != TSTRING && value.type() != TBYTES)) {
+      return 0;
+    }
+    size_t len = value.as_s().size();
+    return (len > 15 ? len + 1 : 0);
+  }
+
+  inline size_t MemBytes(const DynMap &row) {
+    return NodeBytes(row.begin(), row.end());
+  }
+
+  /**
+   * Frees the capacity of a container, unlike clear(). Swaps rather
+   * than assigns, since assigning an empty string keeps the buffer.
+   */
+  template <class T> void ReleaseMemory(T &c) {
+    T empty;
+    std::swap(c, empty);
+  }
+
+  /*
+   * Applies a TrimPolicy from the number of rows of each data set.
+   */
+  class TrimTracker {
+  public:
+    void setPolicy(const TrimPolicy &policy) {
+      _policy = policy;
+      _smallDataSets = 0;
+    }
+
+    /**
+     * Called at beginData() with the number of rows of the previous
+     * data set.
+     * @returns true if the serializer should release memory now.
+     */
+    bool beginDataSet(size_t numRows) {
+      if (_policy.afterSmallDataSets == 0) {
+        return false;
+      }
+      if (numRows > _peakRows) {
+        _peakRows = numRows;
+      }
+      if (_peakRows < _policy.minRows || numRows * 2 >= _peakRows) {
+        _smallDataSets = 0;
+        return false;
+      }
+      if (++_smallDataSets < _policy.afterSmallDataSets) {
+        return false;
+      }
+      _smallDataSets = 0;
+      _peakRows = numRows;
+      return true;
+    }
+
+  private:
+    TrimPolicy _policy;
+    size_t _peakRows { 0 };
+    uint32_t _smallDataSets { 0 };
+  };
+
+} // namespace vsqlite
@@ -1,10 +1,15 @@
 #include "../include/vsqlite_serialize.h"
 
+#include <assert.h>
+#include <mutex>
 #include <rapidjson/document.h>
-#include <rapidjson/stringbuffer.h>
-#include <rapidjson/writer.h>
 #include <sstream>
-#include <set>
+#include <unordered_map>
+
+#include "kernels.h"
+#include "memory_usage.h"
+#include "row_keys.h"
+#include "trace.h"
 
 namespace rj = rapidjson;
 
@@ -13,23 +18,55 @@ namespace vsqlite {
 
 typedef std::map<std::string,std::string> Row;
 
-class OsqueryResultsSerializer : public ResultsSerializer<StringMap> {
+// historical row -> number of copies
+typedef std::map<Row, uint32_t> HistRows;
+
+class OsqueryResultsSerializer : public ResultsSerializer<StringMap>, public std::enable_shared_from_this<OsqueryResultsSerializer> {
 public:
   virtual ~OsqueryResultsSerializer() {}
+
+  using ResultsSerializer<StringMap>::beginData;
+
   /**
    * Initialize with historical data and optional listener.
    */
-  virtual bool beginData(std::string &historical_data, SPDiffResultsListenerStringMap listener, std::vector<SPFieldDef> &knownColumnIds) override {
+  virtual bool beginData(std::string &historical_data, SPDiffResultsListenerStringMap listener, std::vector<SPFieldDef> &knownColumnIds, const DiffOptions &options) override {
+    VSQLITE_TRACE_LABEL(_trace, options.traceLabel);
+    VSQLITE_TRACE_SPAN(_trace, "beginData");
+    if (_trimTracker.beginDataSet(_results.size())) {
+      _releaseMemory();
+    }
     _addCount = 0;
     _removeCount = 0;
+    _changeCount = 0;
     _listener = listener;
+    _numProducers = options.numProducers;
     _prevRows.clear();
     _addedRows.clear();
     _removedRows.clear();
     _results.clear();
+    _keyColIds = options.keyColumnIds;
+    _volatileColIds = options.volatileColumnIds;
+    _histKeyIndex.clear();
+    _histIdentityIndex.clear();
+
+    // only used to name changed columns
+    _colIds = knownColumnIds;
 
     if (!historical_data.empty()) {
       _decodeRowArray(historical_data);
+
+      std::string key;
+      for (auto it = _prevRows.begin(); it != _prevRows.end(); ++it) {
+        if (!_keyColIds.empty()) {
+          MakeRowKey((StringMap&)it->first, _keyColIds, key);
+          _histKeyIndex[key] = it;
+        }
+        if (!_volatileColIds.empty()) {
+          MakeRowIdentity((StringMap&)it->first, _volatileColIds, key);
+          _histIdentityIndex.insert(std::make_pair(key, it));
+        }
+      }
     }
 
     return false;
@@ -41,14 +78,26 @@ public:
    * @returns true if row was not in historical_data.
    */
   virtual bool addNewResult(StringMap &row) override {
+    VSQLITE_TRACE_ROW(_trace);
     bool wasFoundInHistoricalResults = false;
 
-    // lookup
+    // lookup, by identity if some columns are volatile
 
-    auto fit = _prevRows.find(row);
-    if (fit != _prevRows.end()) {
-      wasFoundInHistoricalResults = true;
-      _prevRows.erase(fit);
+    if (!_volatileColIds.empty()) {
+      wasFoundInHistoricalResults = _lookupIdentity(row);
+    } else {
+      auto fit = _prevRows.find(row);
+      if (fit != _prevRows.end()) {
+        wasFoundInHistoricalResults = true;
+        _consumeHistoricalRow(fit);
+      }
+    }
+
+    // key columns : same key as a historical row means changed, not added
+
+    if (!wasFoundInHistoricalResults && !_histKeyIndex.empty() && _lookupChangedRow(row)) {
+      _results.push_back(row);
+      return true;
     }
 
     if (!wasFoundInHistoricalResults) {
@@ -64,6 +113,18 @@ public:
     return !wasFoundInHistoricalResults;
   }
 
+  /**
+   * Rows from several producers are added one at a time.
+   */
+  virtual bool addNewResult(StringMap &row, size_t producer) override {
+    if (producer >= _numProducers) {
+      assert(false);
+      return false;
+    }
+    std::lock_guard<std::mutex> lock(_producerMutex);
+    return addNewResult(row);
+  }
+
   /**
    * Indicates that all addNewResult() calls have been made for
    * current data set.
@@ -71,46 +132,184 @@ public:
    * false if unchanged.
    */
   virtual bool endData() override {
-    if (_listener && !_prevRows.empty()) {
-      for (auto &row : _prevRows) {
-        _listener->onRemoved((StringMap&)row);
+    VSQLITE_TRACE_END_ROWS(_trace);
+    VSQLITE_TRACE_SPAN(_trace, "endData");
+    // without a listener, removed rows are left for removedRows()
+    bool hasRemovedRows = !_prevRows.empty();
+
+    if (_listener && hasRemovedRows) {
+      for (auto &it : _prevRows) {
+        for (uint32_t i=0; i < it.second; i++) {
+          _listener->onRemoved((StringMap&)it.first);
           _removeCount++;
+        }
       }
+      _prevRows.clear();
     }
-    // TODO: find all removed entries
-    return !(_addCount == 0 && _removeCount == 0);
+    return !(_addCount == 0 && _removeCount == 0 && _changeCount == 0 && !hasRemovedRows);
   }
 
   /**
    * Serializes the current data snapshot into dest.
    */
   virtual void serialize(std::string &dest) override {
-    doc.SetArray();
-    doc.Clear();
+    VSQLITE_TRACE_SPAN(_trace, "serialize");
+    dest = "[";
     for (auto &row : _results) {
-      _serializeRow(doc, row);
+      if (dest.size() > 1) { dest += ','; }
+      _serializeRow(row, dest);
     }
+    dest += ']';
+  }
+
+  /**
+   * Historical rows are all decoded in beginData(), so the cursor
+   * copies them out of memory.
+   */
+  virtual std::shared_ptr<RowCursor<StringMap> > removedRows() override {
+    return std::make_shared<HistRowsCursor>(shared_from_this(), _prevRows);
+  }
 
-    // render to string
+  virtual size_t appendRemovedRowsJson(std::string &dest) override {
+    size_t count = 0;
+    for (auto &it : _prevRows) {
+      for (uint32_t i=0; i < it.second; i++) {
+        _serializeRow((Row&)it.first, dest);
+        dest += '\n';
+        count++;
+      }
+    }
+    return count;
+  }
 
-    rj::StringBuffer buffer;
-    rj::Writer<rj::StringBuffer> writer(buffer);
-    doc.Accept(writer);
+  virtual MemoryUsage memoryUsage() override {
+    MemoryUsage usage;
+    usage.historical = MemBytes(_prevRows) + IndexBytes(_histKeyIndex) + IndexBytes(_histIdentityIndex);
+    usage.current = (size_t)_ss.tellp() + MemBytes(_results) + MemBytes(_addedRows) + MemBytes(_removedRows);
+    return usage;
+  }
 
-    dest = buffer.GetString();
+  virtual void setTrimPolicy(const TrimPolicy &policy) override {
+    _trimTracker.setPolicy(policy);
   }
 
 protected:
 
+  struct HistRowsCursor : public RowCursor<StringMap> {
+    HistRowsCursor(std::shared_ptr<const void> owner, const HistRows &rows) : owner(owner), it(rows.begin()), end(rows.end()) {}
+
+    bool next(StringMap &row) override {
+      if (it == end) {
+        return false;
+      }
+      row = it->first;
+      if (++copies >= it->second) {
+        copies = 0;
+        ++it;
+      }
+      return true;
+    }
+
+    std::shared_ptr<const void> owner; // serializer holding rows
+    HistRows::const_iterator it;
+    HistRows::const_iterator end;
+    uint32_t copies { 0 };
+  };
+
+  /*
+   * Frees containers sized by the largest data set, called by the trim
+   * policy before they are filled again.
+   */
+  void _releaseMemory() {
+    ReleaseMemory(_histKeyIndex);
+    ReleaseMemory(_histIdentityIndex);
+    ReleaseMemory(_results);
+    ReleaseMemory(_addedRows);
+    ReleaseMemory(_removedRows);
+  }
+
+  /*
+   * Removes one copy of a historical row. Once no copies remain, the
+   * key and identity index entries for it are dropped and it is erased.
+   */
+  void _consumeHistoricalRow(HistRows::iterator hit) {
+    if (--hit->second > 0) {
+      return;
+    }
+
+    std::string key;
+    if (!_keyColIds.empty()) {
+      MakeRowKey((StringMap&)hit->first, _keyColIds, key);
+      auto kit = _histKeyIndex.find(key);
+      if (kit != _histKeyIndex.end() && kit->second == hit) {
+        _histKeyIndex.erase(kit);
+      }
+    }
+
+    if (!_volatileColIds.empty()) {
+      MakeRowIdentity((StringMap&)hit->first, _volatileColIds, key);
+      auto range = _histIdentityIndex.equal_range(key);
+      for (auto it = range.first; it != range.second; ) {
+        if (it->second == hit) {
+          it = _histIdentityIndex.erase(it);
+        } else {
+          ++it;
+        }
+      }
+    }
+
+    _prevRows.erase(hit);
+  }
+
+  /*
+   * If a remaining historical row has the same key as row, notify
+   * listener of the change and consume the historical row.
+   * @returns true if row was reported as changed.
+   */
+  bool _lookupChangedRow(StringMap &row) {
+    std::string key;
+    MakeRowKey(row, _keyColIds, key);
+    auto fit = _histKeyIndex.find(key);
+    if (fit == _histKeyIndex.end()) {
+      return false;
+    }
+    auto hit = fit->second;
+    Row oldRow = hit->first;
+    _consumeHistoricalRow(hit);
+
+    _changeCount++;
+    if (_listener) {
+      std::vector<SPFieldDef> changedColumns;
+      ChangedColumns(oldRow, row, _colIds, changedColumns);
+      _listener->onChanged(oldRow, row, changedColumns);
+    }
+    return true;
+  }
+
+  /*
+   * Finds a remaining historical row with the same identity as row,
+   * ignoring volatile columns, and consumes it.
+   * @returns true if found.
+   */
+  bool _lookupIdentity(StringMap &row) {
+    std::string identity;
+    MakeRowIdentity(row, _volatileColIds, identity);
+    auto fit = _histIdentityIndex.find(identity);
+    if (fit == _histIdentityIndex.end()) {
+      return false;
+    }
+    _consumeHistoricalRow(fit->second);
+    return true;
+  }
+
   bool deserializeRow(const rj::Value& doc, Row& r) {
     if (!doc.IsObject()) {
       return true;
     }
 
     for (const auto& i : doc.GetObject()) {
-      std::string name(i.name.GetString());
-      if (!name.empty() && i.value.IsString()) {
-        r[name] = i.value.GetString();
+      if (i.name.GetStringLength() > 0 && i.value.IsString()) {
+        r[std::string(i.name.GetString(), i.name.GetStringLength())].assign(i.value.GetString(), i.value.GetStringLength());
       }
     }
     return false;
@@ -132,40 +331,55 @@ protected:
       if (status) {
         return status;
       }
-      _prevRows.insert(std::move(r));
+      _prevRows[std::move(r)]++;
     }
     return false;
 
   }
 
-
-  inline rj::Value SVAL(const std::string &str) {
-    rj::Value retval;
-    retval.SetString(str.c_str(), str.size(), doc.GetAllocator());
-    return retval;
-  }
-
-  void _serializeRow(rj::Value &arr, Row &row) {
-    rj::Value obj(rj::kObjectType);
-
+  /*
+   * Appends row as a JSON object, escaped the same way as rapidjson::Writer.
+   */
+  void _serializeRow(Row &row, std::string &dest) {
+    dest += '{';
+    bool first = true;
     for (auto &it : row) {
-      obj.AddMember(SVAL(it.first),SVAL(it.second),doc.GetAllocator());
+      if (!first) { dest += ','; }
+      first = false;
+      vsqlite_utils::AppendJsonString(dest, it.first);
+      dest += ':';
+      vsqlite_utils::AppendJsonString(dest, it.second);
     }
-    arr.PushBack(rj::Value(obj, doc.GetAllocator()).Move(),
-                 doc.GetAllocator());
-    //arr.PushBack(obj, doc.GetAllocator());
+    dest += '}';
   }
 
   // members
   uint32_t _addCount { 0 };
   uint32_t _removeCount { 0 };
+  uint32_t _changeCount { 0 };
   SPDiffResultsListenerStringMap _listener;
-  rj::Document doc;
+  std::vector<SPFieldDef> _colIds;
   std::stringstream _ss;
-  std::multiset<Row> _prevRows;
+  HistRows _prevRows;
   std::vector<Row> _results;
   std::vector<Row> _addedRows;
   std::vector<Row> _removedRows;
+
+  // sizes of past data sets, for the trim policy
+  TrimTracker _trimTracker;
+
+  // key column and volatile column modes : key or identity -> historical row
+  std::vector<SPFieldDef> _keyColIds;
+  std::vector<SPFieldDef> _volatileColIds;
+  std::unordered_map<std::string, HistRows::iterator> _histKeyIndex;
+  std::unordered_multimap<std::string, HistRows::iterator> _histIdentityIndex;
+
+  // serializes addNewResult(row, producer) calls
+  size_t _numProducers { 1 };
+  std::mutex _producerMutex;
+
+  // phase spans, only built with VSQLITE_TRACE
+  VSQLITE_TRACE_CONTEXT(_trace, "osquery_json");
 };
 
   std::shared_ptr<ResultsSerializer<StringMap> > OsqueryJsonResultsSerializerNew() {
@@ -0,0 +1,85 @@
+#pragma once
+
+#include "../include/vsqlite_serialize.h"
+
+#include <stdint.h>
+#include <string>
+#include <unordered_map>
+
+#include "memory_usage.h"
+
+namespace vsqlite {
+
+  /*
+   * Encoded line and fingerprint of rows from the previous data sets,
+   * keyed by the row id passed to addNewResult(row, rowId, version).
+   * A row passed again with the same version reuses them instead of
+   * being encoded again. Entries not used during a data set are dropped
+   * at the next beginCycle(), so the cache holds one data set at most.
+   */
+  class RowEncodingCache {
+  public:
+
+    /**
+     * Copies the entry for rowId to fingerprint and encoded, if it was
+     * stored with version.
+     * @returns true if found.
+     */
+    bool find(uint64_t rowId, uint64_t version, uint64_t &fingerprint, std::string &encoded) {
+      auto fit = _entries.find(rowId);
+      if (fit == _entries.end() || fit->second.version != version) {
+        return false;
+      }
+      fit->second.cycle = _cycle;
+      fingerprint = fit->second.fingerprint;
+      encoded = fit->second.encoded;
+      return true;
+    }
+
+    void put(uint64_t rowId, uint64_t version, uint64_t fingerprint, const std::string &encoded) {
+      Entry &entry = _entries[rowId];
+      entry.version = version;
+      entry.fingerprint = fingerprint;
+      entry.encoded = encoded;
+      entry.cycle = _cycle;
+    }
+
+    /**
+     * Starts a data set : drops entries not used during the previous one.
+     */
+    void beginCycle() {
+      for (auto it = _entries.begin(); it != _entries.end(); ) {
+        if (it->second.cycle != _cycle) {
+          it = _entries.erase(it);
+        } else {
+          ++it;
+        }
+      }
+      _cycle++;
+    }
+
+    void clear() { _entries.clear(); }
+
+    size_t size() const { return _entries.size(); }
+
+    size_t memoryBytes() const {
+      size_t n = _entries.bucket_count() * sizeof(void *);
+      for (auto &it : _entries) {
+        n += sizeof(it) + MEMORY_NODE_OVERHEAD + MemBytes(it.second.encoded);
+      }
+      return n;
+    }
+
+  private:
+    struct Entry {
+      uint64_t version;
+      uint64_t fingerprint;
+      std::string encoded;
+      uint32_t cycle;
+    };
+
+    std::unordered_map<uint64_t, Entry> _entries;
+    uint32_t _cycle { 0 };
+  };
+
+} // namespace vsqlite
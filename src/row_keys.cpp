@@ -0,0 +1,146 @@
+#include "row_keys.h"
+
+namespace vsqlite {
+
+  static const char KEY_PART_NULL = 'n';
+  static const char KEY_PART_VALUE = 'v';
+
+  static inline void appendKeyPart(std::string &dest, const std::string &value) {
+    dest += KEY_PART_VALUE;
+    dest += std::to_string(value.size());
+    dest += ':';
+    dest += value;
+  }
+
+  void MakeRowKey(DynMap &row, const std::vector<SPFieldDef> &keyColumnIds, std::string &dest) {
+    dest.clear();
+    for (auto &id : keyColumnIds) {
+      DynVal &val = row[id];
+      if (!val.valid()) {
+        dest += KEY_PART_NULL;
+        continue;
+      }
+      appendKeyPart(dest, val.as_s());
+    }
+  }
+
+  void MakeRowKey(StringMap &row, const std::vector<SPFieldDef> &keyColumnIds, std::string &dest) {
+    dest.clear();
+    for (auto &id : keyColumnIds) {
+      auto fit = row.find(id->name);
+      if (fit == row.end()) {
+        dest += KEY_PART_NULL;
+        continue;
+      }
+      appendKeyPart(dest, fit->second);
+    }
+  }
+
+  void RowKeyBuilder::reset(const std::vector<SPFieldDef> &keyColumnIds) {
+    _positions.clear();
+    for (size_t i=0; i < keyColumnIds.size(); i++) {
+      _positions[keyColumnIds[i]->name] = i;
+    }
+    _values.assign(keyColumnIds.size(), std::string());
+    _isSet.assign(keyColumnIds.size(), false);
+  }
+
+  void RowKeyBuilder::set(const char *name, size_t nameLen, const char *value, size_t size) {
+    _name.assign(name, nameLen);
+    auto fit = _positions.find(_name);
+    if (fit == _positions.end()) {
+      return;
+    }
+    _values[fit->second].assign(value, size);
+    _isSet[fit->second] = true;
+  }
+
+  void RowKeyBuilder::build(std::string &dest) {
+    dest.clear();
+    for (size_t i=0; i < _values.size(); i++) {
+      if (!_isSet[i]) {
+        dest += KEY_PART_NULL;
+        continue;
+      }
+      appendKeyPart(dest, _values[i]);
+      _isSet[i] = false;
+    }
+  }
+
+  static bool containsName(const std::vector<SPFieldDef> &ids, const std::string &name) {
+    for (auto &id : ids) {
+      if (id->name == name) {
+        return true;
+      }
+    }
+    return false;
+  }
+
+  std::vector<SPFieldDef> ExcludeColumns(const std::vector<SPFieldDef> &colIds, const std::vector<SPFieldDef> &excludedIds) {
+    std::vector<SPFieldDef> result;
+    for (auto &id : colIds) {
+      if (!containsName(excludedIds, id->name)) {
+        result.push_back(id);
+      }
+    }
+    return result;
+  }
+
+  void MakeRowIdentity(StringMap &row, const std::vector<SPFieldDef> &excludedIds, std::string &dest) {
+    dest.clear();
+    for (auto &it : row) {
+      if (containsName(excludedIds, it.first)) {
+        continue;
+      }
+      appendKeyPart(dest, it.first);
+      appendKeyPart(dest, it.second);
+    }
+  }
+
+  void ChangedColumns(DynMap &oldRow, DynMap &newRow, const std::vector<SPFieldDef> &colIds, std::vector<SPFieldDef> &dest) {
+    dest.clear();
+    for (auto &id : colIds) {
+      DynVal &oldVal = oldRow[id];
+      DynVal &newVal = newRow[id];
+      if (oldVal.valid() != newVal.valid()) {
+        dest.push_back(id);
+      } else if (oldVal.valid() && oldVal.as_s() != newVal.as_s()) {
+        dest.push_back(id);
+      }
+    }
+  }
+
+  static SPFieldDef findOrAllocColumn(const std::string &name, const std::vector<SPFieldDef> &colIds) {
+    for (auto &id : colIds) {
+      if (id->name == name) {
+        return id;
+      }
+    }
+    return FieldDef::alloc(TSTRING, name);
+  }
+
+  void ChangedColumns(StringMap &oldRow, StringMap &newRow, const std::vector<SPFieldDef> &colIds, std::vector<SPFieldDef> &dest) {
+    dest.clear();
+
+    // both maps are sorted by name, so walk them together
+
+    auto itOld = oldRow.begin();
+    auto itNew = newRow.begin();
+    while (itOld != oldRow.end() || itNew != newRow.end()) {
+      if (itNew == newRow.end() || (itOld != oldRow.end() && itOld->first < itNew->first)) {
+        dest.push_back(findOrAllocColumn(itOld->first, colIds));
+        ++itOld;
+      } else if (itOld == oldRow.end() || itNew->first < itOld->first) {
+        dest.push_back(findOrAllocColumn(itNew->first, colIds));
+        ++itNew;
+      } else {
+        if (itOld->second != itNew->second) {
+          dest.push_back(findOrAllocColumn(itOld->first, colIds));
+        }
+        ++itOld;
+        ++itNew;
+      }
+    }
+  }
+
+} // namespace vsqlite
@@ -0,0 +1,73 @@
+#pragma once
+
+#include "../include/vsqlite_serialize.h"
+
+#include <unordered_map>
+
+/*
+ * Helpers for matching rows on a subset of columns
+ * (DiffOptions::keyColumnIds and DiffOptions::volatileColumnIds).
+ */
+namespace vsqlite {
+
+  /**
+   * Builds a composite key from the values of keyColumnIds in row.
+   * Values are length-prefixed, and unset values are distinct from
+   * empty strings, so different rows cannot produce the same key.
+   */
+  void MakeRowKey(DynMap &row, const std::vector<SPFieldDef> &keyColumnIds, std::string &dest);
+  void MakeRowKey(StringMap &row, const std::vector<SPFieldDef> &keyColumnIds, std::string &dest);
+
+  /**
+   * Builds the same key as MakeRowKey() from the values of an encoded
+   * row, passed one field at a time as they are decoded, so historical
+   * rows can be indexed without decoding them into a map.
+   * Fields of other columns are ignored.
+   */
+  class RowKeyBuilder {
+  public:
+    void reset(const std::vector<SPFieldDef> &keyColumnIds);
+
+    bool empty() const { return _values.empty(); }
+
+    bool contains(const std::string &name) const { return _positions.count(name) != 0; }
+
+    void set(const char *name, size_t nameLen, const char *value, size_t size);
+    void set(const std::string &name, const std::string &value) { set(name.data(), name.size(), value.data(), value.size()); }
+
+    /**
+     * Fills dest with the key of the fields set since the last build().
+     */
+    void build(std::string &dest);
+
+  private:
+    std::unordered_map<std::string, size_t> _positions;
+    std::vector<std::string> _values;
+    std::vector<bool> _isSet;
+    std::string _name;
+  };
+
+  /**
+   * @returns columns of colIds whose names are not in excludedIds.
+   */
+  std::vector<SPFieldDef> ExcludeColumns(const std::vector<SPFieldDef> &colIds, const std::vector<SPFieldDef> &excludedIds);
+
+  /**
+   * Builds a key from every value of row except columns named in excludedIds.
+   * Column names are part of the key, since StringMap rows have no fixed schema.
+   */
+  void MakeRowIdentity(StringMap &row, const std::vector<SPFieldDef> &excludedIds, std::string &dest);
+
+  /**
+   * Fills dest with the columns of colIds whose values differ between rows.
+   */
+  void ChangedColumns(DynMap &oldRow, DynMap &newRow, const std::vector<SPFieldDef> &colIds, std::vector<SPFieldDef> &dest);
+
+  /**
+   * Fills dest with the columns whose values differ between rows.
+   * Column names are mapped to the matching entry of colIds, or a
+   * TSTRING FieldDef if there is none.
+   */
+  void ChangedColumns(StringMap &oldRow, StringMap &newRow, const std::vector<SPFieldDef> &colIds, std::vector<SPFieldDef> &dest);
+
+} // namespace vsqlite
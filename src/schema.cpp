@@ -0,0 +1,132 @@
+#include "schema.h"
+
+#include <rapidjson/document.h>
+#include <string.h>
+
+#include "kernels.h"
+#include "row_keys.h"
+#include "varint.h"
+
+namespace rj = rapidjson;
+
+using namespace vsqlite_utils;
+
+namespace vsqlite {
+
+  static const char SCHEMA_MAGIC[] = { 'V', 'S', 'S', '1' };
+  static const char SCHEMA_LINE_PREFIX[] = "{\"#columns\":{";
+
+  /*
+   * @returns true if typeId is one of the types rows hold. Other ids in
+   * a schema come from a corrupt snapshot, and would not convert to a
+   * type.
+   */
+  static bool IsTypeId(uint64_t typeId) {
+    switch (typeId) {
+      case TINT8: case TUINT8: case TINT16: case TUINT16:
+      case TINT32: case TUINT32: case TINT64: case TUINT64:
+      case TFLOAT32: case TFLOAT64: case TSTRING: case TBYTES:
+        return true;
+      default:
+        return false;
+    }
+  }
+
+  bool SameColumns(const std::vector<SPFieldDef> &a, const std::vector<SPFieldDef> &b) {
+    if (a.size() != b.size()) {
+      return false;
+    }
+    for (size_t i=0; i < a.size(); i++) {
+      if (a[i]->name != b[i]->name || a[i]->typeId != b[i]->typeId) {
+        return false;
+      }
+    }
+    return true;
+  }
+
+  std::vector<SPFieldDef> SharedColumns(const std::vector<SPFieldDef> &colIds, const std::vector<SPFieldDef> &histColIds) {
+    return ExcludeColumns(colIds, ExcludeColumns(colIds, histColIds));
+  }
+
+  void AppendSchemaJsonLine(std::string &dest, const std::vector<SPFieldDef> &colIds) {
+    dest.append(SCHEMA_LINE_PREFIX);
+    for (size_t i=0; i < colIds.size(); i++) {
+      if (i > 0) { dest += ','; }
+      AppendJsonString(dest, colIds[i]->name);
+      dest += ':';
+      dest.append(std::to_string((int)colIds[i]->typeId));
+    }
+    dest.append("}}\n");
+  }
+
+  bool IsSchemaJsonLine(const char *p, size_t len) {
+    const size_t prefixLen = sizeof(SCHEMA_LINE_PREFIX) - 1;
+    return len >= prefixLen && 0 == memcmp(p, SCHEMA_LINE_PREFIX, prefixLen);
+  }
+
+  size_t SchemaJsonLineLength(const std::string &data) {
+    if (!IsSchemaJsonLine(data.data(), data.size())) {
+      return 0;
+    }
+    const char *eol = (const char *)memchr(data.data(), '\n', data.size());
+    return (eol == nullptr ? data.size() : (size_t)(eol - data.data()) + 1);
+  }
+
+  bool ParseSchemaJsonLine(const std::string &line, std::vector<SPFieldDef> &dest) {
+    dest.clear();
+    rj::Document doc;
+    if (doc.Parse(line.c_str()).HasParseError() || !doc.IsObject()) {
+      return true;
+    }
+    for (const auto& section : doc.GetObject()) {
+      if (!section.value.IsObject()) {
+        return true;
+      }
+      for (const auto& i : section.value.GetObject()) {
+        if (!i.value.IsInt() || i.value.GetInt() < 0 || !IsTypeId((uint64_t)i.value.GetInt())) {
+          dest.clear();
+          return true;
+        }
+        dest.push_back(FieldDef::alloc((decltype(TSTRING))i.value.GetInt(), std::string(i.name.GetString(), i.name.GetStringLength())));
+      }
+    }
+    return false;
+  }
+
+  void AppendSchemaBinary(std::string &dest, const std::vector<SPFieldDef> &colIds) {
+    dest.append(SCHEMA_MAGIC, sizeof(SCHEMA_MAGIC));
+    PutVarint(dest, colIds.size());
+    for (auto &id : colIds) {
+      PutVarint(dest, (uint64_t)id->typeId);
+      PutBytes(dest, id->name);
+    }
+  }
+
+  bool ReadSchemaBinary(const std::string &data, size_t &offset, std::vector<SPFieldDef> &dest) {
+    dest.clear();
+    if (data.size() < offset + sizeof(SCHEMA_MAGIC) || 0 != memcmp(data.data() + offset, SCHEMA_MAGIC, sizeof(SCHEMA_MAGIC))) {
+      return false;
+    }
+
+    const uint8_t *start = (const uint8_t *)data.data();
+    ByteReader r(start + offset + sizeof(SCHEMA_MAGIC), data.size() - offset - sizeof(SCHEMA_MAGIC));
+    size_t count = (size_t)r.varint();
+    std::string name;
+    for (size_t i=0; i < count && !r.error; i++) {
+      uint64_t typeId = r.varint();
+      if (!r.bytes(name)) { break; }
+      if (!IsTypeId(typeId)) {
+        r.error = true;
+        break;
+      }
+      dest.push_back(FieldDef::alloc((decltype(TSTRING))typeId, name));
+    }
+    if (r.error) {
+      dest.clear();
+      return true;
+    }
+    offset = (size_t)(r.p - start);
+    return false;
+  }
+
+} // namespace vsqlite
@@ -0,0 +1,65 @@
+#pragma once
+
+#include "../include/vsqlite_serialize.h"
+
+#include <stddef.h>
+#include <string>
+#include <vector>
+
+/*
+ * Column list stored with a snapshot. When knownColumnIds gains or
+ * loses columns, e.g. after an upgrade adds a column to a table, rows
+ * are compared with the snapshot on the columns both have instead of
+ * being reported as all removed and added.
+ */
+namespace vsqlite {
+
+  /**
+   * @returns true if a and b have the same column names and types, in
+   * the same order.
+   */
+  bool SameColumns(const std::vector<SPFieldDef> &a, const std::vector<SPFieldDef> &b);
+
+  /**
+   * @returns columns of colIds that histColIds also has, by name.
+   */
+  std::vector<SPFieldDef> SharedColumns(const std::vector<SPFieldDef> &colIds, const std::vector<SPFieldDef> &histColIds);
+
+  /**
+   * Appends the JSON lines schema : {"#columns":{"<name>":<type>,...}}
+   */
+  void AppendSchemaJsonLine(std::string &dest, const std::vector<SPFieldDef> &colIds);
+
+  /**
+   * @returns true if the line is a JSON lines schema.
+   */
+  bool IsSchemaJsonLine(const char *p, size_t len);
+
+  /**
+   * @returns length of the schema line data starts with, including its
+   * newline, or 0 if none.
+   */
+  size_t SchemaJsonLineLength(const std::string &data);
+
+  /**
+   * Fills dest with new FieldDefs for the columns of a JSON lines schema.
+   * Unknown type ids are an error.
+   * return true on error, false on success
+   */
+  bool ParseSchemaJsonLine(const std::string &line, std::vector<SPFieldDef> &dest);
+
+  /**
+   * Appends the binary schema section : "VSS1", varint count,
+   * count x (varint type, varint len, name bytes)
+   */
+  void AppendSchemaBinary(std::string &dest, const std::vector<SPFieldDef> &colIds);
+
+  /**
+   * If data has a binary schema section at offset, fills dest with new
+   * FieldDefs for its columns and moves offset past it. Unknown type
+   * ids are an error.
+   * return true on error, false on success
+   */
+  bool ReadSchemaBinary(const std::string &data, size_t &offset, std::vector<SPFieldDef> &dest);
+
+} // namespace vsqlite
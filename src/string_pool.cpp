@@ -0,0 +1,76 @@
+#include "string_pool.h"
+
+#include "memory_usage.h"
+
+namespace vsqlite {
+
+  size_t StringPool::RefHash::operator()(const Ref &ref) const {
+    // FNV-1a
+    uint64_t h = 0xcbf29ce484222325ULL;
+    for (size_t i=0; i < ref.len; i++) {
+      h ^= (uint8_t)ref.p[i];
+      h *= 0x100000001b3ULL;
+    }
+    return (size_t)h;
+  }
+
+  const std::string *StringPool::intern(const char *p, size_t len) {
+    const std::string *existing = find(p, len);
+    if (existing != nullptr) {
+      return existing;
+    }
+    _strings.push_back(std::string(p, len));
+    const std::string *s = &_strings.back();
+    Ref ref = { s->data(), s->size() };
+    _index[ref] = s;
+    return s;
+  }
+
+  const std::string *StringPool::find(const char *p, size_t len) const {
+    Ref ref = { p, len };
+    auto fit = _index.find(ref);
+    if (fit == _index.end()) {
+      return nullptr;
+    }
+    return fit->second;
+  }
+
+  size_t StringPool::memoryBytes() const {
+    // keys and values of the index point into _strings
+    size_t n = _index.bucket_count() * sizeof(void *) + _index.size() * (sizeof(*_index.begin()) + MEMORY_NODE_OVERHEAD);
+    for (auto &s : _strings) {
+      n += sizeof(s) + MemBytes(s);
+    }
+    return n;
+  }
+
+  void StringPool::clear() {
+    _index.clear();
+    _strings.clear();
+  }
+
+  void ColumnNames::reset(const std::vector<SPFieldDef> &colIds) {
+    _byName.clear();
+    _pool.clear();
+    for (auto &id : colIds) {
+      _byName[_pool.intern(id->name)] = id;
+    }
+  }
+
+  size_t ColumnNames::memoryBytes() const {
+    return _pool.memoryBytes() + MemBytes(_byName);
+  }
+
+  SPFieldDef ColumnNames::find(const char *name, size_t len) const {
+    const std::string *pooled = _pool.find(name, len);
+    if (pooled == nullptr) {
+      return nullptr;
+    }
+    auto fit = _byName.find(pooled);
+    if (fit == _byName.end()) {
+      return nullptr;
+    }
+    return fit->second;
+  }
+
+} // namespace vsqlite
@@ -0,0 +1,85 @@
+#pragma once
+
+#include "../include/vsqlite_serialize.h"
+
+#include <deque>
+#include <string.h>
+#include <unordered_map>
+
+/*
+ * Interning of the column names of a DynMap serializer, so that names
+ * decoded from historical data resolve to application columns without
+ * allocating. Only names are interned, never values, so the pool stays
+ * as small as the column set. StringMap rows own their keys and values,
+ * so they do not use it.
+ */
+namespace vsqlite {
+
+  class StringPool {
+  public:
+    /**
+     * @returns the pooled copy of the bytes, adding it if needed.
+     * Two interned strings are equal if and only if the pointers are equal.
+     * Lookup does not allocate if the string is already pooled.
+     */
+    const std::string *intern(const char *p, size_t len);
+    const std::string *intern(const std::string &s) { return intern(s.data(), s.size()); }
+
+    /**
+     * @returns the pooled copy, or nullptr if not pooled.
+     */
+    const std::string *find(const char *p, size_t len) const;
+
+    void clear();
+
+    size_t size() const { return _strings.size(); }
+
+    size_t memoryBytes() const;
+
+  private:
+    struct Ref {
+      const char *p;
+      size_t len;
+    };
+    struct RefHash {
+      size_t operator()(const Ref &ref) const;
+    };
+    struct RefEqual {
+      bool operator()(const Ref &a, const Ref &b) const {
+        return a.len == b.len && 0 == memcmp(a.p, b.p, a.len);
+      }
+    };
+
+    std::deque<std::string> _strings; // never moved, so pointers stay valid
+    std::unordered_map<Ref, const std::string *, RefHash, RefEqual> _index;
+  };
+
+  /*
+   * Resolves column names from decoded data to application columns.
+   * Names are interned when the columns are set, so a lookup is one
+   * hash of the name bytes and a pointer compare.
+   */
+  class ColumnNames {
+  public:
+    /**
+     * Replaces the columns, interning their names in a pool holding
+     * only these names.
+     */
+    void reset(const std::vector<SPFieldDef> &colIds);
+
+    /**
+     * @returns the application column with name, or nullptr.
+     */
+    SPFieldDef find(const char *name, size_t len) const;
+    SPFieldDef find(const std::string &name) const { return find(name.data(), name.size()); }
+
+    bool empty() const { return _byName.empty(); }
+
+    size_t memoryBytes() const;
+
+  private:
+    StringPool _pool;
+    std::unordered_map<const std::string *, SPFieldDef> _byName;
+  };
+
+} // namespace vsqlite
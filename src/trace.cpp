@@ -0,0 +1,220 @@
+#include "trace.h"
+
+#ifdef VSQLITE_TRACE
+
+#include <stdio.h>
+#include <string.h>
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <unordered_set>
+#include <vector>
+
+#include "kernels.h"
+
+using namespace vsqlite_utils;
+
+namespace vsqlite {
+
+  static_assert((VSQLITE_TRACE_RING_SIZE & (VSQLITE_TRACE_RING_SIZE - 1)) == 0, "VSQLITE_TRACE_RING_SIZE must be a power of 2");
+
+  struct TraceEvent {
+    const char *cat;
+    const char *name;
+    const char *label;
+    uint64_t start;
+    uint64_t end;
+    uint64_t rows;
+    uint64_t busy;
+  };
+
+  /*
+   * Written only by its thread. head is published with release order
+   * after the event is filled in, so a reader that loads head with
+   * acquire order sees complete events, and re-reads head afterwards
+   * to drop events the writer overwrote in the meantime.
+   */
+  struct TraceRing {
+    TraceRing(uint32_t tid) : tid(tid) {}
+
+    uint32_t tid;
+    std::atomic<uint64_t> head { 0 };
+    std::atomic<uint64_t> tail { 0 }; // moved by TraceClear()
+    TraceEvent events[VSQLITE_TRACE_RING_SIZE];
+  };
+
+  static uint64_t steadyMicros() {
+    return (uint64_t)std::chrono::duration_cast<std::chrono::microseconds>(
+        std::chrono::steady_clock::now().time_since_epoch()).count();
+  }
+
+  /*
+   * All rings, kept after their thread exits so its events can still
+   * be written. Also the time origin of the trace.
+   */
+  struct TraceRegistry {
+    TraceRegistry() : originTicks(TraceNow()), originMicros(steadyMicros()) {}
+
+    std::mutex mutex;
+    std::vector<std::shared_ptr<TraceRing> > rings;
+    std::unordered_set<std::string> labels;
+    uint64_t originTicks;
+    uint64_t originMicros;
+  };
+
+  static TraceRegistry &registry() {
+    static TraceRegistry *gRegistry = new TraceRegistry(); // never destroyed, threads may outlive statics
+    return *gRegistry;
+  }
+
+  static thread_local TraceRing *gThreadRing = nullptr;
+
+  static TraceRing *addThreadRing() {
+    TraceRegistry &reg = registry();
+    std::lock_guard<std::mutex> lock(reg.mutex);
+    reg.rings.push_back(std::make_shared<TraceRing>((uint32_t)reg.rings.size() + 1));
+    gThreadRing = reg.rings.back().get();
+    return gThreadRing;
+  }
+
+  void TraceRecord(const char *cat, const char *name, const char *label, uint64_t start, uint64_t end, uint64_t rows, uint64_t busy) {
+    TraceRing *ring = gThreadRing;
+    if (ring == nullptr) {
+      ring = addThreadRing();
+    }
+    uint64_t head = ring->head.load(std::memory_order_relaxed);
+    TraceEvent &event = ring->events[head & (VSQLITE_TRACE_RING_SIZE - 1)];
+    event.cat = cat;
+    event.name = name;
+    event.label = label;
+    event.start = start;
+    event.end = end;
+    event.rows = rows;
+    event.busy = busy;
+    ring->head.store(head + 1, std::memory_order_release);
+  }
+
+  const char *TraceInternLabel(const std::string &label) {
+    if (label.empty()) {
+      return nullptr;
+    }
+    TraceRegistry &reg = registry();
+    std::lock_guard<std::mutex> lock(reg.mutex);
+    return reg.labels.insert(label).first->c_str();
+  }
+
+  /*
+   * Ticks per microsecond, measured against the steady clock since the
+   * registry was created.
+   */
+  static double ticksPerMicro(TraceRegistry &reg) {
+#ifdef VSQLITE_TRACE_TSC
+    uint64_t micros = steadyMicros() - reg.originMicros;
+    if (micros < 10000) {
+      // too short to calibrate, wait a little
+      std::this_thread::sleep_for(std::chrono::milliseconds(10));
+      micros = steadyMicros() - reg.originMicros;
+    }
+    return (double)(TraceNow() - reg.originTicks) / (double)micros;
+#else
+    return 1000.0;
+#endif
+  }
+
+  static void appendMicros(std::string &dest, double micros) {
+    char buf[32];
+    snprintf(buf, sizeof(buf), "%.3f", micros);
+    dest.append(buf);
+  }
+
+  void TraceWriteChromeJson(std::string &dest) {
+    TraceRegistry &reg = registry();
+    std::vector<std::shared_ptr<TraceRing> > rings;
+    {
+      std::lock_guard<std::mutex> lock(reg.mutex);
+      rings = reg.rings;
+    }
+    double scale = 1.0 / ticksPerMicro(reg);
+
+    dest.append("{\"traceEvents\":[");
+    bool first = true;
+    std::vector<TraceEvent> events;
+    for (auto &ring : rings) {
+      uint64_t head = ring->head.load(std::memory_order_acquire);
+      uint64_t begin = ring->tail.load(std::memory_order_relaxed);
+      if (head - begin > VSQLITE_TRACE_RING_SIZE) {
+        begin = head - VSQLITE_TRACE_RING_SIZE;
+      }
+      events.clear();
+      for (uint64_t i = begin; i < head; i++) {
+        events.push_back(ring->events[i & (VSQLITE_TRACE_RING_SIZE - 1)]);
+      }
+
+      // skip events overwritten while copying
+      uint64_t newHead = ring->head.load(std::memory_order_acquire);
+      size_t skip = 0;
+      if (newHead - begin > VSQLITE_TRACE_RING_SIZE) {
+        skip = (size_t)std::min<uint64_t>(newHead - begin - VSQLITE_TRACE_RING_SIZE, events.size());
+      }
+
+      for (size_t i = skip; i < events.size(); i++) {
+        const TraceEvent &event = events[i];
+        if (!first) { dest += ','; }
+        first = false;
+        dest.append("{\"name\":\"");
+        dest.append(event.name);
+        dest.append("\",\"cat\":\"");
+        dest.append(event.cat);
+        dest.append("\",\"ph\":\"X\",\"pid\":1,\"tid\":");
+        dest.append(std::to_string(ring->tid));
+        dest.append(",\"ts\":");
+        appendMicros(dest, (double)(int64_t)(event.start - reg.originTicks) * scale);
+        dest.append(",\"dur\":");
+        appendMicros(dest, (double)(event.end - event.start) * scale);
+        if (event.label != nullptr || event.rows > 0) {
+          dest.append(",\"args\":{");
+          if (event.label != nullptr) {
+            dest.append("\"label\":");
+            AppendJsonString(dest, event.label, strlen(event.label));
+          }
+          if (event.rows > 0) {
+            if (event.label != nullptr) { dest += ','; }
+            dest.append("\"rows\":");
+            dest.append(std::to_string(event.rows));
+            dest.append(",\"busy_us\":");
+            appendMicros(dest, (double)event.busy * scale);
+          }
+          dest += '}';
+        }
+        dest += '}';
+      }
+    }
+    dest.append("]}\n");
+  }
+
+  void TraceClear() {
+    TraceRegistry &reg = registry();
+    std::lock_guard<std::mutex> lock(reg.mutex);
+    for (auto &ring : reg.rings) {
+      ring->tail.store(ring->head.load(std::memory_order_acquire), std::memory_order_relaxed);
+    }
+  }
+
+} // namespace vsqlite
+
+#else
+
+namespace vsqlite {
+
+  void TraceWriteChromeJson(std::string &dest) {
+    dest.append("{\"traceEvents\":[]}\n");
+  }
+
+  void TraceClear() {}
+
+} // namespace vsqlite
+
+#endif // VSQLITE_TRACE
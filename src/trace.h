@@ -0,0 +1,141 @@
+#pragma once
+
+#include "../include/vsqlite_serialize.h"
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string>
+
+/*
+ * Tracing of serializer phases. Built with VSQLITE_TRACE defined, each
+ * hook records a span into a ring buffer owned by the calling thread,
+ * and TraceWriteChromeJson() dumps the rings of all threads.
+ * Otherwise the hooks expand to nothing and serializers carry no
+ * trace state.
+ *
+ *   VSQLITE_TRACE_CONTEXT(ctx, cat)  member holding category and label
+ *   VSQLITE_TRACE_LABEL(ctx, text)   label of following spans (DiffOptions::traceLabel)
+ *   VSQLITE_TRACE_SPAN(ctx, name)    span until end of enclosing scope
+ *   VSQLITE_TRACE_ROW(ctx)           addNewResult() call, spans cover
+ *                                    VSQLITE_TRACE_ROW_BATCH rows each
+ *   VSQLITE_TRACE_END_ROWS(ctx)      records the last partial batch
+ */
+
+#ifdef VSQLITE_TRACE
+
+#if (defined(__x86_64__) || defined(__i386__)) && defined(__GNUC__)
+#define VSQLITE_TRACE_TSC 1
+#include <x86intrin.h>
+#else
+#include <chrono>
+#endif
+
+#ifndef VSQLITE_TRACE_RING_SIZE
+#define VSQLITE_TRACE_RING_SIZE 8192 // events per thread, power of 2
+#endif
+
+#ifndef VSQLITE_TRACE_ROW_BATCH
+#define VSQLITE_TRACE_ROW_BATCH 1024
+#endif
+
+namespace vsqlite {
+
+  /**
+   * @returns current time in ticks : TSC on x86, steady clock nanoseconds
+   * elsewhere. Converted to microseconds when the trace is written.
+   */
+  inline uint64_t TraceNow() {
+#ifdef VSQLITE_TRACE_TSC
+    return __rdtsc();
+#else
+    return (uint64_t)std::chrono::duration_cast<std::chrono::nanoseconds>(
+        std::chrono::steady_clock::now().time_since_epoch()).count();
+#endif
+  }
+
+  /**
+   * Appends a span to the calling thread's ring, overwriting the oldest
+   * event once full. No locking : a thread only writes its own ring.
+   * cat, name and label must outlive the trace (literals or interned).
+   * @param rows number of rows for addNewResult batches, else 0
+   * @param busy ticks spent inside the calls of a batch, else 0
+   */
+  void TraceRecord(const char *cat, const char *name, const char *label, uint64_t start, uint64_t end, uint64_t rows, uint64_t busy);
+
+  /**
+   * @returns a copy of label that lives until exit, or nullptr if empty.
+   */
+  const char *TraceInternLabel(const std::string &label);
+
+  struct TraceContext {
+    TraceContext(const char *cat) : cat(cat) {}
+
+    const char *cat;
+    const char *label { nullptr };
+
+    // current addNewResult batch
+    uint64_t rows { 0 };
+    uint64_t rowsStart { 0 };
+    uint64_t rowsEnd { 0 };
+    uint64_t rowsBusy { 0 };
+  };
+
+  inline void TraceEndRows(TraceContext &ctx) {
+    if (ctx.rows > 0) {
+      TraceRecord(ctx.cat, "addNewResult", ctx.label, ctx.rowsStart, ctx.rowsEnd, ctx.rows, ctx.rowsBusy);
+      ctx.rows = 0;
+      ctx.rowsBusy = 0;
+    }
+  }
+
+  class TraceSpan {
+  public:
+    TraceSpan(const TraceContext &ctx, const char *name) : _ctx(ctx), _name(name), _start(TraceNow()) {}
+    ~TraceSpan() { TraceRecord(_ctx.cat, _name, _ctx.label, _start, TraceNow(), 0, 0); }
+
+  private:
+    const TraceContext &_ctx;
+    const char *_name;
+    uint64_t _start;
+  };
+
+  class TraceRowSpan {
+  public:
+    TraceRowSpan(TraceContext &ctx) : _ctx(ctx), _start(TraceNow()) {
+      if (_ctx.rows == 0) {
+        _ctx.rowsStart = _start;
+      }
+    }
+    ~TraceRowSpan() {
+      _ctx.rowsEnd = TraceNow();
+      _ctx.rowsBusy += _ctx.rowsEnd - _start;
+      if (++_ctx.rows == VSQLITE_TRACE_ROW_BATCH) {
+        TraceEndRows(_ctx);
+      }
+    }
+
+  private:
+    TraceContext &_ctx;
+    uint64_t _start;
+  };
+
+} // namespace vsqlite
+
+#define VSQLITE_TRACE_CONCAT2(a, b) a##b
+#define VSQLITE_TRACE_CONCAT(a, b) VSQLITE_TRACE_CONCAT2(a, b)
+
+#define VSQLITE_TRACE_CONTEXT(ctx, cat) vsqlite::TraceContext ctx { cat }
+#define VSQLITE_TRACE_LABEL(ctx, text) ((ctx).label = vsqlite::TraceInternLabel(text))
+#define VSQLITE_TRACE_SPAN(ctx, name) vsqlite::TraceSpan VSQLITE_TRACE_CONCAT(_traceSpan, __LINE__) ((ctx), (name))
+#define VSQLITE_TRACE_ROW(ctx) vsqlite::TraceRowSpan VSQLITE_TRACE_CONCAT(_traceRow, __LINE__) (ctx)
+#define VSQLITE_TRACE_END_ROWS(ctx) vsqlite::TraceEndRows(ctx)
+
+#else
+
+#define VSQLITE_TRACE_CONTEXT(ctx, cat)
+#define VSQLITE_TRACE_LABEL(ctx, text) ((void)0)
+#define VSQLITE_TRACE_SPAN(ctx, name) ((void)0)
+#define VSQLITE_TRACE_ROW(ctx) ((void)0)
+#define VSQLITE_TRACE_END_ROWS(ctx) ((void)0)
+
+#endif // VSQLITE_TRACE
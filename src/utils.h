@@ -3,5 +3,9 @@
 
 namespace vsqlite_utils {
   void BytesToHexString(const std::string &bytes, std::string &dest);
+
+  /*
+   * dest is left empty if str has an odd length or an invalid digit.
+   */
   void HexStringToBinString(const std::string str, std::string &dest);
 }
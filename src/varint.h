@@ -0,0 +1,101 @@
+#pragma once
+
+#include <stdint.h>
+#include <string>
+
+/*
+ * Little-endian base-128 varints, zigzag and fixed-width helpers
+ * for the binary snapshot formats.
+ */
+namespace vsqlite_utils {
+
+  inline void PutVarint(std::string &dest, uint64_t value) {
+    while (value >= 0x80) {
+      dest.push_back((char)((value & 0x7F) | 0x80));
+      value >>= 7;
+    }
+    dest.push_back((char)value);
+  }
+
+  inline uint64_t ZigZagEncode(int64_t value) {
+    return ((uint64_t)value << 1) ^ (uint64_t)(value >> 63);
+  }
+
+  inline int64_t ZigZagDecode(uint64_t value) {
+    return (int64_t)(value >> 1) ^ -(int64_t)(value & 1);
+  }
+
+  inline void PutFixed64(std::string &dest, uint64_t value) {
+    for (int i=0; i < 8; i++) {
+      dest.push_back((char)(value & 0xFF));
+      value >>= 8;
+    }
+  }
+
+  inline void PutBytes(std::string &dest, const std::string &value) {
+    PutVarint(dest, value.size());
+    dest.append(value);
+  }
+
+  /*
+   * Bounds-checked reader. Once a read runs past the end, error is set
+   * and all further reads return 0 / empty.
+   */
+  struct ByteReader {
+    ByteReader(const uint8_t *data, size_t len) : p(data), end(data + len) {}
+
+    uint64_t varint() {
+      uint64_t value = 0;
+      for (int shift=0; shift < 64; shift += 7) {
+        if (p >= end) { error = true; return 0; }
+        uint8_t b = *p++;
+        value |= (uint64_t)(b & 0x7F) << shift;
+        if (0 == (b & 0x80)) {
+          return value;
+        }
+      }
+      error = true;
+      return 0;
+    }
+
+    uint8_t byte() {
+      if (p >= end) { error = true; return 0; }
+      return *p++;
+    }
+
+    uint64_t fixed64() {
+      if ((size_t)(end - p) < 8) { error = true; p = end; return 0; }
+      uint64_t value = 0;
+      for (int i=0; i < 8; i++) {
+        value |= (uint64_t)p[i] << (8 * i);
+      }
+      p += 8;
+      return value;
+    }
+
+    /**
+     * @returns pointer to the next len bytes, or nullptr if not available.
+     */
+    const uint8_t *skip(size_t len) {
+      if ((size_t)(end - p) < len) { error = true; p = end; return nullptr; }
+      const uint8_t *start = p;
+      p += len;
+      return start;
+    }
+
+    bool bytes(std::string &dest) {
+      size_t len = (size_t)varint();
+      const uint8_t *start = skip(len);
+      if (start == nullptr) { return false; }
+      dest.assign((const char *)start, len);
+      return true;
+    }
+
+    bool atEnd() const { return p >= end; }
+
+    const uint8_t *p;
+    const uint8_t *end;
+    bool error { false };
+  };
+
+} // namespace vsqlite_utils
@@ -1,5 +1,13 @@
 #include <gtest/gtest.h>
 #include <string>
+#include "../src/blob_table.h"
+#include "../src/fingerprint.h"
+#include "../src/kernels.h"
+#include "../src/schema.h"
+#include "../src/string_pool.h"
+#include "../src/trace.h"
+#include "../src/utils.h"
+#include "../src/varint.h"
 using namespace std;
 
 int main(int argc, char **argv) {
@@ -17,3 +25,367 @@ protected:
 TEST_F(MiscTest, placeholder) {
 
 }
+
+TEST_F(MiscTest, string_pool_interns) {
+  vsqlite::StringPool pool;
+  std::string path = "/usr/sbin/sshd";
+
+  auto a = pool.intern(path.data(), path.size());
+  auto b = pool.intern(path);
+  EXPECT_EQ(a, b);
+  EXPECT_EQ(path, *a);
+  EXPECT_EQ(1, pool.size());
+
+  EXPECT_EQ(nullptr, pool.find("/bin/bash", 9));
+  EXPECT_NE(a, pool.intern("/bin/bash", 9));
+  EXPECT_EQ(2, pool.size());
+
+  pool.clear();
+  EXPECT_EQ(0, pool.size());
+  EXPECT_EQ(nullptr, pool.find(path.data(), path.size()));
+}
+
+TEST_F(MiscTest, column_names_resolve) {
+  vsqlite::ColumnNames names;
+  SPFieldDef fpath = FieldDef::alloc(TSTRING, "path");
+  SPFieldDef fpid = FieldDef::alloc(TINT64, "pid");
+  names.reset({ fpath, fpid });
+
+  EXPECT_EQ(fpid, names.find(std::string("pid")));
+  EXPECT_EQ(fpath, names.find("path", 4));
+  EXPECT_EQ(nullptr, names.find("uid", 3));
+
+  // names of earlier columns are dropped
+  SPFieldDef fuid = FieldDef::alloc(TINT64, "uid");
+  names.reset({ fuid });
+  EXPECT_EQ(fuid, names.find("uid", 3));
+  EXPECT_EQ(nullptr, names.find("path", 4));
+}
+
+TEST_F(MiscTest, hex_string_invalid) {
+  std::string dest;
+  vsqlite_utils::HexStringToBinString("00ff7Fa0", dest);
+  EXPECT_EQ(std::string("\x00\xff\x7f\xa0", 4), dest);
+
+  vsqlite_utils::HexStringToBinString("abc", dest);
+  EXPECT_TRUE(dest.empty());
+  vsqlite_utils::HexStringToBinString("0g", dest);
+  EXPECT_TRUE(dest.empty());
+  vsqlite_utils::HexStringToBinString(std::string(40, '0') + "x0", dest);
+  EXPECT_TRUE(dest.empty());
+}
+
+TEST_F(MiscTest, kernels_match_scalar) {
+  std::string value;
+  for (int i=0; i < 300; i++) {
+    value += (char)((i * 7) % 256);
+    value += "path/to/\"file\" caf\xc3\xa9";
+  }
+  std::vector<std::string> escaped, hex;
+  std::vector<size_t> escapeAt;
+
+  for (int level = vsqlite_utils::KERNELS_SCALAR; level <= vsqlite_utils::KERNELS_AVX2; level++) {
+    vsqlite_utils::SetKernelLevel((vsqlite_utils::KernelLevel)level);
+    for (size_t len : { (size_t)0, (size_t)15, (size_t)33, (size_t)200, value.size() }) {
+      std::string e;
+      vsqlite_utils::AppendJsonString(e, value.data(), len);
+      escaped.push_back(e);
+      escapeAt.push_back(vsqlite_utils::FindJsonEscape(value.data() + 20, len > 20 ? len - 20 : 0));
+
+      std::string h, decoded;
+      vsqlite_utils::BytesToHexString(value.substr(0, len), h);
+      hex.push_back(h);
+      vsqlite_utils::HexStringToBinString(h, decoded);
+      EXPECT_EQ(value.substr(0, len), decoded);
+    }
+  }
+  vsqlite_utils::SetKernelLevel(vsqlite_utils::KERNELS_AVX2);
+
+  size_t n = escaped.size() / 3;
+  for (size_t i=n; i < escaped.size(); i++) {
+    EXPECT_EQ(escaped[i % n], escaped[i]);
+    EXPECT_EQ(escapeAt[i % n], escapeAt[i]);
+    EXPECT_EQ(hex[i % n], hex[i]);
+  }
+
+  std::string e;
+  vsqlite_utils::AppendJsonString(e, std::string("a\"b\\\n\x01", 6));
+  EXPECT_EQ("\"a\\\"b\\\\\\n\\u0001\"", e);
+}
+
+TEST_F(MiscTest, fingerprint_line_roundtrip) {
+  std::vector<uint64_t> fingerprints = { 0, 1, 0x0123456789abcdefULL, 0xffffffffffffffffULL };
+  std::string data = "{\"a\":\"1\"}\n";
+  vsqlite_utils::AppendFingerprintLine(data, fingerprints);
+  EXPECT_EQ("{\"a\":\"1\"}\n{\"#fingerprints\":\"00000000000000000100000000000000efcdab8967452301ffffffffffffffff\"}\n", data);
+
+  std::vector<uint64_t> parsed;
+  EXPECT_EQ(10, vsqlite_utils::ParseFingerprintLine(data, parsed));
+  EXPECT_EQ(fingerprints, parsed);
+
+  // no fingerprint line
+  std::string rows = "{\"a\":\"1\"}\n";
+  EXPECT_EQ(rows.size(), vsqlite_utils::ParseFingerprintLine(rows, parsed));
+  EXPECT_TRUE(parsed.empty());
+
+  // same fields in the same order, same fingerprint
+  vsqlite_utils::RowFingerprint a, b, c;
+  a.addField("name", "bob");
+  a.addField("age", "32");
+  b.addField(vsqlite_utils::FingerprintBytes("name"), "bob");
+  b.addField(vsqlite_utils::FingerprintBytes("age"), "32");
+  c.addField("age", "32");
+  c.addField("name", "bob");
+  EXPECT_EQ(a.value(), b.value());
+  EXPECT_NE(a.value(), c.value());
+}
+
+TEST_F(MiscTest, fingerprint_bytes_vectors) {
+  // XXH64, seed 0
+  EXPECT_EQ(0xef46db3751d8e999ULL, vsqlite_utils::FingerprintBytes(""));
+  EXPECT_EQ(0xd24ec4f1a98c6e5bULL, vsqlite_utils::FingerprintBytes("a"));
+  EXPECT_EQ(0x44bc2cf5ad770999ULL, vsqlite_utils::FingerprintBytes("abc"));
+  EXPECT_EQ(0xfbcea83c8a378bf1ULL, vsqlite_utils::FingerprintBytes("Nobody inspects the spammish repetition"));
+
+  // a block that would reset a multiply-only state does not hide earlier bytes
+  std::string block(8, '\0');
+  for (int i=0; i < 8; i++) {
+    block[i] = (char)(0x9E3779B185EBCA87ULL >> (8 * i));
+  }
+  EXPECT_NE(vsqlite_utils::FingerprintBytes("x" + block), vsqlite_utils::FingerprintBytes("y" + block));
+}
+
+TEST_F(MiscTest, match_json_string) {
+  std::string value("a\"b\\\n\x01", 6);
+  std::string rendered;
+  vsqlite_utils::AppendJsonString(rendered, value);
+  std::string line = rendered + ",\"next\":1}";
+
+  EXPECT_EQ(rendered.size(), vsqlite_utils::MatchJsonString(line.data(), line.size(), value));
+  EXPECT_EQ(5, vsqlite_utils::MatchJsonString("\"bob\"}", 6, std::string("bob")));
+  EXPECT_EQ(2, vsqlite_utils::MatchJsonString("\"\"", 2, std::string()));
+
+  // mismatch, prefix of a longer value, truncated line
+  EXPECT_EQ(0, vsqlite_utils::MatchJsonString("\"bob\"}", 6, std::string("bib")));
+  EXPECT_EQ(0, vsqlite_utils::MatchJsonString("\"bobby\"", 7, std::string("bob")));
+  EXPECT_EQ(0, vsqlite_utils::MatchJsonString("\"bob", 4, std::string("bob")));
+  EXPECT_EQ(0, vsqlite_utils::MatchJsonString(line.data(), rendered.size() - 2, value));
+}
+
+/*
+ * @returns value decoded by blobs.resolve()
+ */
+static std::string Resolve(const vsqlite::BlobTable &blobs, const std::string &value) {
+  const char *p = value.data();
+  size_t len = value.size();
+  blobs.resolve(p, len);
+  return std::string(p, len);
+}
+
+TEST_F(MiscTest, blob_table_sections) {
+  vsqlite::BlobTable blobs;
+  std::string ref;
+  EXPECT_FALSE(blobs.encode("long value", ref)); // disabled
+  EXPECT_FALSE(blobs.active());
+
+  blobs.setMinSize(8);
+  EXPECT_TRUE(blobs.active());
+  EXPECT_FALSE(blobs.encode("short", ref));
+  ASSERT_TRUE(blobs.encode("long \"value\"", ref));
+  EXPECT_EQ(vsqlite::BlobTable::REF_SIZE, ref.size());
+  std::string ref2;
+  ASSERT_TRUE(blobs.encode("long \"value\"", ref2));
+  EXPECT_EQ(ref, ref2);
+  EXPECT_EQ(1, blobs.size());
+
+  const char *p = ref.data();
+  size_t len = ref.size();
+  EXPECT_TRUE(blobs.resolve(p, len));
+  EXPECT_EQ("long \"value\"", std::string(p, len));
+  EXPECT_EQ("long \"value\"", Resolve(blobs, "long \"value\""));
+
+  // binary section, followed by other data
+  std::string data;
+  blobs.appendBinary(data);
+  data += "rows";
+  vsqlite::BlobTable binary;
+  size_t offset = 0;
+  EXPECT_FALSE(binary.readBinary(data, offset));
+  EXPECT_TRUE(binary.active());
+  EXPECT_EQ("rows", data.substr(offset));
+  EXPECT_EQ("long \"value\"", Resolve(binary, ref));
+
+  offset = 0;
+  vsqlite::BlobTable none;
+  EXPECT_FALSE(none.readBinary("rows", offset));
+  EXPECT_EQ(0, offset);
+  EXPECT_FALSE(none.active());
+
+  // json lines section
+  std::string line;
+  blobs.appendJsonLine(line);
+  EXPECT_TRUE(vsqlite::BlobTable::IsJsonLine(line.data(), line.size()));
+  line.pop_back(); // newline
+  vsqlite::BlobTable json;
+  EXPECT_FALSE(json.parseJsonLine(line));
+  EXPECT_EQ("long \"value\"", Resolve(json, ref));
+}
+
+TEST_F(MiscTest, blob_table_escapes_refs) {
+  vsqlite::BlobTable blobs;
+  blobs.setMinSize(32);
+  std::string longValue(40, 'x');
+  std::string ref;
+  ASSERT_TRUE(blobs.encode(longValue, ref));
+
+  // a short value with the bytes of a reference, and other values
+  // starting with NUL, are escaped and decode to themselves
+  for (std::string value : { ref, std::string(1, '\0'), std::string("\0\0a", 3), std::string("\0ab", 3) }) {
+    std::string escaped;
+    ASSERT_TRUE(blobs.encode(value, escaped));
+    EXPECT_EQ('\0' + value, escaped);
+
+    const char *p = escaped.data();
+    size_t len = escaped.size();
+    EXPECT_FALSE(blobs.resolve(p, len));
+    EXPECT_EQ(value, std::string(p, len));
+  }
+  std::string escaped;
+  EXPECT_FALSE(blobs.encode("", escaped));
+  EXPECT_FALSE(blobs.encode("a\0", escaped));
+
+  // not decoded by a table that did not read a section
+  vsqlite::BlobTable inactive;
+  EXPECT_EQ('\0' + ref, Resolve(inactive, '\0' + ref));
+  EXPECT_EQ(ref, Resolve(inactive, ref));
+}
+
+TEST_F(MiscTest, blob_table_chains_collisions) {
+  std::string value(40, 'a');
+  std::string other(40, 'b');
+  uint64_t id = vsqlite_utils::FingerprintBytes(value);
+
+  // a section holding another value at the id of value
+  std::string data = "VSB1";
+  vsqlite_utils::PutVarint(data, 1);
+  vsqlite_utils::PutFixed64(data, id);
+  vsqlite_utils::PutBytes(data, other);
+
+  vsqlite::BlobTable blobs;
+  size_t offset = 0;
+  ASSERT_FALSE(blobs.readBinary(data, offset));
+  blobs.setMinSize(32);
+
+  std::string ref, ref2;
+  ASSERT_TRUE(blobs.encode(value, ref));
+  EXPECT_EQ(2, blobs.size());
+  ASSERT_TRUE(blobs.encode(value, ref2));
+  EXPECT_EQ(ref, ref2);
+  EXPECT_EQ(2, blobs.size());
+  EXPECT_EQ(value, Resolve(blobs, ref));
+
+  std::string otherRef = std::string(1, '\0');
+  vsqlite_utils::BytesToHexString(data.substr(5, 8), otherRef);
+  EXPECT_NE(ref, otherRef);
+  EXPECT_EQ(other, Resolve(blobs, otherRef));
+}
+
+TEST_F(MiscTest, blob_table_sections_sorted) {
+  std::vector<std::string> values;
+  for (char c = 'a'; c <= 'h'; c++) {
+    values.push_back(std::string(40, c));
+  }
+
+  // same blobs stored in another order write the same section
+  std::string data, reversed;
+  vsqlite::BlobTable blobs, blobs2;
+  blobs.setMinSize(32);
+  blobs2.setMinSize(32);
+  std::string ref;
+  for (size_t i=0; i < values.size(); i++) {
+    ASSERT_TRUE(blobs.encode(values[i], ref));
+    ASSERT_TRUE(blobs2.encode(values[values.size() - 1 - i], ref));
+  }
+  blobs.appendBinary(data);
+  blobs2.appendBinary(reversed);
+  EXPECT_EQ(data, reversed);
+}
+
+TEST_F(MiscTest, schema_binary_roundtrip) {
+  SPFieldDef fname = FieldDef::alloc(TSTRING, "name");
+  SPFieldDef fage = FieldDef::alloc(TINT32, "age");
+  std::string data;
+  vsqlite::AppendSchemaBinary(data, { fname, fage });
+  EXPECT_EQ("VSS1", data.substr(0, 4));
+  data += "rows";
+
+  std::vector<SPFieldDef> colIds;
+  size_t offset = 0;
+  EXPECT_FALSE(vsqlite::ReadSchemaBinary(data, offset, colIds));
+  EXPECT_EQ("rows", data.substr(offset));
+  EXPECT_TRUE(vsqlite::SameColumns({ fname, fage }, colIds));
+
+  // same names, other type
+  EXPECT_FALSE(vsqlite::SameColumns({ fname, FieldDef::alloc(TSTRING, "age") }, colIds));
+
+  // every type rows hold is accepted, floats included
+  SPFieldDef fscore = FieldDef::alloc(TFLOAT64, "score");
+  SPFieldDef fratio = FieldDef::alloc(TFLOAT32, "ratio");
+  SPFieldDef fport = FieldDef::alloc(TUINT16, "port");
+  data.clear();
+  vsqlite::AppendSchemaBinary(data, { fname, fscore, fratio, fport });
+  offset = 0;
+  EXPECT_FALSE(vsqlite::ReadSchemaBinary(data, offset, colIds));
+  EXPECT_TRUE(vsqlite::SameColumns({ fname, fscore, fratio, fport }, colIds));
+
+  // a columnar snapshot is not a schema section
+  offset = 0;
+  EXPECT_FALSE(vsqlite::ReadSchemaBinary("VSC1rows", offset, colIds));
+  EXPECT_EQ(0, offset);
+
+  // unknown type id
+  std::string bad = "VSS1";
+  vsqlite_utils::PutVarint(bad, 1);
+  vsqlite_utils::PutVarint(bad, 1000);
+  vsqlite_utils::PutBytes(bad, "name");
+  offset = 0;
+  EXPECT_TRUE(vsqlite::ReadSchemaBinary(bad, offset, colIds));
+  EXPECT_TRUE(colIds.empty());
+}
+
+TEST_F(MiscTest, trace_chrome_json) {
+  vsqlite::TraceClear();
+
+  auto spSerializer = vsqlite::BinaryStringMapResultsSerializerNew();
+  std::string historical_data;
+  std::vector<SPFieldDef> columns;
+  vsqlite::DiffOptions options;
+  options.traceLabel = "processes";
+  vsqlite::StringMap row;
+  row["name"] = "bob";
+
+  spSerializer->beginData(historical_data, nullptr, columns, options);
+  spSerializer->addNewResult(row);
+  spSerializer->endData();
+  std::string snapshot;
+  spSerializer->serialize(snapshot);
+
+  std::string trace;
+  vsqlite::TraceWriteChromeJson(trace);
+  EXPECT_EQ(0, trace.find("{\"traceEvents\":["));
+#ifdef VSQLITE_TRACE
+  EXPECT_NE(std::string::npos, trace.find("\"name\":\"beginData\",\"cat\":\"binary_stringmap\""));
+  EXPECT_NE(std::string::npos, trace.find("\"name\":\"addNewResult\""));
+  EXPECT_NE(std::string::npos, trace.find("\"rows\":1,"));
+  EXPECT_NE(std::string::npos, trace.find("\"name\":\"endData\""));
+  EXPECT_NE(std::string::npos, trace.find("\"name\":\"serialize\""));
+  EXPECT_NE(std::string::npos, trace.find("\"label\":\"processes\""));
+
+  vsqlite::TraceClear();
+  trace.clear();
+  vsqlite::TraceWriteChromeJson(trace);
+  EXPECT_EQ("{\"traceEvents\":[]}\n", trace);
+#else
+  EXPECT_EQ("{\"traceEvents\":[]}\n", trace);
+#endif
+}
@@ -0,0 +1,210 @@
+#include <gtest/gtest.h>
+#include <string>
+#include "../include/vsqlite_serialize.h"
+#include "../src/utils.h"
+
+class AdaptiveTest : public ::testing::Test {
+protected:
+  virtual void SetUp() {  }
+};
+
+static const SPFieldDef fname = FieldDef::alloc(TSTRING, "name");
+static const SPFieldDef fage = FieldDef::alloc(TINT32, "age");
+
+static std::vector<SPFieldDef> cols = { fname, fage };
+
+// snapshot tag : "VSA1", then the format byte
+static const size_t FORMAT_BYTE = 4;
+static const char FORMAT_CROW = 1;
+static const char FORMAT_JSON = 2;
+static const char FORMAT_COLUMNAR = 3;
+
+struct AdaptiveDiffResultsListener: public vsqlite::DiffResultsListener<DynMap> {
+  virtual ~AdaptiveDiffResultsListener() {}
+
+  void onAdded(DynMap &row) override {
+    adds.push_back(row[fname].as_s());
+  }
+
+  void onRemoved(DynMap &row) override {
+    removes.push_back(row[fname].as_s());
+  }
+  std::vector<std::string> adds;
+  std::vector<std::string> removes;
+};
+
+static DynMap MakeRow(size_t i) {
+  DynMap row;
+  row[fname] = "row" + std::to_string(i);
+  row[fage] = (int32_t)i;
+  return row;
+}
+
+/*
+ * Runs a data set of rows [first, end) against historicalData, and
+ * replaces historicalData with the new snapshot.
+ * @returns result of endData()
+ */
+static bool RunDataSet(vsqlite::ResultsSerializer<DynMap> &serializer, std::string &historicalData, size_t first, size_t end,
+                       std::shared_ptr<AdaptiveDiffResultsListener> spListener = nullptr) {
+  serializer.beginData(historicalData, spListener, cols);
+  for (size_t i=first; i < end; i++) {
+    DynMap row = MakeRow(i);
+    serializer.addNewResult(row);
+  }
+  bool hasChanged = serializer.endData();
+  historicalData.clear();
+  serializer.serialize(historicalData);
+  return hasChanged;
+}
+
+TEST_F(AdaptiveTest, basic_remove_two) {
+  auto spSerializer = vsqlite::AdaptiveResultsSerializerNew();
+  std::string historicalData;
+  EXPECT_TRUE(RunDataSet(*spSerializer, historicalData, 0, 3));
+  EXPECT_EQ("VSA1", historicalData.substr(0, 4));
+  EXPECT_EQ(FORMAT_CROW, historicalData[FORMAT_BYTE]);
+
+  auto spListener = std::make_shared<AdaptiveDiffResultsListener>();
+  EXPECT_TRUE(RunDataSet(*spSerializer, historicalData, 2, 3, spListener));
+  EXPECT_EQ(0, spListener->adds.size());
+  ASSERT_EQ(2, spListener->removes.size());
+  EXPECT_EQ("row0", spListener->removes[0]);
+  EXPECT_EQ("row1", spListener->removes[1]);
+}
+
+TEST_F(AdaptiveTest, large_stable_table_switches_to_columnar) {
+  auto spSerializer = vsqlite::AdaptiveResultsSerializerNew();
+  std::string historicalData;
+  RunDataSet(*spSerializer, historicalData, 0, 3000);
+  EXPECT_EQ(FORMAT_CROW, historicalData[FORMAT_BYTE]);
+
+  // the switch waits for a few unchanged data sets, and the data set
+  // that switches is still diffed against the crow snapshot. It
+  // reports a change, so that the new snapshot is stored.
+
+  for (int run=0; run < 4; run++) {
+    char format = historicalData[FORMAT_BYTE];
+    bool hasChanged = RunDataSet(*spSerializer, historicalData, 0, 3000);
+    EXPECT_EQ(format != historicalData[FORMAT_BYTE], hasChanged) << run;
+  }
+  EXPECT_EQ(FORMAT_COLUMNAR, historicalData[FORMAT_BYTE]);
+
+  // a new instance reads the columnar snapshot
+
+  auto spSerializer2 = vsqlite::AdaptiveResultsSerializerNew();
+  auto spListener = std::make_shared<AdaptiveDiffResultsListener>();
+  EXPECT_TRUE(RunDataSet(*spSerializer2, historicalData, 1, 3001, spListener));
+  ASSERT_EQ(1, spListener->adds.size());
+  EXPECT_EQ("row3000", spListener->adds[0]);
+  ASSERT_EQ(1, spListener->removes.size());
+  EXPECT_EQ("row0", spListener->removes[0]);
+  EXPECT_EQ(FORMAT_COLUMNAR, historicalData[FORMAT_BYTE]);
+}
+
+TEST_F(AdaptiveTest, key_columns_leave_columnar_at_once) {
+  auto spSerializer = vsqlite::AdaptiveResultsSerializerNew();
+  std::string historicalData;
+  for (int run=0; run < 5; run++) {
+    RunDataSet(*spSerializer, historicalData, 0, 3000);
+  }
+  ASSERT_EQ(FORMAT_COLUMNAR, historicalData[FORMAT_BYTE]);
+
+  vsqlite::DiffOptions options;
+  options.keyColumnIds = { fname };
+  auto spListener = std::make_shared<AdaptiveDiffResultsListener>();
+  spSerializer->beginData(historicalData, spListener, cols, options);
+  for (size_t i=0; i < 3000; i++) {
+    DynMap row = MakeRow(i);
+    spSerializer->addNewResult(row);
+  }
+  EXPECT_TRUE(spSerializer->endData()); // rows unchanged, format changed
+  historicalData.clear();
+  spSerializer->serialize(historicalData);
+  EXPECT_EQ(FORMAT_CROW, historicalData[FORMAT_BYTE]);
+}
+
+TEST_F(AdaptiveTest, snapshot_stored_only_on_change) {
+  // the caller keeps its snapshot while endData() returns false
+
+  auto spSerializer = vsqlite::AdaptiveResultsSerializerNew();
+  std::string historicalData;
+  auto runDataSet = [&](size_t first, size_t end, std::shared_ptr<AdaptiveDiffResultsListener> spListener) {
+    spSerializer->beginData(historicalData, spListener, cols);
+    for (size_t i=first; i < end; i++) {
+      DynMap row = MakeRow(i);
+      spSerializer->addNewResult(row);
+    }
+    bool hasChanged = spSerializer->endData();
+    if (hasChanged) {
+      historicalData.clear();
+      spSerializer->serialize(historicalData);
+    }
+    return hasChanged;
+  };
+
+  EXPECT_TRUE(runDataSet(0, 3000, nullptr));
+  EXPECT_EQ(FORMAT_CROW, historicalData[FORMAT_BYTE]);
+
+  // the switch to columnar is the only change, and its snapshot is stored
+
+  size_t numStored = 0;
+  for (int run=0; run < 4; run++) {
+    if (runDataSet(0, 3000, nullptr)) {
+      numStored++;
+    }
+  }
+  EXPECT_EQ(1, numStored);
+  EXPECT_EQ(FORMAT_COLUMNAR, historicalData[FORMAT_BYTE]);
+
+  auto spListener = std::make_shared<AdaptiveDiffResultsListener>();
+  EXPECT_TRUE(runDataSet(1, 3001, spListener));
+  ASSERT_EQ(1, spListener->adds.size());
+  EXPECT_EQ("row3000", spListener->adds[0]);
+  ASSERT_EQ(1, spListener->removes.size());
+  EXPECT_EQ("row0", spListener->removes[0]);
+}
+
+TEST_F(AdaptiveTest, producers_switch_to_json) {
+  auto spSerializer = vsqlite::AdaptiveResultsSerializerNew();
+  std::string historicalData;
+  RunDataSet(*spSerializer, historicalData, 0, 100);
+  EXPECT_EQ(FORMAT_CROW, historicalData[FORMAT_BYTE]);
+
+  vsqlite::DiffOptions options;
+  options.numProducers = 2;
+  spSerializer->beginData(historicalData, nullptr, cols, options);
+  size_t numAdded = 0;
+  for (size_t i=50; i < 150; i++) {
+    DynMap row = MakeRow(i);
+    if (spSerializer->addNewResult(row, i % 2)) {
+      numAdded++;
+    }
+  }
+  EXPECT_TRUE(spSerializer->endData());
+  EXPECT_EQ(50, numAdded);
+
+  std::string removedJson;
+  EXPECT_EQ(50, spSerializer->appendRemovedRowsJson(removedJson));
+
+  historicalData.clear();
+  spSerializer->serialize(historicalData);
+  EXPECT_EQ(FORMAT_JSON, historicalData[FORMAT_BYTE]);
+}
+
+TEST_F(AdaptiveTest, reads_untagged_snapshots) {
+  for (auto spOther : { vsqlite::CrowResultsSerializerNew(), vsqlite::JsonResultsSerializerNew() }) {
+    std::string historicalData;
+    RunDataSet(*spOther, historicalData, 0, 10);
+
+    auto spSerializer = vsqlite::AdaptiveResultsSerializerNew();
+    EXPECT_FALSE(RunDataSet(*spSerializer, historicalData, 0, 10));
+    EXPECT_EQ("VSA1", historicalData.substr(0, 4));
+  }
+}
+
+TEST_F(AdaptiveTest, invalid_tag) {
+  auto spSerializer = vsqlite::AdaptiveResultsSerializerNew();
+  std::string historicalData = "VSA1\x09";
+  EXPECT_TRUE(spSerializer->beginData(historicalData, nullptr, cols));
+}
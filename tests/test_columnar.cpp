@@ -0,0 +1,330 @@
+#include <gtest/gtest.h>
+#include <algorithm>
+#include <string>
+#include "../include/vsqlite_serialize.h"
+#include "../src/utils.h"
+
+class ColumnarTest : public ::testing::Test {
+protected:
+  virtual void SetUp() {  }
+};
+
+static const SPFieldDef fname = FieldDef::alloc(TSTRING, "name");
+static const SPFieldDef fage = FieldDef::alloc(TINT32, "age");
+static const SPFieldDef factive = FieldDef::alloc(TUINT8, "active");
+static const SPFieldDef femoji = FieldDef::alloc(TSTRING, "emoji");
+
+static std::vector<SPFieldDef> cols = { fname, fage, factive };
+static std::vector<SPFieldDef> cols2 = { fname, fage, factive, femoji };
+
+// this is very simple, no escaping.  Just a way to get a printable value
+static std::string SimpleRowToJSONString(DynMap &row) {
+  std::string s;
+  for (auto colId : cols2) {
+    DynVal &val = row[colId];
+    if (!val.valid()) {
+      continue;
+    }
+
+    if (!s.empty()) { s += ", "; }
+
+    s += colId->name + ":";
+    if (val.type() == TSTRING) {
+      s += "\"" + val.as_s() + "\"";
+    } else {
+      s += val.as_s();
+    }
+  }
+  return "{" + s + "}";
+}
+
+struct ColumnarDiffResultsListener: public vsqlite::DiffResultsListener<DynMap> {
+  virtual ~ColumnarDiffResultsListener() {}
+
+  void onAdded(DynMap &row) override {
+    adds.push_back(SimpleRowToJSONString(row));
+  }
+
+  void onRemoved(DynMap &row) override {
+    removes.push_back(SimpleRowToJSONString(row));
+  }
+  std::vector<std::string> adds;
+  std::vector<std::string> removes;
+};
+
+static const std::vector<DynMap> &ExampleData1() {
+  static std::vector<DynMap> _rows;
+  if (_rows.empty()) {
+    _rows.resize(3);
+    DynMap &row = _rows[0];
+    row[fname] = "bob";
+    row[fage] = 32;
+    row[factive] = true;
+
+    DynMap &row2 = _rows[1];
+    row2[fname] = "Judy";
+    row2[fage] = DynVal(); // null / notset
+    row2[factive] = false;
+
+    DynMap &row3 = _rows[2];
+    row3[fname] = "Coco";
+    row3[fage] = 3;
+  }
+  return _rows;
+}
+
+static const std::vector<DynMap> &ExampleData2() {
+  static std::vector<DynMap> _rows;
+  if (_rows.empty()) {
+    _rows.resize(3);
+    DynMap &row = _rows[0];
+
+    // create a wide string, copy bytes into regular string
+    std::wstring wideBob = L"Bob";
+    std::string tmp;
+    tmp.resize(wideBob.size() * sizeof(wchar_t));
+    memcpy((char *)tmp.data(), wideBob.data(), tmp.size());
+
+    row[fname] = tmp;
+    row[femoji] = "🚔";
+    row[fage] = 32;
+    row[factive] = true;
+
+    DynMap &row2 = _rows[1];
+    row2[fname] = "Judy";
+    row2[femoji] = "😀🌴";
+    row2[fage] = DynVal(); // null / notset
+    row2[factive] = false;
+
+    DynMap &row3 = _rows[2];
+    row3[fname] = "Coco";
+    row3[fage] = 3;
+    row3[femoji] = "🍺🙈";
+  }
+  return _rows;
+}
+
+static std::string SerializeRows(std::vector<SPFieldDef> &columns, std::vector<DynMap> rows) {
+  auto spSerializer = vsqlite::ColumnarResultsSerializerNew();
+  std::string historicalData;
+  spSerializer->beginData(historicalData, nullptr, columns);
+  for (auto &row : rows) {
+    spSerializer->addNewResult(row);
+  }
+  spSerializer->endData();
+  std::string serialized;
+  spSerializer->serialize(serialized);
+  return serialized;
+}
+
+TEST_F(ColumnarTest, basic_add_no_history) {
+  auto spSerializer = vsqlite::ColumnarResultsSerializerNew();
+  auto spListener = std::make_shared<ColumnarDiffResultsListener>();
+  std::string historicalData = "";
+  spSerializer->beginData(historicalData, spListener, cols);
+
+  auto rows = ExampleData1();
+
+  bool isNewRow = spSerializer->addNewResult(rows[0]);
+  EXPECT_TRUE(isNewRow);
+
+  isNewRow = spSerializer->addNewResult(rows[1]);
+  EXPECT_TRUE(isNewRow);
+
+  isNewRow = spSerializer->addNewResult(rows[2]);
+  EXPECT_TRUE(isNewRow);
+
+  bool hasChanged = spSerializer->endData();
+  EXPECT_TRUE(hasChanged);
+
+  ASSERT_EQ(3, spListener->adds.size());
+  ASSERT_EQ(0, spListener->removes.size());
+
+  // serialize
+
+  std::string serialized;
+  spSerializer->serialize(serialized);
+  ASSERT_FALSE(serialized.empty());
+  EXPECT_EQ("VSC1", serialized.substr(0, 4));
+}
+
+TEST_F(ColumnarTest, basic_add_same_history) {
+  auto spSerializer = vsqlite::ColumnarResultsSerializerNew();
+  auto spListener = std::make_shared<ColumnarDiffResultsListener>();
+  std::string historicalData = SerializeRows(cols, ExampleData1());
+  spSerializer->beginData(historicalData, spListener, cols);
+
+  auto rows = ExampleData1();
+
+  bool isNewRow = spSerializer->addNewResult(rows[0]);
+  EXPECT_FALSE(isNewRow);
+
+  isNewRow = spSerializer->addNewResult(rows[1]);
+  EXPECT_FALSE(isNewRow);
+
+  isNewRow = spSerializer->addNewResult(rows[2]);
+  EXPECT_FALSE(isNewRow);
+
+  bool hasChanged = spSerializer->endData();
+  EXPECT_FALSE(hasChanged);
+
+  ASSERT_EQ(0, spListener->adds.size());
+  ASSERT_EQ(0, spListener->removes.size());
+
+  // same data, same snapshot
+
+  std::string serialized;
+  spSerializer->serialize(serialized);
+  EXPECT_EQ(historicalData, serialized);
+}
+
+TEST_F(ColumnarTest, basic_remove_two) {
+  auto spSerializer = vsqlite::ColumnarResultsSerializerNew();
+  auto spListener = std::make_shared<ColumnarDiffResultsListener>();
+  std::string historicalData = SerializeRows(cols, ExampleData1());
+  spSerializer->beginData(historicalData, spListener, cols);
+
+  auto rows = ExampleData1();
+
+  bool isNewRow = spSerializer->addNewResult(rows[1]);
+  EXPECT_FALSE(isNewRow);
+
+  bool hasChanged = spSerializer->endData();
+  EXPECT_TRUE(hasChanged);
+
+  ASSERT_EQ(0, spListener->adds.size());
+  ASSERT_EQ(2, spListener->removes.size());
+
+  // removed rows are decoded from the column blocks
+
+  auto expected = SimpleRowToJSONString(rows[2]);
+  EXPECT_TRUE(spListener->removes[0] == expected || spListener->removes[1] == expected);
+
+  std::string serialized;
+  spSerializer->serialize(serialized);
+  EXPECT_EQ(SerializeRows(cols, { rows[1] }), serialized);
+}
+
+// make sure wide-characters and special characters are preserved
+
+TEST_F(ColumnarTest, special_chars_remove_two) {
+  auto spSerializer = vsqlite::ColumnarResultsSerializerNew();
+  auto spListener = std::make_shared<ColumnarDiffResultsListener>();
+  std::string historicalData = SerializeRows(cols2, ExampleData2());
+  spSerializer->beginData(historicalData, spListener, cols2);
+
+  auto rows = ExampleData2();
+
+  bool isNewRow = spSerializer->addNewResult(rows[1]);
+  EXPECT_FALSE(isNewRow);
+
+  bool hasChanged = spSerializer->endData();
+  EXPECT_TRUE(hasChanged);
+
+  ASSERT_EQ(0, spListener->adds.size());
+  ASSERT_EQ(2, spListener->removes.size());
+
+  auto expected = SimpleRowToJSONString(rows[2]);
+  EXPECT_TRUE(spListener->removes[0] == expected || spListener->removes[1] == expected);
+}
+
+TEST_F(ColumnarTest, repeated_values_are_compact) {
+  std::vector<DynMap> rows(1000);
+  for (size_t i=0; i < rows.size(); i++) {
+    rows[i][fname] = ((i / 100) % 2) ? "/usr/sbin/sshd" : "/bin/bash";
+    rows[i][fage] = (int32_t)(1000 + i);
+    rows[i][factive] = (uint8_t)1;
+  }
+  std::string serialized = SerializeRows(cols, rows);
+
+  // row hashes dominate, column blocks are a few bytes each
+  EXPECT_LT(serialized.size(), rows.size() * 8 + 200);
+}
+
+TEST_F(ColumnarTest, invalid_history) {
+  auto spSerializer = vsqlite::ColumnarResultsSerializerNew();
+  auto spListener = std::make_shared<ColumnarDiffResultsListener>();
+  std::string historicalData = "VSC1garbage";
+  EXPECT_TRUE(spSerializer->beginData(historicalData, spListener, cols));
+
+  auto rows = ExampleData1();
+  EXPECT_TRUE(spSerializer->addNewResult(rows[0]));
+  EXPECT_TRUE(spSerializer->endData());
+  ASSERT_EQ(0, spListener->removes.size());
+}
+
+TEST_F(ColumnarTest, row_hash_match_is_verified) {
+  auto rows = ExampleData1();
+  std::string snapshotBob = SerializeRows(cols, { rows[0] });
+  std::string snapshotCoco = SerializeRows(cols, { rows[2] });
+
+  // forge a collision : Coco's columns behind the row hash of bob
+
+  const size_t hashOffset = 4 + 1 + (1 + 4 + 1) + (1 + 3 + 1) + (1 + 6 + 1) + 1;
+  ASSERT_EQ(snapshotBob.substr(0, hashOffset), snapshotCoco.substr(0, hashOffset));
+  std::string historicalData = snapshotCoco;
+  historicalData.replace(hashOffset, 8, snapshotBob, hashOffset, 8);
+
+  auto spSerializer = vsqlite::ColumnarResultsSerializerNew();
+  auto spListener = std::make_shared<ColumnarDiffResultsListener>();
+  spSerializer->beginData(historicalData, spListener, cols);
+  spSerializer->addNewResult(rows[0]);
+  EXPECT_TRUE(spSerializer->endData());
+
+  ASSERT_EQ(1, spListener->adds.size());
+  EXPECT_EQ(SimpleRowToJSONString(rows[0]), spListener->adds[0]);
+  ASSERT_EQ(1, spListener->removes.size());
+  EXPECT_EQ(SimpleRowToJSONString(rows[2]), spListener->removes[0]);
+}
+
+TEST_F(ColumnarTest, non_canonical_ints_kept_as_strings) {
+  std::vector<DynMap> rows(4);
+  const char *ages[] = { "007", "+5", " 5", "-0" };
+  for (size_t i=0; i < rows.size(); i++) {
+    rows[i][fname] = "row" + std::to_string(i);
+    rows[i][fage] = std::string(ages[i]);
+  }
+  std::string historicalData = SerializeRows(cols, rows);
+
+  auto spSerializer = vsqlite::ColumnarResultsSerializerNew();
+  auto spListener = std::make_shared<ColumnarDiffResultsListener>();
+  spSerializer->beginData(historicalData, spListener, cols);
+  EXPECT_TRUE(spSerializer->endData());
+
+  ASSERT_EQ(4, spListener->removes.size());
+  for (size_t i=0; i < rows.size(); i++) {
+    EXPECT_NE(spListener->removes.end(), std::find(spListener->removes.begin(), spListener->removes.end(),
+        "{name:\"row" + std::to_string(i) + "\", age:\"" + ages[i] + "\"}"));
+  }
+}
+
+TEST_F(ColumnarTest, removed_rows_json) {
+  auto spSerializer = vsqlite::ColumnarResultsSerializerNew();
+  std::string historicalData;
+  spSerializer->beginData(historicalData, nullptr, cols);
+
+  auto rows = ExampleData1();
+  for (auto &row : rows) {
+    spSerializer->addNewResult(row);
+  }
+  spSerializer->endData();
+  spSerializer->serialize(historicalData);
+
+  auto spSerializer2 = vsqlite::ColumnarResultsSerializerNew();
+  spSerializer2->beginData(historicalData, nullptr, cols);
+  spSerializer2->addNewResult(rows[1]);
+  EXPECT_TRUE(spSerializer2->endData());
+
+  std::string json;
+  EXPECT_EQ(2, spSerializer2->appendRemovedRowsJson(json));
+
+  size_t numLines = 0;
+  for (char c : json) {
+    if (c == '\n') { numLines++; }
+  }
+  EXPECT_EQ(2, numLines);
+  EXPECT_EQ('{', json[0]);
+  EXPECT_NE(std::string::npos, json.find("\"bob\""));
+  EXPECT_EQ(std::string::npos, json.find("\"Judy\""));
+}
+
@@ -55,8 +55,19 @@ struct MyDiffResultsListener: public vsqlite::DiffResultsListener<DynMap> {
   void onRemoved(DynMap &row) override {
     removes.push_back(SimpleRowToJSONString(row));
   }
+
+  void onChanged(DynMap &oldRow, DynMap &newRow, const std::vector<SPFieldDef> &changedColumns) override {
+    changes.push_back(SimpleRowToJSONString(newRow));
+    changedFrom.push_back(SimpleRowToJSONString(oldRow));
+    for (auto &id : changedColumns) {
+      changedColumnNames.push_back(id->name);
+    }
+  }
   std::vector<std::string> adds;
   std::vector<std::string> removes;
+  std::vector<std::string> changes;
+  std::vector<std::string> changedFrom;
+  std::vector<std::string> changedColumnNames;
 };
 
 static std::string gExpectedHex1 = "43000100046e616d6543010200036167654302090006616374697665" "058003626f6281408201" "0580044a7564798200" "058004436f636f8106";
@@ -295,3 +306,286 @@ TEST_F(CrowTest, special_chars_remove_two) {
   
   EXPECT_EQ(gExpectedHex2_row1only, serializedHex);
 }
+
+TEST_F(CrowTest, key_columns_changed_row) {
+  auto spSerializer = vsqlite::CrowResultsSerializerNew();
+  auto spListener = std::make_shared<MyDiffResultsListener>();
+  std::string historicalData;
+  vsqlite_utils::HexStringToBinString(gExpectedHex1, historicalData);
+  vsqlite::DiffOptions options;
+  options.keyColumnIds = { fname };
+  ASSERT_FALSE(spSerializer->beginData(historicalData, spListener, cols, options));
+
+  auto rows = ExampleData1();
+  rows[0][fage] = 33;
+
+  EXPECT_TRUE(spSerializer->addNewResult(rows[0]));
+  EXPECT_FALSE(spSerializer->addNewResult(rows[1]));
+  EXPECT_TRUE(spSerializer->endData());
+
+  // the old row is decoded from its crow encoding, with typed values
+
+  ASSERT_EQ(1, spListener->changes.size());
+  EXPECT_EQ(0, spListener->changedFrom[0].find("{name:\"bob\", age:32"));
+  EXPECT_EQ(0, spListener->changes[0].find("{name:\"bob\", age:33"));
+  ASSERT_EQ(1, spListener->changedColumnNames.size());
+  EXPECT_EQ("age", spListener->changedColumnNames[0]);
+  EXPECT_EQ(0, spListener->adds.size());
+  ASSERT_EQ(1, spListener->removes.size());
+  EXPECT_EQ("{name:\"Coco\", age:3}", spListener->removes[0]);
+}
+
+TEST_F(CrowTest, key_columns_need_known_columns) {
+  auto spSerializer = vsqlite::CrowResultsSerializerNew();
+  std::string historicalData;
+  vsqlite_utils::HexStringToBinString(gExpectedHex1, historicalData);
+  vsqlite::DiffOptions options;
+  options.keyColumnIds = { fname };
+  std::vector<SPFieldDef> noColumns;
+  EXPECT_TRUE(spSerializer->beginData(historicalData, nullptr, noColumns, options));
+}
+
+TEST_F(CrowTest, volatile_columns_ignored) {
+  auto spSerializer = vsqlite::CrowResultsSerializerNew();
+  auto spListener = std::make_shared<MyDiffResultsListener>();
+  std::string historicalData;
+  vsqlite_utils::HexStringToBinString(gExpectedHex1, historicalData);
+  vsqlite::DiffOptions options;
+  options.volatileColumnIds = { fage };
+  spSerializer->beginData(historicalData, spListener, cols, options);
+
+  auto rows = ExampleData1();
+  rows[0][fage] = 33;
+
+  bool isNewRow = spSerializer->addNewResult(rows[0]);
+  EXPECT_FALSE(isNewRow);
+
+  isNewRow = spSerializer->addNewResult(rows[1]);
+  EXPECT_FALSE(isNewRow);
+
+  isNewRow = spSerializer->addNewResult(rows[2]);
+  EXPECT_FALSE(isNewRow);
+
+  bool hasChanged = spSerializer->endData();
+  EXPECT_FALSE(hasChanged);
+
+  ASSERT_EQ(0, spListener->adds.size());
+  ASSERT_EQ(0, spListener->removes.size());
+}
+
+TEST_F(CrowTest, duplicate_rows_counted) {
+  auto spSerializer = vsqlite::CrowResultsSerializerNew();
+  std::string historicalData;
+  spSerializer->beginData(historicalData, nullptr, cols);
+
+  auto rows = ExampleData1();
+
+  spSerializer->addNewResult(rows[0]);
+  spSerializer->addNewResult(rows[0]);
+  spSerializer->addNewResult(rows[0]);
+  spSerializer->addNewResult(rows[1]);
+  spSerializer->endData();
+  spSerializer->serialize(historicalData);
+
+  // one copy of the repeated row remains, one is added
+
+  auto spSerializer2 = vsqlite::CrowResultsSerializerNew();
+  auto spListener = std::make_shared<MyDiffResultsListener>();
+  spSerializer2->beginData(historicalData, spListener, cols);
+
+  bool isNewRow = spSerializer2->addNewResult(rows[0]);
+  EXPECT_FALSE(isNewRow);
+
+  isNewRow = spSerializer2->addNewResult(rows[2]);
+  EXPECT_TRUE(isNewRow);
+
+  bool hasChanged = spSerializer2->endData();
+  EXPECT_TRUE(hasChanged);
+
+  ASSERT_EQ(1, spListener->adds.size());
+  ASSERT_EQ(3, spListener->removes.size());
+}
+
+TEST_F(CrowTest, removed_rows_json) {
+  auto spSerializer = vsqlite::CrowResultsSerializerNew();
+  std::string historicalData;
+  spSerializer->beginData(historicalData, nullptr, cols);
+
+  auto rows = ExampleData1();
+  for (auto &row : rows) {
+    spSerializer->addNewResult(row);
+  }
+  spSerializer->endData();
+  spSerializer->serialize(historicalData);
+
+  auto spSerializer2 = vsqlite::CrowResultsSerializerNew();
+  spSerializer2->beginData(historicalData, nullptr, cols);
+  spSerializer2->addNewResult(rows[1]);
+  EXPECT_TRUE(spSerializer2->endData());
+
+  std::string json;
+  EXPECT_EQ(2, spSerializer2->appendRemovedRowsJson(json));
+
+  size_t numLines = 0;
+  for (char c : json) {
+    if (c == '\n') { numLines++; }
+  }
+  EXPECT_EQ(2, numLines);
+  EXPECT_EQ('{', json[0]);
+  EXPECT_NE(std::string::npos, json.find("\"bob\""));
+  EXPECT_EQ(std::string::npos, json.find("\"Judy\""));
+}
+
+static size_t CountOccurrences(const std::string &s, const std::string &part) {
+  size_t n = 0;
+  for (size_t pos = s.find(part); pos != std::string::npos; pos = s.find(part, pos + 1)) {
+    n++;
+  }
+  return n;
+}
+
+struct RowViewDiffResultsListener: public vsqlite::DiffResultsListener<DynMap> {
+  void onAdded(DynMap &row) override {
+  }
+
+  void onRemoved(DynMap &row) override {
+    numRemovedRows++;
+  }
+
+  void onRemovedView(const vsqlite::RowView &view) override {
+    const vsqlite::RowView::Field *pName = view.find(fname);
+    ASSERT_NE(nullptr, pName);
+    ASSERT_NE(nullptr, pName->data);
+    names.push_back(std::string(pName->data, pName->size));
+    numFields += view.fields.size();
+  }
+  size_t numRemovedRows { 0 };
+  size_t numFields { 0 };
+  std::vector<std::string> names;
+};
+
+TEST_F(CrowTest, removed_row_views) {
+  auto spSerializer = vsqlite::CrowResultsSerializerNew();
+  auto spListener = std::make_shared<RowViewDiffResultsListener>();
+  std::string historicalData;
+  vsqlite_utils::HexStringToBinString(gExpectedHex1, historicalData);
+  spSerializer->beginData(historicalData, spListener, cols);
+
+  auto rows = ExampleData1();
+  spSerializer->addNewResult(rows[1]);
+  EXPECT_TRUE(spSerializer->endData());
+
+  // views replace onRemoved() calls
+  EXPECT_EQ(0, spListener->numRemovedRows);
+  ASSERT_EQ(2, spListener->names.size());
+  EXPECT_EQ("bob", spListener->names[0]);
+  EXPECT_EQ("Coco", spListener->names[1]);
+  EXPECT_EQ(5, spListener->numFields);
+}
+
+TEST_F(CrowTest, long_values_in_blob_section) {
+  std::string longName = "/usr/libexec/some-daemon --config /etc/some-daemon.conf";
+  std::vector<DynMap> rows(3);
+  rows[0][fname] = longName;
+  rows[0][fage] = 1;
+  rows[1][fname] = longName;
+  rows[1][fage] = 2;
+  rows[2][fname] = "short";
+  rows[2][fage] = 3;
+
+  vsqlite::DiffOptions options;
+  options.blobMinSize = 32;
+
+  auto spSerializer = vsqlite::CrowResultsSerializerNew();
+  std::string historicalData;
+  spSerializer->beginData(historicalData, nullptr, cols, options);
+  for (auto &row : rows) {
+    spSerializer->addNewResult(row);
+  }
+  spSerializer->endData();
+  spSerializer->serialize(historicalData);
+
+  // stored once
+  EXPECT_EQ(1, CountOccurrences(historicalData, longName));
+
+  // unchanged rows match, removed row has its value
+
+  auto spSerializer2 = vsqlite::CrowResultsSerializerNew();
+  auto spListener = std::make_shared<MyDiffResultsListener>();
+  spSerializer2->beginData(historicalData, spListener, cols, options);
+  EXPECT_FALSE(spSerializer2->addNewResult(rows[0]));
+  EXPECT_FALSE(spSerializer2->addNewResult(rows[2]));
+  EXPECT_TRUE(spSerializer2->endData());
+
+  ASSERT_EQ(0, spListener->adds.size());
+  ASSERT_EQ(1, spListener->removes.size());
+  EXPECT_EQ("{name:\"" + longName + "\", age:2}", spListener->removes[0]);
+}
+
+TEST_F(CrowTest, schema_change_compares_shared_columns) {
+  auto spSerializer = vsqlite::CrowResultsSerializerNew();
+  std::string historicalData;
+  vsqlite::DiffOptions options;
+  options.storeSchema = true;
+  spSerializer->beginData(historicalData, nullptr, cols, options);
+  auto rows = ExampleData1();
+  for (auto &row : rows) {
+    spSerializer->addNewResult(row);
+  }
+  spSerializer->endData();
+  spSerializer->serialize(historicalData);
+
+  // emoji column added, one row changed
+
+  auto spListener = std::make_shared<MyDiffResultsListener>();
+  spSerializer->beginData(historicalData, spListener, cols2, options);
+  rows[0][femoji] = "a";
+  rows[1][femoji] = "b";
+  rows[2][femoji] = "c";
+  rows[2][fage] = 4;
+
+  EXPECT_FALSE(spSerializer->addNewResult(rows[0]));
+  EXPECT_FALSE(spSerializer->addNewResult(rows[1]));
+  EXPECT_TRUE(spSerializer->addNewResult(rows[2]));
+  EXPECT_TRUE(spSerializer->endData());
+
+  ASSERT_EQ(1, spListener->adds.size());
+  ASSERT_EQ(1, spListener->removes.size());
+  EXPECT_EQ("{name:\"Coco\", age:3}", spListener->removes[0]);
+
+  // snapshot has the new schema : no changes, and the added column is compared
+
+  historicalData.clear();
+  spSerializer->serialize(historicalData);
+  spListener = std::make_shared<MyDiffResultsListener>();
+  spSerializer->beginData(historicalData, spListener, cols2, options);
+  rows[1][femoji] = "bb";
+  for (auto &row : rows) {
+    spSerializer->addNewResult(row);
+  }
+  EXPECT_TRUE(spSerializer->endData());
+  EXPECT_EQ(1, spListener->adds.size());
+  EXPECT_EQ(1, spListener->removes.size());
+
+  // emoji column removed again : removed rows keep it
+
+  historicalData.clear();
+  spSerializer->serialize(historicalData);
+  spSerializer->beginData(historicalData, nullptr, cols, options);
+  rows = ExampleData1();
+  EXPECT_FALSE(spSerializer->addNewResult(rows[0]));
+  EXPECT_FALSE(spSerializer->addNewResult(rows[1]));
+  EXPECT_TRUE(spSerializer->endData());
+
+  auto spCursor = spSerializer->removedRows();
+  DynMap row;
+  ASSERT_TRUE(spCursor->next(row));
+  EXPECT_EQ("{name:\"Coco\", age:4}", SimpleRowToJSONString(row));
+  std::string emoji;
+  for (auto &it : row) {
+    if (it.first->name == "emoji") { emoji = it.second.as_s(); }
+  }
+  EXPECT_EQ("c", emoji);
+  EXPECT_FALSE(spCursor->next(row));
+}
+
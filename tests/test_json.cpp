@@ -1,5 +1,7 @@
 #include <gtest/gtest.h>
+#include <atomic>
 #include <string>
+#include <thread>
 
 #include "../include/vsqlite_serialize.h"
 #include "../src/utils.h"
@@ -52,8 +54,19 @@ struct MyDiffResultsListener: public vsqlite::DiffResultsListener<DynMap> {
   void onRemoved(DynMap &row) override {
     removes.push_back(SimpleRowToJSONString(row));
   }
+
+  void onChanged(DynMap &oldRow, DynMap &newRow, const std::vector<SPFieldDef> &changedColumns) override {
+    changes.push_back(SimpleRowToJSONString(newRow));
+    changedFrom.push_back(SimpleRowToJSONString(oldRow));
+    for (auto &id : changedColumns) {
+      changedColumnNames.push_back(id->name);
+    }
+  }
   std::vector<std::string> adds;
   std::vector<std::string> removes;
+  std::vector<std::string> changes;
+  std::vector<std::string> changedFrom;
+  std::vector<std::string> changedColumnNames;
 };
 
 static std::string gExpected1 = "{\"name\":\"bob\",\"age\":\"32\",\"active\":\"1\"}\n"
@@ -62,6 +75,8 @@ static std::string gExpected1 = "{\"name\":\"bob\",\"age\":\"32\",\"active\":\"1
 
 static std::string gExpected1_row1only = "{\"name\":\"Judy\",\"active\":\"0\"}\n";
 
+static std::string gFingerprints1 = "{\"#fingerprints\":\"ac48cf648d3f421d1da885af5b2fd2b95d3a959bafb91dad\"}\n";
+
 static const std::vector<DynMap> &ExampleData1() {
   static std::vector<DynMap> _rows;
   if (_rows.empty()) {
@@ -171,3 +186,393 @@ TEST_F(JsonTest, basic_remove_two) {
   
   EXPECT_EQ(gExpected1_row1only, serialized);
 }
+
+TEST_F(JsonTest, key_columns_changed_row) {
+  auto spSerializer = vsqlite::JsonResultsSerializerNew();
+  auto spListener = std::make_shared<MyDiffResultsListener>();
+  vsqlite::DiffOptions options;
+  options.keyColumnIds = { fname };
+  ASSERT_FALSE(spSerializer->beginData(gExpected1, spListener, cols, options));
+
+  auto rows = ExampleData1();
+  rows[0][fage] = 33;
+
+  EXPECT_TRUE(spSerializer->addNewResult(rows[0]));
+  EXPECT_FALSE(spSerializer->addNewResult(rows[1]));
+  EXPECT_TRUE(spSerializer->endData());
+
+  // the old row is decoded from its json line, so values are strings
+
+  ASSERT_EQ(1, spListener->changes.size());
+  EXPECT_EQ(0, spListener->changedFrom[0].find("{name:\"bob\", age:\"32\""));
+  ASSERT_EQ(1, spListener->changedColumnNames.size());
+  EXPECT_EQ("age", spListener->changedColumnNames[0]);
+  EXPECT_EQ(1, spListener->removes.size());
+
+  // the changed row replaces the old line in the snapshot
+
+  std::string serialized;
+  spSerializer->serialize(serialized);
+  EXPECT_EQ(std::string::npos, serialized.find("\"32\""));
+  EXPECT_NE(std::string::npos, serialized.find("\"33\""));
+}
+
+TEST_F(JsonTest, key_columns_need_known_columns) {
+  auto spSerializer = vsqlite::JsonResultsSerializerNew();
+  vsqlite::DiffOptions options;
+  options.keyColumnIds = { fname };
+  std::vector<SPFieldDef> noColumns;
+  EXPECT_TRUE(spSerializer->beginData(gExpected1, nullptr, noColumns, options));
+}
+
+TEST_F(JsonTest, volatile_columns_ignored) {
+  auto spSerializer = vsqlite::JsonResultsSerializerNew();
+  auto spListener = std::make_shared<MyDiffResultsListener>();
+  vsqlite::DiffOptions options;
+  options.volatileColumnIds = { fage };
+  spSerializer->beginData(gExpected1, spListener, cols, options);
+
+  auto rows = ExampleData1();
+  rows[0][fage] = 33;
+
+  bool isNewRow = spSerializer->addNewResult(rows[0]);
+  EXPECT_FALSE(isNewRow);
+
+  isNewRow = spSerializer->addNewResult(rows[1]);
+  EXPECT_FALSE(isNewRow);
+
+  isNewRow = spSerializer->addNewResult(rows[2]);
+  EXPECT_FALSE(isNewRow);
+
+  bool hasChanged = spSerializer->endData();
+  EXPECT_FALSE(hasChanged);
+
+  ASSERT_EQ(0, spListener->adds.size());
+  ASSERT_EQ(0, spListener->removes.size());
+}
+
+TEST_F(JsonTest, duplicate_rows_counted) {
+  auto spSerializer = vsqlite::JsonResultsSerializerNew();
+  std::string historicalData;
+  spSerializer->beginData(historicalData, nullptr, cols);
+
+  auto rows = ExampleData1();
+
+  spSerializer->addNewResult(rows[0]);
+  spSerializer->addNewResult(rows[0]);
+  spSerializer->addNewResult(rows[0]);
+  spSerializer->addNewResult(rows[1]);
+  spSerializer->endData();
+  spSerializer->serialize(historicalData);
+
+  // one copy of the repeated row remains, one is added
+
+  auto spSerializer2 = vsqlite::JsonResultsSerializerNew();
+  auto spListener = std::make_shared<MyDiffResultsListener>();
+  spSerializer2->beginData(historicalData, spListener, cols);
+
+  bool isNewRow = spSerializer2->addNewResult(rows[0]);
+  EXPECT_FALSE(isNewRow);
+
+  isNewRow = spSerializer2->addNewResult(rows[2]);
+  EXPECT_TRUE(isNewRow);
+
+  bool hasChanged = spSerializer2->endData();
+  EXPECT_TRUE(hasChanged);
+
+  ASSERT_EQ(1, spListener->adds.size());
+  ASSERT_EQ(3, spListener->removes.size());
+}
+
+TEST_F(JsonTest, history_without_fingerprints) {
+  auto spSerializer = vsqlite::JsonResultsSerializerNew();
+  auto spListener = std::make_shared<MyDiffResultsListener>();
+  std::string historicalData = gExpected1;
+  vsqlite::DiffOptions options;
+  options.storeFingerprints = true;
+  spSerializer->beginData(historicalData, spListener, cols, options);
+
+  auto rows = ExampleData1();
+
+  for (auto &row : rows) {
+    EXPECT_FALSE(spSerializer->addNewResult(row));
+  }
+
+  bool hasChanged = spSerializer->endData();
+  EXPECT_FALSE(hasChanged);
+
+  ASSERT_EQ(0, spListener->adds.size());
+  ASSERT_EQ(0, spListener->removes.size());
+
+  // fingerprints are added on the next snapshot, and only on request
+
+  std::string serialized;
+  spSerializer->serialize(serialized);
+  EXPECT_EQ(gExpected1 + gFingerprints1, serialized);
+
+  historicalData = serialized;
+  spSerializer->beginData(historicalData, spListener, cols);
+  for (auto &row : rows) {
+    EXPECT_FALSE(spSerializer->addNewResult(row));
+  }
+  EXPECT_FALSE(spSerializer->endData());
+  spSerializer->serialize(serialized);
+  EXPECT_EQ(gExpected1, serialized);
+}
+
+TEST_F(JsonTest, fingerprint_hit_is_verified) {
+  // bob's line stored with Judy's fingerprint, as a collision would
+  std::string historicalData = "{\"name\":\"bob\",\"age\":\"32\",\"active\":\"1\"}\n"
+    "{\"#fingerprints\":\"1da885af5b2fd2b9\"}\n";
+
+  auto spSerializer = vsqlite::JsonResultsSerializerNew();
+  auto spListener = std::make_shared<MyDiffResultsListener>();
+  spSerializer->beginData(historicalData, spListener, cols);
+  auto rows = ExampleData1();
+  EXPECT_TRUE(spSerializer->addNewResult(rows[1]));
+  EXPECT_TRUE(spSerializer->endData());
+
+  ASSERT_EQ(1, spListener->adds.size());
+  EXPECT_EQ(SimpleRowToJSONString(rows[1]), spListener->adds[0]);
+  ASSERT_EQ(1, spListener->removes.size());
+  EXPECT_EQ("{name:\"bob\", age:\"32\", active:\"1\"}", spListener->removes[0]);
+
+  std::string serialized;
+  spSerializer->serialize(serialized);
+  EXPECT_EQ(gExpected1_row1only, serialized);
+}
+
+TEST_F(JsonTest, removed_rows_json) {
+  auto spSerializer = vsqlite::JsonResultsSerializerNew();
+  std::string historicalData;
+  spSerializer->beginData(historicalData, nullptr, cols);
+
+  auto rows = ExampleData1();
+  for (auto &row : rows) {
+    spSerializer->addNewResult(row);
+  }
+  spSerializer->endData();
+  spSerializer->serialize(historicalData);
+
+  auto spSerializer2 = vsqlite::JsonResultsSerializerNew();
+  spSerializer2->beginData(historicalData, nullptr, cols);
+  spSerializer2->addNewResult(rows[1]);
+  EXPECT_TRUE(spSerializer2->endData());
+
+  std::string json;
+  EXPECT_EQ(2, spSerializer2->appendRemovedRowsJson(json));
+
+  size_t numLines = 0;
+  for (char c : json) {
+    if (c == '\n') { numLines++; }
+  }
+  EXPECT_EQ(2, numLines);
+  EXPECT_EQ('{', json[0]);
+  EXPECT_NE(std::string::npos, json.find("\"bob\""));
+  EXPECT_EQ(std::string::npos, json.find("\"Judy\""));
+}
+
+static size_t CountOccurrences(const std::string &s, const std::string &part) {
+  size_t n = 0;
+  for (size_t pos = s.find(part); pos != std::string::npos; pos = s.find(part, pos + 1)) {
+    n++;
+  }
+  return n;
+}
+
+TEST_F(JsonTest, long_values_in_blob_section) {
+  std::string longName = "/usr/libexec/some-daemon --config /etc/some-daemon.conf";
+  std::vector<DynMap> rows(3);
+  rows[0][fname] = longName;
+  rows[0][fage] = 1;
+  rows[1][fname] = longName;
+  rows[1][fage] = 2;
+  rows[2][fname] = "short";
+  rows[2][fage] = 3;
+
+  vsqlite::DiffOptions options;
+  options.blobMinSize = 32;
+
+  auto spSerializer = vsqlite::JsonResultsSerializerNew();
+  std::string historicalData;
+  spSerializer->beginData(historicalData, nullptr, cols, options);
+  for (auto &row : rows) {
+    spSerializer->addNewResult(row);
+  }
+  spSerializer->endData();
+  spSerializer->serialize(historicalData);
+
+  // stored once
+  EXPECT_EQ(1, CountOccurrences(historicalData, longName));
+
+  // unchanged rows match, removed row has its value
+
+  auto spSerializer2 = vsqlite::JsonResultsSerializerNew();
+  auto spListener = std::make_shared<MyDiffResultsListener>();
+  spSerializer2->beginData(historicalData, spListener, cols, options);
+  EXPECT_FALSE(spSerializer2->addNewResult(rows[0]));
+  EXPECT_FALSE(spSerializer2->addNewResult(rows[2]));
+  EXPECT_TRUE(spSerializer2->endData());
+
+  ASSERT_EQ(0, spListener->adds.size());
+  ASSERT_EQ(1, spListener->removes.size());
+  EXPECT_EQ("{name:\"" + longName + "\", age:\"2\"}", spListener->removes[0]);
+}
+
+TEST_F(JsonTest, schema_change_compares_shared_columns) {
+  static const SPFieldDef fpath = FieldDef::alloc(TSTRING, "path");
+  std::vector<SPFieldDef> cols2 = { fname, fage, factive, fpath };
+
+  auto spSerializer = vsqlite::JsonResultsSerializerNew();
+  vsqlite::DiffOptions options;
+  options.storeSchema = true;
+  std::string historicalData;
+  spSerializer->beginData(historicalData, nullptr, cols, options);
+  auto rows = ExampleData1();
+  for (auto &row : rows) {
+    spSerializer->addNewResult(row);
+  }
+  spSerializer->endData();
+  spSerializer->serialize(historicalData);
+
+  // path column added, one row changed
+
+  auto spListener = std::make_shared<MyDiffResultsListener>();
+  spSerializer->beginData(historicalData, spListener, cols2, options);
+  rows[0][fpath] = "/a";
+  rows[1][fpath] = "/b";
+  rows[2][fpath] = "/c";
+  rows[2][fage] = 4;
+
+  EXPECT_FALSE(spSerializer->addNewResult(rows[0]));
+  EXPECT_FALSE(spSerializer->addNewResult(rows[1]));
+  EXPECT_TRUE(spSerializer->addNewResult(rows[2]));
+  EXPECT_TRUE(spSerializer->endData());
+
+  ASSERT_EQ(1, spListener->adds.size());
+  ASSERT_EQ(1, spListener->removes.size());
+  EXPECT_EQ("{name:\"Coco\", age:\"3\"}", spListener->removes[0]);
+
+  historicalData.clear();
+  spSerializer->serialize(historicalData);
+  EXPECT_EQ(0, historicalData.find("{\"#columns\":{\"name\":"));
+  EXPECT_NE(std::string::npos, historicalData.find(",\"path\":"));
+
+  // same data and schema : unchanged
+
+  spListener = std::make_shared<MyDiffResultsListener>();
+  spSerializer->beginData(historicalData, spListener, cols2, options);
+  for (auto &row : rows) {
+    EXPECT_FALSE(spSerializer->addNewResult(row));
+  }
+  EXPECT_FALSE(spSerializer->endData());
+
+  // path column removed again : removed rows keep it
+
+  historicalData.clear();
+  spSerializer->serialize(historicalData);
+  spSerializer->beginData(historicalData, nullptr, cols, options);
+  rows = ExampleData1();
+  EXPECT_FALSE(spSerializer->addNewResult(rows[0]));
+  EXPECT_FALSE(spSerializer->addNewResult(rows[1]));
+  EXPECT_TRUE(spSerializer->endData());
+
+  auto spCursor = spSerializer->removedRows();
+  DynMap row;
+  ASSERT_TRUE(spCursor->next(row));
+  EXPECT_EQ("{name:\"Coco\", age:\"4\"}", SimpleRowToJSONString(row));
+  std::string path;
+  for (auto &it : row) {
+    if (it.first->name == "path") { path = it.second.as_s(); }
+  }
+  EXPECT_EQ("/c", path);
+  EXPECT_FALSE(spCursor->next(row));
+}
+
+TEST_F(JsonTest, row_version_reuses_encoding) {
+  auto spSerializer = vsqlite::JsonResultsSerializerNew();
+  std::string historicalData;
+  spSerializer->beginData(historicalData, nullptr, cols);
+
+  auto rows = ExampleData1();
+  for (size_t i=0; i < rows.size(); i++) {
+    EXPECT_TRUE(spSerializer->addNewResult(rows[i], i, 1));
+  }
+  spSerializer->endData();
+  spSerializer->serialize(historicalData);
+
+  // same version : the previous encoding is used, without looking at the row
+
+  DynMap changed = rows[1];
+  changed[fname] = "Judith";
+
+  spSerializer->beginData(historicalData, nullptr, cols);
+  EXPECT_FALSE(spSerializer->addNewResult(rows[0], 0, 1));
+  EXPECT_FALSE(spSerializer->addNewResult(changed, 1, 1));
+  EXPECT_TRUE(spSerializer->addNewResult(changed, 2, 2));
+  EXPECT_TRUE(spSerializer->endData());
+
+  std::string data;
+  spSerializer->serialize(data);
+  EXPECT_EQ(1, CountOccurrences(data, "Judith"));
+  EXPECT_EQ(1, CountOccurrences(data, "Judy"));
+  EXPECT_EQ(0, CountOccurrences(data, "Coco"));
+}
+
+TEST_F(JsonTest, concurrent_producers) {
+  auto makeRow = [](size_t i) {
+    DynMap row;
+    row[fname] = "row" + std::to_string(i);
+    row[fage] = (int32_t)i;
+    return row;
+  };
+
+  auto spSerializer = vsqlite::JsonResultsSerializerNew();
+  std::string historicalData;
+  spSerializer->beginData(historicalData, nullptr, cols);
+  for (size_t i=0; i < 1000; i++) {
+    DynMap row = makeRow(i);
+    spSerializer->addNewResult(row);
+  }
+  spSerializer->endData();
+  spSerializer->serialize(historicalData);
+
+  // 4 threads add rows 500..1499, each its share in order
+
+  vsqlite::DiffOptions options;
+  options.numProducers = 4;
+  std::string snapshots[2];
+  for (int run=0; run < 2; run++) {
+    spSerializer->beginData(historicalData, nullptr, cols, options);
+    std::atomic<size_t> numAdded(0);
+    std::vector<std::thread> threads;
+    for (size_t producer=0; producer < 4; producer++) {
+      threads.emplace_back([&, producer]() {
+        for (size_t i=500 + producer; i < 1500; i += 4) {
+          DynMap row = makeRow(i);
+          if (spSerializer->addNewResult(row, producer)) {
+            numAdded++;
+          }
+        }
+      });
+    }
+    for (auto &thread : threads) {
+      thread.join();
+    }
+    EXPECT_TRUE(spSerializer->endData());
+    EXPECT_EQ(500, numAdded.load());
+
+    auto cursor = spSerializer->removedRows();
+    DynMap row;
+    size_t numRemoved = 0;
+    while (cursor->next(row)) {
+      numRemoved++;
+    }
+    EXPECT_EQ(500, numRemoved);
+
+    spSerializer->serialize(snapshots[run]);
+  }
+
+  // buffers are appended in producer order, whatever the scheduling
+  EXPECT_EQ(snapshots[0], snapshots[1]);
+}
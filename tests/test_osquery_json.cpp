@@ -37,8 +37,19 @@ struct StringMapDiffResultsListener: public vsqlite::DiffResultsListener<Row > {
   void onRemoved(Row &row) override {
     removes.push_back(SimpleRowToJSONString(row));
   }
+
+  void onChanged(Row &oldRow, Row &newRow, const std::vector<SPFieldDef> &changedColumns) override {
+    changes.push_back(SimpleRowToJSONString(newRow));
+    changedFrom.push_back(SimpleRowToJSONString(oldRow));
+    for (auto &id : changedColumns) {
+      changedColumnNames.push_back(id->name);
+    }
+  }
   std::vector<std::string> adds;
   std::vector<std::string> removes;
+  std::vector<std::string> changes;
+  std::vector<std::string> changedFrom;
+  std::vector<std::string> changedColumnNames;
 };
 
 static std::string gExpected1 = "[{\"active\":\"1\",\"age\":\"32\",\"name\":\"bob\"},{\"active\":\"0\",\"name\":\"Judy\"},{\"age\":\"3\",\"name\":\"Coco\"}]";
@@ -157,3 +168,125 @@ TEST_F(OsqueryJsonTest, basic_remove_two) {
 
   EXPECT_EQ(gExpected1_row1only, serialized);
 }
+
+TEST_F(OsqueryJsonTest, key_columns_changed_row) {
+  auto spSerializer = vsqlite::OsqueryJsonResultsSerializerNew();
+  auto spListener = std::make_shared<StringMapDiffResultsListener>();
+  std::vector<SPFieldDef> cols;
+  vsqlite::DiffOptions options;
+  options.keyColumnIds = { FieldDef::alloc(TSTRING, "name") };
+  ASSERT_FALSE(spSerializer->beginData(gExpected1, spListener, cols, options));
+
+  // without known columns, keys come from the column names of each row
+
+  auto rows = ExampleData1();
+  rows[0]["age"] = "33";
+  rows[1]["active"] = "1";
+
+  EXPECT_TRUE(spSerializer->addNewResult(rows[0]));
+  EXPECT_TRUE(spSerializer->addNewResult(rows[1]));
+  EXPECT_FALSE(spSerializer->addNewResult(rows[2]));
+  EXPECT_TRUE(spSerializer->endData());
+
+  ASSERT_EQ(2, spListener->changes.size());
+  EXPECT_EQ("{active:\"1\", age:\"32\", name:\"bob\"}", spListener->changedFrom[0]);
+  EXPECT_EQ("{active:\"0\", name:\"Judy\"}", spListener->changedFrom[1]);
+  ASSERT_EQ(2, spListener->changedColumnNames.size());
+  EXPECT_EQ("age", spListener->changedColumnNames[0]);
+  EXPECT_EQ("active", spListener->changedColumnNames[1]);
+  EXPECT_EQ(0, spListener->adds.size());
+  EXPECT_EQ(0, spListener->removes.size());
+}
+
+TEST_F(OsqueryJsonTest, volatile_columns_ignored) {
+  auto spSerializer = vsqlite::OsqueryJsonResultsSerializerNew();
+  auto spListener = std::make_shared<StringMapDiffResultsListener>();
+  std::vector<SPFieldDef> cols;
+  vsqlite::DiffOptions options;
+  options.volatileColumnIds = { FieldDef::alloc(TSTRING, "age") };
+  spSerializer->beginData(gExpected1, spListener, cols, options);
+
+  auto rows = ExampleData1();
+  rows[0]["age"] = "33";
+
+  bool isNewRow = spSerializer->addNewResult(rows[0]);
+  EXPECT_FALSE(isNewRow);
+
+  isNewRow = spSerializer->addNewResult(rows[1]);
+  EXPECT_FALSE(isNewRow);
+
+  isNewRow = spSerializer->addNewResult(rows[2]);
+  EXPECT_FALSE(isNewRow);
+
+  bool hasChanged = spSerializer->endData();
+  EXPECT_FALSE(hasChanged);
+
+  ASSERT_EQ(0, spListener->adds.size());
+  ASSERT_EQ(0, spListener->removes.size());
+}
+
+TEST_F(OsqueryJsonTest, duplicate_rows_counted) {
+  auto spSerializer = vsqlite::OsqueryJsonResultsSerializerNew();
+  std::vector<SPFieldDef> cols;
+  std::string historicalData;
+  spSerializer->beginData(historicalData, nullptr, cols);
+
+  auto rows = ExampleData1();
+
+  spSerializer->addNewResult(rows[0]);
+  spSerializer->addNewResult(rows[0]);
+  spSerializer->addNewResult(rows[0]);
+  spSerializer->addNewResult(rows[1]);
+  spSerializer->endData();
+  spSerializer->serialize(historicalData);
+
+  // one copy of the repeated row remains, one is added
+
+  auto spSerializer2 = vsqlite::OsqueryJsonResultsSerializerNew();
+  auto spListener = std::make_shared<StringMapDiffResultsListener>();
+  spSerializer2->beginData(historicalData, spListener, cols);
+
+  bool isNewRow = spSerializer2->addNewResult(rows[0]);
+  EXPECT_FALSE(isNewRow);
+
+  isNewRow = spSerializer2->addNewResult(rows[2]);
+  EXPECT_TRUE(isNewRow);
+
+  bool hasChanged = spSerializer2->endData();
+  EXPECT_TRUE(hasChanged);
+
+  ASSERT_EQ(1, spListener->adds.size());
+  ASSERT_EQ(3, spListener->removes.size());
+}
+
+TEST_F(OsqueryJsonTest, removed_rows_json) {
+  auto spSerializer = vsqlite::OsqueryJsonResultsSerializerNew();
+  std::vector<SPFieldDef> cols;
+  std::string historicalData;
+  spSerializer->beginData(historicalData, nullptr, cols);
+
+  auto rows = ExampleData1();
+  for (auto &row : rows) {
+    spSerializer->addNewResult(row);
+  }
+  spSerializer->endData();
+  spSerializer->serialize(historicalData);
+
+  auto spSerializer2 = vsqlite::OsqueryJsonResultsSerializerNew();
+  spSerializer2->beginData(historicalData, nullptr, cols);
+  spSerializer2->addNewResult(rows[1]);
+  EXPECT_TRUE(spSerializer2->endData());
+
+  std::string json;
+  EXPECT_EQ(2, spSerializer2->appendRemovedRowsJson(json));
+
+  size_t numLines = 0;
+  for (char c : json) {
+    if (c == '\n') { numLines++; }
+  }
+  EXPECT_EQ(2, numLines);
+  EXPECT_EQ('{', json[0]);
+  EXPECT_NE(std::string::npos, json.find("\"bob\""));
+  EXPECT_EQ(std::string::npos, json.find("\"Judy\""));
+}
+
@@ -0,0 +1,309 @@
+#include <gtest/gtest.h>
+#include <algorithm>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "../include/vsqlite_serialize.h"
+
+/*
+ * Behavior shared by all serializers, run against each of them.
+ */
+
+static const SPFieldDef fname = FieldDef::alloc(TSTRING, "name");
+static const SPFieldDef fage = FieldDef::alloc(TINT32, "age");
+
+template <class T>
+struct SerializerParam {
+  const char *name;
+  std::shared_ptr<vsqlite::ResultsSerializer<T> > (*factory)();
+  bool digestOnly; // honors DiffOptions::digestOnly
+};
+
+typedef std::vector<std::pair<std::string, int32_t> > RowSpecs;
+
+template <class T> struct RowTraits;
+
+template <>
+struct RowTraits<DynMap> {
+  typedef vsqlite::SPDiffResultsListener SPListener;
+
+  static std::vector<SPFieldDef> columns() { return { fname, fage }; }
+
+  static DynMap make(const std::string &name, int32_t age) {
+    DynMap row;
+    row[fname] = name;
+    row[fage] = age;
+    return row;
+  }
+
+  // decoded values may be strings, so compare as strings
+  static std::string describe(DynMap &row) {
+    return row[fname].as_s() + ":" + row[fage].as_s();
+  }
+};
+
+template <>
+struct RowTraits<vsqlite::StringMap> {
+  typedef vsqlite::SPDiffResultsListenerStringMap SPListener;
+
+  static std::vector<SPFieldDef> columns() { return {}; }
+
+  static vsqlite::StringMap make(const std::string &name, int32_t age) {
+    vsqlite::StringMap row;
+    row["name"] = name;
+    row["age"] = std::to_string(age);
+    return row;
+  }
+
+  static std::string describe(vsqlite::StringMap &row) {
+    return row["name"] + ":" + row["age"];
+  }
+};
+
+template <class T>
+struct RecordingListener : public vsqlite::DiffResultsListener<T> {
+  void onAdded(T &row) override {
+    adds.push_back(RowTraits<T>::describe(row));
+  }
+
+  void onRemoved(T &row) override {
+    removes.push_back(RowTraits<T>::describe(row));
+  }
+
+  std::vector<std::string> adds;
+  std::vector<std::string> removes;
+};
+
+template <class T>
+static std::vector<T> MakeRows(const RowSpecs &specs) {
+  std::vector<T> rows;
+  for (auto &spec : specs) {
+    rows.push_back(RowTraits<T>::make(spec.first, spec.second));
+  }
+  return rows;
+}
+
+/*
+ * Runs rows through serializer against a copy of historicalData.
+ * @param numNew if not null, set to the number of rows addNewResult()
+ * reported as new.
+ * @param snapshot if not null, set to the serialized snapshot.
+ * @returns result of endData()
+ */
+template <class T>
+static bool RunDataSet(vsqlite::ResultsSerializer<T> &serializer, std::string historicalData, const RowSpecs &specs,
+                       const vsqlite::DiffOptions &options, typename RowTraits<T>::SPListener listener = nullptr,
+                       size_t *numNew = nullptr, std::string *snapshot = nullptr) {
+  auto cols = RowTraits<T>::columns();
+  EXPECT_FALSE(serializer.beginData(historicalData, listener, cols, options));
+  size_t n = 0;
+  for (auto &row : MakeRows<T>(specs)) {
+    if (serializer.addNewResult(row)) {
+      n++;
+    }
+  }
+  bool hasChanged = serializer.endData();
+  if (numNew) {
+    *numNew = n;
+  }
+  if (snapshot) {
+    snapshot->clear();
+    serializer.serialize(*snapshot);
+  }
+  return hasChanged;
+}
+
+template <class T>
+static void CheckDigestOnly(const SerializerParam<T> &param) {
+  const RowSpecs history = { {"bob", 32}, {"judy", 41}, {"coco", 3}, {"coco", 3} };
+  vsqlite::DiffOptions options;
+  options.storeFingerprints = true;
+  std::string historicalData;
+  RunDataSet(*param.factory(), historicalData, history, options, nullptr, nullptr, &historicalData);
+
+  options.digestOnly = true;
+
+  // same rows in another order : unchanged, listener not called
+
+  auto spListener = std::make_shared<RecordingListener<T> >();
+  size_t numNew = 0;
+  std::string snapshot;
+  EXPECT_FALSE(RunDataSet(*param.factory(), historicalData, { {"coco", 3}, {"bob", 32}, {"coco", 3}, {"judy", 41} },
+                          options, spListener, &numNew, &snapshot));
+  EXPECT_EQ(0, numNew);
+  EXPECT_EQ(0, spListener->adds.size());
+  EXPECT_EQ(0, spListener->removes.size());
+
+  // each of these differs from history as a multiset
+
+  const std::vector<RowSpecs> changedSets = {
+    { {"bob", 32}, {"judy", 41}, {"coco", 3} },                           // duplicate missing
+    { {"bob", 32}, {"judy", 41}, {"coco", 3}, {"coco", 3}, {"coco", 3} }, // duplicate added
+    { {"bob", 32}, {"judy", 41}, {"coco", 3}, {"coco", 3}, {"ann", 7} },  // row added
+    { {"bob", 33}, {"judy", 41}, {"coco", 3}, {"coco", 3} },              // value changed
+    { {"bob", 32}, {"judy", 41}, {"judy", 41}, {"coco", 3} },             // same count, other duplicate
+    {},
+  };
+  for (auto &specs : changedSets) {
+    auto spChangedListener = std::make_shared<RecordingListener<T> >();
+    EXPECT_TRUE(RunDataSet(*param.factory(), historicalData, specs, options, spChangedListener, &numNew)) << specs.size() << " rows";
+    if (param.digestOnly) {
+      EXPECT_EQ(0, numNew);
+      EXPECT_EQ(0, spChangedListener->adds.size());
+      EXPECT_EQ(0, spChangedListener->removes.size());
+    }
+  }
+
+  // the snapshot is still written in full, so a full diff against it works
+
+  auto spFullListener = std::make_shared<RecordingListener<T> >();
+  EXPECT_FALSE(RunDataSet(*param.factory(), snapshot, history, vsqlite::DiffOptions(), spFullListener));
+  EXPECT_EQ(0, spFullListener->adds.size());
+  EXPECT_EQ(0, spFullListener->removes.size());
+
+  EXPECT_TRUE(RunDataSet(*param.factory(), snapshot, { {"bob", 32} }, vsqlite::DiffOptions(), spFullListener));
+  EXPECT_EQ(0, spFullListener->adds.size());
+  EXPECT_EQ(3, spFullListener->removes.size());
+}
+
+/*
+ * @returns value of name in a JSON line of appendRemovedRowsJson(),
+ * whose values are strings without escapes here.
+ */
+static std::string JsonLineValue(const std::string &line, const std::string &name) {
+  std::string prefix = "\"" + name + "\":\"";
+  size_t pos = line.find(prefix);
+  if (pos == std::string::npos) {
+    return "";
+  }
+  pos += prefix.size();
+  return line.substr(pos, line.find('"', pos) - pos);
+}
+
+template <class T>
+static void CheckRemovedRowsCursor(const SerializerParam<T> &param) {
+  std::string historicalData;
+  RunDataSet(*param.factory(), historicalData, { {"bob", 32}, {"coco", 3}, {"judy", 41}, {"coco", 3}, {"ann", 7}, {"coco", 3} },
+             vsqlite::DiffOptions(), nullptr, nullptr, &historicalData);
+
+  // no listener : removed rows are pulled after endData()
+
+  auto spSerializer = param.factory();
+  EXPECT_TRUE(RunDataSet(*spSerializer, historicalData, { {"judy", 41}, {"coco", 3} }, vsqlite::DiffOptions()));
+
+  std::string json;
+  EXPECT_EQ(4, spSerializer->appendRemovedRowsJson(json));
+  std::vector<std::string> jsonRows;
+  for (size_t pos = 0, end; (end = json.find('\n', pos)) != std::string::npos; pos = end + 1) {
+    std::string line = json.substr(pos, end - pos);
+    jsonRows.push_back(JsonLineValue(line, "name") + ":" + JsonLineValue(line, "age"));
+  }
+
+  // the cursor holds the serializer, and walks rows in the same order
+  // as appendRemovedRowsJson()
+
+  auto cursor = spSerializer->removedRows();
+  spSerializer.reset();
+  std::vector<std::string> rows;
+  T row;
+  while (cursor->next(row)) {
+    rows.push_back(RowTraits<T>::describe(row));
+  }
+  EXPECT_FALSE(cursor->next(row));
+  EXPECT_EQ(jsonRows, rows);
+
+  std::sort(rows.begin(), rows.end());
+  EXPECT_EQ(std::vector<std::string>({ "ann:7", "bob:32", "coco:3", "coco:3" }), rows);
+
+  // stopping early
+
+  spSerializer = param.factory();
+  RunDataSet(*spSerializer, historicalData, {}, vsqlite::DiffOptions());
+  cursor = spSerializer->removedRows();
+  ASSERT_TRUE(cursor->next(row));
+  EXPECT_FALSE(row.empty());
+  cursor.reset();
+
+  // with a listener, endData() already reported the rows
+
+  auto spListener = std::make_shared<RecordingListener<T> >();
+  EXPECT_TRUE(RunDataSet(*spSerializer, historicalData, { {"judy", 41} }, vsqlite::DiffOptions(), spListener));
+  EXPECT_EQ(5, spListener->removes.size());
+  EXPECT_FALSE(spSerializer->removedRows()->next(row));
+}
+
+/*
+ * Runs one large data set, then small ones.
+ * @param peakBytes raised to the largest memoryUsage() seen
+ * @returns memoryUsage() after the last data set
+ */
+template <class T>
+static size_t RunTrimDataSets(const SerializerParam<T> &param, const vsqlite::TrimPolicy &policy, size_t &peakBytes) {
+  auto spSerializer = param.factory();
+  spSerializer->setTrimPolicy(policy);
+  std::string historicalData;
+  for (size_t numRows : { 5000, 3, 3, 3 }) {
+    RowSpecs specs;
+    for (size_t i=0; i < numRows; i++) {
+      specs.push_back(std::make_pair("row" + std::to_string(i), (int32_t)i));
+    }
+    RunDataSet(*spSerializer, historicalData, specs, vsqlite::DiffOptions(), nullptr, nullptr, &historicalData);
+    peakBytes = std::max(peakBytes, spSerializer->memoryUsage().total());
+  }
+  return spSerializer->memoryUsage().total();
+}
+
+template <class T>
+static void CheckTrimPolicy(const SerializerParam<T> &param) {
+  size_t peakBytes = 0;
+  size_t keptBytes = RunTrimDataSets(param, vsqlite::TrimPolicy(), peakBytes);
+
+  vsqlite::TrimPolicy policy;
+  policy.afterSmallDataSets = 2;
+  policy.minRows = 1000;
+  size_t trimmedBytes = RunTrimDataSets(param, policy, peakBytes);
+
+  EXPECT_LT(trimmedBytes, keptBytes);
+  EXPECT_LT(trimmedBytes * 4, peakBytes);
+}
+
+class DynMapSerializerTest : public ::testing::TestWithParam<SerializerParam<DynMap> > {};
+class StringMapSerializerTest : public ::testing::TestWithParam<SerializerParam<vsqlite::StringMap> > {};
+
+TEST_P(DynMapSerializerTest, digest_only) {
+  CheckDigestOnly(GetParam());
+}
+
+TEST_P(StringMapSerializerTest, digest_only) {
+  CheckDigestOnly(GetParam());
+}
+
+TEST_P(DynMapSerializerTest, removed_rows_cursor) {
+  CheckRemovedRowsCursor(GetParam());
+}
+
+TEST_P(StringMapSerializerTest, removed_rows_cursor) {
+  CheckRemovedRowsCursor(GetParam());
+}
+
+TEST_P(DynMapSerializerTest, trim_policy_releases_memory) {
+  CheckTrimPolicy(GetParam());
+}
+
+TEST_P(StringMapSerializerTest, trim_policy_releases_memory) {
+  CheckTrimPolicy(GetParam());
+}
+
+INSTANTIATE_TEST_SUITE_P(All, DynMapSerializerTest, ::testing::Values(
+    SerializerParam<DynMap> { "crow", vsqlite::CrowResultsSerializerNew, true },
+    SerializerParam<DynMap> { "json", vsqlite::JsonResultsSerializerNew, true },
+    SerializerParam<DynMap> { "columnar", vsqlite::ColumnarResultsSerializerNew, true },
+    SerializerParam<DynMap> { "adaptive", vsqlite::AdaptiveResultsSerializerNew, true }),
+  [](const ::testing::TestParamInfo<SerializerParam<DynMap> > &info) { return std::string(info.param.name); });
+
+INSTANTIATE_TEST_SUITE_P(All, StringMapSerializerTest, ::testing::Values(
+    SerializerParam<vsqlite::StringMap> { "osquery_json", vsqlite::OsqueryJsonResultsSerializerNew, false },
+    SerializerParam<vsqlite::StringMap> { "json", vsqlite::JsonStringMapResultsSerializerNew, true },
+    SerializerParam<vsqlite::StringMap> { "binary", vsqlite::BinaryStringMapResultsSerializerNew, true }),
+  [](const ::testing::TestParamInfo<SerializerParam<vsqlite::StringMap> > &info) { return std::string(info.param.name); });
@@ -0,0 +1,326 @@
+#include <gtest/gtest.h>
+#include <string>
+
+#include "../include/vsqlite_serialize.h"
+#include "../src/utils.h"
+
+class StringMapBinaryTest : public ::testing::Test {
+protected:
+  virtual void SetUp() {  }
+};
+
+typedef vsqlite::StringMap Row;
+
+// this is very simple, no escaping.  Just a way to get a printable value
+static std::string SimpleRowToJSONString( Row &row) {
+  std::string s;
+  int i=-1;
+  for (auto &it : row) {
+    i++;
+
+    if (!s.empty()) { s += ", "; }
+
+    s += it.first + ":";
+    s += "\"" + it.second + "\"";
+  }
+  return "{" + s + "}";
+}
+
+
+struct BinaryStringMapDiffResultsListener: public vsqlite::DiffResultsListener<Row > {
+  virtual ~BinaryStringMapDiffResultsListener() {}
+
+  void onAdded(Row &row) override {
+    adds.push_back(SimpleRowToJSONString(row));
+  }
+
+  void onRemoved(Row &row) override {
+    removes.push_back(SimpleRowToJSONString(row));
+  }
+
+  void onChanged(Row &oldRow, Row &newRow, const std::vector<SPFieldDef> &changedColumns) override {
+    changes.push_back(SimpleRowToJSONString(newRow));
+    changedFrom.push_back(SimpleRowToJSONString(oldRow));
+    for (auto &id : changedColumns) {
+      changedColumnNames.push_back(id->name);
+    }
+  }
+  std::vector<std::string> adds;
+  std::vector<std::string> removes;
+  std::vector<std::string> changes;
+  std::vector<std::string> changedFrom;
+  std::vector<std::string> changedColumnNames;
+};
+
+static std::string gExpectedHex1 = "56534d31" "03" "06616374697665" "03616765" "046e616d65"
+"0d03000131010233320203626f62" "0a0200013002044a756479" "0a020101330204436f636f";
+
+// historical keys stay in the dictionary
+static std::string gExpectedHex1_row1only = "56534d31" "03" "06616374697665" "03616765" "046e616d65"
+"0a0200013002044a756479";
+
+static std::vector<Row> &ExampleData1() {
+  static std::vector<Row> _rows;
+  if (_rows.empty()) {
+    _rows.resize(3);
+    auto &row = _rows[0];
+    row["name"] = "bob";
+    row["age"] = "32";
+    row["active"] = "1";
+
+    auto &row2 = _rows[1];
+    row2["name"] = "Judy";
+    row2["active"] = "0";
+
+    auto &row3 = _rows[2];
+    row3["name"] = "Coco";
+    row3["age"] = "3";
+  }
+  return _rows;
+}
+
+TEST_F(StringMapBinaryTest, basic_add_no_history) {
+  auto spSerializer = vsqlite::BinaryStringMapResultsSerializerNew();
+  auto spListener = std::make_shared<BinaryStringMapDiffResultsListener>();
+  std::string historicalData = "";
+  std::vector<SPFieldDef> cols;
+  spSerializer->beginData(historicalData, spListener, cols);
+
+  auto& rows = ExampleData1();
+
+  bool isNewRow = spSerializer->addNewResult(rows[0]);
+  EXPECT_TRUE(isNewRow);
+
+  isNewRow = spSerializer->addNewResult(rows[1]);
+  EXPECT_TRUE(isNewRow);
+
+  isNewRow = spSerializer->addNewResult(rows[2]);
+  EXPECT_TRUE(isNewRow);
+
+  bool hasChanged = spSerializer->endData();
+  EXPECT_TRUE(hasChanged);
+
+  ASSERT_EQ(3, spListener->adds.size());
+  ASSERT_EQ(0, spListener->removes.size());
+
+  // serialize
+
+  std::string serialized;
+  spSerializer->serialize(serialized);
+  ASSERT_FALSE(serialized.empty());
+
+  std::string serializedHex;
+  vsqlite_utils::BytesToHexString(serialized, serializedHex);
+
+  EXPECT_EQ(gExpectedHex1, serializedHex);
+}
+
+TEST_F(StringMapBinaryTest, basic_add_same_history) {
+  auto spSerializer = vsqlite::BinaryStringMapResultsSerializerNew();
+  auto spListener = std::make_shared<BinaryStringMapDiffResultsListener>();
+  std::vector<SPFieldDef> cols;
+  std::string historicalData;
+  vsqlite_utils::HexStringToBinString(gExpectedHex1, historicalData);
+  spSerializer->beginData(historicalData, spListener, cols);
+
+  auto rows = ExampleData1();
+
+  bool isNewRow = spSerializer->addNewResult(rows[0]);
+  EXPECT_FALSE(isNewRow);
+
+  isNewRow = spSerializer->addNewResult(rows[1]);
+  EXPECT_FALSE(isNewRow);
+
+  isNewRow = spSerializer->addNewResult(rows[2]);
+  EXPECT_FALSE(isNewRow);
+
+  bool hasChanged = spSerializer->endData();
+  EXPECT_FALSE(hasChanged);
+
+
+  ASSERT_EQ(0, spListener->adds.size());
+  ASSERT_EQ(0, spListener->removes.size());
+
+}
+
+TEST_F(StringMapBinaryTest, basic_remove_two) {
+  auto spSerializer = vsqlite::BinaryStringMapResultsSerializerNew();
+  auto spListener = std::make_shared<BinaryStringMapDiffResultsListener>();
+  std::vector<SPFieldDef> cols;
+  std::string historicalData;
+  vsqlite_utils::HexStringToBinString(gExpectedHex1, historicalData);
+  spSerializer->beginData(historicalData, spListener, cols);
+
+  auto rows = ExampleData1();
+
+  //bool isNewRow = spSerializer->addNewResult(rows[0]);
+
+  bool isNewRow = spSerializer->addNewResult(rows[1]);
+  EXPECT_FALSE(isNewRow);
+
+  //isNewRow = spSerializer->addNewResult(rows[2]);
+
+  bool hasChanged = spSerializer->endData();
+  EXPECT_TRUE(hasChanged);
+
+
+  ASSERT_EQ(0, spListener->adds.size());
+  ASSERT_EQ(2, spListener->removes.size());
+
+  // serialize
+
+  std::string serialized;
+  spSerializer->serialize(serialized);
+  ASSERT_FALSE(serialized.empty());
+
+  std::string serializedHex;
+  vsqlite_utils::BytesToHexString(serialized, serializedHex);
+
+  EXPECT_EQ(gExpectedHex1_row1only, serializedHex);
+}
+
+TEST_F(StringMapBinaryTest, key_columns_changed_row) {
+  auto spSerializer = vsqlite::BinaryStringMapResultsSerializerNew();
+  auto spListener = std::make_shared<BinaryStringMapDiffResultsListener>();
+  std::vector<SPFieldDef> cols;
+  vsqlite::DiffOptions options;
+  options.keyColumnIds = { FieldDef::alloc(TSTRING, "name"), FieldDef::alloc(TSTRING, "active") };
+  std::string historicalData;
+  vsqlite_utils::HexStringToBinString(gExpectedHex1, historicalData);
+  ASSERT_FALSE(spSerializer->beginData(historicalData, spListener, cols, options));
+
+  // with a composite key, changing one key column is a remove and an add
+
+  auto rows = ExampleData1();
+  rows[0]["age"] = "33";
+  rows[1]["active"] = "1";
+
+  EXPECT_TRUE(spSerializer->addNewResult(rows[0]));
+  EXPECT_TRUE(spSerializer->addNewResult(rows[1]));
+  EXPECT_TRUE(spSerializer->endData());
+
+  ASSERT_EQ(1, spListener->changes.size());
+  EXPECT_EQ(SimpleRowToJSONString(ExampleData1()[0]), spListener->changedFrom[0]);
+  ASSERT_EQ(1, spListener->changedColumnNames.size());
+  EXPECT_EQ("age", spListener->changedColumnNames[0]);
+  ASSERT_EQ(1, spListener->adds.size());
+  EXPECT_EQ(SimpleRowToJSONString(rows[1]), spListener->adds[0]);
+  EXPECT_EQ(2, spListener->removes.size());
+}
+
+TEST_F(StringMapBinaryTest, volatile_columns_ignored) {
+  auto spSerializer = vsqlite::BinaryStringMapResultsSerializerNew();
+  auto spListener = std::make_shared<BinaryStringMapDiffResultsListener>();
+  std::vector<SPFieldDef> cols;
+  vsqlite::DiffOptions options;
+  options.volatileColumnIds = { FieldDef::alloc(TSTRING, "age") };
+  std::string historicalData;
+  vsqlite_utils::HexStringToBinString(gExpectedHex1, historicalData);
+  spSerializer->beginData(historicalData, spListener, cols, options);
+
+  auto rows = ExampleData1();
+  rows[0]["age"] = "33";
+
+  bool isNewRow = spSerializer->addNewResult(rows[0]);
+  EXPECT_FALSE(isNewRow);
+
+  isNewRow = spSerializer->addNewResult(rows[1]);
+  EXPECT_FALSE(isNewRow);
+
+  isNewRow = spSerializer->addNewResult(rows[2]);
+  EXPECT_FALSE(isNewRow);
+
+  bool hasChanged = spSerializer->endData();
+  EXPECT_FALSE(hasChanged);
+
+  ASSERT_EQ(0, spListener->adds.size());
+  ASSERT_EQ(0, spListener->removes.size());
+}
+
+TEST_F(StringMapBinaryTest, binary_values_preserved) {
+  auto spSerializer = vsqlite::BinaryStringMapResultsSerializerNew();
+  auto spListener = std::make_shared<BinaryStringMapDiffResultsListener>();
+  std::vector<SPFieldDef> cols;
+  std::string historicalData;
+  spSerializer->beginData(historicalData, spListener, cols);
+
+  Row row;
+  row["name"] = std::string("a\0b\n\"c\"", 7);
+  row["emoji"] = "\xf0\x9f\x9a\x94";
+  spSerializer->addNewResult(row);
+  spSerializer->endData();
+  spSerializer->serialize(historicalData);
+
+  // removed row decodes to the same bytes
+
+  spSerializer->beginData(historicalData, spListener, cols);
+  EXPECT_TRUE(spSerializer->endData());
+  ASSERT_EQ(1, spListener->removes.size());
+  EXPECT_EQ(SimpleRowToJSONString(row), spListener->removes[0]);
+}
+
+TEST_F(StringMapBinaryTest, duplicate_rows_counted) {
+  auto spSerializer = vsqlite::BinaryStringMapResultsSerializerNew();
+  std::vector<SPFieldDef> cols;
+  std::string historicalData;
+  spSerializer->beginData(historicalData, nullptr, cols);
+
+  auto rows = ExampleData1();
+
+  spSerializer->addNewResult(rows[0]);
+  spSerializer->addNewResult(rows[0]);
+  spSerializer->addNewResult(rows[0]);
+  spSerializer->addNewResult(rows[1]);
+  spSerializer->endData();
+  spSerializer->serialize(historicalData);
+
+  // one copy of the repeated row remains, one is added
+
+  auto spSerializer2 = vsqlite::BinaryStringMapResultsSerializerNew();
+  auto spListener = std::make_shared<BinaryStringMapDiffResultsListener>();
+  spSerializer2->beginData(historicalData, spListener, cols);
+
+  bool isNewRow = spSerializer2->addNewResult(rows[0]);
+  EXPECT_FALSE(isNewRow);
+
+  isNewRow = spSerializer2->addNewResult(rows[2]);
+  EXPECT_TRUE(isNewRow);
+
+  bool hasChanged = spSerializer2->endData();
+  EXPECT_TRUE(hasChanged);
+
+  ASSERT_EQ(1, spListener->adds.size());
+  ASSERT_EQ(3, spListener->removes.size());
+}
+
+TEST_F(StringMapBinaryTest, removed_rows_json) {
+  auto spSerializer = vsqlite::BinaryStringMapResultsSerializerNew();
+  std::vector<SPFieldDef> cols;
+  std::string historicalData;
+  spSerializer->beginData(historicalData, nullptr, cols);
+
+  auto rows = ExampleData1();
+  for (auto &row : rows) {
+    spSerializer->addNewResult(row);
+  }
+  spSerializer->endData();
+  spSerializer->serialize(historicalData);
+
+  auto spSerializer2 = vsqlite::BinaryStringMapResultsSerializerNew();
+  spSerializer2->beginData(historicalData, nullptr, cols);
+  spSerializer2->addNewResult(rows[1]);
+  EXPECT_TRUE(spSerializer2->endData());
+
+  std::string json;
+  EXPECT_EQ(2, spSerializer2->appendRemovedRowsJson(json));
+
+  size_t numLines = 0;
+  for (char c : json) {
+    if (c == '\n') { numLines++; }
+  }
+  EXPECT_EQ(2, numLines);
+  EXPECT_EQ('{', json[0]);
+  EXPECT_NE(std::string::npos, json.find("\"bob\""));
+  EXPECT_EQ(std::string::npos, json.find("\"Judy\""));
+}
+
@@ -1,5 +1,7 @@
 #include <gtest/gtest.h>
+#include <atomic>
 #include <string>
+#include <thread>
 
 #include "../include/vsqlite_serialize.h"
 #include "../src/utils.h"
@@ -37,14 +39,27 @@ struct StringMapDiffResultsListener: public vsqlite::DiffResultsListener<Row > {
   void onRemoved(Row &row) override {
     removes.push_back(SimpleRowToJSONString(row));
   }
+
+  void onChanged(Row &oldRow, Row &newRow, const std::vector<SPFieldDef> &changedColumns) override {
+    changes.push_back(SimpleRowToJSONString(newRow));
+    changedFrom.push_back(SimpleRowToJSONString(oldRow));
+    for (auto &id : changedColumns) {
+      changedColumnNames.push_back(id->name);
+    }
+  }
   std::vector<std::string> adds;
   std::vector<std::string> removes;
+  std::vector<std::string> changes;
+  std::vector<std::string> changedFrom;
+  std::vector<std::string> changedColumnNames;
 };
 
 static std::string gExpected1 = "{\"active\":\"1\",\"age\":\"32\",\"name\":\"bob\"}\n{\"active\":\"0\",\"name\":\"Judy\"}\n{\"age\":\"3\",\"name\":\"Coco\"}\n";
 
 static std::string gExpected1_row1only = "{\"active\":\"0\",\"name\":\"Judy\"}\n";
 
+static std::string gFingerprints1 = "{\"#fingerprints\":\"1a99132547c4c036bf8bdd769b933c99c6bab65c9c92da73\"}\n";
+
 static std::vector<Row> &ExampleData1() {
   static std::vector<Row> _rows;
   if (_rows.empty()) {
@@ -157,3 +172,368 @@ TEST_F(StringMapJsonTest, basic_remove_two) {
 
   EXPECT_EQ(gExpected1_row1only, serialized);
 }
+
+TEST_F(StringMapJsonTest, key_columns_changed_row) {
+  auto spSerializer = vsqlite::JsonStringMapResultsSerializerNew();
+  auto spListener = std::make_shared<StringMapDiffResultsListener>();
+  std::vector<SPFieldDef> cols;
+  vsqlite::DiffOptions options;
+  options.keyColumnIds = { FieldDef::alloc(TSTRING, "age") };
+  ASSERT_FALSE(spSerializer->beginData(gExpected1, spListener, cols, options));
+
+  // a row without the key column only matches a row also without it
+
+  auto rows = ExampleData1();
+  rows[1]["active"] = "1";
+
+  EXPECT_FALSE(spSerializer->addNewResult(rows[0]));
+  EXPECT_TRUE(spSerializer->addNewResult(rows[1]));
+  EXPECT_TRUE(spSerializer->endData());
+
+  ASSERT_EQ(1, spListener->changes.size());
+  EXPECT_EQ("{active:\"0\", name:\"Judy\"}", spListener->changedFrom[0]);
+  EXPECT_EQ("{active:\"1\", name:\"Judy\"}", spListener->changes[0]);
+  ASSERT_EQ(1, spListener->changedColumnNames.size());
+  EXPECT_EQ("active", spListener->changedColumnNames[0]);
+  ASSERT_EQ(1, spListener->removes.size());
+  EXPECT_EQ("{age:\"3\", name:\"Coco\"}", spListener->removes[0]);
+}
+
+TEST_F(StringMapJsonTest, volatile_columns_ignored) {
+  auto spSerializer = vsqlite::JsonStringMapResultsSerializerNew();
+  auto spListener = std::make_shared<StringMapDiffResultsListener>();
+  std::vector<SPFieldDef> cols;
+  vsqlite::DiffOptions options;
+  options.volatileColumnIds = { FieldDef::alloc(TSTRING, "age") };
+  spSerializer->beginData(gExpected1, spListener, cols, options);
+
+  auto rows = ExampleData1();
+  rows[0]["age"] = "33";
+
+  bool isNewRow = spSerializer->addNewResult(rows[0]);
+  EXPECT_FALSE(isNewRow);
+
+  isNewRow = spSerializer->addNewResult(rows[1]);
+  EXPECT_FALSE(isNewRow);
+
+  isNewRow = spSerializer->addNewResult(rows[2]);
+  EXPECT_FALSE(isNewRow);
+
+  bool hasChanged = spSerializer->endData();
+  EXPECT_FALSE(hasChanged);
+
+  ASSERT_EQ(0, spListener->adds.size());
+  ASSERT_EQ(0, spListener->removes.size());
+}
+
+TEST_F(StringMapJsonTest, duplicate_rows_counted) {
+  auto spSerializer = vsqlite::JsonStringMapResultsSerializerNew();
+  std::vector<SPFieldDef> cols;
+  std::string historicalData;
+  spSerializer->beginData(historicalData, nullptr, cols);
+
+  auto rows = ExampleData1();
+
+  spSerializer->addNewResult(rows[0]);
+  spSerializer->addNewResult(rows[0]);
+  spSerializer->addNewResult(rows[0]);
+  spSerializer->addNewResult(rows[1]);
+  spSerializer->endData();
+  spSerializer->serialize(historicalData);
+
+  // one copy of the repeated row remains, one is added
+
+  auto spSerializer2 = vsqlite::JsonStringMapResultsSerializerNew();
+  auto spListener = std::make_shared<StringMapDiffResultsListener>();
+  spSerializer2->beginData(historicalData, spListener, cols);
+
+  bool isNewRow = spSerializer2->addNewResult(rows[0]);
+  EXPECT_FALSE(isNewRow);
+
+  isNewRow = spSerializer2->addNewResult(rows[2]);
+  EXPECT_TRUE(isNewRow);
+
+  bool hasChanged = spSerializer2->endData();
+  EXPECT_TRUE(hasChanged);
+
+  ASSERT_EQ(1, spListener->adds.size());
+  ASSERT_EQ(3, spListener->removes.size());
+}
+
+TEST_F(StringMapJsonTest, history_without_fingerprints) {
+  auto spSerializer = vsqlite::JsonStringMapResultsSerializerNew();
+  auto spListener = std::make_shared<StringMapDiffResultsListener>();
+  std::vector<SPFieldDef> cols;
+  std::string historicalData = gExpected1;
+  vsqlite::DiffOptions options;
+  options.storeFingerprints = true;
+  spSerializer->beginData(historicalData, spListener, cols, options);
+
+  auto rows = ExampleData1();
+
+  for (auto &row : rows) {
+    EXPECT_FALSE(spSerializer->addNewResult(row));
+  }
+
+  bool hasChanged = spSerializer->endData();
+  EXPECT_FALSE(hasChanged);
+
+  ASSERT_EQ(0, spListener->adds.size());
+  ASSERT_EQ(0, spListener->removes.size());
+
+  // fingerprints are added on the next snapshot, and only on request
+
+  std::string serialized;
+  spSerializer->serialize(serialized);
+  EXPECT_EQ(gExpected1 + gFingerprints1, serialized);
+
+  historicalData = serialized;
+  spSerializer->beginData(historicalData, spListener, cols);
+  for (auto &row : rows) {
+    EXPECT_FALSE(spSerializer->addNewResult(row));
+  }
+  EXPECT_FALSE(spSerializer->endData());
+  spSerializer->serialize(serialized);
+  EXPECT_EQ(gExpected1, serialized);
+}
+
+TEST_F(StringMapJsonTest, fingerprint_hit_is_verified) {
+  // bob's line stored with Judy's fingerprint, as a collision would
+  std::string historicalData = "{\"active\":\"1\",\"age\":\"32\",\"name\":\"bob\"}\n"
+    "{\"#fingerprints\":\"bf8bdd769b933c99\"}\n";
+
+  auto spSerializer = vsqlite::JsonStringMapResultsSerializerNew();
+  auto spListener = std::make_shared<StringMapDiffResultsListener>();
+  std::vector<SPFieldDef> cols;
+  spSerializer->beginData(historicalData, spListener, cols);
+  auto rows = ExampleData1();
+  EXPECT_TRUE(spSerializer->addNewResult(rows[1]));
+  EXPECT_TRUE(spSerializer->endData());
+
+  ASSERT_EQ(1, spListener->adds.size());
+  EXPECT_EQ(SimpleRowToJSONString(rows[1]), spListener->adds[0]);
+  ASSERT_EQ(1, spListener->removes.size());
+  EXPECT_EQ(SimpleRowToJSONString(rows[0]), spListener->removes[0]);
+
+  std::string serialized;
+  spSerializer->serialize(serialized);
+  EXPECT_EQ(gExpected1_row1only, serialized);
+}
+
+TEST_F(StringMapJsonTest, removed_rows_json) {
+  auto spSerializer = vsqlite::JsonStringMapResultsSerializerNew();
+  std::vector<SPFieldDef> cols;
+  std::string historicalData;
+  spSerializer->beginData(historicalData, nullptr, cols);
+
+  auto rows = ExampleData1();
+  for (auto &row : rows) {
+    spSerializer->addNewResult(row);
+  }
+  spSerializer->endData();
+  spSerializer->serialize(historicalData);
+
+  auto spSerializer2 = vsqlite::JsonStringMapResultsSerializerNew();
+  spSerializer2->beginData(historicalData, nullptr, cols);
+  spSerializer2->addNewResult(rows[1]);
+  EXPECT_TRUE(spSerializer2->endData());
+
+  std::string json;
+  EXPECT_EQ(2, spSerializer2->appendRemovedRowsJson(json));
+
+  size_t numLines = 0;
+  for (char c : json) {
+    if (c == '\n') { numLines++; }
+  }
+  EXPECT_EQ(2, numLines);
+  EXPECT_EQ('{', json[0]);
+  EXPECT_NE(std::string::npos, json.find("\"bob\""));
+  EXPECT_EQ(std::string::npos, json.find("\"Judy\""));
+}
+
+static size_t CountOccurrences(const std::string &s, const std::string &part) {
+  size_t n = 0;
+  for (size_t pos = s.find(part); pos != std::string::npos; pos = s.find(part, pos + 1)) {
+    n++;
+  }
+  return n;
+}
+
+TEST_F(StringMapJsonTest, long_values_in_blob_section) {
+  std::string longName = "/usr/libexec/some-daemon --config /etc/some-daemon.conf";
+  std::vector<Row> rows(3);
+  rows[0]["name"] = longName;
+  rows[0]["age"] = "1";
+  rows[1]["name"] = longName;
+  rows[1]["age"] = "2";
+  rows[2]["name"] = "short";
+  rows[2]["age"] = "3";
+
+  std::vector<SPFieldDef> cols;
+  vsqlite::DiffOptions options;
+  options.blobMinSize = 32;
+
+  auto spSerializer = vsqlite::JsonStringMapResultsSerializerNew();
+  std::string historicalData;
+  spSerializer->beginData(historicalData, nullptr, cols, options);
+  for (auto &row : rows) {
+    spSerializer->addNewResult(row);
+  }
+  spSerializer->endData();
+  spSerializer->serialize(historicalData);
+
+  // stored once
+  EXPECT_EQ(1, CountOccurrences(historicalData, longName));
+
+  // unchanged rows match, removed row has its value
+
+  auto spSerializer2 = vsqlite::JsonStringMapResultsSerializerNew();
+  auto spListener = std::make_shared<StringMapDiffResultsListener>();
+  spSerializer2->beginData(historicalData, spListener, cols, options);
+  EXPECT_FALSE(spSerializer2->addNewResult(rows[0]));
+  EXPECT_FALSE(spSerializer2->addNewResult(rows[2]));
+  EXPECT_TRUE(spSerializer2->endData());
+
+  ASSERT_EQ(0, spListener->adds.size());
+  ASSERT_EQ(1, spListener->removes.size());
+  EXPECT_EQ("{age:\"2\", name:\"" + longName + "\"}", spListener->removes[0]);
+}
+
+TEST_F(StringMapJsonTest, schema_change_compares_shared_columns) {
+  std::vector<SPFieldDef> cols = { FieldDef::alloc(TSTRING, "name"), FieldDef::alloc(TSTRING, "age"), FieldDef::alloc(TSTRING, "active") };
+  std::vector<SPFieldDef> cols2 = cols;
+  cols2.push_back(FieldDef::alloc(TSTRING, "path"));
+
+  auto spSerializer = vsqlite::JsonStringMapResultsSerializerNew();
+  vsqlite::DiffOptions options;
+  options.storeSchema = true;
+  std::string historicalData;
+  spSerializer->beginData(historicalData, nullptr, cols, options);
+  auto rows = ExampleData1();
+  for (auto &row : rows) {
+    spSerializer->addNewResult(row);
+  }
+  spSerializer->endData();
+  spSerializer->serialize(historicalData);
+  EXPECT_EQ(0, historicalData.find("{\"#columns\":{\"name\":"));
+
+  // path column added, one row changed
+
+  auto spListener = std::make_shared<StringMapDiffResultsListener>();
+  spSerializer->beginData(historicalData, spListener, cols2, options);
+  rows[0]["path"] = "/a";
+  rows[1]["path"] = "/b";
+  rows[2]["path"] = "/c";
+  rows[2]["age"] = "4";
+
+  EXPECT_FALSE(spSerializer->addNewResult(rows[0]));
+  EXPECT_FALSE(spSerializer->addNewResult(rows[1]));
+  EXPECT_TRUE(spSerializer->addNewResult(rows[2]));
+  EXPECT_TRUE(spSerializer->endData());
+
+  ASSERT_EQ(1, spListener->adds.size());
+  ASSERT_EQ(1, spListener->removes.size());
+  EXPECT_EQ("{age:\"3\", name:\"Coco\"}", spListener->removes[0]);
+
+  // same data and schema : unchanged
+
+  historicalData.clear();
+  spSerializer->serialize(historicalData);
+  spListener = std::make_shared<StringMapDiffResultsListener>();
+  spSerializer->beginData(historicalData, spListener, cols2, options);
+  for (auto &row : rows) {
+    EXPECT_FALSE(spSerializer->addNewResult(row));
+  }
+  EXPECT_FALSE(spSerializer->endData());
+  EXPECT_EQ(0, spListener->removes.size());
+}
+
+TEST_F(StringMapJsonTest, row_version_reuses_encoding) {
+  auto spSerializer = vsqlite::JsonStringMapResultsSerializerNew();
+  std::vector<SPFieldDef> cols;
+  std::string historicalData;
+  spSerializer->beginData(historicalData, nullptr, cols);
+
+  auto rows = ExampleData1();
+  for (size_t i=0; i < rows.size(); i++) {
+    EXPECT_TRUE(spSerializer->addNewResult(rows[i], i, 1));
+  }
+  spSerializer->endData();
+  spSerializer->serialize(historicalData);
+
+  // same version : the previous encoding is used, without looking at the row
+
+  Row changed = rows[1];
+  changed["name"] = "Judith";
+
+  spSerializer->beginData(historicalData, nullptr, cols);
+  EXPECT_FALSE(spSerializer->addNewResult(rows[0], 0, 1));
+  EXPECT_FALSE(spSerializer->addNewResult(changed, 1, 1));
+  EXPECT_TRUE(spSerializer->addNewResult(changed, 2, 2));
+  EXPECT_TRUE(spSerializer->endData());
+
+  std::string data;
+  spSerializer->serialize(data);
+  EXPECT_EQ(1, CountOccurrences(data, "Judith"));
+  EXPECT_EQ(1, CountOccurrences(data, "Judy"));
+  EXPECT_EQ(0, CountOccurrences(data, "Coco"));
+}
+
+TEST_F(StringMapJsonTest, concurrent_producers) {
+  auto makeRow = [](size_t i) {
+    Row row;
+    row["name"] = "row" + std::to_string(i);
+    row["age"] = std::to_string(i);
+    return row;
+  };
+
+  auto spSerializer = vsqlite::JsonStringMapResultsSerializerNew();
+  std::vector<SPFieldDef> cols;
+  std::string historicalData;
+  spSerializer->beginData(historicalData, nullptr, cols);
+  for (size_t i=0; i < 1000; i++) {
+    Row row = makeRow(i);
+    spSerializer->addNewResult(row);
+  }
+  spSerializer->endData();
+  spSerializer->serialize(historicalData);
+
+  // 4 threads add rows 500..1499, each its share in order
+
+  vsqlite::DiffOptions options;
+  options.numProducers = 4;
+  std::string snapshots[2];
+  for (int run=0; run < 2; run++) {
+    spSerializer->beginData(historicalData, nullptr, cols, options);
+    std::atomic<size_t> numAdded(0);
+    std::vector<std::thread> threads;
+    for (size_t producer=0; producer < 4; producer++) {
+      threads.emplace_back([&, producer]() {
+        for (size_t i=500 + producer; i < 1500; i += 4) {
+          Row row = makeRow(i);
+          if (spSerializer->addNewResult(row, producer)) {
+            numAdded++;
+          }
+        }
+      });
+    }
+    for (auto &thread : threads) {
+      thread.join();
+    }
+    EXPECT_TRUE(spSerializer->endData());
+    EXPECT_EQ(500, numAdded.load());
+
+    auto cursor = spSerializer->removedRows();
+    Row row;
+    size_t numRemoved = 0;
+    while (cursor->next(row)) {
+      numRemoved++;
+    }
+    EXPECT_EQ(500, numRemoved);
+
+    spSerializer->serialize(snapshots[run]);
+  }
+
+  // buffers are appended in producer order, whatever the scheduling
+  EXPECT_EQ(snapshots[0], snapshots[1]);
+}